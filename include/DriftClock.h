@@ -0,0 +1,144 @@
+/*
+    DriftClock.h - Wall clock kept on the local microsecond timer between syncs
+*/
+
+#ifndef DriftClock_h
+#define DriftClock_h
+
+#include <Arduino.h>
+#include <math.h>
+
+// Serves epoch time from a free-running microsecond counter, esp_timer on the
+// ESP32, in O(1). Each sync() pins the counter to a reference time, and the
+// first sync since boot is kept as a baseline to measure how fast the local
+// oscillator runs against the reference. Between syncs the clock keeps a bound
+// on its own error, the sync's resolution plus the drift it could not account
+// for, and asks for a new sync only when that bound passes setMaxError().
+class DriftClock {
+  public:
+    // a sync in whole seconds can be behind by up to a second
+    static const uint32_t SYNC_ERROR_MS = 1000;
+    // crystal tolerance assumed until the drift has been measured
+    static constexpr float DEFAULT_UNCERTAINTY_PPM = 50;
+    // drift left over once measured, temperature moves it about this much
+    static constexpr float MIN_UNCERTAINTY_PPM = 2;
+    // a baseline shorter than this says little about the drift
+    static const uint32_t MIN_BASELINE_S = 6 * 3600;
+
+    DriftClock() {
+      _set = false;
+      _maxErrorMs = 3000;
+      _maxIntervalS = 86400;
+      _carriedErrorMs = 0;
+      _baseErrorMs = 0;
+      setDrift(0, DEFAULT_UNCERTAINTY_PPM);
+    }
+
+    void setMaxError(uint32_t ms) {
+      _maxErrorMs = ms;
+    }
+
+    // syncs at least this often whatever the error bound says
+    void setMaxInterval(uint32_t seconds) {
+      _maxIntervalS = seconds;
+    }
+
+    // starts from a drift measured earlier, e.g. kept in flash across resets
+    void setDrift(float ppm, float uncertaintyPpm) {
+      _priorPpm = ppm;
+      _priorUncertaintyPpm = max(uncertaintyPpm, MIN_UNCERTAINTY_PPM);
+      _driftPpm = _priorPpm;
+      _uncertaintyPpm = _priorUncertaintyPpm;
+    }
+
+    // Pins the clock to a reference time in whole seconds, read at local
+    // microseconds now. Returns true when the drift was measured again
+    bool sync(time_t epoch, int64_t now) {
+      bool measured = false;
+      if (!_set) {
+        _baseEpoch = epoch;
+        _baseLocal = now;
+        _baseErrorMs = 0;
+      }
+      else if (now - _baseLocal >= (int64_t) MIN_BASELINE_S * 1000000) {
+        double local = (double) (now - _baseLocal);
+        double reference = (double) (epoch - _baseEpoch) * 1e6;
+        // both ends are whole seconds, so the baseline is good to about a
+        // second, and to what carryOver() could not measure
+        float drift = (reference - local) / local * 1e6;
+        float uncertainty = (SYNC_ERROR_MS + _baseErrorMs) * 1e9 / local;
+        // weighed against what was known before this boot
+        float priorWeight = 1 / (_priorUncertaintyPpm * _priorUncertaintyPpm);
+        float weight = 1 / (uncertainty * uncertainty);
+        _driftPpm = (_priorPpm * priorWeight + drift * weight) / (priorWeight + weight);
+        _uncertaintyPpm = max(1 / sqrtf(priorWeight + weight), MIN_UNCERTAINTY_PPM);
+        measured = true;
+      }
+      _anchorEpoch = epoch;
+      _anchorLocal = now;
+      _carriedErrorMs = 0;
+      _set = true;
+      return measured;
+    }
+
+    // Moves the clock onto a local counter that started over, e.g. esp_timer
+    // after a deep sleep: the moment the old counter read before is read as
+    // after on the new one. errorMs is how far the gap between them, timed
+    // by another clock, may be off
+    void carryOver(int64_t before, int64_t after, uint32_t errorMs) {
+      _baseLocal += after - before;
+      _anchorLocal += after - before;
+      _carriedErrorMs += errorMs;
+      _baseErrorMs += errorMs;
+    }
+
+    bool isSet() const {
+      return _set;
+    }
+
+    // epoch microseconds at local microseconds now
+    int64_t micros(int64_t now) const {
+      int64_t local = now - _anchorLocal;
+      return (int64_t) _anchorEpoch * 1000000 + local + (int64_t) (local * (_driftPpm / 1e6));
+    }
+
+    // epoch seconds at local microseconds now, 0 until the first sync
+    time_t now(int64_t now) const {
+      return _set ? (time_t) (micros(now) / 1000000) : 0;
+    }
+
+    // how far off the clock can be at local microseconds now
+    uint32_t getErrorBound(int64_t now) const {
+      double elapsed = (now - _anchorLocal) / 1e6;
+      return SYNC_ERROR_MS + _carriedErrorMs + (uint32_t) (elapsed * _uncertaintyPpm / 1000);
+    }
+
+    bool needsSync(int64_t now) const {
+      return !_set || getErrorBound(now) > _maxErrorMs || now - _anchorLocal > (int64_t) _maxIntervalS * 1000000;
+    }
+
+    float getDrift() const {
+      return _driftPpm;
+    }
+
+    float getUncertainty() const {
+      return _uncertaintyPpm;
+    }
+
+  private:
+    bool _set;
+    uint32_t _maxErrorMs;
+    uint32_t _maxIntervalS;
+    uint32_t _carriedErrorMs;   // since the anchor, from carryOver()
+    uint32_t _baseErrorMs;      // since the baseline
+    float _priorPpm;
+    float _priorUncertaintyPpm;
+    float _driftPpm;
+    float _uncertaintyPpm;
+    time_t _baseEpoch;
+    int64_t _baseLocal;
+    time_t _anchorEpoch;
+    int64_t _anchorLocal;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+    NoteStats.h - Counts, errors, bytes and latency of Notecard transactions
+*/
+
+#ifndef NoteStats_h
+#define NoteStats_h
+
+#include <Arduino.h>
+#include <string.h>
+
+// Accumulates Notecard transactions by request type ("note.add", "card.time"
+// ...) in fixed memory: the first MAX_TYPES types seen get their own entry,
+// later ones are counted under "other". Latency goes into a histogram whose
+// buckets end at BUCKET_LIMITS_MS, the last bucket takes everything slower.
+class NoteStats {
+  public:
+    static const uint8_t MAX_TYPES = 12;
+    static const uint8_t BUCKETS = 8;
+    static const uint8_t NAME_SIZE = 20;
+
+    struct Entry {
+      char name[NAME_SIZE];
+      uint32_t count;
+      uint32_t errors;
+      uint32_t bytesSent;
+      uint32_t bytesReceived;
+      uint64_t totalMicros;
+      uint32_t maxMicros;
+      uint32_t histogram[BUCKETS];
+    };
+
+    NoteStats() {
+      clear();
+    }
+
+    // upper bound of bucket i in ms, 0 for the last one
+    static uint32_t getBucketLimit(uint8_t bucket) {
+      static const uint32_t limits[BUCKETS - 1] = { 10, 25, 50, 100, 250, 500, 1000 };
+      return bucket < BUCKETS - 1 ? limits[bucket] : 0;
+    }
+
+    void record(const char* type, uint32_t micros, size_t sent, size_t received, bool error) {
+      Entry& entry = _find(type);
+      entry.count++;
+      if (error) {
+        entry.errors++;
+      }
+      entry.bytesSent += sent;
+      entry.bytesReceived += received;
+      entry.totalMicros += micros;
+      if (micros > entry.maxMicros) {
+        entry.maxMicros = micros;
+      }
+      uint8_t bucket = 0;
+      while (bucket < BUCKETS - 1 && micros > getBucketLimit(bucket) * 1000) {
+        bucket++;
+      }
+      entry.histogram[bucket]++;
+    }
+
+    uint8_t getTypeCount() const {
+      return _types;
+    }
+
+    const Entry& getType(uint8_t index) const {
+      return _entries[index];
+    }
+
+    // time spent in every transaction, in µs
+    uint64_t getTotalMicros() const {
+      uint64_t total = 0;
+      for (uint8_t i = 0; i < _types; i++) {
+        total += _entries[i].totalMicros;
+      }
+      return total;
+    }
+
+    unsigned long getAgeMillis() const {
+      return millis() - _since;
+    }
+
+    void clear() {
+      _types = 0;
+      _since = millis();
+    }
+
+  private:
+    Entry& _find(const char* type) {
+      if (type == NULL) {
+        type = "other";
+      }
+      for (uint8_t i = 0; i < _types; i++) {
+        if (strncmp(_entries[i].name, type, NAME_SIZE - 1) == 0) {
+          return _entries[i];
+        }
+      }
+      // the last entry is kept for "other" once the table fills
+      if (_types == MAX_TYPES - 1 && strcmp(type, "other") != 0) {
+        return _find("other");
+      }
+      Entry& entry = _entries[_types++];
+      memset(&entry, 0, sizeof(entry));
+      strncpy(entry.name, type, NAME_SIZE - 1);
+      return entry;
+    }
+
+    Entry _entries[MAX_TYPES];
+    uint8_t _types;
+    unsigned long _since;
+};
+
+#endif
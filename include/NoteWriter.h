@@ -0,0 +1,283 @@
+/*
+    NoteWriter.h - Writes a note.add request as JSON text into a fixed buffer
+*/
+
+#ifndef NoteWriter_h
+#define NoteWriter_h
+
+#include <Arduino.h>
+#include <math.h>
+#include <string.h>
+
+// Streams {"req":"note.add","file":...,"body":{...}} straight into a caller's
+// buffer, without building a J* tree first, so a note costs no heap. Numbers
+// are written with integer arithmetic, fixed-point ones with the given
+// decimals. Anything that does not fit sets overflowed() and end() then
+// returns NULL instead of a truncated request.
+class NoteWriter {
+  public:
+    NoteWriter(char* buffer, size_t size) {
+      _buffer = buffer;
+      _size = size;
+      _length = 0;
+      _depth = 0;
+      _overflow = false;
+    }
+
+    // opens the request and its body
+    void begin(const char* file, bool sync = false) {
+      _length = 0;
+      _depth = 0;
+      _overflow = false;
+      _open('{');
+      _key("req");
+      _string("note.add");
+      _key("file");
+      _string(file);
+      if (sync) {
+        _key("sync");
+        _put("true");
+      }
+      _key("body");
+      _open('{');
+    }
+
+    void addInt(const char* key, int64_t value) {
+      _key(key);
+      _int(value);
+    }
+
+    // value rounded half away from zero to decimals places, null when it
+    // is not a number or too large to scale
+    void addFixed(const char* key, double value, uint8_t decimals) {
+      _key(key);
+      _fixed(value, decimals);
+    }
+
+    void addBool(const char* key, bool value) {
+      _key(key);
+      _put(value ? "true" : "false");
+    }
+
+    void addString(const char* key, const char* value) {
+      _key(key);
+      _string(value);
+    }
+
+    void beginArray(const char* key) {
+      _key(key);
+      _open('[');
+    }
+
+    void itemInt(int64_t value) {
+      _comma();
+      _int(value);
+    }
+
+    void itemFixed(double value, uint8_t decimals) {
+      _comma();
+      _fixed(value, decimals);
+    }
+
+    void itemBool(bool value) {
+      _comma();
+      _put(value ? "true" : "false");
+    }
+
+    // an array as the next item of the array open, closed by endArray()
+    void beginItemArray() {
+      _comma();
+      _open('[');
+    }
+
+    void endArray() {
+      _close(']');
+    }
+
+    void beginObject(const char* key) {
+      _key(key);
+      _open('{');
+    }
+
+    void endObject() {
+      _close('}');
+    }
+
+    // Closes the body and the request and ends it with the newline the
+    // Notecard takes requests by. The text stays in the buffer, NULL if it
+    // did not fit
+    const char* end() {
+      while (_depth > 0) {
+        _close('}');
+      }
+      _char('\n');
+      if (_overflow || _length >= _size) {
+        _overflow = true;
+        return NULL;
+      }
+      _buffer[_length] = '\0';
+      return _buffer;
+    }
+
+    // bytes written, without the terminating NUL
+    size_t length() const {
+      return _length;
+    }
+
+    bool overflowed() const {
+      return _overflow;
+    }
+
+  private:
+    // the request, its body and four levels inside it
+    static const uint8_t MAX_DEPTH = 6;
+
+    void _char(char c) {
+      if (_length + 1 < _size) {
+        _buffer[_length++] = c;
+      }
+      else {
+        _overflow = true;
+      }
+    }
+
+    void _put(const char* text) {
+      while (*text != '\0') {
+        _char(*text++);
+      }
+    }
+
+    // a comma before every member of a container but the first
+    void _comma() {
+      if (_depth > 0 && !_first[_depth - 1]) {
+        _char(',');
+      }
+      if (_depth > 0) {
+        _first[_depth - 1] = false;
+      }
+    }
+
+    void _open(char bracket) {
+      _char(bracket);
+      if (_depth < MAX_DEPTH) {
+        _first[_depth++] = true;
+      }
+      else {
+        _overflow = true;
+      }
+    }
+
+    void _close(char bracket) {
+      if (_depth > 0) {
+        _depth--;
+      }
+      _char(bracket);
+    }
+
+    void _key(const char* key) {
+      _comma();
+      _string(key);
+      _char(':');
+    }
+
+    // control characters as \n, \r, \t or \u00XX, everything else as is
+    void _string(const char* text) {
+      _char('"');
+      for (; *text != '\0'; text++) {
+        uint8_t c = *text;
+        if (c == '"' || c == '\\') {
+          _char('\\');
+          _char(c);
+        }
+        else if (c == '\n') {
+          _put("\\n");
+        }
+        else if (c == '\r') {
+          _put("\\r");
+        }
+        else if (c == '\t') {
+          _put("\\t");
+        }
+        else if (c < 0x20) {
+          _put("\\u00");
+          _char("0123456789abcdef"[c >> 4]);
+          _char("0123456789abcdef"[c & 0x0f]);
+        }
+        else {
+          _char(c);
+        }
+      }
+      _char('"');
+    }
+
+    void _int(int64_t value) {
+      uint64_t magnitude = value;
+      if (value < 0) {
+        _char('-');
+        magnitude = 0 - magnitude;
+      }
+      _unsigned(magnitude, 1);
+    }
+
+    // at least digits digits, zero padded
+    void _unsigned(uint64_t value, uint8_t digits) {
+      char text[21];
+      uint8_t count = 0;
+      do {
+        text[count++] = '0' + value % 10;
+        value /= 10;
+      } while (value > 0 || count < digits);
+      while (count > 0) {
+        _char(text[--count]);
+      }
+    }
+
+    void _fixed(double value, uint8_t decimals) {
+      if (isnan(value) || isinf(value)) {
+        _put("null");
+        return;
+      }
+      double scale = 1;
+      for (uint8_t i = 0; i < decimals; i++) {
+        scale *= 10;
+      }
+      // past 2^63 the scaled value has no int64, and llround() none to give
+      if (fabs(value * scale) >= 9.2e18) {
+        _put("null");
+        return;
+      }
+      int64_t scaled = llround(value * scale);
+      if (decimals == 0) {
+        _int(scaled);
+        return;
+      }
+      uint64_t magnitude = scaled < 0 ? 0 - (uint64_t) scaled : scaled;
+      if (scaled < 0) {
+        _char('-');
+      }
+      _unsigned(magnitude / (uint64_t) scale, 1);
+      _char('.');
+      _unsigned(magnitude % (uint64_t) scale, decimals);
+    }
+
+    char* _buffer;
+    size_t _size;
+    size_t _length;
+    uint8_t _depth;
+    bool _first[MAX_DEPTH];
+    bool _overflow;
+};
+
+// True when no two of count keys are the same, for static_assert on the field
+// lists notes are written from
+constexpr bool noteKeysEqual(const char* a, const char* b) {
+  return *a == *b && (*a == '\0' || noteKeysEqual(a + 1, b + 1));
+}
+
+constexpr bool noteKeysUnique(const char* const* keys, size_t count, size_t i = 0, size_t j = 1) {
+  return i + 1 >= count ? true
+    : j >= count ? noteKeysUnique(keys, count, i + 1, i + 2)
+    : !noteKeysEqual(keys[i], keys[j]) && noteKeysUnique(keys, count, i, j + 1);
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+    PowerPolicy.h - Whether to sleep until the next deadline, and how deeply
+*/
+
+#ifndef PowerPolicy_h
+#define PowerPolicy_h
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Decides from the deadlines the caller knows of whether the gap until the
+// next one is worth sleeping through, and keeps the time spent awake and
+// asleep for the duty cycle. It touches no hardware and takes every time as
+// an argument, in µs of the local clock, so it runs the same against
+// simulated time. A light sleep keeps RAM and wakes in about a millisecond,
+// a deep sleep restarts the firmware, so it is only worth it for long gaps
+// and only when nothing held in RAM would be lost.
+class PowerPolicy {
+  public:
+    enum Mode : uint8_t { MODE_AWAKE, MODE_LIGHT, MODE_DEEP };
+    enum Action : uint8_t { STAY_AWAKE, LIGHT_SLEEP, DEEP_SLEEP };
+
+    // what the device is doing at the moment it could sleep
+    struct State {
+      int64_t now;
+      int64_t nextDeadline;   // earliest deadline of anything
+      bool idle;              // nothing is running or waiting to run
+      int64_t deepDeadline;   // earliest work a restarted firmware still has to be up for
+      bool deepReady;         // nothing held in RAM would be lost by a restart
+    };
+    struct Plan {
+      Action action;
+      int64_t sleepUs;
+    };
+
+    // shorter light sleeps cost more in waking up than they save
+    static const uint32_t LIGHT_MIN_US = 20000;
+    // woken this much early to be running by the deadline
+    static const uint32_t LIGHT_LEAD_US = 2000;
+    // a restart costs seconds at full power, shorter gaps are slept lightly
+    static const uint32_t DEEP_MIN_US = 120000000;
+
+    PowerPolicy() {
+      _mode = MODE_AWAKE;
+      _deepLeadUs = 30000000;
+      restore(0, 0);
+    }
+
+    void setMode(Mode mode) {
+      _mode = mode;
+    }
+
+    Mode getMode() const {
+      return _mode;
+    }
+
+    // how long before its deadline a deep sleep ends, to boot and get ready
+    void setDeepLead(uint32_t ms) {
+      _deepLeadUs = (int64_t) ms * 1000;
+    }
+
+    Plan decide(const State& state) const {
+      Plan plan = { STAY_AWAKE, 0 };
+      if (_mode == MODE_AWAKE || !state.idle) {
+        return plan;
+      }
+      if (_mode == MODE_DEEP && state.deepReady) {
+        int64_t sleep = state.deepDeadline - state.now - _deepLeadUs;
+        if (sleep >= (int64_t) DEEP_MIN_US) {
+          plan.action = DEEP_SLEEP;
+          plan.sleepUs = sleep;
+          return plan;
+        }
+      }
+      int64_t sleep = state.nextDeadline - state.now - LIGHT_LEAD_US;
+      if (sleep >= (int64_t) LIGHT_MIN_US) {
+        plan.action = LIGHT_SLEEP;
+        plan.sleepUs = sleep;
+      }
+      return plan;
+    }
+
+    // Time awake and asleep before this boot, which the caller keeps across
+    // a deep sleep, e.g. in RTC memory
+    void restore(uint64_t awakeUs, uint64_t asleepUs) {
+      _awakeBeforeUs = awakeUs;
+      _asleepBeforeUs = asleepUs;
+      _asleepUs = 0;
+    }
+
+    // after a light sleep that lasted us, the local clock kept counting
+    void addSleep(int64_t us) {
+      _asleepUs += us;
+    }
+
+    uint64_t getAwakeMicros(int64_t now) const {
+      return _awakeBeforeUs + (now - _asleepUs);
+    }
+
+    uint64_t getAsleepMicros() const {
+      return _asleepBeforeUs + _asleepUs;
+    }
+
+    // share of the time spent awake, 1 when it never slept
+    float getDutyCycle(int64_t now) const {
+      uint64_t awake = getAwakeMicros(now);
+      uint64_t total = awake + getAsleepMicros();
+      return total == 0 ? 1 : (float) ((double) awake / total);
+    }
+
+  private:
+    Mode _mode;
+    int64_t _deepLeadUs;
+    uint64_t _awakeBeforeUs;
+    uint64_t _asleepBeforeUs;
+    int64_t _asleepUs;      // this boot
+};
+
+#endif
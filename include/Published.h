@@ -0,0 +1,126 @@
+/*
+    Published.h - Latest value of a producer, read by any number of consumers
+*/
+
+#ifndef Published_h
+#define Published_h
+
+#include <Arduino.h>
+#include <atomic>
+#include <limits.h>
+#include <string.h>
+#include <type_traits>
+
+// One writer publishes whole values of T, readers take consistent copies
+// without locking and without waiting on the writer. Values alternate between
+// two slots, each guarded by its own sequence count: odd while the writer is
+// filling the slot, even once it is done. A reader copies the current slot
+// and keeps the copy only if the count was even and unchanged across it and
+// the slot is still current, so it is retried when the writer comes round to
+// that slot again mid-copy.
+// Every publish bumps the version, so a reader can tell whether it has seen
+// a value before.
+template <typename T>
+class Published {
+    static_assert(std::is_trivially_copyable<T>::value, "values are copied bytewise");
+
+  public:
+    Published() : _version(0), _current(0), _publishedAt(0) {
+      for (uint8_t i = 0; i < 2; i++) {
+        _slots[i].sequence.store(0, std::memory_order_relaxed);
+        _slots[i].version.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    // from the single writer only
+    void publish(const T& value) {
+      uint8_t next = 1 - _current.load(std::memory_order_relaxed);
+      uint32_t version = _version.load(std::memory_order_relaxed) + 1;
+      Slot& slot = _slots[next];
+
+      uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+      slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+      // a reader that sees any of the new words also sees the odd count
+      std::atomic_thread_fence(std::memory_order_release);
+      _store(slot, value);
+      slot.version.store(version, std::memory_order_relaxed);
+      slot.sequence.store(sequence + 2, std::memory_order_release);
+
+      _publishedAt.store(millis(), std::memory_order_relaxed);
+      _current.store(next, std::memory_order_release);
+      _version.store(version, std::memory_order_release);
+    }
+
+    // Copies the latest value into out and returns its version, 0 if nothing
+    // has been published yet and out is left alone
+    uint32_t read(T* out) const {
+      while (true) {
+        if (_version.load(std::memory_order_acquire) == 0) {
+          return 0;
+        }
+        uint8_t current = _current.load(std::memory_order_acquire);
+        const Slot& slot = _slots[current];
+        uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+          continue;
+        }
+        _load(slot, out);
+        uint32_t version = slot.version.load(std::memory_order_relaxed);
+        // the copy is done before the count is checked again
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // a slot refilled behind a reader's stale index holds a value that is
+        // not current yet, taking it could make the next read go backwards
+        if (slot.sequence.load(std::memory_order_relaxed) == sequence
+          && _current.load(std::memory_order_relaxed) == current) {
+          return version;
+        }
+      }
+    }
+
+    uint32_t getVersion() const {
+      return _version.load(std::memory_order_acquire);
+    }
+
+    // ms since the latest publish, ULONG_MAX before the first
+    unsigned long getAgeMillis() const {
+      if (getVersion() == 0) {
+        return ULONG_MAX;
+      }
+      return millis() - _publishedAt.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // the value is kept as relaxed atomic words, so a copy racing the writer
+    // is a stale copy that the count rejects rather than undefined behaviour
+    static const size_t WORDS = (sizeof(T) + 3) / 4;
+
+    struct Slot {
+      std::atomic<uint32_t> sequence;
+      std::atomic<uint32_t> version;
+      std::atomic<uint32_t> words[WORDS];
+    };
+
+    static void _store(Slot& slot, const T& value) {
+      const uint8_t* bytes = (const uint8_t*) &value;
+      for (size_t i = 0; i < WORDS; i++) {
+        uint32_t word = 0;
+        memcpy(&word, bytes + 4 * i, min((size_t) 4, sizeof(T) - 4 * i));
+        slot.words[i].store(word, std::memory_order_relaxed);
+      }
+    }
+
+    static void _load(const Slot& slot, T* out) {
+      uint8_t* bytes = (uint8_t*) out;
+      for (size_t i = 0; i < WORDS; i++) {
+        uint32_t word = slot.words[i].load(std::memory_order_relaxed);
+        memcpy(bytes + 4 * i, &word, min((size_t) 4, sizeof(T) - 4 * i));
+      }
+    }
+
+    Slot _slots[2];
+    std::atomic<uint32_t> _version;
+    std::atomic<uint8_t> _current;
+    std::atomic<unsigned long> _publishedAt;
+};
+
+#endif
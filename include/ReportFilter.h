@@ -0,0 +1,104 @@
+/*
+    ReportFilter.h - Report-by-exception with a deadband per field
+*/
+
+#ifndef ReportFilter_h
+#define ReportFilter_h
+
+#include <Arduino.h>
+#include <math.h>
+#include <string.h>
+
+// Decides whether a sample of one source is worth sending. Each of the N
+// fields has a threshold in the units it is sent in: the sample is reported
+// when any field moved further than its threshold from the value last
+// reported, or when keyframeInterval samples have gone by without a report.
+// A threshold of 0 reports any change, a negative one never triggers.
+template <uint8_t N>
+class ReportFilter {
+  public:
+    ReportFilter() {
+      _keyframeInterval = 1;
+      for (uint8_t i = 0; i < N; i++) {
+        _thresholds[i] = 0;
+        _last[i] = 0;
+      }
+      reset();
+    }
+
+    void setThreshold(uint8_t field, float threshold) {
+      if (field < N) {
+        _thresholds[field] = threshold;
+      }
+    }
+
+    float getThreshold(uint8_t field) const {
+      return field < N ? _thresholds[field] : 0;
+    }
+
+    // the whole table, to keep it in flash
+    float* getThresholds() {
+      return _thresholds;
+    }
+
+    // samples between forced reports, 1 reports every sample
+    void setKeyframeInterval(int samples) {
+      _keyframeInterval = samples < 1 ? 1 : samples;
+    }
+
+    int getKeyframeInterval() const {
+      return _keyframeInterval;
+    }
+
+    // values holds the sample's N fields. Reported values become the
+    // reference the next samples are compared with
+    bool report(const double* values) {
+      bool send = !_primed || ++_skipped >= _keyframeInterval;
+      for (uint8_t i = 0; i < N && !send; i++) {
+        send = _thresholds[i] >= 0 && fabs(values[i] - _last[i]) > _thresholds[i];
+      }
+      if (send) {
+        for (uint8_t i = 0; i < N; i++) {
+          _last[i] = values[i];
+        }
+        _primed = true;
+        _skipped = 0;
+      }
+      return send;
+    }
+
+    // What the next samples are compared with, without the thresholds, which
+    // come from the settings. Kept across a deep sleep
+    struct Reference {
+      double last[N];
+      int skipped;
+      bool primed;
+    };
+
+    void getReference(Reference* reference) const {
+      memcpy(reference->last, _last, sizeof(_last));
+      reference->skipped = _skipped;
+      reference->primed = _primed;
+    }
+
+    void setReference(const Reference& reference) {
+      memcpy(_last, reference.last, sizeof(_last));
+      _skipped = reference.skipped;
+      _primed = reference.primed;
+    }
+
+    // the next sample is reported whatever it holds
+    void reset() {
+      _primed = false;
+      _skipped = 0;
+    }
+
+  private:
+    float _thresholds[N];
+    double _last[N];
+    int _keyframeInterval;
+    int _skipped;
+    bool _primed;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+    RunningStats.h - Streaming min, max, mean and variance of one value
+*/
+
+#ifndef RunningStats_h
+#define RunningStats_h
+
+#include <Arduino.h>
+#include <math.h>
+
+// Folds in one reading at a time in O(1) and a few doubles of state, using
+// Welford's update so the variance stays accurate over long intervals
+class RunningStats {
+  public:
+    RunningStats() {
+      clear();
+    }
+
+    void add(double value) {
+      _count++;
+      if (_count == 1) {
+        _min = value;
+        _max = value;
+        _mean = value;
+        _m2 = 0;
+      }
+      else {
+        if (value < _min) {
+          _min = value;
+        }
+        if (value > _max) {
+          _max = value;
+        }
+        double delta = value - _mean;
+        _mean += delta / _count;
+        _m2 += delta * (value - _mean);
+      }
+      _last = value;
+    }
+
+    unsigned long count() const {
+      return _count;
+    }
+
+    double getMin() const {
+      return _min;
+    }
+
+    double getMax() const {
+      return _max;
+    }
+
+    double getMean() const {
+      return _mean;
+    }
+
+    double getLast() const {
+      return _last;
+    }
+
+    // population variance, 0 until there are two readings
+    double getVariance() const {
+      return _count < 2 ? 0 : _m2 / _count;
+    }
+
+    double getStdDev() const {
+      return sqrt(getVariance());
+    }
+
+    void clear() {
+      _count = 0;
+      _min = 0;
+      _max = 0;
+      _mean = 0;
+      _m2 = 0;
+      _last = 0;
+    }
+
+  private:
+    unsigned long _count;
+    double _min;
+    double _max;
+    double _mean;
+    double _m2;
+    double _last;
+};
+
+#endif
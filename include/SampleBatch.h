@@ -0,0 +1,148 @@
+/*
+    SampleBatch.h - RAM buffer of samples taken at a fixed step, sent as one note
+*/
+
+#ifndef SampleBatch_h
+#define SampleBatch_h
+
+#include <Arduino.h>
+#include <TimeLib.h>
+
+// Holds up to N samples of one source. A batch is sent as a single note with
+// a base time and a step, so every sample has to land on base + k * step. A
+// sample that does not, or a full batch, means the batch is flushed first.
+// Without setStep() the step is taken from the first two samples and k is
+// the sample's position. With it, later samples may skip whole steps, as
+// report-by-exception leaves them out, and getIndex() gives each sample's k.
+template <typename T, uint8_t N>
+class SampleBatch {
+  public:
+    SampleBatch() {
+      _limit = 1;
+      _fixedStep = 0;
+      clear();
+    }
+
+    // seconds the samples are taken at, 0 to learn it from the first two.
+    // Samples already held are dropped, flush them first
+    void setStep(unsigned long step) {
+      _fixedStep = step;
+      clear();
+    }
+
+    // samples per note, 1 sends every sample on its own
+    void setLimit(int limit) {
+      _limit = limit < 1 ? 1 : (limit > N ? N : limit);
+    }
+
+    uint8_t getLimit() const {
+      return _limit;
+    }
+
+    // returns false if the sample does not continue this batch
+    bool add(const T& sample, time_t time) {
+      if (!accepts(time)) {
+        return false;
+      }
+      if (_count == 0) {
+        _base = time;
+        _firstMillis = millis();
+        _index[0] = 0;
+      }
+      else if (_step == 0) {
+        _step = time - _base;
+        _index[1] = 1;
+      }
+      else {
+        _index[_count] = _slot(time);
+      }
+      _samples[_count++] = sample;
+      return true;
+    }
+
+    bool accepts(time_t time) const {
+      if (_count == 0) {
+        return true;
+      }
+      if (_count >= _limit || time <= _base) {
+        return false;
+      }
+      if (_step == 0) {
+        return true;
+      }
+      // a learned step could itself span a gap, so only a set one skips
+      unsigned long slot = _slot(time);
+      if (slot <= _index[_count - 1] || slot > MAX_INDEX || (_fixedStep == 0 && slot != _count)) {
+        return false;
+      }
+      // the logging interval is kept in millis(), allow a second of slip
+      long slip = (long) (time - (_base + (time_t) _step * slot));
+      return slip >= -1 && slip <= 1;
+    }
+
+    bool full() const {
+      return _count >= _limit;
+    }
+
+    bool empty() const {
+      return _count == 0;
+    }
+
+    uint8_t count() const {
+      return _count;
+    }
+
+    time_t getBaseTime() const {
+      return _base;
+    }
+
+    // seconds between samples, without setStep() 0 until there are two
+    unsigned long getStep() const {
+      return _step;
+    }
+
+    // sample index was taken at getBaseTime() + getIndex(index) * getStep()
+    uint16_t getIndex(uint8_t index) const {
+      return _index[index];
+    }
+
+    // true when steps were skipped, and the indexes have to be sent
+    bool hasGaps() const {
+      return _count > 0 && _index[_count - 1] != _count - 1;
+    }
+
+    // how long the oldest sample has been waiting
+    unsigned long getAgeMillis() const {
+      return _count == 0 ? 0 : millis() - _firstMillis;
+    }
+
+    const T& operator[](uint8_t index) const {
+      return _samples[index];
+    }
+
+    void clear() {
+      _count = 0;
+      _base = 0;
+      _step = _fixedStep;
+      _firstMillis = 0;
+    }
+
+  private:
+    static const uint16_t MAX_INDEX = 0xFFFF;
+
+    // the nearest whole number of steps from the base time
+    unsigned long _slot(time_t time) const {
+      return (unsigned long) (time - _base + _step / 2) / _step;
+    }
+
+    T _samples[N];
+    uint16_t _index[N];
+    uint8_t _count;
+    uint8_t _limit;
+    time_t _base;
+    unsigned long _step;
+    unsigned long _fixedStep;
+    unsigned long _firstMillis;
+};
+
+#endif
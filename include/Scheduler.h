@@ -0,0 +1,202 @@
+/*
+    Scheduler.h - Periodic jobs on fixed-phase deadlines of a 64-bit clock
+*/
+
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <string.h>
+#include "RunningStats.h"
+
+// Runs jobs every period ms from the caller's task, timed by a monotonic
+// microsecond clock, esp_timer on the ESP32, which does not roll over. Each
+// deadline is the last one plus the period, never the time the job ran plus
+// the period, so processing time does not accumulate as drift. A job that
+// falls more than a period behind skips the deadlines it missed and counts
+// them instead of running back to back. Aligned jobs run on whole periods of
+// the wall clock, e.g. on the minute, given its offset from the local clock.
+// Lateness of every run is kept as jitter statistics.
+class Scheduler {
+  public:
+    static const uint8_t MAX_JOBS = 8;
+    static const uint8_t NAME_SIZE = 12;
+
+    typedef void (*Job)();
+    typedef int64_t (*Clock)();
+
+    struct JobReport {
+      char name[NAME_SIZE];
+      uint32_t periodMs;
+      uint32_t runs;
+      uint32_t missed;      // deadlines skipped
+      float meanLateMs;     // after the deadline, per run
+      float sdLateMs;
+      float maxLateMs;
+    };
+    struct Report {
+      uint8_t jobs;
+      JobReport job[MAX_JOBS];
+    };
+
+    Scheduler(Clock clock) {
+      _clock = clock;
+      _count = 0;
+      _wallOffset = 0;
+    }
+
+    // Adds a job first run at local µs start, -1 when the table is full
+    int8_t add(const char* name, Job job, uint32_t periodMs, int64_t start) {
+      if (_count >= MAX_JOBS) {
+        return -1;
+      }
+      Entry& entry = _jobs[_count];
+      memset(entry.name, 0, NAME_SIZE);
+      strncpy(entry.name, name, NAME_SIZE - 1);
+      entry.job = job;
+      entry.period = _periodMicros(periodMs);
+      entry.next = start;
+      entry.aligned = false;
+      entry.runs = 0;
+      entry.missed = 0;
+      entry.late.clear();
+      return _count++;
+    }
+
+    // Runs the job on whole periods of the wall clock from the next one on
+    void align(int8_t id) {
+      if (!_valid(id)) {
+        return;
+      }
+      _jobs[id].aligned = true;
+      _jobs[id].next = _boundary(_jobs[id].period);
+    }
+
+    // The next deadline keeps the job's phase, or for an aligned job moves
+    // to the new period's next boundary
+    void setPeriod(int8_t id, uint32_t periodMs) {
+      if (!_valid(id) || _periodMicros(periodMs) == _jobs[id].period) {
+        return;
+      }
+      Entry& entry = _jobs[id];
+      int64_t last = entry.next - entry.period;
+      entry.period = _periodMicros(periodMs);
+      if (entry.aligned) {
+        entry.next = _boundary(entry.period);
+      }
+      else {
+        entry.next = max(last + entry.period, _clock());
+      }
+    }
+
+    // Moves the next run of an unaligned job to ms from now, for a job that
+    // knows when it next has work, or has some straight away
+    void runIn(int8_t id, uint32_t ms) {
+      if (_valid(id) && !_jobs[id].aligned) {
+        _jobs[id].next = _clock() + (int64_t) ms * 1000;
+      }
+    }
+
+    // Wall clock µs minus local µs, as the wall clock's corrections move it.
+    // A step larger than a period, such as the first sync, starts an aligned
+    // job over at its next boundary rather than counting misses
+    void setWallOffset(int64_t offset) {
+      int64_t step = offset - _wallOffset;
+      _wallOffset = offset;
+      for (uint8_t i = 0; i < _count; i++) {
+        if (_jobs[i].aligned && (step >= _jobs[i].period || -step >= _jobs[i].period)) {
+          _jobs[i].next = _boundary(_jobs[i].period);
+        }
+      }
+    }
+
+    // Runs every job that is due, in the order they were added, and returns
+    // how many ran. A job may change its own period while it runs
+    uint8_t run() {
+      uint8_t ran = 0;
+      for (uint8_t i = 0; i < _count; i++) {
+        Entry& entry = _jobs[i];
+        int64_t now = _clock();
+        int64_t late = now - _deadline(entry);
+        if (late < 0) {
+          continue;
+        }
+        int64_t missed = late / entry.period;
+        entry.missed += missed;
+        entry.runs++;
+        entry.late.add((late - missed * entry.period) / 1000.0);
+        entry.next += (missed + 1) * entry.period;
+        entry.job();
+        ran++;
+      }
+      return ran;
+    }
+
+    // local µs of a job's next deadline, INT64_MAX for no such job
+    int64_t getDeadline(int8_t id) const {
+      return _valid(id) ? _deadline(_jobs[id]) : INT64_MAX;
+    }
+
+    // local µs of the earliest deadline, INT64_MAX without jobs
+    int64_t getNextDeadline() const {
+      int64_t next = INT64_MAX;
+      for (uint8_t i = 0; i < _count; i++) {
+        next = min(next, _deadline(_jobs[i]));
+      }
+      return next;
+    }
+
+    void getReport(Report* report) const {
+      report->jobs = _count;
+      for (uint8_t i = 0; i < _count; i++) {
+        const Entry& entry = _jobs[i];
+        JobReport& job = report->job[i];
+        memcpy(job.name, entry.name, NAME_SIZE);
+        job.periodMs = entry.period / 1000;
+        job.runs = entry.runs;
+        job.missed = entry.missed;
+        job.meanLateMs = entry.late.getMean();
+        job.sdLateMs = entry.late.getStdDev();
+        job.maxLateMs = entry.late.getMax();
+      }
+    }
+
+  private:
+    struct Entry {
+      char name[NAME_SIZE];
+      Job job;
+      int64_t period;       // in µs
+      int64_t next;         // deadline, on the wall clock when aligned
+      bool aligned;
+      uint32_t runs;
+      uint32_t missed;
+      RunningStats late;    // in ms
+    };
+
+    bool _valid(int8_t id) const {
+      return id >= 0 && id < _count;
+    }
+
+    static int64_t _periodMicros(uint32_t periodMs) {
+      return (int64_t) max(periodMs, (uint32_t) 1) * 1000;
+    }
+
+    // the first whole period of the wall clock after now
+    int64_t _boundary(int64_t period) const {
+      int64_t wall = _clock() + _wallOffset;
+      return (wall / period + 1) * period;
+    }
+
+    // local µs of a job's next deadline
+    int64_t _deadline(const Entry& entry) const {
+      return entry.aligned ? entry.next - _wallOffset : entry.next;
+    }
+
+    Clock _clock;
+    Entry _jobs[MAX_JOBS];
+    uint8_t _count;
+    int64_t _wallOffset;
+};
+
+#endif
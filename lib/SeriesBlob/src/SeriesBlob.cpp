@@ -0,0 +1,246 @@
+/*
+    SeriesBlob.cpp - Compact binary encoding of batched telemetry
+*/
+
+#include <SeriesBlob.h>
+#include <string.h>
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+SeriesEncoder::SeriesEncoder(uint8_t* buffer, size_t size) {
+    _buffer = buffer;
+    _size = size;
+    begin(0, 0, 0);
+}
+
+void SeriesEncoder::begin(uint32_t baseTime, uint32_t step, uint16_t count) {
+    _length = 0;
+    _channels = 0;
+    _samples = 0;
+    _overflow = false;
+    _put('S');
+    _put('B');
+    _put(VERSION);
+    _putVarint(count);
+    _putVarint(baseTime);
+    _putVarint(step);
+    _channelCountAt = _length;
+    _put(0);
+}
+
+bool SeriesEncoder::addChannel(const char* name, uint8_t decimals) {
+    if (_samples > 0 || _channels >= MAX_CHANNELS) {
+        return false;
+    }
+    do {
+        _put(*name);
+    } while (*name++ != '\0');
+    _put(decimals);
+    _channels++;
+    if (_channelCountAt < _size) {
+        _buffer[_channelCountAt] = _channels;
+    }
+    return !_overflow;
+}
+
+bool SeriesEncoder::addSample(const int32_t* values) {
+    for (uint8_t i = 0; i < _channels; i++) {
+        int64_t out;
+        if (_samples == 0) {
+            out = values[i];
+        } else {
+            int64_t delta = (int64_t) values[i] - _previous[i];
+            out = _samples == 1 ? delta : delta - _delta[i];
+            _delta[i] = delta;
+        }
+        _previous[i] = values[i];
+        _putVarint(zigzag(out));
+    }
+    _samples++;
+    return !_overflow;
+}
+
+size_t SeriesEncoder::length() const {
+    return _length;
+}
+
+bool SeriesEncoder::overflowed() const {
+    return _overflow;
+}
+
+void SeriesEncoder::_put(uint8_t byte) {
+    if (_length >= _size) {
+        _overflow = true;
+        return;
+    }
+    _buffer[_length++] = byte;
+}
+
+void SeriesEncoder::_putVarint(uint64_t value) {
+    while (value >= 0x80) {
+        _put((uint8_t) value | 0x80);
+        value >>= 7;
+    }
+    _put((uint8_t) value);
+}
+
+SeriesDecoder::SeriesDecoder(const uint8_t* data, size_t length) {
+    _data = data;
+    _length = length;
+    _position = 0;
+    _count = 0;
+    _samples = 0;
+    _baseTime = 0;
+    _step = 0;
+    _channels = 0;
+}
+
+bool SeriesDecoder::begin() {
+    _position = 0;
+    _samples = 0;
+    if (_length < 3 || _data[0] != 'S' || _data[1] != 'B' || _data[2] != SeriesEncoder::VERSION) {
+        return false;
+    }
+    _position = 3;
+
+    uint64_t count, baseTime, step;
+    if (!_getVarint(&count) || !_getVarint(&baseTime) || !_getVarint(&step) || _position >= _length) {
+        return false;
+    }
+    _count = count;
+    _baseTime = baseTime;
+    _step = step;
+    _channels = _data[_position++];
+    if (_channels > SeriesEncoder::MAX_CHANNELS) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < _channels; i++) {
+        const void* end = memchr(_data + _position, '\0', _length - _position);
+        if (end == NULL) {
+            return false;
+        }
+        _names[i] = (const char*) _data + _position;
+        _position = (const uint8_t*) end - _data + 1;
+        if (_position >= _length) {
+            return false;
+        }
+        _decimals[i] = _data[_position++];
+    }
+    return true;
+}
+
+uint16_t SeriesDecoder::getCount() const {
+    return _count;
+}
+
+uint32_t SeriesDecoder::getBaseTime() const {
+    return _baseTime;
+}
+
+uint32_t SeriesDecoder::getStep() const {
+    return _step;
+}
+
+uint8_t SeriesDecoder::getChannelCount() const {
+    return _channels;
+}
+
+const char* SeriesDecoder::getChannelName(uint8_t channel) const {
+    return channel < _channels ? _names[channel] : NULL;
+}
+
+uint8_t SeriesDecoder::getDecimals(uint8_t channel) const {
+    return channel < _channels ? _decimals[channel] : 0;
+}
+
+bool SeriesDecoder::nextSample(int32_t* values) {
+    if (_samples >= _count) {
+        return false;
+    }
+    for (uint8_t i = 0; i < _channels; i++) {
+        uint64_t encoded;
+        if (!_getVarint(&encoded)) {
+            return false;
+        }
+        int64_t in = unzigzag(encoded);
+        if (_samples == 0) {
+            _previous[i] = in;
+        } else {
+            int64_t delta = _samples == 1 ? in : in + _delta[i];
+            _delta[i] = delta;
+            _previous[i] = _previous[i] + delta;
+        }
+        values[i] = _previous[i];
+    }
+    _samples++;
+    return true;
+}
+
+bool SeriesDecoder::_getVarint(uint64_t* value) {
+    *value = 0;
+    for (uint8_t shift = 0; shift < 64; shift += 7) {
+        if (_position >= _length) {
+            return false;
+        }
+        uint8_t byte = _data[_position++];
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t seriesBase64Encode(const uint8_t* data, size_t length, char* out, size_t size) {
+    size_t needed = (length + 2) / 3 * 4;
+    if (needed + 1 > size) {
+        return 0;
+    }
+    size_t o = 0;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t group = (uint32_t) data[i] << 16;
+        if (i + 1 < length) {
+            group |= (uint32_t) data[i + 1] << 8;
+        }
+        if (i + 2 < length) {
+            group |= data[i + 2];
+        }
+        out[o++] = BASE64[(group >> 18) & 0x3F];
+        out[o++] = BASE64[(group >> 12) & 0x3F];
+        out[o++] = i + 1 < length ? BASE64[(group >> 6) & 0x3F] : '=';
+        out[o++] = i + 2 < length ? BASE64[group & 0x3F] : '=';
+    }
+    out[o] = '\0';
+    return o;
+}
+
+size_t seriesBase64Decode(const char* text, uint8_t* out, size_t size) {
+    size_t o = 0;
+    uint32_t group = 0;
+    uint8_t bits = 0;
+    for (; *text != '\0' && *text != '='; text++) {
+        const char* found = strchr(BASE64, *text);
+        if (found == NULL) {
+            return 0;
+        }
+        group = (group << 6) | (uint32_t) (found - BASE64);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (o >= size) {
+                return 0;
+            }
+            out[o++] = (uint8_t) (group >> bits);
+        }
+    }
+    return o;
+}
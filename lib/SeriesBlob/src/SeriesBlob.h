@@ -0,0 +1,96 @@
+/*
+    SeriesBlob.h - Compact binary encoding of batched telemetry
+
+    A blob holds count samples of several channels taken at baseTime + i * step.
+    Values are integers worth raw / 10^decimals. Layout, all varints unsigned
+    LEB128:
+
+        'S' 'B' version
+        varint count, varint baseTime, varint step
+        channel count byte, then per channel its NUL-terminated name and a
+        decimals byte
+        count rows of one zigzag varint per channel
+
+    The first row holds each value, the second its delta and the rest the
+    delta of the delta, so a steady or linearly changing channel costs one
+    byte per sample. Nothing here depends on Arduino, so the decoder builds
+    on Linux as well, see tools/series_decode.cpp.
+*/
+
+#ifndef SeriesBlob_h
+#define SeriesBlob_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+class SeriesEncoder {
+    public:
+        static const uint8_t VERSION = 1;
+        static const uint8_t MAX_CHANNELS = 96;
+
+        SeriesEncoder(uint8_t* buffer, size_t size);
+        // starts a blob of count samples
+        void begin(uint32_t baseTime, uint32_t step, uint16_t count);
+        // channels are declared before the first sample
+        bool addChannel(const char* name, uint8_t decimals);
+        // one raw value per channel, in the order the channels were added
+        bool addSample(const int32_t* values);
+
+        size_t length() const;
+        // true if the buffer was too small, the blob is then unusable
+        bool overflowed() const;
+
+    private:
+        uint8_t* _buffer;
+        size_t _size;
+        size_t _length;
+        size_t _channelCountAt;
+        uint8_t _channels;
+        uint16_t _samples;
+        bool _overflow;
+        int32_t _previous[MAX_CHANNELS];
+        int64_t _delta[MAX_CHANNELS];
+
+        void _put(uint8_t byte);
+        void _putVarint(uint64_t value);
+};
+
+class SeriesDecoder {
+    public:
+        SeriesDecoder(const uint8_t* data, size_t length);
+        // reads the header, false if this is not a blob of a known version
+        bool begin();
+
+        uint16_t getCount() const;
+        uint32_t getBaseTime() const;
+        uint32_t getStep() const;
+        uint8_t getChannelCount() const;
+        const char* getChannelName(uint8_t channel) const;
+        uint8_t getDecimals(uint8_t channel) const;
+
+        // fills one raw value per channel, false when the blob is used up or damaged
+        bool nextSample(int32_t* values);
+
+    private:
+        const uint8_t* _data;
+        size_t _length;
+        size_t _position;
+        uint16_t _count;
+        uint16_t _samples;
+        uint32_t _baseTime;
+        uint32_t _step;
+        uint8_t _channels;
+        const char* _names[SeriesEncoder::MAX_CHANNELS];
+        uint8_t _decimals[SeriesEncoder::MAX_CHANNELS];
+        int32_t _previous[SeriesEncoder::MAX_CHANNELS];
+        int64_t _delta[SeriesEncoder::MAX_CHANNELS];
+
+        bool _getVarint(uint64_t* value);
+};
+
+// returns the length written without the terminating NUL, 0 if out is too small
+size_t seriesBase64Encode(const uint8_t* data, size_t length, char* out, size_t size);
+// returns the number of bytes decoded, 0 on bad input or if out is too small
+size_t seriesBase64Decode(const char* text, uint8_t* out, size_t size);
+
+#endif
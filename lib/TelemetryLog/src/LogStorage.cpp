@@ -0,0 +1,126 @@
+/*
+    LogStorage.cpp - Segment files behind TelemetryLog
+*/
+
+#include <LogStorage.h>
+
+#if defined(ESP_PLATFORM)
+#include <LittleFS.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+LittleFsStorage::LittleFsStorage() {
+    _directory = "/log";
+}
+
+bool LittleFsStorage::begin(const char* directory) {
+    _directory = directory;
+    if (!LittleFS.begin(true)) {
+        return false;
+    }
+    if (!LittleFS.exists(_directory)) {
+        LittleFS.mkdir(_directory);
+    }
+    return true;
+}
+
+bool LittleFsStorage::append(uint32_t segment, const uint8_t* header, size_t headerLength,
+    const uint8_t* payload, size_t payloadLength) {
+    char path[32];
+    _path(segment, path, sizeof(path));
+    File file = LittleFS.open(path, "a");
+    if (!file) {
+        return false;
+    }
+    bool ok = file.write(header, headerLength) == headerLength
+        && file.write(payload, payloadLength) == payloadLength;
+    file.close();
+    return ok;
+}
+
+size_t LittleFsStorage::read(uint32_t segment, uint32_t offset, uint8_t* buffer, size_t length) {
+    char path[32];
+    _path(segment, path, sizeof(path));
+    File file = LittleFS.open(path, "r");
+    if (!file) {
+        return 0;
+    }
+    size_t count = file.seek(offset) ? file.read(buffer, length) : 0;
+    file.close();
+    return count;
+}
+
+uint32_t LittleFsStorage::size(uint32_t segment) {
+    char path[32];
+    _path(segment, path, sizeof(path));
+    File file = LittleFS.open(path, "r");
+    if (!file) {
+        return 0;
+    }
+    uint32_t length = file.size();
+    file.close();
+    return length;
+}
+
+bool LittleFsStorage::remove(uint32_t segment) {
+    char path[32];
+    _path(segment, path, sizeof(path));
+    return LittleFS.remove(path);
+}
+
+bool LittleFsStorage::range(uint32_t* first, uint32_t* last) {
+    File directory = LittleFS.open(_directory);
+    if (!directory || !directory.isDirectory()) {
+        return false;
+    }
+    bool found = false;
+    for (File file = directory.openNextFile(); file; file = directory.openNextFile()) {
+        // segment files are named by their number in hex, the cursor file is not
+        const char* name = strrchr(file.name(), '/');
+        name = name != NULL ? name + 1 : file.name();
+        char* end;
+        uint32_t segment = strtoul(name, &end, 16);
+        if (*end == '\0' && end != name) {
+            if (!found || segment < *first) {
+                *first = segment;
+            }
+            if (!found || segment > *last) {
+                *last = segment;
+            }
+            found = true;
+        }
+        file.close();
+    }
+    directory.close();
+    return found;
+}
+
+bool LittleFsStorage::writeCursor(const uint8_t* data, size_t length) {
+    char path[32];
+    snprintf(path, sizeof(path), "%s/cursor", _directory);
+    File file = LittleFS.open(path, "w");
+    if (!file) {
+        return false;
+    }
+    bool ok = file.write(data, length) == length;
+    file.close();
+    return ok;
+}
+
+size_t LittleFsStorage::readCursor(uint8_t* data, size_t length) {
+    char path[32];
+    snprintf(path, sizeof(path), "%s/cursor", _directory);
+    File file = LittleFS.open(path, "r");
+    if (!file) {
+        return 0;
+    }
+    size_t count = file.read(data, length);
+    file.close();
+    return count;
+}
+
+void LittleFsStorage::_path(uint32_t segment, char* path, size_t size) {
+    snprintf(path, size, "%s/%08lx", _directory, (unsigned long) segment);
+}
+#endif
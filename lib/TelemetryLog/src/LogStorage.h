@@ -0,0 +1,53 @@
+/*
+    LogStorage.h - Segment files behind TelemetryLog
+*/
+
+#ifndef LogStorage_h
+#define LogStorage_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Numbered, append-only segment files plus one small cursor file. An append
+// or a cursor write is durable once it returns; a power loss during one may
+// leave a torn tail, which TelemetryLog finds by CRC
+class LogStorage {
+    public:
+        virtual ~LogStorage() {}
+        // header and payload are written as one record
+        virtual bool append(uint32_t segment, const uint8_t* header, size_t headerLength,
+            const uint8_t* payload, size_t payloadLength) = 0;
+        virtual size_t read(uint32_t segment, uint32_t offset, uint8_t* buffer, size_t length) = 0;
+        // 0 if the segment does not exist
+        virtual uint32_t size(uint32_t segment) = 0;
+        virtual bool remove(uint32_t segment) = 0;
+        // lowest and highest segment present, false if there are none
+        virtual bool range(uint32_t* first, uint32_t* last) = 0;
+        virtual bool writeCursor(const uint8_t* data, size_t length) = 0;
+        virtual size_t readCursor(uint8_t* data, size_t length) = 0;
+};
+
+#if defined(ESP_PLATFORM)
+// Segments as files in a directory of the LittleFS partition. LittleFS is
+// copy-on-write and levels wear itself, a file write is committed on close
+class LittleFsStorage : public LogStorage {
+    public:
+        LittleFsStorage();
+        // mounts LittleFS, formatting the partition if it cannot be mounted
+        bool begin(const char* directory);
+        bool append(uint32_t segment, const uint8_t* header, size_t headerLength,
+            const uint8_t* payload, size_t payloadLength);
+        size_t read(uint32_t segment, uint32_t offset, uint8_t* buffer, size_t length);
+        uint32_t size(uint32_t segment);
+        bool remove(uint32_t segment);
+        bool range(uint32_t* first, uint32_t* last);
+        bool writeCursor(const uint8_t* data, size_t length);
+        size_t readCursor(uint8_t* data, size_t length);
+    private:
+        const char* _directory;
+
+        void _path(uint32_t segment, char* path, size_t size);
+};
+#endif
+
+#endif
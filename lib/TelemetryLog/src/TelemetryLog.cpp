@@ -0,0 +1,242 @@
+/*
+    TelemetryLog.cpp - Append-only store-and-forward log of outbound records
+*/
+
+#include <TelemetryLog.h>
+
+static const uint8_t MAGIC_0 = 0x5A;
+static const uint8_t MAGIC_1 = 0xA5;
+// records are read into this while segments are scanned
+static uint8_t scratch[TelemetryLog::MAX_RECORD];
+
+static void putU32(uint8_t* out, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t getU32(const uint8_t* in) {
+    return in[0] | ((uint32_t) in[1] << 8) | ((uint32_t) in[2] << 16) | ((uint32_t) in[3] << 24);
+}
+
+TelemetryLog::TelemetryLog() {
+    _storage = NULL;
+    _first = 1;
+    _last = 1;
+    _writeOffset = 0;
+    _readSegment = 1;
+    _readOffset = 0;
+    _peekLength = 0;
+    _pendingBytes = 0;
+    _dropped = 0;
+}
+
+bool TelemetryLog::begin(LogStorage& storage) {
+    _storage = &storage;
+    _peekLength = 0;
+    if (!_storage->range(&_first, &_last)) {
+        _first = 1;
+        _last = 1;
+        _writeOffset = 0;
+        _readSegment = 1;
+        _readOffset = 0;
+        _pendingBytes = 0;
+        return true;
+    }
+
+    // a torn append can only be at the end of the newest segment
+    unsigned long records;
+    _writeOffset = _scan(_last, _storage->size(_last), &records);
+    if (_writeOffset < _storage->size(_last)) {
+        _last++;
+        _writeOffset = 0;
+    }
+
+    uint8_t cursor[12];
+    _readSegment = _first;
+    _readOffset = 0;
+    if (_storage->readCursor(cursor, sizeof(cursor)) == sizeof(cursor)
+        && getU32(cursor + 8) == _crc32(cursor, 8)) {
+        uint32_t segment = getU32(cursor);
+        uint32_t offset = getU32(cursor + 4);
+        if (segment >= _first && segment <= _last) {
+            _readSegment = segment;
+            _readOffset = offset;
+        }
+    }
+    while (_first < _readSegment) {
+        _storage->remove(_first++);
+    }
+
+    _pendingBytes = 0;
+    for (uint32_t segment = _readSegment; segment <= _last; segment++) {
+        _pendingBytes += segment == _last ? _writeOffset : _storage->size(segment);
+    }
+    _pendingBytes = _pendingBytes > _readOffset ? _pendingBytes - _readOffset : 0;
+    return true;
+}
+
+bool TelemetryLog::append(const uint8_t* payload, size_t length) {
+    if (_storage == NULL || length == 0 || length > MAX_RECORD) {
+        return false;
+    }
+    if (_writeOffset > 0 && _writeOffset + HEADER_SIZE + length > SEGMENT_SIZE) {
+        _last++;
+        _writeOffset = 0;
+    }
+    while (_last - _first + 1 > MAX_SEGMENTS) {
+        _dropOldest();
+    }
+
+    uint8_t header[HEADER_SIZE];
+    header[0] = MAGIC_0;
+    header[1] = MAGIC_1;
+    header[2] = length;
+    header[3] = length >> 8;
+    putU32(header + 4, _crc32(payload, length));
+    if (!_storage->append(_last, header, HEADER_SIZE, payload, length)) {
+        // if part of it landed the segment is sealed, the next append starts afresh
+        if (_storage->size(_last) != _writeOffset) {
+            _last++;
+            _writeOffset = 0;
+        }
+        return false;
+    }
+    _writeOffset += HEADER_SIZE + length;
+    _pendingBytes += HEADER_SIZE + length;
+    return true;
+}
+
+size_t TelemetryLog::peek(uint8_t* buffer, size_t size) {
+    _peekLength = 0;
+    while (_storage != NULL) {
+        uint32_t end = _readSegment == _last ? _writeOffset : _storage->size(_readSegment);
+        if (_readOffset >= end) {
+            if (_readSegment >= _last) {
+                return 0;
+            }
+            _nextReadSegment();
+            continue;
+        }
+
+        uint32_t length = _check(_readSegment, _readOffset, buffer, size);
+        if (length == 0) {
+            // damaged, or too big for the caller: the rest of the segment cannot be trusted
+            _dropped++;
+            _pendingBytes = _pendingBytes > end - _readOffset ? _pendingBytes - (end - _readOffset) : 0;
+            if (_readSegment == _last) {
+                _last++;
+                _writeOffset = 0;
+            }
+            _nextReadSegment();
+            continue;
+        }
+        _peekLength = length;
+        return length;
+    }
+    return 0;
+}
+
+void TelemetryLog::advance() {
+    if (_peekLength == 0) {
+        return;
+    }
+    _readOffset += HEADER_SIZE + _peekLength;
+    _pendingBytes = _pendingBytes > HEADER_SIZE + _peekLength ? _pendingBytes - HEADER_SIZE - _peekLength : 0;
+    _peekLength = 0;
+    _saveCursor();
+}
+
+bool TelemetryLog::empty() {
+    return _pendingBytes == 0;
+}
+
+uint32_t TelemetryLog::getPendingBytes() {
+    return _pendingBytes;
+}
+
+unsigned long TelemetryLog::getDropped() {
+    return _dropped;
+}
+
+uint32_t TelemetryLog::getSegmentCount() {
+    return _last - _first + 1;
+}
+
+uint32_t TelemetryLog::_check(uint32_t segment, uint32_t offset, uint8_t* buffer, size_t size) {
+    uint8_t header[HEADER_SIZE];
+    if (_storage->read(segment, offset, header, HEADER_SIZE) != HEADER_SIZE
+        || header[0] != MAGIC_0 || header[1] != MAGIC_1) {
+        return 0;
+    }
+    uint32_t length = header[2] | ((uint32_t) header[3] << 8);
+    if (length == 0 || length > MAX_RECORD || length > size
+        || _storage->read(segment, offset + HEADER_SIZE, buffer, length) != length
+        || _crc32(buffer, length) != getU32(header + 4)) {
+        return 0;
+    }
+    return length;
+}
+
+uint32_t TelemetryLog::_scan(uint32_t segment, uint32_t limit, unsigned long* records) {
+    uint32_t offset = 0;
+    *records = 0;
+    while (offset < limit) {
+        uint32_t length = _check(segment, offset, scratch, sizeof(scratch));
+        if (length == 0) {
+            break;
+        }
+        offset += HEADER_SIZE + length;
+        (*records)++;
+    }
+    return offset;
+}
+
+void TelemetryLog::_nextReadSegment() {
+    // everything before the cursor has been sent
+    while (_first <= _readSegment) {
+        _storage->remove(_first++);
+    }
+    _readSegment = _first;
+    _readOffset = 0;
+    if (_first > _last) {
+        _last = _first;
+        _writeOffset = 0;
+    }
+    _saveCursor();
+}
+
+void TelemetryLog::_dropOldest() {
+    if (_readSegment == _first) {
+        // count only what was still waiting to be sent
+        unsigned long records, sent;
+        uint32_t end = _scan(_first, _storage->size(_first), &records);
+        _scan(_first, _readOffset, &sent);
+        records = records > sent ? records - sent : 0;
+        _pendingBytes = _pendingBytes > end - _readOffset ? _pendingBytes - (end - _readOffset) : 0;
+        _dropped += records;
+        _peekLength = 0;
+        _nextReadSegment();
+    } else {
+        _storage->remove(_first++);
+    }
+}
+
+void TelemetryLog::_saveCursor() {
+    uint8_t cursor[12];
+    putU32(cursor, _readSegment);
+    putU32(cursor + 4, _readOffset);
+    putU32(cursor + 8, _crc32(cursor, 8));
+    _storage->writeCursor(cursor, sizeof(cursor));
+}
+
+uint32_t TelemetryLog::_crc32(const uint8_t* data, size_t length, uint32_t crc) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
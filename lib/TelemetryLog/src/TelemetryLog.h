@@ -0,0 +1,71 @@
+/*
+    TelemetryLog.h - Append-only store-and-forward log of outbound records
+
+    Records are appended to numbered segments of at most SEGMENT_SIZE bytes
+    and read back in order through a persistent cursor. Each record is
+
+        0x5A 0xA5, payload length (2 bytes), CRC-32 of the payload (4 bytes),
+        payload
+
+    all little endian. A power loss mid-append leaves a torn tail in the
+    newest segment; begin() finds it by CRC, seals that segment at its last
+    good record and continues in a new one. Drained segments are deleted, and
+    when MAX_SEGMENTS are in use the oldest is dropped to make room, so the
+    log never grows without bound. The cursor is saved after every advance,
+    so a record is delivered at least once across restarts.
+*/
+
+#ifndef TelemetryLog_h
+#define TelemetryLog_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <LogStorage.h>
+
+class TelemetryLog {
+    public:
+        static const uint32_t SEGMENT_SIZE = 16384;
+        static const uint8_t MAX_SEGMENTS = 32;
+        static const uint16_t MAX_RECORD = 8192;
+        static const uint8_t HEADER_SIZE = 8;
+
+        TelemetryLog();
+        // recovers the segments and cursor left by the last run
+        bool begin(LogStorage& storage);
+
+        bool append(const uint8_t* payload, size_t length);
+        // copies the record at the cursor without consuming it, returns its
+        // length or 0 once the log is drained. buffer has to hold MAX_RECORD
+        size_t peek(uint8_t* buffer, size_t size);
+        // consumes the record returned by peek()
+        void advance();
+
+        bool empty();
+        // bytes appended and not yet consumed, headers included
+        uint32_t getPendingBytes();
+        // records lost to a full log or to damage
+        unsigned long getDropped();
+        uint32_t getSegmentCount();
+
+    private:
+        LogStorage* _storage;
+        uint32_t _first;
+        uint32_t _last;
+        uint32_t _writeOffset;
+        uint32_t _readSegment;
+        uint32_t _readOffset;
+        uint32_t _peekLength;
+        uint32_t _pendingBytes;
+        unsigned long _dropped;
+
+        // length of the valid record at offset, 0 if there is none
+        uint32_t _check(uint32_t segment, uint32_t offset, uint8_t* buffer, size_t size);
+        // end of the valid records before limit, and how many there are
+        uint32_t _scan(uint32_t segment, uint32_t limit, unsigned long* records);
+        void _nextReadSegment();
+        void _dropOldest();
+        void _saveCursor();
+        static uint32_t _crc32(const uint8_t* data, size_t length, uint32_t crc = 0);
+};
+
+#endif
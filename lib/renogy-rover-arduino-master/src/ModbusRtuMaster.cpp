@@ -0,0 +1,259 @@
+/*
+    ModbusRtuMaster.cpp - Non-blocking Modbus RTU master for RenogyRover
+    Released into the public domain
+*/
+
+#include <ModbusRtuMaster.h>
+
+// CRC-16/MODBUS, reflected polynomial 0xA001
+static const uint16_t crcTable[256] = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+ModbusRtuMaster::ModbusRtuMaster() {
+    _transport = NULL;
+    _slaveId = 1;
+    _state = IDLE;
+    _lastResult = ku8MBSuccess;
+    _timeoutMs = 2000;
+    _frameGapMicros = 4010;
+    _lastActivityMicros = 0;
+    _sentMillis = 0;
+    _frameLength = 0;
+    _responseWords = 0;
+    _callback = NULL;
+    _context = NULL;
+}
+
+void ModbusRtuMaster::begin(uint8_t slaveId, Stream& serial, unsigned long baud) {
+    _streamTransport.begin(serial);
+    begin(slaveId, _streamTransport, baud);
+}
+
+void ModbusRtuMaster::begin(uint8_t slaveId, ModbusTransport& transport, unsigned long baud) {
+    _slaveId = slaveId;
+    _transport = &transport;
+
+    // 3.5 character times of 11 bits, fixed at 1.75ms above 19200 baud
+    if (baud > 19200) {
+        _frameGapMicros = 1750;
+    } else {
+        _frameGapMicros = 38500000UL / baud;
+    }
+    _lastActivityMicros = micros();
+}
+
+void ModbusRtuMaster::setResponseTimeout(uint16_t timeoutMs) {
+    _timeoutMs = timeoutMs;
+}
+
+int ModbusRtuMaster::readHoldingRegisters(uint16_t address, uint16_t quantity,
+    CompletionCallback callback, void* context) {
+    if (quantity == 0 || quantity > ku8MaxBufferSize) {
+        return 0;
+    }
+    return _queue(0x03, address, quantity, callback, context);
+}
+
+int ModbusRtuMaster::writeSingleRegister(uint16_t address, uint16_t value,
+    CompletionCallback callback, void* context) {
+    return _queue(0x06, address, value, callback, context);
+}
+
+void ModbusRtuMaster::poll() {
+    if (_transport == NULL) {
+        return;
+    }
+
+    switch (_state) {
+        case SEND_PENDING:
+            // respect the inter-frame gap before putting a new request on the bus
+            if (micros() - _lastActivityMicros >= _frameGapMicros) {
+                _send();
+            }
+            break;
+        case AWAITING_RESPONSE:
+            _receive();
+            break;
+        default:
+            break;
+    }
+}
+
+uint8_t ModbusRtuMaster::waitIdle() {
+    while (_state != IDLE) {
+        poll();
+        yield();
+    }
+    return _lastResult;
+}
+
+bool ModbusRtuMaster::isBusy() {
+    return _state != IDLE;
+}
+
+uint8_t ModbusRtuMaster::getLastResult() {
+    return _lastResult;
+}
+
+uint16_t ModbusRtuMaster::getResponseBuffer(uint8_t index) {
+    if (index >= _responseWords) {
+        return 0xFFFF;
+    }
+    // register data starts after id, function and byte count
+    return ((uint16_t) _frame[3 + 2 * index] << 8) | _frame[4 + 2 * index];
+}
+
+int ModbusRtuMaster::_queue(uint8_t function, uint16_t address, uint16_t value,
+    CompletionCallback callback, void* context) {
+    if (_state != IDLE || _transport == NULL) {
+        return 0;
+    }
+
+    _request[0] = _slaveId;
+    _request[1] = function;
+    _request[2] = address >> 8;
+    _request[3] = address;
+    _request[4] = value >> 8;
+    _request[5] = value;
+    uint16_t crc = _crc16(_request, 6);
+    _request[6] = crc;
+    _request[7] = crc >> 8;
+
+    _callback = callback;
+    _context = context;
+    _state = SEND_PENDING;
+    poll();
+    return 1;
+}
+
+void ModbusRtuMaster::_send() {
+    // drop anything left over from a late or partial reply
+    _transport->discardInput();
+
+    _transport->write(_request, sizeof(_request));
+    _frameLength = 0;
+    _responseWords = 0;
+    _sentMillis = millis();
+    _lastActivityMicros = micros();
+    _state = AWAITING_RESPONSE;
+}
+
+void ModbusRtuMaster::_receive() {
+    // the frame is assembled in place, no per-byte copies
+    size_t count = _transport->read(&_frame[_frameLength], MAX_FRAME - _frameLength);
+    if (count > 0) {
+        _frameLength += count;
+        _lastActivityMicros = micros();
+    }
+
+    if (_transport->overrun()) {
+        _complete(ku8MBInvalidCRC);
+        return;
+    }
+
+    int expected = _expectedLength();
+    if (expected > MAX_FRAME) {
+        _complete(ku8MBInvalidCRC);
+    } else if (expected > 0 && _frameLength >= expected) {
+        _complete(_parse(expected));
+    } else if (millis() - _sentMillis > _timeoutMs) {
+        _complete(ku8MBResponseTimedOut);
+    }
+}
+
+// Length of the frame being received, or 0 if not enough is known yet
+int ModbusRtuMaster::_expectedLength() {
+    if (_frameLength < 2) {
+        return 0;
+    }
+    if (_frame[1] & 0x80) {
+        // exception: id, function, code, crc
+        return 5;
+    }
+    if (_frame[1] == 0x03) {
+        if (_frameLength < 3) {
+            return 0;
+        }
+        return 5 + _frame[2];
+    }
+    // write single register echoes the request
+    return 8;
+}
+
+uint8_t ModbusRtuMaster::_parse(uint8_t length) {
+    uint16_t crc = _crc16(_frame, length - 2);
+    if (_frame[length - 2] != (uint8_t) crc || _frame[length - 1] != (uint8_t) (crc >> 8)) {
+        return ku8MBInvalidCRC;
+    }
+    if (_frame[0] != _slaveId) {
+        return ku8MBInvalidSlaveID;
+    }
+    if ((_frame[1] & 0x7F) != _request[1]) {
+        return ku8MBInvalidFunction;
+    }
+    if (_frame[1] & 0x80) {
+        return _frame[2];
+    }
+
+    if (_frame[1] == 0x03) {
+        // a reply to some other read must not be taken for this one
+        uint16_t quantity = ((uint16_t) _request[4] << 8) | _request[5];
+        if (_frame[2] != 2 * quantity) {
+            return ku8MBInvalidByteCount;
+        }
+        _responseWords = quantity;
+    }
+    return ku8MBSuccess;
+}
+
+void ModbusRtuMaster::_complete(uint8_t result) {
+    _lastResult = result;
+    _state = IDLE;
+
+    // the callback may queue the next request straight away
+    CompletionCallback callback = _callback;
+    _callback = NULL;
+    if (callback != NULL) {
+        callback(result, _context);
+    }
+}
+
+uint16_t ModbusRtuMaster::_crc16(const uint8_t* data, uint8_t length) {
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < length; i++) {
+        crc = (crc >> 8) ^ crcTable[(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
@@ -0,0 +1,93 @@
+/*
+    ModbusRtuMaster.h - Non-blocking Modbus RTU master for RenogyRover
+    Released into the public domain
+*/
+
+#ifndef ModbusRtuMaster_h
+#define ModbusRtuMaster_h
+
+#include <Arduino.h>
+#include <ModbusTransport.h>
+
+class ModbusRtuMaster {
+    public:
+        // result codes match ModbusMaster so error strings carry over
+        static const uint8_t ku8MBSuccess = 0x00;
+        static const uint8_t ku8MBIllegalFunction = 0x01;
+        static const uint8_t ku8MBIllegalDataAddress = 0x02;
+        static const uint8_t ku8MBIllegalDataValue = 0x03;
+        static const uint8_t ku8MBSlaveDeviceFailure = 0x04;
+        static const uint8_t ku8MBInvalidSlaveID = 0xE0;
+        static const uint8_t ku8MBInvalidFunction = 0xE1;
+        static const uint8_t ku8MBResponseTimedOut = 0xE2;
+        static const uint8_t ku8MBInvalidCRC = 0xE3;
+        static const uint8_t ku8MBBusy = 0xE4;
+        // a read reply whose byte count is not twice the registers asked for
+        static const uint8_t ku8MBInvalidByteCount = 0xE5;
+
+        static const uint8_t ku8MaxBufferSize = 64;
+
+        // called from poll() once a transaction finished, successfully or not
+        typedef void (*CompletionCallback)(uint8_t result, void* context);
+
+        ModbusRtuMaster();
+        void begin(uint8_t slaveId, Stream& serial, unsigned long baud = 9600);
+        // the transport can be shared by several masters on one bus
+        void begin(uint8_t slaveId, ModbusTransport& transport, unsigned long baud = 9600);
+        void setResponseTimeout(uint16_t timeoutMs);
+
+        // queue a request, returns 0 if another transaction is in flight
+        int readHoldingRegisters(uint16_t address, uint16_t quantity,
+            CompletionCallback callback, void* context);
+        int writeSingleRegister(uint16_t address, uint16_t value,
+            CompletionCallback callback, void* context);
+
+        // drive the state machine, never waits on the bus
+        void poll();
+        // poll until idle, for callers that need the old blocking behaviour
+        uint8_t waitIdle();
+
+        bool isBusy();
+        uint8_t getLastResult();
+        // registers are read in place from the received frame, valid until
+        // the next request is queued
+        uint16_t getResponseBuffer(uint8_t index);
+
+    private:
+        enum State {
+            IDLE,
+            SEND_PENDING,
+            AWAITING_RESPONSE
+        };
+
+        static const uint8_t MAX_FRAME = 5 + 2 * ku8MaxBufferSize;
+
+        ModbusTransport* _transport;
+        StreamTransport _streamTransport;
+        uint8_t _slaveId;
+        State _state;
+        uint8_t _lastResult;
+        uint16_t _timeoutMs;
+        unsigned long _frameGapMicros;
+        unsigned long _lastActivityMicros;
+        unsigned long _sentMillis;
+
+        uint8_t _request[8];
+        uint8_t _frame[MAX_FRAME];
+        uint8_t _frameLength;
+        uint8_t _responseWords;
+
+        CompletionCallback _callback;
+        void* _context;
+
+        int _queue(uint8_t function, uint16_t address, uint16_t value,
+            CompletionCallback callback, void* context);
+        void _send();
+        void _receive();
+        int _expectedLength();
+        uint8_t _parse(uint8_t length);
+        void _complete(uint8_t result);
+        static uint16_t _crc16(const uint8_t* data, uint8_t length);
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*
+    ModbusTransport.cpp - Byte transports for ModbusRtuMaster
+    Released into the public domain
+*/
+
+#include <ModbusTransport.h>
+
+StreamTransport::StreamTransport() {
+    _stream = NULL;
+}
+
+void StreamTransport::begin(Stream& stream) {
+    _stream = &stream;
+}
+
+void StreamTransport::write(const uint8_t* data, size_t length) {
+    _stream->write(data, length);
+}
+
+size_t StreamTransport::read(uint8_t* buffer, size_t maxLength) {
+    size_t count = 0;
+    while (count < maxLength && _stream->available() > 0) {
+        buffer[count++] = _stream->read();
+    }
+    return count;
+}
+
+void StreamTransport::discardInput() {
+    while (_stream->available() > 0) {
+        _stream->read();
+    }
+}
+
+#if defined(ESP_PLATFORM)
+UartTransport::UartTransport() {
+    _port = UART_NUM_2;
+    _events = NULL;
+    _overrun = false;
+    _installed = false;
+}
+
+int UartTransport::begin(uart_port_t port, unsigned long baud, int rxPin, int txPin) {
+    _port = port;
+
+    uart_config_t config = {};
+    config.baud_rate = baud;
+    config.data_bits = UART_DATA_8_BITS;
+    config.parity = UART_PARITY_DISABLE;
+    config.stop_bits = UART_STOP_BITS_1;
+    config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    config.source_clk = UART_SCLK_APB;
+
+    if (uart_driver_install(_port, RX_BUFFER_SIZE, 0, EVENT_QUEUE_LENGTH, &_events, 0) != ESP_OK) {
+        return 0;
+    }
+    _installed = true;
+    if (uart_param_config(_port, &config) != ESP_OK
+        || uart_set_pin(_port, txPin, rxPin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK
+        || uart_set_rx_timeout(_port, RX_TIMEOUT_SYMBOLS) != ESP_OK
+        || uart_set_rx_full_threshold(_port, RX_FULL_THRESHOLD) != ESP_OK) {
+        return 0;
+    }
+    return 1;
+}
+
+void UartTransport::write(const uint8_t* data, size_t length) {
+    // no TX ring buffer, a request frame always fits the 128 byte hardware FIFO
+    uart_tx_chars(_port, (const char*) data, length);
+}
+
+size_t UartTransport::read(uint8_t* buffer, size_t maxLength) {
+    _drainEvents();
+
+    size_t buffered = 0;
+    uart_get_buffered_data_len(_port, &buffered);
+    if (buffered == 0) {
+        return 0;
+    }
+    if (buffered > maxLength) {
+        buffered = maxLength;
+    }
+    int count = uart_read_bytes(_port, buffer, buffered, 0);
+    return count > 0 ? count : 0;
+}
+
+void UartTransport::discardInput() {
+    _drainEvents();
+    uart_flush_input(_port);
+    _overrun = false;
+}
+
+bool UartTransport::overrun() {
+    _drainEvents();
+    bool overrun = _overrun;
+    _overrun = false;
+    return overrun;
+}
+
+void UartTransport::_drainEvents() {
+    if (!_installed) {
+        return;
+    }
+
+    uart_event_t event;
+    while (xQueueReceive(_events, &event, 0) == pdTRUE) {
+        if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL) {
+            uart_flush_input(_port);
+            xQueueReset(_events);
+            _overrun = true;
+            return;
+        }
+    }
+}
+#endif
@@ -0,0 +1,76 @@
+/*
+    ModbusTransport.h - Byte transports for ModbusRtuMaster
+    Released into the public domain
+*/
+
+#ifndef ModbusTransport_h
+#define ModbusTransport_h
+
+#include <Arduino.h>
+
+#if defined(ESP_PLATFORM)
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#endif
+
+// What the master needs from the wire: send a frame, and hand over whatever
+// has been received so far without waiting for more
+class ModbusTransport {
+    public:
+        virtual ~ModbusTransport() {}
+        virtual void write(const uint8_t* data, size_t length) = 0;
+        // copies up to maxLength received bytes straight into buffer
+        virtual size_t read(uint8_t* buffer, size_t maxLength) = 0;
+        virtual void discardInput() = 0;
+        // true once if received data was lost since the last call
+        virtual bool overrun() { return false; }
+};
+
+// Any Arduino Stream, e.g. HardwareSerial or RenogyRoverSim
+class StreamTransport : public ModbusTransport {
+    public:
+        StreamTransport();
+        void begin(Stream& stream);
+        void write(const uint8_t* data, size_t length);
+        size_t read(uint8_t* buffer, size_t maxLength);
+        void discardInput();
+    private:
+        Stream* _stream;
+};
+
+#if defined(ESP_PLATFORM)
+// ESP-IDF UART driver used directly. The RX timeout interrupt moves a frame
+// into the driver's ring buffer as soon as the line goes quiet, instead of
+// waiting for the FIFO threshold, and frames are read out in one call.
+class UartTransport : public ModbusTransport {
+    public:
+        UartTransport();
+        int begin(uart_port_t port, unsigned long baud, int rxPin, int txPin);
+        void write(const uint8_t* data, size_t length);
+        size_t read(uint8_t* buffer, size_t maxLength);
+        void discardInput();
+        bool overrun();
+    private:
+        static const int RX_BUFFER_SIZE = 512;
+        // room for a full ring buffer's worth of UART_DATA events at the
+        // full threshold, with the UART_BUFFER_FULL and UART_FIFO_OVF after
+        // them, or a lost event hides the overrun
+        static const int EVENT_QUEUE_LENGTH = 16;
+        // symbol times of silence that end a frame, a little over 3.5 characters
+        static const uint8_t RX_TIMEOUT_SYMBOLS = 4;
+        // FIFO fill that raises the interrupt before the line goes quiet. The
+        // driver's 120 leaves a reply longer than the 128 byte FIFO 8
+        // characters of interrupt latency, half the FIFO leaves it 64
+        static const int RX_FULL_THRESHOLD = 64;
+
+        uart_port_t _port;
+        QueueHandle_t _events;
+        bool _overrun;
+        bool _installed;
+
+        void _drainEvents();
+};
+#endif
+
+#endif
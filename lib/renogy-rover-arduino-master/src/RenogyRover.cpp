@@ -5,23 +5,50 @@
 */
 
 #include <RenogyRover.h>
+#include <RoverRegisters.h>
+
+// first register and length of each RegisterGroup, taken from roverRegisters[]
+static constexpr uint16_t groupBase[GROUP_COUNT] = {
+    RoverRegisters::groupBase(GROUP_LIVE),
+    RoverRegisters::groupBase(GROUP_DAY),
+    RoverRegisters::groupBase(GROUP_HISTORY),
+    RoverRegisters::groupBase(GROUP_STATE)
+};
+static constexpr uint8_t groupLength[GROUP_COUNT] = {
+    RoverRegisters::groupLength(GROUP_LIVE),
+    RoverRegisters::groupLength(GROUP_DAY),
+    RoverRegisters::groupLength(GROUP_HISTORY),
+    RoverRegisters::groupLength(GROUP_STATE)
+};
 
 RenogyRover::RenogyRover() {
-    _client = ModbusMaster();
     _modbusId = 1;
+    _lastError = 0;
+    _transactions = 0;
+    _bytes = 0;
+    _snapshotCallback = NULL;
+    _initCache();
 }
 
 RenogyRover::RenogyRover(int modbusId) {
-    _client = ModbusMaster();
     RenogyRover::_modbusId = modbusId;
+    _lastError = 0;
+    _transactions = 0;
+    _bytes = 0;
+    _snapshotCallback = NULL;
+    _initCache();
 }
 
-ModbusMaster RenogyRover::getModbusClient() {
+ModbusRtuMaster& RenogyRover::getModbusClient() {
     return _client;
 }
 
-void RenogyRover::begin(Stream& serial) {
-    _client.begin(_modbusId, serial);
+void RenogyRover::begin(Stream& serial, unsigned long baud) {
+    _client.begin(_modbusId, serial, baud);
+}
+
+void RenogyRover::begin(ModbusTransport& transport, unsigned long baud) {
+    _client.begin(_modbusId, transport, baud);
 }
 
 const char* RenogyRover::getLastModbusError() {
@@ -44,261 +71,160 @@ const char* RenogyRover::getLastModbusError() {
             return "Response timed out";
         case _client.ku8MBInvalidCRC:
             return "InvalidCRC"; 
+        case _client.ku8MBBusy:
+            return "Bus busy";
+        case _client.ku8MBInvalidByteCount:
+            return "Invalid byte count: The response does not hold the registers requested.";
         default:
             return "Unknown error";
     }
 }
 
-int RenogyRover::getProductModel(char*& productModel) {
+uint8_t RenogyRover::getLastModbusErrorCode() {
+    return _lastError;
+}
+
+int RenogyRover::getProductModel(char* productModel, size_t size) {
     int registerBase = 0x000C;
     int registerLength = 8;
 
-    uint16_t* values = new uint16_t[registerLength];
-    productModel = new char[registerLength * 2 + 1];
-
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(productModel);
-        free(values);
+    // 16 chars, the first two are spaces, plus the null terminator
+    if (size < (size_t) registerLength * 2 - 1) {
         return 0;
-    } else {
-        // convert uint16_t to int8_t, 
-        // higher and lower byte need to be switched
-        int j = 0;
-        for (int i = 0; i < registerLength; i++) {
-            productModel[j++] = values[i] >> 8;
-            productModel[j++] = values[i];
-        }
-        // append null terminator and slice first two chars as they are spaces
-        productModel[16] = '\0';
-        productModel = &productModel[2];
-        free(productModel);
-        free(values);
     }
 
-    return 1;
-}
-
-int RenogyRover::getControllerLoadState(ControllerLoadState* state) {
-    state->active = 0;
-    state->voltage  = 0;
-    state->current = 0;
-    state->power = 0;
-
-    int registerBase = 0x0104;
-    int registerLength = 3;
-    int registerLoadActiveBase = 0x010A;
-    int registerLoadActiveLength = 1;
-
-    uint16_t* valueLoadActive = new uint16_t[registerLoadActiveLength];
-    uint16_t* values = new uint16_t[registerLength];
-
-    if (!_readHoldingRegisters(registerLoadActiveBase, registerLoadActiveLength, valueLoadActive)) {
-        free(valueLoadActive);
-        free(values);
+    if (!_readHoldingRegisters(registerBase, registerLength)) {
+        productModel[0] = '\0';
         return 0;
-    } else {
-        state->active = (int16_t) valueLoadActive[0];
     }
 
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(valueLoadActive);
-        free(values);
-        return 0;
-    } else {
-        state->voltage = (int16_t) values[0] * 0.1f;
-        state->current = (int16_t) values[1] * 0.01f;
-        state->power = (int16_t) values[2];
-        free(valueLoadActive);
-        free(values);
+    // higher and lower byte need to be switched,
+    // skip the first register as it holds two spaces
+    int j = 0;
+    for (int i = 1; i < registerLength; i++) {
+        productModel[j++] = _reg(i) >> 8;
+        productModel[j++] = _reg(i);
     }
+    productModel[j] = '\0';
 
     return 1;
 }
 
-int RenogyRover::getPanelState(PanelState* state) {
-    state->chargingPower = 0;
-    state->current = 0;
-    state->voltage  = 0;
-
-    int registerBase = 0x0107;
-    int registerLength = 3;
-
-    uint16_t* values = new uint16_t[registerLength];
-
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(values);
-        return 0;
-    } else {
-        state->voltage = (int16_t) values[0] * 0.1f;
-        state->current = (int16_t) values[1] * 0.01f;
-        state->chargingPower = (int16_t) values[2];
-        free(values);
+// The direct getters below bypass the cache, each reading only the registers
+// of its own struct as laid out in roverRegisters[]
+template <size_t Offset, typename T>
+int RenogyRover::_readMembers(T* out) {
+    constexpr size_t end = Offset + sizeof(T);
+    constexpr uint16_t base = RoverRegisters::spanBase(Offset, end);
+    constexpr uint8_t length = RoverRegisters::spanLength(Offset, end);
+
+    RoverSnapshot snapshot;
+    _clearSnapshot(&snapshot);
+
+    int success = _readHoldingRegisters(base, length);
+    if (success) {
+        auto reg = [this](uint8_t offset) { return _reg(offset); };
+        RoverRegisters::decodeMembers<Offset, end>(&snapshot, reg, base);
     }
 
-    return 1;
+    memcpy(out, (char*) &snapshot + Offset, sizeof(T));
+    return success;
 }
 
-int RenogyRover::getBatteryState(BatteryState* state) {
-    state->batteryTemperature = 0;
-    state->chargingCurrent = 0;
-    state->controllerTemperature = 0;
-    state->stateOfCharge = 0;
-    state->batteryVoltage = 0;
-
-    int registerBase = 0x0100;
-    int registerLength = 4;
-
-    uint16_t* values = new uint16_t[registerLength];
+int RenogyRover::getControllerLoadState(ControllerLoadState* state) {
+    return _readMembers<offsetof(RoverSnapshot, load)>(state);
+}
 
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(values);
-        return 0;
-    } else {
-        state->stateOfCharge = (int16_t) values[0];
-        state->batteryVoltage = (int16_t) values[1] * 0.1f;
-        state->chargingCurrent = (int16_t) values[2] * 0.01f;
-
-        // temperatures are in signed magnitude notation
-        state->batteryTemperature = _convertSignedMagnitude(values[3]);
-        state->controllerTemperature = _convertSignedMagnitude(values[3] >> 8);
-        free(values);
-    }
+int RenogyRover::getPanelState(PanelState* state) {
+    return _readMembers<offsetof(RoverSnapshot, panel)>(state);
+}
 
-    return 1;
+int RenogyRover::getBatteryState(BatteryState* state) {
+    return _readMembers<offsetof(RoverSnapshot, battery)>(state);
 }
 
 int RenogyRover::getDayStatistics(DayStatistics* params) {
-    params->batteryVoltageMaxForDay = 0;
-    params->batteryVoltageMinForDay = 0;
-    params->chargingAmpHoursForDay = 0;
-    params->maxChargeCurrentForDay = 0;
-    params->maxChargePowerForDay = 0;
-    params->dischargingAmpHoursForDay = 0;
-    params->maxDischargeCurrentForDay = 0;
-    params->maxDischargePowerForDay = 0;
-    params->powerGenerationForDay = 0;
-    params->powerConsumptionForDay = 0;
-
-    int registerBase = 0x010B;
-    int registerLength = 10;
-
-    uint16_t* values = new uint16_t[registerLength];
-
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(values);
-        return 0;
-    } else {
-        params->batteryVoltageMinForDay = (int16_t) values[0] * 0.1f;
-        params->batteryVoltageMaxForDay = (int16_t) values[1] * 0.1f;
-        params->maxChargeCurrentForDay = (int16_t) values[2] * 0.01f;
-        params->maxDischargeCurrentForDay = (int16_t) values[3] * 0.01f;
-        params->maxChargePowerForDay = (int16_t) values[4];
-        params->maxDischargePowerForDay = (int16_t) values[5];
-        params->chargingAmpHoursForDay= (int16_t) values[6];
-        params->dischargingAmpHoursForDay = (int16_t) values[7];
-        params->powerGenerationForDay = (int16_t) values[8];
-        params->powerConsumptionForDay = (int16_t) values[9];
-        free(values);
-    }
-    
-    return 1;
+    return _readMembers<offsetof(RoverSnapshot, day)>(params);
 }
 
 int RenogyRover::getHistoricalStatistics(HistStatistics* stats) {
-    stats->batChargingAmpHours = 0;
-    stats->batDischargingAmpHours = 0;
-    stats->batFullCharges = 0;
-    stats->batOverDischarges = 0;
-    stats->operatingDays = 0;
-    stats->powerConsumed = 0;
-    stats->powerGenerated = 0;
+    return _readMembers<offsetof(RoverSnapshot, hist)>(stats);
+}
 
-    int registerBase =  0x0115;
-    int registerLength = 3;
+int RenogyRover::getChargingState(ChargingState* state) {
+    return _readMembers<offsetof(RoverSnapshot, charging)>(state);
+}
 
-    uint16_t* values = new uint16_t[registerLength];
+int RenogyRover::getErrors(int& errors) {
+    int16_t faults;
+    int success = _readMembers<offsetof(RoverSnapshot, errors)>(&faults);
+    errors = faults;
+    return success;
+}
 
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(values);
+int RenogyRover::getSnapshot(RoverSnapshot* snapshot) {
+    _client.waitIdle();
+    if (!requestSnapshot(NULL)) {
+        _lastError = _client.ku8MBBusy;
         return 0;
-    } else {
-        stats->operatingDays = (int16_t) values[0];
-        stats->batOverDischarges = (int16_t) values[1];
-        stats->batFullCharges = (int16_t) values[2];
-        free(values);
     }
+    _client.waitIdle();
 
-    registerBase = 0x118;
-    registerLength = 8;
-
-    values = new uint16_t[registerLength];
-    uint32_t* integers = new uint32_t[registerLength / 2];
+    *snapshot = _snapshot;
+    return _snapshotOk;
+}
 
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(values);
-        free(integers);
+int RenogyRover::requestSnapshot(SnapshotCallback callback) {
+    if (_client.isBusy()) {
         return 0;
-    } else {
-        int j = 0;
-        for (int i = 0; i < registerLength / 2; i++) {
-            integers[i] = ((int32_t) values[j++]) << 8;
-            integers[i] = integers[i] | ((int32_t) values[j++]);
-        }
+    }
 
-        stats->batChargingAmpHours = integers[0];
-        stats->batDischargingAmpHours = integers[1];
-        stats->powerGenerated =  integers[2] / 10000.0f;
-        stats->powerConsumed = integers[3] / 10000.0f;
-        free(values);
-        free(integers);
+    _snapshotCallback = callback;
+    _snapshotOk = 1;
+    _pendingGroups = _staleGroups();
+
+    // everything is fresh, answer from the cache straight away
+    if (_pendingGroups == 0) {
+        _finishSnapshot();
+        return 1;
     }
 
+    _startNextRange();
     return 1;
-};
+}
 
-int RenogyRover::getChargingState(ChargingState* state) {
-    state->chargingMode = ChargingMode::UNDEFINED;
-    state->streetLightBrightness = 0;
-    state->streetLightState = 0;
+const RoverSnapshot* RenogyRover::getLastSnapshot() {
+    return &_snapshot;
+}
 
-    int registerBase = 0x0120;
-    int registerLength = 1;
+int RenogyRover::lastSnapshotSucceeded() {
+    return _snapshotOk;
+}
 
-    uint16_t* values  = new uint16_t;
+int RenogyRover::requestProbe() {
+    return _client.readHoldingRegisters(0x0100, 1, _onProbeResponse, this);
+}
 
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(values);
-        return 0;
-    } else {
-        state->streetLightState = (*values >> 15) & 1U;
-        state->streetLightBrightness = (*values >> 8) & ~(1U << 7);
-        state->chargingMode = ChargingMode((uint8_t) *values);
-        free(values);
+void RenogyRover::setRefreshPeriod(RegisterGroup group, unsigned long periodMs) {
+    if (group < GROUP_COUNT) {
+        _refreshPeriod[group] = periodMs;
     }
-
-    return 1;
 }
 
-int RenogyRover::getErrors(int& errors) {
-    int registerBase = 0x0121;
-    int registerLength = 2;
-    //numErrors = 15;
-
-    uint16_t* values = new uint16_t[registerLength];
-
-    if (!_readHoldingRegisters(registerBase, registerLength, values)) {
-        free(values);
-        return 0;
-    } 
+void RenogyRover::invalidateCache() {
+    _validGroups = 0;
+}
 
-    //int16_t* errVals = new int16_t[numErrors];
+int RenogyRover::getModbusId() {
+    return _modbusId;
+}
 
-    // 16 lower bits are reserved
-    // highest bit is reserved
-    errors = (values[0] << 1U) >> 1U;
+void RenogyRover::poll() {
+    _client.poll();
+}
 
-    free(values);
-    return 1;
+bool RenogyRover::isBusy() {
+    return _client.isBusy();
 }
 
 int RenogyRover::setLoadState(int state) {
@@ -306,44 +232,197 @@ int RenogyRover::setLoadState(int state) {
         return 0;
     }
 
-    _lastError = _client.writeSingleRegister(0x010A, (uint16_t) state);
+    // let an outstanding request finish before taking the bus
+    _client.waitIdle();
+    _client.writeSingleRegister(0x010A, (uint16_t) state, NULL, NULL);
+    _lastError = _client.waitIdle();
+    // write single register is echoed back, 8 bytes each way
+    _countTransaction(8, _lastError == _client.ku8MBSuccess ? 8 : 0);
+
+    // the cached load values no longer hold
+    _validGroups &= ~(1 << GROUP_LIVE);
     return _lastError == _client.ku8MBSuccess;
 }
 
-int RenogyRover::_readHoldingRegisters(int base, int length, uint16_t*& values) {
-    _lastError = _client.readHoldingRegisters(base, length);
+unsigned long RenogyRover::getTransactionCount() {
+    return _transactions;
+}
+
+unsigned long RenogyRover::getBytesTransferred() {
+    return _bytes;
+}
+
+void RenogyRover::resetCounters() {
+    _transactions = 0;
+    _bytes = 0;
+}
+
+int RenogyRover::_readHoldingRegisters(int base, int length) {
+    _client.waitIdle();
+    if (!_client.readHoldingRegisters(base, length, NULL, NULL)) {
+        _lastError = _client.ku8MBBusy;
+        return 0;
+    }
+    _lastError = _client.waitIdle();
     if(_lastError != _client.ku8MBSuccess) {
+        _countTransaction(8, 0);
         return 0;
-    } else {
-        for(uint8_t i = 0x00; i < (uint16_t) length; i++){
-            values[i] = _client.getResponseBuffer(i);
-        }
     }
+
+    // id, function, byte count, data, crc
+    _countTransaction(8, 5 + 2 * length);
     return 1;
 }
 
-int* RenogyRover::_filterZeroes(int16_t arr[], int& size) {
-    int* result = new int[size];
-    int ctr = 0;
+void RenogyRover::_initCache() {
+    _snapshotOk = 0;
+    _validGroups = 0;
+    _pendingGroups = 0;
+    _rangeFirst = 0;
+    _rangeLast = 0;
+    for (uint8_t group = 0; group < GROUP_COUNT; group++) {
+        _refreshPeriod[group] = 0;
+        _refreshedAt[group] = 0;
+    }
+    _clearSnapshot(&_snapshot);
+}
 
-    for (int i= 0; i < size; i++) {
-        if (arr[i] != 0) {
-            result[ctr++] = arr[i];
+uint8_t RenogyRover::_staleGroups() {
+    unsigned long now = millis();
+    uint8_t stale = 0;
+    for (uint8_t group = 0; group < GROUP_COUNT; group++) {
+        if (!(_validGroups & (1 << group)) || now - _refreshedAt[group] >= _refreshPeriod[group]) {
+            stale |= 1 << group;
         }
     }
+    return stale;
+}
 
-    if (ctr < size) {
-        realloc(result, ctr * sizeof(int));
-        size = ctr;
+// Reads the first pending group, plus any later pending groups close enough
+// that reading the fresh registers in between beats another transaction
+void RenogyRover::_startNextRange() {
+    uint8_t first = 0;
+    while (!(_pendingGroups & (1 << first))) {
+        first++;
     }
 
-    free(result);
-    return result;
+    uint8_t last = first;
+    for (uint8_t group = first + 1; group < GROUP_COUNT; group++) {
+        if (!(_pendingGroups & (1 << group))) {
+            continue;
+        }
+        int gap = groupBase[group] - (groupBase[last] + groupLength[last]);
+        if (gap > MERGE_GAP) {
+            break;
+        }
+        last = group;
+    }
+
+    _rangeFirst = first;
+    _rangeLast = last;
+    int length = groupBase[last] + groupLength[last] - groupBase[first];
+    _client.readHoldingRegisters(groupBase[first], length, _onRangeResponse, this);
+}
+
+void RenogyRover::_onRangeResponse(uint8_t result, void* context) {
+    RenogyRover* rover = (RenogyRover*) context;
+    // the error of a failed range stands for the whole snapshot
+    if (rover->_snapshotOk) {
+        rover->_lastError = result;
+    }
+
+    uint16_t base = groupBase[rover->_rangeFirst];
+    int length = groupBase[rover->_rangeLast] + groupLength[rover->_rangeLast] - base;
+
+    if (result != rover->_client.ku8MBSuccess) {
+        // the stale groups this read was for read as zero until they are
+        // refreshed again, fresh groups merged into the range keep their
+        // values and the ranges still queued are read as planned
+        rover->_countTransaction(8, 0);
+        for (uint8_t group = rover->_rangeFirst; group <= rover->_rangeLast; group++) {
+            if (rover->_pendingGroups & (1 << group)) {
+                rover->_clearGroup(group);
+                rover->_validGroups &= ~(1 << group);
+                rover->_pendingGroups &= ~(1 << group);
+            }
+        }
+        rover->_snapshotOk = 0;
+    } else {
+        rover->_countTransaction(8, 5 + 2 * length);
+        unsigned long now = millis();
+        for (uint8_t group = rover->_rangeFirst; group <= rover->_rangeLast; group++) {
+            rover->_decodeGroup(group, base);
+            rover->_validGroups |= 1 << group;
+            rover->_refreshedAt[group] = now;
+            rover->_pendingGroups &= ~(1 << group);
+        }
+    }
+
+    if (rover->_pendingGroups != 0) {
+        rover->_startNextRange();
+    } else {
+        rover->_finishSnapshot();
+    }
+}
+
+void RenogyRover::_onProbeResponse(uint8_t result, void* context) {
+    RenogyRover* rover = (RenogyRover*) context;
+    rover->_lastError = result;
+    rover->_countTransaction(8, result == rover->_client.ku8MBSuccess ? 7 : 0);
+}
+
+void RenogyRover::_finishSnapshot() {
+    if (_snapshotCallback != NULL) {
+        _snapshotCallback(_snapshotOk, &_snapshot);
+    }
+}
+
+void RenogyRover::_clearSnapshot(RoverSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(RoverSnapshot));
+    snapshot->charging.chargingMode = ChargingMode::UNDEFINED;
+}
+
+void RenogyRover::_clearGroup(uint8_t group) {
+    switch (group) {
+        case GROUP_LIVE:
+            RoverRegisters::clearGroup<GROUP_LIVE>(&_snapshot);
+            break;
+        case GROUP_DAY:
+            RoverRegisters::clearGroup<GROUP_DAY>(&_snapshot);
+            break;
+        case GROUP_HISTORY:
+            RoverRegisters::clearGroup<GROUP_HISTORY>(&_snapshot);
+            break;
+        case GROUP_STATE:
+            RoverRegisters::clearGroup<GROUP_STATE>(&_snapshot);
+            break;
+    }
 }
 
-int8_t RenogyRover::_convertSignedMagnitude(uint8_t val) {
-    if (val & 0x80) {
-        return -(val & 0x7F);
+// base is the address of the first register in the response buffer
+void RenogyRover::_decodeGroup(uint8_t group, uint16_t base) {
+    auto reg = [this](uint8_t offset) { return _reg(offset); };
+    switch (group) {
+        case GROUP_LIVE:
+            RoverRegisters::decodeGroup<GROUP_LIVE>(&_snapshot, reg, base);
+            break;
+        case GROUP_DAY:
+            RoverRegisters::decodeGroup<GROUP_DAY>(&_snapshot, reg, base);
+            break;
+        case GROUP_HISTORY:
+            RoverRegisters::decodeGroup<GROUP_HISTORY>(&_snapshot, reg, base);
+            break;
+        case GROUP_STATE:
+            RoverRegisters::decodeGroup<GROUP_STATE>(&_snapshot, reg, base);
+            break;
     }
-    return val;
-}
\ No newline at end of file
+}
+
+uint16_t RenogyRover::_reg(uint8_t offset) {
+    return _client.getResponseBuffer(offset);
+}
+
+void RenogyRover::_countTransaction(int requestBytes, int responseBytes) {
+    _transactions++;
+    _bytes += requestBytes + responseBytes;
+}
@@ -8,7 +8,7 @@
 #define RenogyRover_h
 
 #include <Arduino.h>
-#include <ModbusMaster.h>
+#include <ModbusRtuMaster.h>
 
 enum ChargingMode {
     UNDEFINED = -1,
@@ -39,65 +39,115 @@ enum FaultCode {
     CHARGE_MOS_SHORT = 16384
 };
 
+// A reading kept as the integer the controller reports, worth raw * 10^E.
+// Sums and comparisons work on raw, toDouble() is only for display and the
+// uplink encoder
+template <typename T, int8_t E>
+struct Scaled {
+    T raw;
+
+    static constexpr double divisor() {
+        double value = 1;
+        for (int8_t i = E; i < 0; i++) {
+            value *= 10;
+        }
+        return value;
+    }
+
+    // one correctly rounded division, so 132 tenths prints as 13.2
+    double toDouble() const {
+        return raw / divisor();
+    }
+};
+
+typedef Scaled<int16_t, -1> Tenths;
+typedef Scaled<int16_t, -2> Hundredths;
+typedef Scaled<int32_t, -4> TenThousandths;
+
 struct ControllerLoadState {
     bool active;
-    float voltage;
-    float current;
-    float power;
+    Tenths voltage;             // V
+    Hundredths current;         // A
+    int16_t power;              // W
 };
 
 struct PanelState {
-    float voltage;
-    float current;
-    float chargingPower;
+    Tenths voltage;             // V
+    Hundredths current;         // A
+    int16_t chargingPower;      // W
 };
 
 struct BatteryState {
-    int stateOfCharge;
-    float batteryVoltage;
-    float chargingCurrent;
-    float controllerTemperature;
-    float batteryTemperature;
+    int16_t stateOfCharge;      // %
+    Tenths batteryVoltage;      // V
+    Hundredths chargingCurrent; // A
+    int8_t controllerTemperature;   // C
+    int8_t batteryTemperature;      // C
 };
 
 struct DayStatistics {
-    float batteryVoltageMinForDay;
-    float batteryVoltageMaxForDay;
-    float maxChargeCurrentForDay;
-    float maxDischargeCurrentForDay;
-    float maxChargePowerForDay;
-    float maxDischargePowerForDay;
-    float chargingAmpHoursForDay;
-    float dischargingAmpHoursForDay;
-    float powerGenerationForDay;
-    float powerConsumptionForDay;
+    Tenths batteryVoltageMinForDay;
+    Tenths batteryVoltageMaxForDay;
+    Hundredths maxChargeCurrentForDay;
+    Hundredths maxDischargeCurrentForDay;
+    int16_t maxChargePowerForDay;       // W
+    int16_t maxDischargePowerForDay;    // W
+    int16_t chargingAmpHoursForDay;
+    int16_t dischargingAmpHoursForDay;
+    int16_t powerGenerationForDay;      // Wh
+    int16_t powerConsumptionForDay;     // Wh
 };
 
 struct HistStatistics {
-    int operatingDays;
-    int batOverDischarges;
-    int batFullCharges;
-    int batChargingAmpHours;
-    int batDischargingAmpHours;
-    float powerGenerated;
-    float powerConsumed;
+    int16_t operatingDays;
+    int16_t batOverDischarges;
+    int16_t batFullCharges;
+    int32_t batChargingAmpHours;
+    int32_t batDischargingAmpHours;
+    TenThousandths powerGenerated;  // kWh
+    TenThousandths powerConsumed;   // kWh
 };
 
 struct ChargingState {
-    int streetLightState;
-    int streetLightBrightness;
+    int8_t streetLightState;
+    int8_t streetLightBrightness;
     ChargingMode chargingMode;
 };
 
+// Everything in the 0x0100 - 0x0122 register window, cached per RegisterGroup
+struct RoverSnapshot {
+    BatteryState battery;
+    PanelState panel;
+    ControllerLoadState load;
+    DayStatistics day;
+    HistStatistics hist;
+    ChargingState charging;
+    int16_t errors;
+};
+
+// Register groups of the snapshot window, each cached with its own refresh period
+enum RegisterGroup {
+    GROUP_LIVE = 0,     // 0x0100 - 0x010A battery, load and panel
+    GROUP_DAY = 1,      // 0x010B - 0x0114 day statistics
+    GROUP_HISTORY = 2,  // 0x0115 - 0x011F historical statistics
+    GROUP_STATE = 3,    // 0x0120 - 0x0121 charging state and faults
+    GROUP_COUNT = 4
+};
+
+// Called from poll() when a snapshot requested with requestSnapshot() completes
+typedef void (*SnapshotCallback)(int success, const RoverSnapshot* snapshot);
+
 class RenogyRover {
     public:
         RenogyRover();
         RenogyRover(int modbusId);
-        ModbusMaster getModbusClient();
-        void begin(Stream& serial);
+        ModbusRtuMaster& getModbusClient();
+        void begin(Stream& serial, unsigned long baud = 9600);
+        void begin(ModbusTransport& transport, unsigned long baud = 9600);
         const char* getLastModbusError();
+        uint8_t getLastModbusErrorCode();
 
-        int getProductModel(char*& productModel);
+        int getProductModel(char* productModel, size_t size);
         int getControllerLoadState(ControllerLoadState* state);
         int getPanelState(PanelState* state);
         int getBatteryState(BatteryState* state);
@@ -105,15 +155,68 @@ class RenogyRover {
         int getHistoricalStatistics(HistStatistics* histStats);
         int getChargingState(ChargingState* chargingState);
         int getErrors(int& errors);
+        // served from the register cache, only stale groups are read from the bus
+        int getSnapshot(RoverSnapshot* snapshot);
+
+        // non-blocking snapshot, returns 0 if a transaction is already in flight
+        int requestSnapshot(SnapshotCallback callback);
+        const RoverSnapshot* getLastSnapshot();
+        int lastSnapshotSucceeded();
+        // non-blocking single register read to check the controller answers
+        int requestProbe();
+
+        // 0 (the default) refreshes the group on every snapshot
+        void setRefreshPeriod(RegisterGroup group, unsigned long periodMs);
+        // marks every group stale, the next snapshot reads the whole window
+        void invalidateCache();
+        int getModbusId();
+        // drives outstanding requests, call from loop()
+        void poll();
+        bool isBusy();
 
         int setLoadState(int state);
+
+        // bus usage counters, request and response frames both counted
+        unsigned long getTransactionCount();
+        unsigned long getBytesTransferred();
+        void resetCounters();
     private:
-        ModbusMaster _client;
+        // fresh registers worth reading to save a transaction between two stale groups
+        static const int MERGE_GAP = 12;
+
+        ModbusRtuMaster _client;
         int _modbusId;
         uint8_t _lastError;
-        int _readHoldingRegisters(int base, int length, uint16_t*& values);
-        int* _filterZeroes(int16_t arr[], int& size);
-        int8_t _convertSignedMagnitude(uint8_t val);
+        unsigned long _transactions;
+        unsigned long _bytes;
+        RoverSnapshot _snapshot;
+        SnapshotCallback _snapshotCallback;
+        int _snapshotOk;
+
+        unsigned long _refreshPeriod[GROUP_COUNT];
+        unsigned long _refreshedAt[GROUP_COUNT];
+        uint8_t _validGroups;
+        uint8_t _pendingGroups;
+        uint8_t _rangeFirst;
+        uint8_t _rangeLast;
+
+        int _readHoldingRegisters(int base, int length);
+        void _initCache();
+        uint8_t _staleGroups();
+        void _startNextRange();
+        static void _onRangeResponse(uint8_t result, void* context);
+        static void _onProbeResponse(uint8_t result, void* context);
+        void _finishSnapshot();
+        void _clearSnapshot(RoverSnapshot* snapshot);
+        void _clearGroup(uint8_t group);
+        void _decodeGroup(uint8_t group, uint16_t base);
+        uint16_t _reg(uint8_t offset);
+        void _countTransaction(int requestBytes, int responseBytes);
+
+        // reads just the registers behind the RoverSnapshot member at Offset,
+        // decoders work in place on the Modbus master's response buffer
+        template <size_t Offset, typename T>
+        int _readMembers(T* out);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,294 @@
+/*
+    RenogyRoverSim.cpp - Software Renogy Rover answering Modbus RTU over a Stream
+    Released into the public domain
+*/
+
+#include <RenogyRoverSim.h>
+
+RenogyRoverSim::RenogyRoverSim(unsigned long baud) {
+    // 8N1 plus the RTU parity slot, 11 bits per character
+    _charMicros = 11000000UL / baud;
+    _latencyMicros = 20000;
+    _dropRate = 0;
+    _crcErrorRate = 0;
+    _random = 1;
+    _count = 0;
+    _requestLength = 0;
+    _lastRxMicros = 0;
+    _responseLength = 0;
+    _responseRead = 0;
+    _responseStartMicros = 0;
+    _requests = 0;
+    _dropped = 0;
+    _corrupted = 0;
+}
+
+int RenogyRoverSim::addDevice(uint8_t modbusId) {
+    if (_count >= MAX_DEVICES || _findDevice(modbusId) != NULL) {
+        return 0;
+    }
+    Device* device = &_devices[_count++];
+    device->modbusId = modbusId;
+    _loadDefaults(device);
+    return 1;
+}
+
+void RenogyRoverSim::setRegister(uint8_t modbusId, uint16_t address, uint16_t value) {
+    uint16_t* reg = _findRegister(_findDevice(modbusId), address);
+    if (reg != NULL) {
+        *reg = value;
+    }
+}
+
+uint16_t RenogyRoverSim::getRegister(uint8_t modbusId, uint16_t address) {
+    uint16_t* reg = _findRegister(_findDevice(modbusId), address);
+    return reg != NULL ? *reg : 0;
+}
+
+void RenogyRoverSim::setResponseLatency(unsigned long latencyMs) {
+    _latencyMicros = latencyMs * 1000;
+}
+
+void RenogyRoverSim::setDropRate(uint8_t percent) {
+    _dropRate = percent;
+}
+
+void RenogyRoverSim::setCrcErrorRate(uint8_t percent) {
+    _crcErrorRate = percent;
+}
+
+void RenogyRoverSim::setSeed(uint32_t seed) {
+    _random = seed != 0 ? seed : 1;
+}
+
+unsigned long RenogyRoverSim::getRequestCount() {
+    return _requests;
+}
+
+unsigned long RenogyRoverSim::getDroppedCount() {
+    return _dropped;
+}
+
+unsigned long RenogyRoverSim::getCorruptedCount() {
+    return _corrupted;
+}
+
+size_t RenogyRoverSim::write(uint8_t value) {
+    unsigned long now = micros();
+
+    // a silent interval longer than 3.5 characters starts a new frame
+    if (_requestLength > 0 && now - _lastRxMicros > _charMicros * 7 / 2) {
+        _requestLength = 0;
+    }
+    _lastRxMicros = now;
+
+    _request[_requestLength++] = value;
+    if (_requestLength == sizeof(_request)) {
+        _handleRequest();
+        _requestLength = 0;
+    }
+    return 1;
+}
+
+int RenogyRoverSim::available() {
+    if (_responseRead >= _responseLength) {
+        return 0;
+    }
+    unsigned long now = micros();
+    if ((long) (now - _responseStartMicros) < 0) {
+        return 0;
+    }
+
+    // one character lands every character time once the reply has started
+    unsigned long arrived = (now - _responseStartMicros) / _charMicros + 1;
+    if (arrived > _responseLength) {
+        arrived = _responseLength;
+    }
+    return arrived - _responseRead;
+}
+
+int RenogyRoverSim::read() {
+    if (available() <= 0) {
+        return -1;
+    }
+    return _response[_responseRead++];
+}
+
+int RenogyRoverSim::peek() {
+    if (available() <= 0) {
+        return -1;
+    }
+    return _response[_responseRead];
+}
+
+void RenogyRoverSim::flush() {
+}
+
+RenogyRoverSim::Device* RenogyRoverSim::_findDevice(uint8_t modbusId) {
+    for (uint8_t i = 0; i < _count; i++) {
+        if (_devices[i].modbusId == modbusId) {
+            return &_devices[i];
+        }
+    }
+    return NULL;
+}
+
+uint16_t* RenogyRoverSim::_findRegister(Device* device, uint16_t address) {
+    if (device == NULL) {
+        return NULL;
+    }
+    if (address >= MODEL_BASE && address < MODEL_BASE + MODEL_LENGTH) {
+        return &device->registers[address - MODEL_BASE];
+    }
+    if (address >= DATA_BASE && address < DATA_BASE + DATA_LENGTH) {
+        return &device->registers[MODEL_LENGTH + address - DATA_BASE];
+    }
+    return NULL;
+}
+
+// A Rover 40 on a 12V bank at midday, values as the controller reports them
+void RenogyRoverSim::_loadDefaults(Device* device) {
+    memset(device->registers, 0, sizeof(device->registers));
+
+    const char* model = "  RNG-CTRL-RVR40";
+    for (uint8_t i = 0; i < MODEL_LENGTH; i++) {
+        device->registers[i] = ((uint16_t) model[2 * i] << 8) | (uint8_t) model[2 * i + 1];
+    }
+
+    uint8_t id = device->modbusId;
+    setRegister(id, 0x0100, 87);            // state of charge, %
+    setRegister(id, 0x0101, 132);           // battery voltage, 0.1 V
+    setRegister(id, 0x0102, 412);           // charging current, 0.01 A
+    setRegister(id, 0x0103, (31 << 8) | 22);// controller / battery temperature, C
+    setRegister(id, 0x0104, 131);           // load voltage, 0.1 V
+    setRegister(id, 0x0105, 85);            // load current, 0.01 A
+    setRegister(id, 0x0106, 11);            // load power, W
+    setRegister(id, 0x0107, 186);           // panel voltage, 0.1 V
+    setRegister(id, 0x0108, 301);           // panel current, 0.01 A
+    setRegister(id, 0x0109, 56);            // charging power, W
+    setRegister(id, 0x010A, 1);             // load on
+    setRegister(id, 0x010B, 124);           // battery voltage min for day, 0.1 V
+    setRegister(id, 0x010C, 141);           // battery voltage max for day, 0.1 V
+    setRegister(id, 0x010D, 598);           // max charge current for day, 0.01 A
+    setRegister(id, 0x010E, 120);           // max discharge current for day, 0.01 A
+    setRegister(id, 0x010F, 82);            // max charge power for day, W
+    setRegister(id, 0x0110, 16);            // max discharge power for day, W
+    setRegister(id, 0x0111, 21);            // charging Ah for day
+    setRegister(id, 0x0112, 6);             // discharging Ah for day
+    setRegister(id, 0x0113, 275);           // power generation for day, Wh
+    setRegister(id, 0x0114, 74);            // power consumption for day, Wh
+    setRegister(id, 0x0115, 412);           // operating days
+    setRegister(id, 0x0116, 3);             // battery over-discharges
+    setRegister(id, 0x0117, 288);           // battery full charges
+    setRegister(id, 0x0119, 8650);          // charging Ah total (low word)
+    setRegister(id, 0x011B, 2480);          // discharging Ah total (low word)
+    setRegister(id, 0x011C, 1);             // power generated total, high word
+    setRegister(id, 0x011D, 45100);         // power generated total, low word
+    setRegister(id, 0x011F, 32400);         // power consumed total (low word)
+    setRegister(id, 0x0120, 2);             // MPPT charging
+}
+
+void RenogyRoverSim::_handleRequest() {
+    _requests++;
+
+    uint16_t crc = _crc16(_request, 6);
+    if (_request[6] != (uint8_t) crc || _request[7] != (uint8_t) (crc >> 8)) {
+        return;
+    }
+    Device* device = _findDevice(_request[0]);
+    if (device == NULL) {
+        return;
+    }
+    if (_chance(_dropRate)) {
+        _dropped++;
+        return;
+    }
+
+    uint8_t function = _request[1];
+    uint16_t address = ((uint16_t) _request[2] << 8) | _request[3];
+    uint16_t value = ((uint16_t) _request[4] << 8) | _request[5];
+
+    _responseLength = 0;
+    _response[_responseLength++] = device->modbusId;
+    _response[_responseLength++] = function;
+
+    if (function == 0x03) {
+        if (value == 0 || value > 64) {
+            _respondException(0x03);
+            return;
+        }
+        _response[_responseLength++] = value * 2;
+        for (uint16_t i = 0; i < value; i++) {
+            uint16_t* reg = _findRegister(device, address + i);
+            if (reg == NULL) {
+                _responseLength = 2;
+                _respondException(0x02);
+                return;
+            }
+            _response[_responseLength++] = *reg >> 8;
+            _response[_responseLength++] = *reg;
+        }
+    } else if (function == 0x06) {
+        uint16_t* reg = _findRegister(device, address);
+        if (reg == NULL) {
+            _respondException(0x02);
+            return;
+        }
+        *reg = value;
+        for (uint8_t i = 2; i < 6; i++) {
+            _response[_responseLength++] = _request[i];
+        }
+    } else {
+        _respondException(0x01);
+        return;
+    }
+
+    _finishResponse();
+}
+
+void RenogyRoverSim::_respondException(uint8_t code) {
+    _response[1] |= 0x80;
+    _response[_responseLength++] = code;
+    _finishResponse();
+}
+
+void RenogyRoverSim::_finishResponse() {
+    uint16_t crc = _crc16(_response, _responseLength);
+    _response[_responseLength++] = crc;
+    _response[_responseLength++] = crc >> 8;
+
+    if (_chance(_crcErrorRate)) {
+        _corrupted++;
+        _response[_responseLength - 1] ^= 0x5A;
+    }
+
+    // the last request character is still on the wire when write() returns
+    _responseRead = 0;
+    _responseStartMicros = micros() + _charMicros + _latencyMicros;
+}
+
+bool RenogyRoverSim::_chance(uint8_t percent) {
+    if (percent == 0) {
+        return false;
+    }
+    // xorshift32, reproducible for a given seed
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return _random % 100 < percent;
+}
+
+uint16_t RenogyRoverSim::_crc16(const uint8_t* data, uint8_t length) {
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            if (crc & 0x0001) {
+                crc = (crc >> 1) ^ 0xA001;
+            } else {
+                crc >>= 1;
+            }
+        }
+    }
+    return crc;
+}
@@ -0,0 +1,89 @@
+/*
+    RenogyRoverSim.h - Software Renogy Rover answering Modbus RTU over a Stream
+    Released into the public domain
+*/
+
+#ifndef RenogyRoverSim_h
+#define RenogyRoverSim_h
+
+#include <Arduino.h>
+
+// Stands in for the serial port a Rover is wired to. Requests written to it
+// are answered from a register map with serial line timing, so RenogyRover
+// and RoverBus run against it unchanged.
+class RenogyRoverSim : public Stream {
+    public:
+        static const uint8_t MAX_DEVICES = 4;
+
+        RenogyRoverSim(unsigned long baud = 9600);
+
+        // returns 0 if the id is taken or the simulator is full
+        int addDevice(uint8_t modbusId);
+        void setRegister(uint8_t modbusId, uint16_t address, uint16_t value);
+        uint16_t getRegister(uint8_t modbusId, uint16_t address);
+
+        // time from the end of a request to the first byte of the reply
+        void setResponseLatency(unsigned long latencyMs);
+        // chance in percent that a request gets no reply at all
+        void setDropRate(uint8_t percent);
+        // chance in percent that a reply arrives with a broken CRC
+        void setCrcErrorRate(uint8_t percent);
+        void setSeed(uint32_t seed);
+
+        unsigned long getRequestCount();
+        unsigned long getDroppedCount();
+        unsigned long getCorruptedCount();
+
+        size_t write(uint8_t value);
+        using Print::write;
+        int available();
+        int read();
+        int peek();
+        void flush();
+
+    private:
+        // 0x000C - 0x0013 product model, 0x0100 - 0x0122 live data and statistics
+        static const uint16_t MODEL_BASE = 0x000C;
+        static const uint8_t MODEL_LENGTH = 8;
+        static const uint16_t DATA_BASE = 0x0100;
+        static const uint8_t DATA_LENGTH = 0x23;
+        static const uint8_t MAX_RESPONSE = 5 + 2 * 64;
+
+        struct Device {
+            uint8_t modbusId;
+            uint16_t registers[MODEL_LENGTH + DATA_LENGTH];
+        };
+
+        unsigned long _charMicros;
+        unsigned long _latencyMicros;
+        uint8_t _dropRate;
+        uint8_t _crcErrorRate;
+        uint32_t _random;
+
+        Device _devices[MAX_DEVICES];
+        uint8_t _count;
+
+        uint8_t _request[8];
+        uint8_t _requestLength;
+        unsigned long _lastRxMicros;
+
+        uint8_t _response[MAX_RESPONSE];
+        uint8_t _responseLength;
+        uint8_t _responseRead;
+        unsigned long _responseStartMicros;
+
+        unsigned long _requests;
+        unsigned long _dropped;
+        unsigned long _corrupted;
+
+        Device* _findDevice(uint8_t modbusId);
+        uint16_t* _findRegister(Device* device, uint16_t address);
+        void _loadDefaults(Device* device);
+        void _handleRequest();
+        void _respondException(uint8_t code);
+        void _finishResponse();
+        bool _chance(uint8_t percent);
+        static uint16_t _crc16(const uint8_t* data, uint8_t length);
+};
+
+#endif
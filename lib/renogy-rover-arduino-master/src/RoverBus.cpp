@@ -0,0 +1,372 @@
+/*
+    RoverBus.cpp - Round-robin polling of several Renogy controllers on one serial bus
+    Released into the public domain
+*/
+
+#include <RoverBus.h>
+#include <limits.h>
+
+RoverBus::RoverBus() {
+    _transport = NULL;
+    _baud = 9600;
+    _timeoutMs = 500;
+    _frameGapMicros = 4010;
+    _count = 0;
+    _active = -1;
+    _next = 0;
+    _lastCompletionMicros = 0;
+    _windowStartMillis = 0;
+    _cycleStartMillis = 0;
+    _cycleTime = 0;
+    _cycleMask = 0;
+    _callback = NULL;
+}
+
+void RoverBus::begin(Stream& serial, unsigned long baud) {
+    _streamTransport.begin(serial);
+    begin(_streamTransport, baud);
+}
+
+void RoverBus::begin(ModbusTransport& transport, unsigned long baud) {
+    _transport = &transport;
+    _baud = baud;
+
+    // same 3.5 character gap the master keeps between its own frames
+    if (baud > 19200) {
+        _frameGapMicros = 1750;
+    } else {
+        _frameGapMicros = 38500000UL / baud;
+    }
+
+    _lastCompletionMicros = micros();
+    _windowStartMillis = millis();
+    _cycleStartMillis = millis();
+}
+
+void RoverBus::setResponseTimeout(uint16_t timeoutMs) {
+    _timeoutMs = timeoutMs;
+    for (uint8_t i = 0; i < _count; i++) {
+        _rovers[i].getModbusClient().setResponseTimeout(_timeoutMs);
+    }
+}
+
+void RoverBus::onSnapshot(RoverBusCallback callback) {
+    _callback = callback;
+}
+
+int RoverBus::addDevice(int modbusId, unsigned long pollPeriodMs) {
+    if (_count >= MAX_DEVICES || _transport == NULL) {
+        return -1;
+    }
+
+    uint8_t index = _count++;
+    _rovers[index] = RenogyRover(modbusId);
+    _rovers[index].begin(*_transport, _baud);
+    _rovers[index].getModbusClient().setResponseTimeout(_timeoutMs);
+
+    // due straight away
+    _devices[index].pollPeriodMs = pollPeriodMs;
+    _devices[index].lastRequestMillis = millis() - pollPeriodMs;
+    _devices[index].windowPolls = 0;
+    _devices[index].pollRate = 0;
+    _devices[index].online = false;
+    _devices[index].retries = 0;
+    _devices[index].retryPending = false;
+    _devices[index].failedMicros = 0;
+    _devices[index].retryDelayMicros = 0;
+    _devices[index].failedPolls = 0;
+    _devices[index].breakerOpen = false;
+    _devices[index].probing = false;
+    _devices[index].openedMillis = 0;
+    _devices[index].backoffMs = BACKOFF_MIN_MS;
+    _devices[index].breakerTrips = 0;
+
+    return index;
+}
+
+uint8_t RoverBus::getDeviceCount() {
+    return _count;
+}
+
+RenogyRover& RoverBus::getRover(uint8_t index) {
+    return _rovers[index];
+}
+
+void RoverBus::poll() {
+    if (_active >= 0) {
+        _rovers[_active].poll();
+        if (!_rovers[_active].isBusy()) {
+            _complete();
+        }
+        return;
+    }
+
+    _updatePollRates();
+
+    // next request goes out as soon as the inter-frame gap allows
+    if (micros() - _lastCompletionMicros < _frameGapMicros) {
+        return;
+    }
+
+    // round robin from the device after the last one served, so a device
+    // with a short period cannot starve the others
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < _count; i++) {
+        uint8_t index = (_next + i) % _count;
+        Device& device = _devices[index];
+
+        if (device.breakerOpen) {
+            if (now - device.openedMillis < device.backoffMs) {
+                continue;
+            }
+        } else if (device.retryPending) {
+            if (micros() - device.failedMicros < device.retryDelayMicros) {
+                continue;
+            }
+        } else if (now - device.lastRequestMillis < device.pollPeriodMs) {
+            continue;
+        }
+        if (_start(index, now)) {
+            _next = (index + 1) % _count;
+        }
+        return;
+    }
+}
+
+// A device with an open breaker only gets a one register probe
+int RoverBus::_start(uint8_t index, unsigned long now) {
+    Device& device = _devices[index];
+
+    if (device.breakerOpen) {
+        if (!_rovers[index].requestProbe()) {
+            return 0;
+        }
+        device.probing = true;
+        device.openedMillis = now;
+    } else {
+        if (!_rovers[index].requestSnapshot(NULL)) {
+            return 0;
+        }
+        device.lastRequestMillis = now;
+        device.retryPending = false;
+    }
+
+    _active = index;
+    return 1;
+}
+
+void RoverBus::requestPoll() {
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < _count; i++) {
+        _devices[i].lastRequestMillis = now - _devices[i].pollPeriodMs;
+    }
+}
+
+unsigned long RoverBus::getIdleMillis() {
+    if (_active >= 0) {
+        return 0;
+    }
+    unsigned long now = millis();
+    unsigned long idle = ULONG_MAX;
+    for (uint8_t i = 0; i < _count; i++) {
+        const Device& device = _devices[i];
+        unsigned long wait;
+        if (device.breakerOpen) {
+            wait = device.backoffMs - min(now - device.openedMillis, device.backoffMs);
+        } else if (device.retryPending) {
+            unsigned long elapsed = min(micros() - device.failedMicros, device.retryDelayMicros);
+            wait = (device.retryDelayMicros - elapsed + 999) / 1000;
+        } else {
+            wait = device.pollPeriodMs - min(now - device.lastRequestMillis, device.pollPeriodMs);
+        }
+        idle = min(idle, wait);
+    }
+    return idle;
+}
+
+void RoverBus::waitIdle() {
+    while (_active >= 0) {
+        poll();
+        yield();
+    }
+}
+
+int RoverBus::setLoadState(int state) {
+    waitIdle();
+
+    int success = 1;
+    for (uint8_t i = 0; i < _count; i++) {
+        // don't wait out a timeout on a controller known to be gone
+        if (_devices[i].breakerOpen) {
+            success = 0;
+            continue;
+        }
+        while (micros() - _lastCompletionMicros < _frameGapMicros) {
+            yield();
+        }
+        if (!_rovers[i].setLoadState(state)) {
+            success = 0;
+        }
+        _lastCompletionMicros = micros();
+    }
+    return success;
+}
+
+const RoverSnapshot* RoverBus::getSnapshot(uint8_t index) {
+    return _rovers[index].getLastSnapshot();
+}
+
+bool RoverBus::isOnline(uint8_t index) {
+    return _devices[index].online;
+}
+
+float RoverBus::getPollRate(uint8_t index) {
+    return _devices[index].pollRate;
+}
+
+bool RoverBus::isBreakerOpen(uint8_t index) {
+    return _devices[index].breakerOpen;
+}
+
+unsigned long RoverBus::getBreakerTrips(uint8_t index) {
+    return _devices[index].breakerTrips;
+}
+
+unsigned long RoverBus::getBackoff(uint8_t index) {
+    return _devices[index].backoffMs;
+}
+
+unsigned long RoverBus::getCycleTime() {
+    return _cycleTime;
+}
+
+void RoverBus::getSiteTotals(RoverSiteTotals* totals) {
+    memset(totals, 0, sizeof(RoverSiteTotals));
+    totals->controllers = _count;
+
+    for (uint8_t i = 0; i < _count; i++) {
+        if (!_devices[i].online) {
+            continue;
+        }
+        const RoverSnapshot* snapshot = _rovers[i].getLastSnapshot();
+        totals->online++;
+        totals->chargingCurrent.raw += snapshot->battery.chargingCurrent.raw;
+        totals->panelPower += snapshot->panel.chargingPower;
+        totals->loadCurrent.raw += snapshot->load.current.raw;
+        totals->loadPower += snapshot->load.power;
+        totals->chargingAmpHoursForDay += snapshot->day.chargingAmpHoursForDay;
+        totals->dischargingAmpHoursForDay += snapshot->day.dischargingAmpHoursForDay;
+        totals->powerGenerationForDay += snapshot->day.powerGenerationForDay;
+        totals->powerConsumptionForDay += snapshot->day.powerConsumptionForDay;
+        totals->powerGenerated.raw += snapshot->hist.powerGenerated.raw;
+        totals->powerConsumed.raw += snapshot->hist.powerConsumed.raw;
+    }
+}
+
+void RoverBus::_complete() {
+    uint8_t index = _active;
+    _active = -1;
+    _lastCompletionMicros = micros();
+
+    Device& device = _devices[index];
+    if (device.probing) {
+        _completeProbe(index);
+        return;
+    }
+
+    RenogyRover& rover = _rovers[index];
+    int success = rover.lastSnapshotSucceeded();
+    if (success) {
+        device.online = true;
+        device.retries = 0;
+        device.failedPolls = 0;
+        device.windowPolls++;
+    } else {
+        // timeouts and garbled frames are worth another go after a backoff
+        // that doubles with each retry, an exception reply means the
+        // controller is there but said no
+        uint8_t error = rover.getLastModbusErrorCode();
+        bool retryable = error == ModbusRtuMaster::ku8MBResponseTimedOut
+            || error == ModbusRtuMaster::ku8MBInvalidCRC
+            || error == ModbusRtuMaster::ku8MBInvalidSlaveID
+            || error == ModbusRtuMaster::ku8MBInvalidFunction
+            || error == ModbusRtuMaster::ku8MBInvalidByteCount;
+        if (retryable && device.retries < MAX_RETRIES) {
+            device.retries++;
+            device.retryPending = true;
+            device.failedMicros = _lastCompletionMicros;
+            device.retryDelayMicros = _frameGapMicros << device.retries;
+            _next = index;
+            return;
+        }
+        _recordFailure(index);
+    }
+
+    // a bus cycle is done once every reachable device has been asked once
+    _cycleMask |= 1 << index;
+    uint8_t required = 0;
+    for (uint8_t i = 0; i < _count; i++) {
+        if (!_devices[i].breakerOpen) {
+            required |= 1 << i;
+        }
+    }
+    if ((_cycleMask & required) == required) {
+        unsigned long now = millis();
+        _cycleTime = now - _cycleStartMillis;
+        _cycleStartMillis = now;
+        _cycleMask = 0;
+    }
+
+    if (_callback != NULL) {
+        _callback(index, success, rover.getLastSnapshot());
+    }
+}
+
+void RoverBus::_completeProbe(uint8_t index) {
+    Device& device = _devices[index];
+    device.probing = false;
+
+    if (_rovers[index].getLastModbusErrorCode() != ModbusRtuMaster::ku8MBSuccess) {
+        device.backoffMs *= 2;
+        if (device.backoffMs > BACKOFF_MAX_MS) {
+            device.backoffMs = BACKOFF_MAX_MS;
+        }
+        return;
+    }
+
+    // it answered, close the breaker and take a full snapshot next
+    device.breakerOpen = false;
+    device.failedPolls = 0;
+    device.retries = 0;
+    device.backoffMs = BACKOFF_MIN_MS;
+    device.lastRequestMillis = millis() - device.pollPeriodMs;
+    _rovers[index].invalidateCache();
+    _next = index;
+}
+
+void RoverBus::_recordFailure(uint8_t index) {
+    Device& device = _devices[index];
+    device.online = false;
+    device.retries = 0;
+    device.failedPolls++;
+
+    if (device.failedPolls >= BREAKER_THRESHOLD && !device.breakerOpen) {
+        device.breakerOpen = true;
+        device.openedMillis = millis();
+        device.backoffMs = BACKOFF_MIN_MS;
+        device.breakerTrips++;
+    }
+}
+
+void RoverBus::_updatePollRates() {
+    unsigned long elapsed = millis() - _windowStartMillis;
+    if (elapsed < RATE_WINDOW_MS) {
+        return;
+    }
+
+    for (uint8_t i = 0; i < _count; i++) {
+        _devices[i].pollRate = _devices[i].windowPolls * 1000.0f / elapsed;
+        _devices[i].windowPolls = 0;
+    }
+    _windowStartMillis += elapsed;
+}
@@ -0,0 +1,123 @@
+/*
+    RoverBus.h - Round-robin polling of several Renogy controllers on one serial bus
+    Released into the public domain
+*/
+
+#ifndef RoverBus_h
+#define RoverBus_h
+
+#include <Arduino.h>
+#include <RenogyRover.h>
+
+// Sums across every controller that answered its last poll
+struct RoverSiteTotals {
+    int controllers;
+    int online;
+    // same units as RoverSnapshot, widened so the sums cannot overflow
+    Scaled<int32_t, -2> chargingCurrent;
+    int32_t panelPower;
+    Scaled<int32_t, -2> loadCurrent;
+    int32_t loadPower;
+    int32_t chargingAmpHoursForDay;
+    int32_t dischargingAmpHoursForDay;
+    int32_t powerGenerationForDay;
+    int32_t powerConsumptionForDay;
+    TenThousandths powerGenerated;
+    TenThousandths powerConsumed;
+};
+
+// Called from poll() each time one controller's snapshot completes
+typedef void (*RoverBusCallback)(uint8_t index, int success, const RoverSnapshot* snapshot);
+
+class RoverBus {
+    public:
+        static const uint8_t MAX_DEVICES = 4;
+
+        RoverBus();
+        void begin(Stream& serial, unsigned long baud = 9600);
+        void begin(ModbusTransport& transport, unsigned long baud = 9600);
+        // Rovers answer well inside this, a dead one should not hold up the others
+        void setResponseTimeout(uint16_t timeoutMs);
+        void onSnapshot(RoverBusCallback callback);
+
+        // returns the device index, or -1 if the bus is full
+        int addDevice(int modbusId, unsigned long pollPeriodMs);
+        uint8_t getDeviceCount();
+        RenogyRover& getRover(uint8_t index);
+
+        // issues the next due request or advances the one in flight, call from loop()
+        void poll();
+        // makes every device due on the next free slot
+        void requestPoll();
+        // ms until poll() has a request to issue, 0 while one is in flight,
+        // so a caller can sleep rather than call poll() in the meantime
+        unsigned long getIdleMillis();
+        // blocks until the bus is free, for writes that have to go out now
+        void waitIdle();
+        int setLoadState(int state);
+
+        const RoverSnapshot* getSnapshot(uint8_t index);
+        bool isOnline(uint8_t index);
+        // an open breaker means the device is skipped and only probed on backoff
+        bool isBreakerOpen(uint8_t index);
+        unsigned long getBreakerTrips(uint8_t index);
+        unsigned long getBackoff(uint8_t index);
+        float getPollRate(uint8_t index);
+        unsigned long getCycleTime();
+        void getSiteTotals(RoverSiteTotals* totals);
+
+    private:
+        static const unsigned long RATE_WINDOW_MS = 10000;
+        // CRC and timeout errors are retried this many times within one poll,
+        // the first after two frame gaps and each further one after twice that
+        static const uint8_t MAX_RETRIES = 2;
+        // consecutive failed polls before the breaker opens
+        static const uint8_t BREAKER_THRESHOLD = 3;
+        static const unsigned long BACKOFF_MIN_MS = 10000;
+        static const unsigned long BACKOFF_MAX_MS = 600000;
+
+        struct Device {
+            unsigned long pollPeriodMs;
+            unsigned long lastRequestMillis;
+            unsigned long windowPolls;
+            float pollRate;
+            bool online;
+
+            uint8_t retries;
+            bool retryPending;
+            unsigned long failedMicros;
+            unsigned long retryDelayMicros;
+            uint8_t failedPolls;
+            bool breakerOpen;
+            bool probing;
+            unsigned long openedMillis;
+            unsigned long backoffMs;
+            unsigned long breakerTrips;
+        };
+
+        // every controller's master reads the same transport
+        ModbusTransport* _transport;
+        StreamTransport _streamTransport;
+        unsigned long _baud;
+        uint16_t _timeoutMs;
+        unsigned long _frameGapMicros;
+        RenogyRover _rovers[MAX_DEVICES];
+        Device _devices[MAX_DEVICES];
+        uint8_t _count;
+        int _active;
+        uint8_t _next;
+        unsigned long _lastCompletionMicros;
+        unsigned long _windowStartMillis;
+        unsigned long _cycleStartMillis;
+        unsigned long _cycleTime;
+        uint8_t _cycleMask;
+        RoverBusCallback _callback;
+
+        int _start(uint8_t index, unsigned long now);
+        void _complete();
+        void _completeProbe(uint8_t index);
+        void _recordFailure(uint8_t index);
+        void _updatePollRates();
+};
+
+#endif
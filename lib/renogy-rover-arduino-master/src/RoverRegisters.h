@@ -0,0 +1,377 @@
+/*
+    RoverRegisters.h - Register map of the Renogy Rover 20/40 AMP MPPT controller
+    Released into the public domain
+
+    Every value the library reads is one line in roverRegisters[]. The block
+    read ranges of each RegisterGroup, the decoders filling RoverSnapshot and
+    the fields of the controller note and its template are all generated from
+    it, so a new register is added in this table and nowhere else.
+*/
+
+#ifndef RoverRegisters_h
+#define RoverRegisters_h
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <type_traits>
+#include <RenogyRover.h>
+
+// How a value is packed into its register(s)
+enum RegisterFormat {
+    FORMAT_S16,         // signed 16 bit
+    FORMAT_U32,         // two registers, high word first
+    FORMAT_TEMP_HIGH,   // signed magnitude temperature in the high byte
+    FORMAT_TEMP_LOW,    // signed magnitude temperature in the low byte
+    FORMAT_BIT15,       // single flag in the top bit
+    FORMAT_BITS8_14,    // 7 bit value in the high byte below the flag
+    FORMAT_LOW_BYTE,    // unsigned low byte
+    FORMAT_FAULTS       // fault bits, the top bit is reserved
+};
+
+// Kind of RoverSnapshot member a register is decoded into
+enum FieldType {
+    FIELD_INT,      // plain or Scaled integer of 1, 2 or 4 bytes
+    FIELD_BOOL,
+    FIELD_MODE
+};
+
+struct RoverRegister {
+    uint16_t address;
+    RegisterFormat format;
+    RegisterGroup group;
+    FieldType type;
+    uint8_t size;           // of the member
+    bool isSigned;          // of the member's integer, picks the template hint
+    int8_t exponent;        // value = raw * 10^exponent, from the member's type
+    uint16_t offset;        // of the member in RoverSnapshot
+    const char* key;        // in the controller note, NULL if not sent
+};
+
+namespace RoverRegisters {
+    template <typename T> struct FieldTraits;
+    template <> struct FieldTraits<int8_t> {
+        static constexpr FieldType type = FIELD_INT;
+        static constexpr int8_t exponent = 0;
+        static constexpr bool isSigned = true;
+    };
+    template <> struct FieldTraits<int16_t> {
+        static constexpr FieldType type = FIELD_INT;
+        static constexpr int8_t exponent = 0;
+        static constexpr bool isSigned = true;
+    };
+    template <> struct FieldTraits<int32_t> {
+        static constexpr FieldType type = FIELD_INT;
+        static constexpr int8_t exponent = 0;
+        static constexpr bool isSigned = true;
+    };
+    template <typename T, int8_t E> struct FieldTraits<Scaled<T, E> > {
+        static constexpr FieldType type = FIELD_INT;
+        static constexpr int8_t exponent = E;
+        static constexpr bool isSigned = std::is_signed<T>::value;
+    };
+    template <> struct FieldTraits<bool> {
+        static constexpr FieldType type = FIELD_BOOL;
+        static constexpr int8_t exponent = 0;
+        static constexpr bool isSigned = false;
+    };
+    template <> struct FieldTraits<ChargingMode> {
+        static constexpr FieldType type = FIELD_MODE;
+        static constexpr int8_t exponent = 0;
+        // UNDEFINED is -1
+        static constexpr bool isSigned = std::is_signed<std::underlying_type<ChargingMode>::type>::value;
+    };
+}
+
+// type, size, signedness and scale are taken from the RoverSnapshot member,
+// an unsupported member type does not compile
+#define ROVER_REGISTER(address, format, group, member, key) \
+    { address, format, group, \
+      RoverRegisters::FieldTraits<decltype(((RoverSnapshot*) 0)->member)>::type, \
+      sizeof(((RoverSnapshot*) 0)->member), \
+      RoverRegisters::FieldTraits<decltype(((RoverSnapshot*) 0)->member)>::isSigned, \
+      RoverRegisters::FieldTraits<decltype(((RoverSnapshot*) 0)->member)>::exponent, \
+      offsetof(RoverSnapshot, member), key }
+
+constexpr RoverRegister roverRegisters[] = {
+    ROVER_REGISTER(0x0100, FORMAT_S16,       GROUP_LIVE,    battery.stateOfCharge,          "StateOfCharge"),
+    ROVER_REGISTER(0x0101, FORMAT_S16,       GROUP_LIVE,    battery.batteryVoltage,         "BatteryVoltage"),
+    ROVER_REGISTER(0x0102, FORMAT_S16,       GROUP_LIVE,    battery.chargingCurrent,        "ChargingCurrent"),
+    ROVER_REGISTER(0x0103, FORMAT_TEMP_HIGH, GROUP_LIVE,    battery.controllerTemperature,  "RoverTemperature"),
+    ROVER_REGISTER(0x0103, FORMAT_TEMP_LOW,  GROUP_LIVE,    battery.batteryTemperature,     "BatteryTemperature"),
+    ROVER_REGISTER(0x0104, FORMAT_S16,       GROUP_LIVE,    load.voltage,                   "LoadVoltage"),
+    ROVER_REGISTER(0x0105, FORMAT_S16,       GROUP_LIVE,    load.current,                   "LoadCurrent"),
+    ROVER_REGISTER(0x0106, FORMAT_S16,       GROUP_LIVE,    load.power,                     "LoadPower"),
+    ROVER_REGISTER(0x0107, FORMAT_S16,       GROUP_LIVE,    panel.voltage,                  "PanelVoltage"),
+    ROVER_REGISTER(0x0108, FORMAT_S16,       GROUP_LIVE,    panel.current,                  "PanelCurrent"),
+    ROVER_REGISTER(0x0109, FORMAT_S16,       GROUP_LIVE,    panel.chargingPower,            "PanelPower"),
+    ROVER_REGISTER(0x010A, FORMAT_S16,       GROUP_LIVE,    load.active,                    "LoadState"),
+
+    ROVER_REGISTER(0x010B, FORMAT_S16,       GROUP_DAY,     day.batteryVoltageMinForDay,    "BattVoltageMin"),
+    ROVER_REGISTER(0x010C, FORMAT_S16,       GROUP_DAY,     day.batteryVoltageMaxForDay,    "BattVoltageMax"),
+    ROVER_REGISTER(0x010D, FORMAT_S16,       GROUP_DAY,     day.maxChargeCurrentForDay,     "MaxChargeCurrent"),
+    ROVER_REGISTER(0x010E, FORMAT_S16,       GROUP_DAY,     day.maxDischargeCurrentForDay,  "MaxDischargeCurrent"),
+    ROVER_REGISTER(0x010F, FORMAT_S16,       GROUP_DAY,     day.maxChargePowerForDay,       "MaxChargePower"),
+    ROVER_REGISTER(0x0110, FORMAT_S16,       GROUP_DAY,     day.maxDischargePowerForDay,    "MaxDischargePower"),
+    ROVER_REGISTER(0x0111, FORMAT_S16,       GROUP_DAY,     day.chargingAmpHoursForDay,     "chargingAH_day"),
+    ROVER_REGISTER(0x0112, FORMAT_S16,       GROUP_DAY,     day.dischargingAmpHoursForDay,  "DischargingAH_day"),
+    ROVER_REGISTER(0x0113, FORMAT_S16,       GROUP_DAY,     day.powerGenerationForDay,      "PowerGenerated_day"),
+    ROVER_REGISTER(0x0114, FORMAT_S16,       GROUP_DAY,     day.powerConsumptionForDay,     "PowerConsumed_day"),
+
+    ROVER_REGISTER(0x0115, FORMAT_S16,       GROUP_HISTORY, hist.operatingDays,             "OperatingDays"),
+    ROVER_REGISTER(0x0116, FORMAT_S16,       GROUP_HISTORY, hist.batOverDischarges,         "OverDischarges"),
+    ROVER_REGISTER(0x0117, FORMAT_S16,       GROUP_HISTORY, hist.batFullCharges,            "FullCharges"),
+    ROVER_REGISTER(0x0118, FORMAT_U32,       GROUP_HISTORY, hist.batChargingAmpHours,       "ChargingAH"),
+    ROVER_REGISTER(0x011A, FORMAT_U32,       GROUP_HISTORY, hist.batDischargingAmpHours,    "DischargingAH"),
+    ROVER_REGISTER(0x011C, FORMAT_U32,       GROUP_HISTORY, hist.powerGenerated,            "PowerGenerated"),
+    ROVER_REGISTER(0x011E, FORMAT_U32,       GROUP_HISTORY, hist.powerConsumed,             "PowerConsumed"),
+
+    ROVER_REGISTER(0x0120, FORMAT_BIT15,     GROUP_STATE,   charging.streetLightState,      NULL),
+    ROVER_REGISTER(0x0120, FORMAT_BITS8_14,  GROUP_STATE,   charging.streetLightBrightness, NULL),
+    ROVER_REGISTER(0x0120, FORMAT_LOW_BYTE,  GROUP_STATE,   charging.chargingMode,          NULL),
+    // 0x0122 holds the reserved lower half of the fault word and is not read
+    ROVER_REGISTER(0x0121, FORMAT_FAULTS,    GROUP_STATE,   errors,                         NULL)
+};
+
+namespace RoverRegisters {
+    constexpr size_t COUNT = sizeof(roverRegisters) / sizeof(roverRegisters[0]);
+
+    constexpr size_t noteFieldCount() {
+        size_t count = 0;
+        for (size_t i = 0; i < COUNT; i++) {
+            if (roverRegisters[i].key != NULL) {
+                count++;
+            }
+        }
+        return count;
+    }
+    // fields with a note key, in table order
+    constexpr size_t NOTE_FIELDS = noteFieldCount();
+
+    constexpr uint16_t fieldEnd(const RoverRegister& field) {
+        return field.address + (field.format == FORMAT_U32 ? 2 : 1);
+    }
+
+    // first register and length of the smallest read covering every field
+    // whose member lies in [begin, end) of RoverSnapshot
+    constexpr uint16_t spanBase(size_t begin, size_t end) {
+        uint16_t base = 0xFFFF;
+        for (size_t i = 0; i < COUNT; i++) {
+            if (roverRegisters[i].offset >= begin && roverRegisters[i].offset < end
+                && roverRegisters[i].address < base) {
+                base = roverRegisters[i].address;
+            }
+        }
+        return base;
+    }
+
+    constexpr uint8_t spanLength(size_t begin, size_t end) {
+        uint16_t last = 0;
+        for (size_t i = 0; i < COUNT; i++) {
+            if (roverRegisters[i].offset >= begin && roverRegisters[i].offset < end
+                && fieldEnd(roverRegisters[i]) > last) {
+                last = fieldEnd(roverRegisters[i]);
+            }
+        }
+        return last - spanBase(begin, end);
+    }
+
+    constexpr uint16_t groupBase(RegisterGroup group) {
+        uint16_t base = 0xFFFF;
+        for (size_t i = 0; i < COUNT; i++) {
+            if (roverRegisters[i].group == group && roverRegisters[i].address < base) {
+                base = roverRegisters[i].address;
+            }
+        }
+        return base;
+    }
+
+    constexpr uint8_t groupLength(RegisterGroup group) {
+        uint16_t last = 0;
+        for (size_t i = 0; i < COUNT; i++) {
+            if (roverRegisters[i].group == group && fieldEnd(roverRegisters[i]) > last) {
+                last = fieldEnd(roverRegisters[i]);
+            }
+        }
+        return last - groupBase(group);
+    }
+
+    // range merging in RenogyRover relies on the groups following each other
+    constexpr bool groupsOrdered() {
+        for (int group = 1; group < GROUP_COUNT; group++) {
+            if (groupBase((RegisterGroup) group)
+                < groupBase((RegisterGroup) (group - 1)) + groupLength((RegisterGroup) (group - 1))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(groupsOrdered(), "register groups must be in address order and not overlap");
+
+    // every value a format can decode fits the member it is stored in,
+    // so the member's size and signedness are also right for the template
+    constexpr bool formatFits(const RoverRegister& field) {
+        if (field.type != FIELD_INT) {
+            return true;
+        }
+        switch (field.format) {
+            case FORMAT_S16:
+                return field.isSigned && field.size >= 2;
+            case FORMAT_U32:
+                // sent as the signed 32 bit value the member holds
+                return field.size == 4;
+            case FORMAT_TEMP_HIGH:
+            case FORMAT_TEMP_LOW:
+                return field.isSigned;
+            case FORMAT_BIT15:
+            case FORMAT_BITS8_14:
+                return true;
+            case FORMAT_LOW_BYTE:
+                return !field.isSigned || field.size >= 2;
+            case FORMAT_FAULTS:
+                return field.size >= 2;
+        }
+        return false;
+    }
+
+    constexpr bool formatsFit() {
+        for (size_t i = 0; i < COUNT; i++) {
+            if (!formatFits(roverRegisters[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    static_assert(formatsFit(), "a register's member is too small or of the wrong signedness for its format");
+
+    // the member's integer, Scaled members are stored as their raw value
+    template <size_t I>
+    inline void storeField(RoverSnapshot* snapshot, int32_t raw) {
+        constexpr RoverRegister field = roverRegisters[I];
+        void* member = (char*) snapshot + field.offset;
+        if constexpr (field.type == FIELD_BOOL) {
+            *(bool*) member = raw != 0;
+        } else if constexpr (field.type == FIELD_MODE) {
+            *(ChargingMode*) member = (ChargingMode) raw;
+        } else if constexpr (field.size == 1) {
+            *(int8_t*) member = raw;
+        } else if constexpr (field.size == 2) {
+            *(int16_t*) member = raw;
+        } else {
+            *(int32_t*) member = raw;
+        }
+    }
+
+    template <size_t I>
+    inline int32_t loadField(const RoverSnapshot* snapshot) {
+        constexpr RoverRegister field = roverRegisters[I];
+        const void* member = (const char*) snapshot + field.offset;
+        if constexpr (field.type == FIELD_BOOL) {
+            return *(const bool*) member;
+        } else if constexpr (field.type == FIELD_MODE) {
+            return *(const ChargingMode*) member;
+        } else if constexpr (field.size == 1) {
+            return *(const int8_t*) member;
+        } else if constexpr (field.size == 2) {
+            return *(const int16_t*) member;
+        } else {
+            return *(const int32_t*) member;
+        }
+    }
+
+    // runtime counterpart of storeField(), for code that walks the table
+    inline void setField(RoverSnapshot* snapshot, const RoverRegister& field, int32_t raw) {
+        void* member = (char*) snapshot + field.offset;
+        if (field.type == FIELD_BOOL) {
+            *(bool*) member = raw != 0;
+        } else if (field.type == FIELD_MODE) {
+            *(ChargingMode*) member = (ChargingMode) raw;
+        } else if (field.size == 1) {
+            *(int8_t*) member = raw;
+        } else if (field.size == 2) {
+            *(int16_t*) member = raw;
+        } else {
+            *(int32_t*) member = raw;
+        }
+    }
+
+    // reg(i) returns register base + i of the response being decoded
+    template <size_t I, typename Reader>
+    inline void decodeField(RoverSnapshot* snapshot, Reader& reg, uint16_t base) {
+        constexpr RoverRegister field = roverRegisters[I];
+        uint16_t value = reg(field.address - base);
+        int32_t raw;
+        if constexpr (field.format == FORMAT_U32) {
+            raw = ((uint32_t) value << 16) | reg(field.address - base + 1);
+        } else if constexpr (field.format == FORMAT_TEMP_HIGH || field.format == FORMAT_TEMP_LOW) {
+            uint8_t byte = field.format == FORMAT_TEMP_HIGH ? value >> 8 : value;
+            raw = (byte & 0x80) ? -(int32_t) (byte & 0x7F) : (int32_t) byte;
+        } else if constexpr (field.format == FORMAT_BIT15) {
+            raw = (value >> 15) & 1;
+        } else if constexpr (field.format == FORMAT_BITS8_14) {
+            raw = (value >> 8) & 0x7F;
+        } else if constexpr (field.format == FORMAT_LOW_BYTE) {
+            raw = (uint8_t) value;
+        } else if constexpr (field.format == FORMAT_FAULTS) {
+            raw = value & 0x7FFF;
+        } else {
+            raw = (int16_t) value;
+        }
+        storeField<I>(snapshot, raw);
+    }
+
+    template <RegisterGroup G, size_t I = 0, typename Reader>
+    inline void decodeGroup(RoverSnapshot* snapshot, Reader& reg, uint16_t base) {
+        if constexpr (I < COUNT) {
+            if constexpr (roverRegisters[I].group == G) {
+                decodeField<I>(snapshot, reg, base);
+            }
+            decodeGroup<G, I + 1>(snapshot, reg, base);
+        }
+    }
+
+    template <size_t Begin, size_t End, size_t I = 0, typename Reader>
+    inline void decodeMembers(RoverSnapshot* snapshot, Reader& reg, uint16_t base) {
+        if constexpr (I < COUNT) {
+            if constexpr (roverRegisters[I].offset >= Begin && roverRegisters[I].offset < End) {
+                decodeField<I>(snapshot, reg, base);
+            }
+            decodeMembers<Begin, End, I + 1>(snapshot, reg, base);
+        }
+    }
+
+    // failed groups read as zero, and an unknown charging mode
+    template <RegisterGroup G, size_t I = 0>
+    inline void clearGroup(RoverSnapshot* snapshot) {
+        if constexpr (I < COUNT) {
+            if constexpr (roverRegisters[I].group == G) {
+                storeField<I>(snapshot, roverRegisters[I].type == FIELD_MODE ? UNDEFINED : 0);
+            }
+            clearGroup<G, I + 1>(snapshot);
+        }
+    }
+
+    // calls emit(field, raw) for every field with a note key, raw is the
+    // controller's integer, field.exponent says where the decimal point goes
+    template <size_t I = 0, typename Emit>
+    inline void forEachNoteField(const RoverSnapshot* snapshot, Emit& emit) {
+        if constexpr (I < COUNT) {
+            if constexpr (roverRegisters[I].key != NULL) {
+                emit(roverRegisters[I], loadField<I>(snapshot));
+            }
+            forEachNoteField<I + 1>(snapshot, emit);
+        }
+    }
+
+    // calls emit(field) for every field with a note key, to build templates
+    template <size_t I = 0, typename Emit>
+    inline void forEachNoteKey(Emit& emit) {
+        if constexpr (I < COUNT) {
+            if constexpr (roverRegisters[I].key != NULL) {
+                emit(roverRegisters[I]);
+            }
+            forEachNoteKey<I + 1>(emit);
+        }
+    }
+}
+
+#endif
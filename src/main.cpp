@@ -24,18 +24,47 @@
 #include <esp_task_wdt.h>
 #include <string>
 #include <Preferences.h>
+#include <esp_timer.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <sys/time.h>
 
 #include "RenogyRover.h"
+#include "RoverBus.h"
+#include "RoverRegisters.h"
+#ifdef ROVER_SIMULATOR
+#include "RenogyRoverSim.h"
+#endif
 #include "SparkFun_STTS22H.h"
 #include <SensirionI2CSen5x.h>
 #include "TimeLib.h"
 #include "TimeAlarms.h"
 #include "ArduinoSMBus.h"
+#include "SampleBatch.h"
+#include "ReportFilter.h"
+#include "SeriesBlob.h"
+#include "TelemetryLog.h"
+#include "RunningStats.h"
+#include "DriftClock.h"
+#include "NoteStats.h"
+#include "NoteWriter.h"
+#include "Published.h"
+#include "Scheduler.h"
+#include "PowerPolicy.h"
 
  // IO definitions
 #define LED_PIN 13;
 #define RDX2 16
 #define TXD2 17
+#define NOTECARD_ATTN_PIN 34 // wired to ATTN on the Notecard carrier
 
 // Hardware watchdog timeout
 #define WDT_TIMEOUT 30 // in seconds
@@ -52,6 +81,23 @@ Preferences preferences;
 bool send_time_updates = false;
 Notecard notecard;
 float notecard_temp;
+// Notecard transactions, see NoteStats.h. Every request goes through
+// noteRequest(), health.qo reports the stats every HEALTH_INTERVAL and clears them
+#define HEALTH_INTERVAL 3600000 // in ms
+NoteStats note_stats;
+// settingsUpdate.qi is only read when the Notecard raises ATTN for it. If the
+// Notecard cannot arm ATTN it is polled every logging interval instead
+bool attn_armed = false;
+volatile bool settings_pending = true; // look once at boot
+// Notes taken from settingsUpdate.qi in one pass, the rest wait for the next loop
+#define SETTINGS_DRAIN_MAX 16
+// What a pass over settingsUpdate.qi changed, committed once at its end
+struct SettingsChange {
+  bool any;
+  bool timer;   // timer_mode or the on/off times
+  bool hub;     // the inbound or outbound interval
+  bool reset;   // reset_esp_now was asked for
+};
 
 // Firmware_data
 int firmware_version_prim = 0;
@@ -60,6 +106,8 @@ int firmware_version_tert = 5;
 int firmware_updated_d = 31;
 int firmware_updated_m = 1;
 int firmware_updated_y = 2024;
+// Layout of the templated notes, bump whenever a template below changes
+int note_template_version = 3;
 
 // Changeable Settings
 int logging_interval = 1; // in minutes
@@ -73,11 +121,20 @@ int time_off_hour = 18;
 int time_off_min = 0;
 int time_reset_hour = 1;
 int time_reset_minute = 0;
+#ifdef ROVER_SIMULATOR
+bool enable_renogy = true;
+#else
 bool enable_renogy = false;
+#endif
 bool enable_STTS22H = false;
 bool enable_sen5x = true;
 bool enable_wifi = false;
 bool enable_bms = true;
+int batch_size = 1; // samples per data note, 1 sends each sample on its own
+int keyframe_interval = 1; // samples between forced reports, 1 turns report-by-exception off
+bool batch_blob = false; // send batches as a SeriesBlob instead of JSON arrays
+int sample_period = 1; // in seconds, 0 takes one point sample per logging interval
+int power_mode = PowerPolicy::MODE_AWAKE; // 1 light sleeps between deadlines, 2 also deep sleeps between data notes
 
 // Temp sensor
 SparkFun_STTS22H tempSensor;
@@ -99,29 +156,414 @@ const long timeout_time = 2000;
 // Timekeeping
 unsigned long current_time = millis();
 unsigned long previous_time = 0;
-unsigned long previous_data_time = 0;
 char time_string[10];
+// Wall clock, see DriftClock.h. card.time is only asked for when the clock
+// may be more than TIME_MAX_ERROR off, the drift measured is kept in flash
+#define TIME_MAX_ERROR 2000 // in ms
+#define TIME_RETRY 60000    // in ms, after card.time failed
+DriftClock time_service;
+portMUX_TYPE time_mux = portMUX_INITIALIZER_UNLOCKED; // guards time_service across tasks
+long time_offset = 0;       // in seconds, the Notecard's time zone
+unsigned long time_failed_at = 0;
+bool time_failed = false;
 AlarmId on_timer;
 AlarmId off_timer;
 AlarmId reset_timer;
 
-// Charge Controller (Renogy Rover)
-RenogyRover rover(255); // Default modbus ID 255
-BatteryState battery_state;
-ControllerLoadState load_state;
-PanelState panel_state;
-HistStatistics controller_statistics;
-DayStatistics day_statistics;
+// Charge Controllers (Renogy Rover / Wanderer), all sharing UART2
+struct ControllerConfig {
+  int modbus_id;
+  unsigned long poll_period_ms;
+};
+const ControllerConfig controller_config[] = {
+  { 255, 1000 }, // Default modbus ID 255, polled at the sampling rate
+};
+// Statistics change slowly, so they are re-read less often than live values
+#define DAY_STATS_REFRESH 300000    // in ms
+#define HIST_STATS_REFRESH 3600000  // in ms
+const int controller_count = sizeof(controller_config) / sizeof(controller_config[0]);
+RoverBus controller_bus;
+#ifdef ROVER_SIMULATOR
+// Bench builds answer the bus from a simulated Rover instead of UART2
+RenogyRoverSim rover_sim(9600);
+#else
+// Driven through the IDF UART driver rather than Serial2, see ModbusTransport.h
+UartTransport controller_uart;
+#endif
+
+// Fields of each source, in the order of their deadbands and statistics.
+// Field 0 of the controller is the OSM temperature, the rest are the keyed
+// fields of roverRegisters[]
+#define CONTROLLER_FIELDS (RoverRegisters::NOTE_FIELDS + 1)
+constexpr const char* sen5x_fields[] = { "PM1p0", "PM2p5", "PM4", "PM10", "Humidity", "Temperature", "VOCIndex", "NOxIndex" };
+constexpr const char* bms_fields[] = { "BatteryVoltage", "BatteryCurrent", "BatteryTemperature", "BatteryStateOfCharge", "BatteryRemainingCapacity", "BatteryOK" };
+// decimals kept when a field is packed into a SeriesBlob, the sensors' own resolution
+constexpr uint8_t sen5x_decimals[] = { 4, 4, 4, 4, 2, 2, 1, 1 };
+constexpr uint8_t bms_decimals[] = { 0, 0, 1, 0, 0, 0 };
+#define SEN5X_FIELDS (sizeof(sen5x_fields) / sizeof(sen5x_fields[0]))
+#define BMS_FIELDS (sizeof(bms_fields) / sizeof(bms_fields[0]))
+static_assert(sizeof(sen5x_decimals) == SEN5X_FIELDS && sizeof(bms_decimals) == BMS_FIELDS, "every field needs its decimals");
+static_assert(noteKeysUnique(sen5x_fields, SEN5X_FIELDS) && noteKeysUnique(bms_fields, BMS_FIELDS), "note keys must be unique");
+
+// High-rate sampling, see RunningStats.h. Between logging intervals the live
+// values are read every sample_period seconds and folded into running
+// statistics. Each interval then sends their mean in place of a point sample,
+// with the spread as <key>Min, <key>Max and <key>SD
+struct SpreadField {
+  const char* key;              // without the decimals suffix
+  int8_t decimals;              // of the value as sent, as in the key suffix
+  uint8_t precision;            // further decimals it carries, 0 for integers
+  uint8_t field;                // index into the source's fields
+};
+struct FieldSpread {
+  float min;
+  float max;
+  float sd;
+};
+// the controller's live integer values and the OSM temperature are averaged,
+// statistics and counters are sent as last read
+constexpr size_t controllerSpreadCount() {
+  size_t count = 1;
+  for (size_t i = 0; i < RoverRegisters::COUNT; i++) {
+    if (roverRegisters[i].key != NULL && roverRegisters[i].group == GROUP_LIVE && roverRegisters[i].type == FIELD_INT) {
+      count++;
+    }
+  }
+  return count;
+}
+#define CONTROLLER_SPREAD controllerSpreadCount()
+#define SEN5X_SPREAD SEN5X_FIELDS
+#define BMS_SPREAD (BMS_FIELDS - 1) // BatteryOK is the worst seen instead
+SpreadField controller_spread[CONTROLLER_SPREAD];
+SpreadField sen5x_spread[SEN5X_SPREAD];
+SpreadField bms_spread[BMS_SPREAD];
+RunningStats controller_stats[CONTROLLER_SPREAD];
+RunningStats sen5x_stats[SEN5X_SPREAD];
+RunningStats bms_stats[BMS_SPREAD];
+bool bms_fault_seen = false;
+unsigned long sample_passes = 0;
+unsigned long sample_micros = 0;
+
+// Sample batching, see SampleBatch.h. A batch is flushed when it holds
+// batch_size samples, when its oldest sample is outbound_interval minutes old,
+// or right away with sync when a sample carries an urgent change
+#define SAMPLE_BATCH_MAX 10
+struct ControllerSample {
+  RoverSnapshot rover;
+  int16_t osmTemperature; // tenths of a degree
+  FieldSpread spread[CONTROLLER_SPREAD];
+};
+struct Sen5xSample {
+  float pm1p0;
+  float pm2p5;
+  float pm4p0;
+  float pm10p0;
+  float humidity;
+  float temperature;
+  float vocIndex;
+  float noxIndex;
+  FieldSpread spread[SEN5X_SPREAD];
+};
+struct BMSSample {
+  int32_t voltage;
+  int32_t current;
+  float temperature;
+  int32_t stateOfCharge;
+  int32_t remainingCapacity;
+  bool ok;
+  FieldSpread spread[BMS_SPREAD];
+};
+SampleBatch<ControllerSample, SAMPLE_BATCH_MAX> controller_batch;
+SampleBatch<Sen5xSample, SAMPLE_BATCH_MAX> sen5x_batch;
+SampleBatch<BMSSample, SAMPLE_BATCH_MAX> bms_batch;
+
+// Report-by-exception, see ReportFilter.h
+ReportFilter<CONTROLLER_FIELDS> controller_filter;
+ReportFilter<SEN5X_FIELDS> sen5x_filter;
+ReportFilter<BMS_FIELDS> bms_filter;
+
+// Encoded batches, see SeriesBlob.h. A full controller batch is well under 4 kB
+uint8_t blob_buffer[4096];
+char blob_text[(sizeof(blob_buffer) + 2) / 3 * 4 + 1];
+static_assert(CONTROLLER_FIELDS + 3 * CONTROLLER_SPREAD <= SeriesEncoder::MAX_CHANNELS, "controller blob has too many channels");
+
+// Deadbands until settingsUpdate.qi says otherwise, in the units each field
+// is sent in. Fields not listed report any change
+struct DefaultDeadband {
+  const char* source;
+  const char* key;
+  float threshold;
+};
+const DefaultDeadband default_deadbands[] = {
+  { "controller", "OSMTemperature_1", 5 },   // 0.5 C
+  { "controller", "BatteryVoltage_1", 1 },   // 0.1 V
+  { "controller", "ChargingCurrent_2", 20 }, // 0.2 A
+  { "controller", "LoadVoltage_1", 1 },
+  { "controller", "LoadCurrent_2", 20 },
+  { "controller", "LoadPower", 5 },          // W
+  { "controller", "PanelVoltage_1", 5 },
+  { "controller", "PanelCurrent_2", 20 },
+  { "controller", "PanelPower", 5 },
+  { "controller", "PowerGenerated_4", 100 }, // 0.01 kWh
+  { "controller", "PowerConsumed_4", 100 },
+  { "Sen5x", "PM1p0", 0.002 },               // mg/m3
+  { "Sen5x", "PM2p5", 0.002 },
+  { "Sen5x", "PM4", 0.002 },
+  { "Sen5x", "PM10", 0.002 },
+  { "Sen5x", "Humidity", 2 },                // %
+  { "Sen5x", "Temperature", 0.5 },           // C
+  { "Sen5x", "VOCIndex", 10 },
+  { "Sen5x", "NOxIndex", 5 },
+  { "BMS", "BatteryVoltage", 100 },          // mV
+  { "BMS", "BatteryCurrent", 100 },          // mA
+  { "BMS", "BatteryTemperature", 0.5 },      // C
+  { "BMS", "BatteryRemainingCapacity", 50 }, // mAh
+};
+
+// Store-and-forward, see TelemetryLog.h. Data notes are written to flash
+// first and drained to the Notecard from loop(), a few per pass. A note the
+// Notecard refuses stays at the head of the log and is retried with backoff
+#define LOG_DRAIN_PER_LOOP 4
+#define LOG_BACKOFF_MIN 5000   // in ms
+#define LOG_BACKOFF_MAX 300000 // in ms
+#define LOG_MAX_ATTEMPTS 5     // refusals before a note is given up on
+LittleFsStorage log_storage;
+TelemetryLog telemetry_log;
+bool log_ready = false;
+uint8_t log_record[TelemetryLog::MAX_RECORD + 2]; // room for a newline and NUL
+// Data notes are written as text into note_text, see NoteWriter.h, so
+// building one takes no heap. batch_rows holds a batch's values while its
+// columns are written
+char note_text[TelemetryLog::MAX_RECORD];
+double batch_rows[SAMPLE_BATCH_MAX][CONTROLLER_FIELDS];
+unsigned long log_failed_at = 0;
+unsigned long log_backoff = 0;
+uint8_t log_attempts = 0;
+unsigned long log_refused = 0;
+
+// Controller data, see Published.h. onControllerData() publishes a copy of
+// the bus state after every poll, and everything else reads that copy
+// instead of the bus, so readers add no bus traffic. A reader that needs
+// fresher data than TELEMETRY_MAX_AGE asks the bus for a poll
+#define TELEMETRY_MAX_AGE 10000 // in ms
+struct ControllerTelemetry {
+  uint8_t devices;
+  RoverSnapshot rovers[RoverBus::MAX_DEVICES]; // rovers[0] is the primary controller
+  uint8_t modbusIds[RoverBus::MAX_DEVICES];
+  bool online[RoverBus::MAX_DEVICES];
+  bool breakerOpen[RoverBus::MAX_DEVICES];
+  float pollRates[RoverBus::MAX_DEVICES];
+  unsigned long cycleTime;
+  RoverSiteTotals site;
+};
+Published<ControllerTelemetry> controller_telemetry;
+
+// Tasks, started by startTasks() once setup() is done. Each owns its
+// hardware and takes work from the others through bounded queues, so a slow
+// Notecard or web client no longer holds up the bus or the sensors. The bus,
+// control logic and sensors share core 1, the Notecard and web server run on
+// core 0 next to the WiFi stack. A higher priority preempts a lower one on
+// the same core, and every task registers with the watchdog on its own.
+// A task's periodic work runs from its own Scheduler, see Scheduler.h, and
+// between deadlines the task sleeps or waits for a command
+struct TaskConfig {
+  const char* name;
+  TaskFunction_t function;
+  uint32_t stack;         // in bytes
+  UBaseType_t priority;
+  BaseType_t core;
+  Scheduler* schedule;
+};
+enum TaskIndex { TASK_BUS, TASK_CONTROL, TASK_SENSORS, TASK_UPLINK, TASK_WEB, TASK_COUNT };
+void busTask(void* parameter);
+void controlTask(void* parameter);
+void sensorTask(void* parameter);
+void uplinkTask(void* parameter);
+void webTask(void* parameter);
+Scheduler bus_schedule(esp_timer_get_time);
+Scheduler control_schedule(esp_timer_get_time);
+Scheduler sensor_schedule(esp_timer_get_time);
+Scheduler uplink_schedule(esp_timer_get_time);
+Scheduler web_schedule(esp_timer_get_time);
+// Stacks are in bytes. The bus and control tasks build a ControllerTelemetry
+// on the stack and print to Serial, the sensor task runs the Sen5x driver,
+// so none of them is given less than the web task
+const TaskConfig task_config[TASK_COUNT] = {
+  { "bus", busTask, 6144, 5, 1, &bus_schedule },            // Modbus on UART2
+  { "control", controlTask, 6144, 4, 1, &control_schedule }, // TimeAlarms and the load
+  { "sensors", sensorTask, 6144, 3, 1, &sensor_schedule },  // I2C sensors
+  { "uplink", uplinkTask, 16384, 2, 0, &uplink_schedule },  // Notecard, batches and the telemetry log
+  { "web", webTask, 6144, 1, 0, &web_schedule },            // status page
+};
+TaskHandle_t task_handles[TASK_COUNT];
+// A task whose stack has had less than this left is reported once on Serial,
+// health.qo reports every task's in StackFree
+#define STACK_MARGIN 1024 // in bytes
+bool stack_warned[TASK_COUNT];
+// Each schedule's jitter and misses, health.qo reads them from the uplink task
+Published<Scheduler::Report> schedule_reports[TASK_COUNT];
+// Job periods, the sensors and the data notes run on wall clock boundaries
+// of sample_period and logging_interval instead. The once-a-second jobs are
+// on whole seconds too, so a sleeping board wakes once for all of them
+#define BUS_POLL_PERIOD 5       // in ms, while a request is in flight, see pollControllers()
+#define ALARM_PERIOD 1000       // in ms, TimeAlarms has whole seconds
+#define READINGS_PERIOD 1000    // in ms, takes the queued readings
+#define NOTECARD_PERIOD 1000    // in ms, clock, aged batches and settings
+#define LOG_DRAIN_PERIOD 1000   // in ms
+#define WEB_POLL_PERIOD 20      // in ms
+#define IDLE_WAIT 1000          // in ms, longest a task waits without a deadline
+int8_t bus_job = -1;            // bus_schedule's poll
+int8_t sample_job = -1;         // uplink_schedule's data notes
+int8_t health_job = -1;         // uplink_schedule's health notes
+int8_t sensor_job = -1;         // sensor_schedule's sensor pass
+// Commands each task takes, one byte each
+enum BusCommand : uint8_t { BUS_POLL, BUS_LOAD_ON, BUS_LOAD_OFF };
+enum ControlCommand : uint8_t { CONTROL_TIMER };        // the timer settings changed
+enum UplinkCommand : uint8_t { UPLINK_RESET, UPLINK_SETTINGS_NOTE, UPLINK_DEEP_SLEEP };
+#define COMMAND_WAKE 0xFF       // any task's, ends its wait after a light sleep
+#define COMMAND_QUEUE_DEPTH 4
+QueueHandle_t bus_commands;
+QueueHandle_t control_commands;
+QueueHandle_t uplink_commands;
+QueueHandle_t task_commands[TASK_COUNT]; // the queue each task waits on, NULL for none
+// One pass of the sensor task, readings are taken even when they fail
+struct SensorReading {
+  bool sen5xValid;
+  Sen5xSample sen5x;
+  bool bmsValid;
+  BMSSample bms;
+  unsigned long micros;   // time the pass took
+};
+// Readings wait here while the uplink task is busy with the Notecard. A full
+// queue drops the new reading and counts it in queue_drops
+#define READING_QUEUE_DEPTH 8
+QueueHandle_t controller_readings; // RoverSnapshot of the primary controller
+QueueHandle_t sensor_readings;     // SensorReading
+SensorReading latest_reading;      // the last one the uplink task took
+bool reading_received = false;
+std::atomic<uint32_t> queue_drops(0);
+// The Notecard and the sensors share Wire, note-c takes the same mutex
+// around every Notecard transaction
+#define I2C_WAIT 1000 // in ms, the sensors skip a pass after that
+SemaphoreHandle_t i2c_mutex;
+// note_stats belongs to the uplink task, the web page reads this copy
+Published<NoteStats> note_stats_view;
+
+// Low-power mode, see PowerPolicy.h. The last task to go idle asks
+// power_policy whether the gap to the earliest deadline of every task is
+// worth a light sleep, woken early by ATTN or the console. Deep sleep is only
+// taken between data notes, without high-rate sampling, and restarts the
+// firmware: what has to outlive it is kept in RTC memory, see SleepState
+#define DEEP_SLEEP_LEAD 30000 // in ms, woken this early to boot and poll the controllers
+PowerPolicy power_policy;
+portMUX_TYPE power_mux = portMUX_INITIALIZER_UNLOCKED; // guards the task states and power_policy
+bool tasks_started = false;
+bool task_waiting[TASK_COUNT];
+int64_t task_deadlines[TASK_COUNT];
+bool power_deciding = false;  // one task at a time decides and sleeps
+time_t next_alarm = 0;        // local time of the next TimeAlarms trigger, 0 for none
+int64_t deep_sleep_us = 0;    // planned for the uplink task
+RTC_DATA_ATTR uint64_t rtc_awake_us = 0;
+RTC_DATA_ATTR uint64_t rtc_asleep_us = 0;
+RTC_DATA_ATTR int64_t rtc_health_in_us = -1; // µs left until health.qo, -1 when not deep slept
+// What else a deep sleep keeps: the batches and the filters' references, so
+// batching and report-by-exception carry on across it, and the clock, so a
+// wake needs no card.time. The objects are constructed again on every boot,
+// which would clear them if they lived in RTC memory, so deepSleep() copies
+// them into rtc_sleep_state and setup() copies them back
+#define DEEP_SLEEP_CLOCK_PPM 500 // the RTC slow clock that times a deep sleep, a calibrated RC
+struct SleepState {
+  SampleBatch<ControllerSample, SAMPLE_BATCH_MAX> controllerBatch;
+  SampleBatch<Sen5xSample, SAMPLE_BATCH_MAX> sen5xBatch;
+  SampleBatch<BMSSample, SAMPLE_BATCH_MAX> bmsBatch;
+  ReportFilter<CONTROLLER_FIELDS>::Reference controllerFilter;
+  ReportFilter<SEN5X_FIELDS>::Reference sen5xFilter;
+  ReportFilter<BMS_FIELDS>::Reference bmsFilter;
+  DriftClock clock;
+  long timeOffset;
+  int64_t sleptAt;      // esp_timer µs as the sleep began
+  int64_t sleptAtRtc;   // sleepClockMicros() at the same moment
+  bool attnArmed;
+};
+static_assert(std::is_trivially_copyable<SleepState>::value, "SleepState is kept as bytes");
+RTC_DATA_ATTR bool rtc_state_kept = false;
+RTC_DATA_ATTR uint8_t rtc_sleep_state[sizeof(SleepState)] __attribute__((aligned(8)));
 
 /********* Function Declarations ********/
 void setupNotecard();            // Sets up the notecard
+void setupNoteTemplates();       // Registers the templates of the outbound notes
 void updateNotecard();           // Updates the notecard
 void doNotecard();               // Runs notecard update tasks
-time_t getCurrentTimeFromNote(); // Updates the system time from the cellular time
+void logData();                  // Samples every source once a logging interval
+J* noteRequest(J* req);          // Sends a request and returns its response, timed into note_stats
+bool noteSend(J* req);           // Sends a request whose response is not needed
+size_t jsonLength(J* json);      // Length of a request or response as sent on the wire
+void sendHealthNote();           // Reports note_stats and the telemetry log in health.qo
+void setupNotecardAttn();        // Raises ATTN when settingsUpdate.qi changes
+void attachNotecardAttn();       // Takes ATTN's rising edge
+bool armNotecardAttn();
+void IRAM_ATTR onNotecardAttn();
+void getSettingsUpdate();        // Applies every note waiting in settingsUpdate.qi
+void mergeSettings(J* body, SettingsChange* change); // Takes the settings present in a note
+bool mergeInt(J* body, const char* key, int* value);
+bool mergeBool(J* body, const char* key, bool* value);
+time_t getCurrentTimeFromNote(); // Local time for TimeLib, 0 until the clock is synced
+void updateTime();               // Syncs the clock with the cellular time when needed
+void setupTime();                // Loads the clock drift measured before
+bool syncTime();                 // Syncs the clock with card.time
+time_t epochNow();               // UTC epoch seconds, 0 until the first sync
 void sendCurrentSettingsNote();  // Sends a note with the current settings to the cloud
-void sendControllerNote();
-void sendSen5xNote();
-void sendBMSNote();
+void sendControllerNote(const ControllerSample& sample, time_t time);
+void sendSiteNotes();
+void addBusStatusToNote(NoteWriter& note); // Poll rate, cycle time and link of the primary controller
+void roverNoteKey(const RoverRegister& field, char* key, size_t size);
+void sendSen5xNote(const Sen5xSample& sample, time_t time);
+void sendBMSNote(const BMSSample& sample, time_t time);
+
+void takeSamples();                     // Adds a sample of every enabled source to its batch
+bool readSen5x(Sen5xSample* sample);    // Reads the air quality sensor
+void readBMS(BMSSample* sample);        // Reads the smart battery
+void flushBatches(bool sync);           // Sends every batch that holds samples
+void flushAgedBatches();                // Sends batches whose oldest sample has waited long enough
+void flushControllerBatch(bool sync);
+void flushSen5xBatch(bool sync);
+void flushBMSBatch(bool sync);
+template <typename Batch>
+void beginBatchNote(NoteWriter& note, const char* file, const Batch& batch, bool sync);
+
+void setBatchLimits();                  // Applies batch_size and the step to every batch
+bool addControllerBlob(NoteWriter& note); // Packs the controller batch into a SeriesBlob
+bool addSen5xBlob(NoteWriter& note);
+bool addBMSBlob(NoteWriter& note);
+bool addBlobToNote(NoteWriter& note, SeriesEncoder& encoder);
+
+void setupTelemetryLog();               // Mounts the flash log and recovers what the last run left
+void queueNote(NoteWriter& note);       // Writes a data note to the flash log
+void queueNote(const char* text, size_t length);
+char* noteRequestText(const char* text);  // Sends a request as text, timed into note_stats
+void drainTelemetryLog();               // Hands logged notes to the Notecard
+
+void setupSpreadFields();               // Lists the fields whose spread is sent
+void foldValues(const SpreadField* spread, RunningStats* stats, size_t count, const double* values);
+bool takeSpread(const SpreadField* spread, RunningStats* stats, size_t count, double* values, FieldSpread* out);
+void spreadKey(const SpreadField& spread, const char* suffix, char* key, size_t size);
+void addSpreadToNote(NoteWriter& note, const SpreadField* spread, const FieldSpread* values, size_t count);
+void addSpreadHints(J* body, const SpreadField* spread, size_t count);
+void addSpreadChannels(SeriesEncoder& encoder, const SpreadField* spread, size_t count);
+uint8_t addSpreadRow(int32_t* row, const SpreadField* spread, const FieldSpread* values, size_t count);
+template <typename Batch>
+void addSpreadColumns(NoteWriter& note, const SpreadField* spread, size_t count, const Batch& batch);
+
+void controllerField(uint8_t field, char* key, size_t size);    // Key of a controller deadband field
+void controllerValues(const ControllerSample& sample, double* values);
+void sen5xValues(const Sen5xSample& sample, double* values);
+void bmsValues(const BMSSample& sample, double* values);
+void setControllerValues(ControllerSample* sample, const double* values);  // Inverse of controllerValues()
+void setSen5xValues(Sen5xSample* sample, const double* values);
+void setBMSValues(BMSSample* sample, const double* values);
+void setupDeadbands();                  // Loads the default deadbands
+void applyDeadbands(J* deadbands);      // Takes the deadbands present in a settings update
+void addDeadbandsToNote(J* body);       // Echoes the deadbands in settings.qo
 
 void setupTemp();   // Sets up the temp sensor
 void getTempData(); // Gets the current temp data from the optional sensor
@@ -131,8 +573,11 @@ void setupSen5x();  //Sets up the Sen5x air quality sensor
 void setupWiFi(); // Sets up wifi
 void doWiFi();    // Runs an ad-hoc web page for status info
 
-void setupController();          // Sets up the connection with the controller
-void getCurrentControllerData(); // Polls the controller for current data
+void setupController();          // Sets up the connection with the controllers
+void getCurrentControllerData(); // Asks the bus for fresh data from every controller
+uint32_t readControllerTelemetry(ControllerTelemetry* telemetry, unsigned long max_age); // Copies the latest controller data
+bool loadActive();               // Whether the primary controller's load is on
+void onControllerData(uint8_t index, int success, const RoverSnapshot* snapshot); // Completes a controller poll
 void powerOn();                  // Turns the load on
 void powerOff();                 // Turns the load off
 
@@ -148,410 +593,2144 @@ void printStartupInfo();
 bool settingsEmpty();         //Looks for pre-existing settings in flash
 
 void resetESP();
+void requestReset();         // Asks the uplink task to flush and restart
+
+void createQueues();         // Creates the queues and the I2C mutex the tasks share
+void startTasks();           // Starts the task of every enabled part
+bool postToQueue(QueueHandle_t queue, const void* item); // Queues an item without waiting, counts it if dropped
+void watchTask(TaskIndex task); // Registers the calling task with the watchdog
+void runBusCommand(uint8_t command);
+void runControlCommand(uint8_t command);
+void runUplinkCommand(uint8_t command);
+bool runSchedule(TaskIndex task, uint8_t* command); // Runs a task's due jobs and waits for the next
+int64_t wallOffset();        // Wall clock µs minus esp_timer µs, 0 until synced
+void sleepIfIdle(TaskIndex task, int64_t deadline); // Sleeps when every task waits long enough
+void lightSleep(int64_t us); // Sleeps with RAM kept, woken by the timer, ATTN or the console
+void deepSleep();            // Keeps the batches and the clock and sleeps until just before the next data note
+void saveSleepState();       // Copies what a deep sleep keeps into RTC memory
+bool restoreSleepState();    // Takes it back after a wake, false after a cold boot
+int64_t sleepClockMicros();  // The system time, which the RTC keeps through a deep sleep
+void wakeTasks();            // Ends every task's wait
+void pollControllers();      // Jobs without a function of their own
+void serviceAlarms();
+void sensorPass();
+void readSensors();          // Reads the I2C sensors and queues the reading
+void takeReadings();         // Folds the queued readings into their statistics
+void lockI2C();              // note-c's I2C mutex
+void unlockI2C();
 
 /********* Default Functions *********/
 void setup()
 {
-  delay(2000); // Allow the notecard to boot
+  // the Notecard stayed up through a deep sleep, it needs no time to boot
+  esp_sleep_wakeup_cause_t wake = esp_sleep_get_wakeup_cause();
+  bool deep_slept = wake == ESP_SLEEP_WAKEUP_TIMER || wake == ESP_SLEEP_WAKEUP_EXT0;
+  power_policy.restore(rtc_awake_us, rtc_asleep_us);
+  power_policy.setDeepLead(DEEP_SLEEP_LEAD);
+  if (!deep_slept) {
+    delay(2000); // Allow the notecard to boot
+  }
   pinMode(LED_BUILTIN, OUTPUT);
   Wire.begin();
+  createQueues();
   Serial.begin(115200);
   Serial.println("");
   Serial.println("");
 
   printStartupInfo();
-  for (int i = 0; i < 5; i++) {
+  for (int i = 0; i < 5 && !deep_slept; i++) {
     Serial.print(". ");
     delay(1000); // allow the notecard to get started
   }
 
   // Update settings from flash if they don't exist
+  setupDeadbands();
+  setupSpreadFields();
   if (settingsEmpty()) {
     updateSettings();
   }
   readSettings();
+  setBatchLimits();
   printCurrentSettings();
 
-  for (int i = 0; i < 5; i++) {
+  for (int i = 0; i < 5 && !deep_slept; i++) {
     Serial.print(". ");
     delay(1000); // allow the notecard to get started
   }
 
-  setupNotecard();
-
-  // Start time sync services
+  if (deep_slept) {
+    // the Notecard kept its hub settings, templates and ATTN through the sleep
+    notecard.begin();
+    notecard.setDebugOutputStream(Serial);
+  }
+  else {
+    setupNotecard();
+  }
+  setupTelemetryLog();
+
+  // Start time sync services, the clock is synced once here and from the
+  // uplink task after that. A wake from deep sleep carries on with the
+  // batches and the clock it slept with, and only an ATTN wake has settings
+  // to read
+  setupTime();
+  if (deep_slept && restoreSleepState()) {
+    settings_pending = wake == ESP_SLEEP_WAKEUP_EXT0;
+  }
+  if (!time_service.isSet()) {
+    syncTime();
+  }
   setSyncProvider(getCurrentTimeFromNote);
+  setSyncInterval(60);
 
   // Startup other services
   setupTimer();
   if (enable_STTS22H) {
     setupTemp();
   }
-  if (enable_renogy) {
-    setupController();
+  if (enable_renogy) {
+    setupController();
+  }
+  if (enable_sen5x) {
+    setupSen5x();
+  }
+  if (enable_wifi) {
+    setupWiFi();
+  }
+
+  // Set up hardware watchdog timer, each task registers itself
+  esp_task_wdt_init(WDT_TIMEOUT, true);
+  startTasks();
+
+  Serial.println("***** Setup Complete *****");
+  Serial.println("");
+}
+
+// Everything runs in the tasks started by setup(), the loop task is not needed
+void loop()
+{
+  vTaskDelete(NULL);
+}
+
+/******** Tasks ********/
+
+// Creates the queues and the I2C mutex the tasks share, before anything
+// that uses them is set up
+void createQueues()
+{
+  bus_commands = xQueueCreate(COMMAND_QUEUE_DEPTH, sizeof(uint8_t));
+  control_commands = xQueueCreate(COMMAND_QUEUE_DEPTH, sizeof(uint8_t));
+  uplink_commands = xQueueCreate(COMMAND_QUEUE_DEPTH, sizeof(uint8_t));
+  task_commands[TASK_BUS] = bus_commands;
+  task_commands[TASK_CONTROL] = control_commands;
+  task_commands[TASK_UPLINK] = uplink_commands;
+  controller_readings = xQueueCreate(READING_QUEUE_DEPTH, sizeof(RoverSnapshot));
+  sensor_readings = xQueueCreate(READING_QUEUE_DEPTH, sizeof(SensorReading));
+  i2c_mutex = xSemaphoreCreateMutex();
+  NoteSetFnI2CMutex(lockI2C, unlockI2C);
+}
+
+// Starts the task of every enabled part, pinned to its core
+void startTasks()
+{
+  bool enabled[TASK_COUNT] = {};
+  enabled[TASK_BUS] = enable_renogy;
+  enabled[TASK_CONTROL] = true;
+  enabled[TASK_SENSORS] = enable_STTS22H || enable_sen5x || enable_bms;
+  enabled[TASK_UPLINK] = true;
+  enabled[TASK_WEB] = enable_wifi;
+
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    task_handles[i] = NULL;
+    if (!enabled[i]) {
+      continue;
+    }
+    const TaskConfig& config = task_config[i];
+    if (xTaskCreatePinnedToCore(config.function, config.name, config.stack, NULL, config.priority, &task_handles[i], config.core) != pdPASS) {
+      Serial.print("Could not start the ");
+      Serial.print(config.name);
+      Serial.println(" task");
+      task_handles[i] = NULL;
+    }
+  }
+  // tasks not started never hold up a sleep
+  portENTER_CRITICAL(&power_mux);
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    task_waiting[i] = task_handles[i] == NULL;
+    task_deadlines[i] = INT64_MAX;
+  }
+  tasks_started = true;
+  portEXIT_CRITICAL(&power_mux);
+}
+
+// Registers the calling task with the watchdog, which then resets the board
+// if the task goes WDT_TIMEOUT without reaching runSchedule()
+void watchTask(TaskIndex task)
+{
+  esp_err_t err = esp_task_wdt_add(NULL);
+  if (err != ESP_OK) {
+    Serial.print("The ");
+    Serial.print(task_config[task].name);
+    Serial.print(" task is not watched, esp_task_wdt_add() returned ");
+    Serial.println(err);
+  }
+}
+
+// Queues an item without waiting, false and counted in queue_drops when the
+// queue is full
+bool postToQueue(QueueHandle_t queue, const void* item)
+{
+  if (xQueueSend(queue, item, 0) == pdTRUE) {
+    return true;
+  }
+  queue_drops++;
+  return false;
+}
+
+// Runs a task's due jobs, publishes their statistics, then waits until the
+// next deadline, asleep if every other task is waiting too. With a command
+// queue the wait ends early when a command arrives, which is then returned
+// in command
+bool runSchedule(TaskIndex task, uint8_t* command)
+{
+  Scheduler& schedule = *task_config[task].schedule;
+  schedule.setWallOffset(wallOffset());
+  if (schedule.run() > 0) {
+    Scheduler::Report report;
+    schedule.getReport(&report);
+    schedule_reports[task].publish(report);
+  }
+  UBaseType_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+  if (stack_free < STACK_MARGIN && !stack_warned[task]) {
+    stack_warned[task] = true;
+    Serial.print("The ");
+    Serial.print(task_config[task].name);
+    Serial.print(" task has had only ");
+    Serial.print(stack_free);
+    Serial.print(" of its ");
+    Serial.print(task_config[task].stack);
+    Serial.println(" bytes of stack left");
+  }
+  esp_task_wdt_reset();
+  sleepIfIdle(task, schedule.getNextDeadline());
+
+  int64_t wait = (schedule.getNextDeadline() - esp_timer_get_time() + 999) / 1000;
+  TickType_t ticks = pdMS_TO_TICKS(constrain(wait, (int64_t) 0, (int64_t) IDLE_WAIT));
+  bool received = false;
+  if (task_commands[task] == NULL) {
+    ulTaskNotifyTake(pdTRUE, ticks);
+  }
+  else {
+    received = xQueueReceive(task_commands[task], command, ticks) == pdTRUE && *command != COMMAND_WAKE;
+  }
+
+  portENTER_CRITICAL(&power_mux);
+  task_waiting[task] = false;
+  portEXIT_CRITICAL(&power_mux);
+  return received;
+}
+
+// Wall clock µs minus esp_timer µs, what aligned jobs are scheduled by
+int64_t wallOffset()
+{
+  portENTER_CRITICAL(&time_mux);
+  int64_t now = esp_timer_get_time();
+  int64_t offset = time_service.isSet() ? time_service.micros(now) - now : 0;
+  portEXIT_CRITICAL(&time_mux);
+  return offset;
+}
+
+// Marks the task waiting until deadline. The last task to wait, with every
+// command queue empty, asks power_policy what the gap until the earliest
+// deadline of all of them is worth, and sleeps it or has the uplink task
+// deep sleep
+void sleepIfIdle(TaskIndex task, int64_t deadline)
+{
+  portENTER_CRITICAL(&power_mux);
+  task_waiting[task] = true;
+  task_deadlines[task] = deadline;
+  bool decide = tasks_started && !power_deciding && power_policy.getMode() != PowerPolicy::MODE_AWAKE;
+  PowerPolicy::State state = {};
+  state.nextDeadline = INT64_MAX;
+  for (uint8_t i = 0; i < TASK_COUNT && decide; i++) {
+    decide = task_waiting[i];
+    state.nextDeadline = min(state.nextDeadline, task_deadlines[i]);
+  }
+  power_deciding = decide;
+  time_t alarm = next_alarm;
+  portEXIT_CRITICAL(&power_mux);
+  if (!decide) {
+    return;
+  }
+
+  state.now = esp_timer_get_time();
+  state.idle = !settings_pending && !enable_wifi;
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    if (task_commands[i] != NULL && uxQueueMessagesWaiting(task_commands[i]) > 0) {
+      state.idle = false;
+    }
+  }
+  // a restart is only worth it between data notes and the on/off timers
+  state.deepReady = sample_period <= 0;
+  state.deepDeadline = uplink_schedule.getDeadline(sample_job);
+  if (alarm != 0) {
+    int64_t wall = (int64_t) (alarm - time_offset) * 1000000;
+    state.deepDeadline = min(state.deepDeadline, wall - wallOffset());
+  }
+
+  PowerPolicy::Plan plan = power_policy.decide(state);
+  if (plan.action == PowerPolicy::LIGHT_SLEEP) {
+    lightSleep(plan.sleepUs);
+    wakeTasks();
+  }
+  else if (plan.action == PowerPolicy::DEEP_SLEEP) {
+    const uint8_t command = UPLINK_DEEP_SLEEP;
+    deep_sleep_us = plan.sleepUs;
+    postToQueue(uplink_commands, &command);
+  }
+  portENTER_CRITICAL(&power_mux);
+  power_deciding = false;
+  portEXIT_CRITICAL(&power_mux);
+}
+
+// Light sleeps for us at most. The Notecard's ATTN wakes it for a settings
+// update and the console for whoever is typing at it
+void lightSleep(int64_t us)
+{
+  Serial.flush();
+  esp_sleep_enable_timer_wakeup(us);
+  // ATTN is low while armed, its interrupt is held off so the level wake
+  // does not fire it over and over
+  gpio_num_t attn = (gpio_num_t) NOTECARD_ATTN_PIN;
+  bool attn_wake = attn_armed && digitalRead(NOTECARD_ATTN_PIN) == LOW;
+  if (attn_wake) {
+    gpio_intr_disable(attn);
+    gpio_wakeup_enable(attn, GPIO_INTR_HIGH_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+  }
+  uart_set_wakeup_threshold(UART_NUM_0, 3);
+  esp_sleep_enable_uart_wakeup(0);
+
+  int64_t start = esp_timer_get_time();
+  esp_light_sleep_start();
+  int64_t slept = esp_timer_get_time() - start;
+
+  if (attn_wake) {
+    gpio_wakeup_disable(attn);
+    gpio_set_intr_type(attn, GPIO_INTR_POSEDGE);
+    gpio_intr_enable(attn);
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+      settings_pending = true;
+    }
+  }
+  portENTER_CRITICAL(&power_mux);
+  power_policy.addSleep(slept);
+  portEXIT_CRITICAL(&power_mux);
+}
+
+// From the uplink task. The batches, the clock, the time awake and asleep
+// and the health note's deadline go to RTC memory
+void deepSleep()
+{
+  saveSleepState();
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&power_mux);
+  rtc_awake_us = power_policy.getAwakeMicros(now);
+  rtc_asleep_us = power_policy.getAsleepMicros() + deep_sleep_us;
+  portEXIT_CRITICAL(&power_mux);
+  rtc_health_in_us = max(uplink_schedule.getDeadline(health_job) - now - deep_sleep_us, (int64_t) 0);
+
+  Serial.print("Deep sleeping for ");
+  Serial.print((long) (deep_sleep_us / 1000000));
+  Serial.println(" s");
+  Serial.flush();
+  esp_sleep_enable_timer_wakeup(deep_sleep_us);
+  if (attn_armed) {
+    esp_sleep_enable_ext0_wakeup((gpio_num_t) NOTECARD_ATTN_PIN, 1);
+  }
+  esp_deep_sleep_start();
+}
+
+// Copies the batches, the filters' references and the clock into RTC memory,
+// from the uplink task, which owns the batches and filters
+void saveSleepState()
+{
+  SleepState* state = new (rtc_sleep_state) SleepState;
+  state->controllerBatch = controller_batch;
+  state->sen5xBatch = sen5x_batch;
+  state->bmsBatch = bms_batch;
+  controller_filter.getReference(&state->controllerFilter);
+  sen5x_filter.getReference(&state->sen5xFilter);
+  bms_filter.getReference(&state->bmsFilter);
+  portENTER_CRITICAL(&time_mux);
+  state->clock = time_service;
+  state->timeOffset = time_offset;
+  state->sleptAt = esp_timer_get_time();
+  state->sleptAtRtc = sleepClockMicros();
+  portEXIT_CRITICAL(&time_mux);
+  state->attnArmed = attn_armed;
+  rtc_state_kept = true;
+}
+
+// Takes back what saveSleepState() kept, from setup() after the batch limits
+// and the deadbands are set. esp_timer starts from 0 again, so the clock is
+// moved on by the sleep as the RTC timed it
+bool restoreSleepState()
+{
+  if (!rtc_state_kept) {
+    return false;
+  }
+  rtc_state_kept = false;
+  const SleepState* state = (const SleepState*) rtc_sleep_state;
+  controller_batch = state->controllerBatch;
+  sen5x_batch = state->sen5xBatch;
+  bms_batch = state->bmsBatch;
+  controller_filter.setReference(state->controllerFilter);
+  sen5x_filter.setReference(state->sen5xFilter);
+  bms_filter.setReference(state->bmsFilter);
+
+  int64_t slept = max(sleepClockMicros() - state->sleptAtRtc, (int64_t) 0);
+  time_service = state->clock;
+  time_service.carryOver(state->sleptAt + slept, esp_timer_get_time(), slept * DEEP_SLEEP_CLOCK_PPM / 1000000000);
+  time_offset = state->timeOffset;
+
+  attn_armed = state->attnArmed;
+  if (attn_armed) {
+    attachNotecardAttn();
+  }
+  return true;
+}
+
+// µs of the system time, which keeps counting on the RTC through a deep
+// sleep. Nothing sets it, the wall clock is time_service
+int64_t sleepClockMicros()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+// FreeRTOS ticks stand still through a light sleep, so every task's wait is
+// ended for it to look at its deadlines again
+void wakeTasks()
+{
+  const uint8_t command = COMMAND_WAKE;
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    if (task_handles[i] == NULL) {
+      continue;
+    }
+    if (task_commands[i] != NULL) {
+      postToQueue(task_commands[i], &command);
+    }
+    else {
+      xTaskNotifyGive(task_handles[i]);
+    }
+  }
+}
+
+// Owns the controller bus: advances it, polls each controller at its own
+// rate and runs the commands the other tasks send it
+void busTask(void* parameter)
+{
+  watchTask(TASK_BUS);
+  bus_job = bus_schedule.add("poll", pollControllers, BUS_POLL_PERIOD, esp_timer_get_time());
+  while (true) {
+    uint8_t command;
+    if (runSchedule(TASK_BUS, &command)) {
+      runBusCommand(command);
+    }
+  }
+}
+
+// Runs again once the bus has a request to issue rather than every few ms,
+// which leaves the gaps between polls for sleeping
+void pollControllers()
+{
+  controller_bus.poll();
+  bus_schedule.runIn(bus_job, max(controller_bus.getIdleMillis(), (unsigned long) BUS_POLL_PERIOD));
+}
+
+void runBusCommand(uint8_t command)
+{
+  switch (command) {
+  case BUS_POLL:
+    controller_bus.requestPoll();
+    break;
+  case BUS_LOAD_ON:
+    controller_bus.setLoadState(1);
+    controller_bus.requestPoll();
+    break;
+  case BUS_LOAD_OFF:
+    controller_bus.setLoadState(0);
+    controller_bus.requestPoll();
+    break;
+  }
+  bus_schedule.runIn(bus_job, 0);
+}
+
+// Owns TimeAlarms: runs the on/off and reset timers and reprograms them when
+// the settings change
+void controlTask(void* parameter)
+{
+  watchTask(TASK_CONTROL);
+  int8_t job = control_schedule.add("alarms", serviceAlarms, ALARM_PERIOD, esp_timer_get_time());
+  // just after each second of the wall clock, when TimeAlarms' time changes
+  control_schedule.align(job);
+  while (true) {
+    uint8_t command;
+    if (runSchedule(TASK_CONTROL, &command)) {
+      runControlCommand(command);
+    }
+  }
+}
+
+void serviceAlarms()
+{
+  // handle alarm scheduling
+  Alarm.delay(0);
+  time_t alarm = Alarm.getNextTrigger();
+  portENTER_CRITICAL(&power_mux);
+  next_alarm = alarm;
+  portEXIT_CRITICAL(&power_mux);
+
+  // run output state machine
+  //evaluateOutputState();
+}
+
+void runControlCommand(uint8_t command)
+{
+  const uint8_t reply = UPLINK_SETTINGS_NOTE;
+  switch (command) {
+  case CONTROL_TIMER:
+    if (timer_mode) {
+      setupTimer();
+    }
+    else {
+      turnOffTimer();
+    }
+    // the settings echo reports the timers as programmed
+    postToQueue(uplink_commands, &reply);
+    break;
+  }
+}
+
+// Owns the I2C sensors: reads them every sample_period seconds, once a second
+// when sampling is off, on the wall clock's whole seconds
+void sensorTask(void* parameter)
+{
+  watchTask(TASK_SENSORS);
+  sensor_job = sensor_schedule.add("sensors", sensorPass, max(sample_period, 1) * 1000, esp_timer_get_time());
+  sensor_schedule.align(sensor_job);
+  while (true) {
+    runSchedule(TASK_SENSORS, NULL);
+  }
+}
+
+// One pass of the sensors, then follows sample_period when the settings change it
+void sensorPass()
+{
+  readSensors();
+  sensor_schedule.setPeriod(sensor_job, max(sample_period, 1) * 1000);
+}
+
+// Owns the Notecard, the batches and the telemetry log. Takes the readings
+// queued by the bus and sensor tasks, then does the Notecard's work
+void uplinkTask(void* parameter)
+{
+  watchTask(TASK_UPLINK);
+  int64_t now = esp_timer_get_time();
+  uplink_schedule.add("readings", takeReadings, READINGS_PERIOD, now);
+  uplink_schedule.add("notecard", doNotecard, NOTECARD_PERIOD, now);
+  // data notes on the wall clock's whole logging intervals, e.g. on the minute
+  sample_job = uplink_schedule.add("sample", logData, logging_interval * 60000, now);
+  uplink_schedule.align(sample_job);
+  // the health note keeps its hour across a deep sleep
+  int64_t health_in = rtc_health_in_us >= 0 ? rtc_health_in_us : (int64_t) HEALTH_INTERVAL * 1000;
+  rtc_health_in_us = -1;
+  health_job = uplink_schedule.add("health", sendHealthNote, HEALTH_INTERVAL, now + health_in);
+  uplink_schedule.add("log", drainTelemetryLog, LOG_DRAIN_PERIOD, now);
+  while (true) {
+    uint8_t command;
+    if (runSchedule(TASK_UPLINK, &command)) {
+      runUplinkCommand(command);
+    }
+    note_stats_view.publish(note_stats);
+  }
+}
+
+void runUplinkCommand(uint8_t command)
+{
+  switch (command) {
+  case UPLINK_RESET:
+    resetESP();
+    break;
+  case UPLINK_SETTINGS_NOTE:
+    sendCurrentSettingsNote();
+    break;
+  case UPLINK_DEEP_SLEEP:
+    deepSleep();
+    break;
+  }
+}
+
+// Owns the web server
+void webTask(void* parameter)
+{
+  watchTask(TASK_WEB);
+  web_schedule.add("web", doWiFi, WEB_POLL_PERIOD, esp_timer_get_time());
+  while (true) {
+    runSchedule(TASK_WEB, NULL);
+  }
+}
+
+// note-c takes the I2C mutex around each Notecard transaction
+void lockI2C()
+{
+  xSemaphoreTake(i2c_mutex, portMAX_DELAY);
+}
+
+void unlockI2C()
+{
+  xSemaphoreGive(i2c_mutex);
+}
+
+/******** Function Definitions ********/
+// ---- Timer ---- //
+
+// Sets up power on/off timers
+void setupTimer()
+{
+
+  // Erase existing alarm
+  Alarm.free(on_timer);
+  Alarm.free(off_timer);
+
+  // write new times
+  on_timer = Alarm.alarmRepeat(time_on_hour, time_on_min, 0, powerOn);
+  off_timer = Alarm.alarmRepeat(time_off_hour, time_off_min, 0, powerOff);
+
+  Serial.print("Timer set to turn on at ");
+  Serial.print(hour(Alarm.read(on_timer)));
+  Serial.print(":");
+  Serial.print(minute(Alarm.read(on_timer)));
+  Serial.print(", off at ");
+  Serial.print(hour(Alarm.read(off_timer)));
+  Serial.print(":");
+  Serial.println(minute(Alarm.read(off_timer)));
+
+  // Set up global reset timer
+  reset_timer = Alarm.alarmRepeat(time_reset_hour, time_reset_minute, 0, requestReset);
+  Serial.print("Reset timer set to ");
+  Serial.print(hour(Alarm.read(reset_timer)));
+  Serial.print(":");
+  Serial.println(minute(Alarm.read(reset_timer)));
+}
+
+// Deletes all timer objects
+void turnOffTimer()
+{
+  Alarm.free(on_timer);
+  Alarm.free(off_timer);
+}
+
+// ---- Notecard ---- //
+// Sets up the notecard
+void setupNotecard()
+{
+  Serial.println("Starting Notecard...");
+  notecard.begin();
+  notecard.setDebugOutputStream(Serial);
+
+  //Init wifi
+  J* req = notecard.newRequest("card.wifi");
+  JAddStringToObject(req, "ssid", WIFI_SSID);
+  JAddStringToObject(req, "password", WIFI_PASS);
+  noteSend(req);
+
+  // Initial hub.set request
+  req = notecard.newRequest("hub.set");
+  JAddStringToObject(req, "product", PRODUCT_UID);
+  JAddStringToObject(req, "mode", "periodic");
+  JAddNumberToObject(req, "outbound", outbound_interval);
+  JAddNumberToObject(req, "inbound", inbound_interval);
+  JAddStringToObject(req, "sn", SERIAL_NO);
+  noteSend(req);
+
+  setupNoteTemplates();
+  setupNotecardAttn();
+  /*
+    //Turn on accelerometer
+    req = notecard.newRequest("card.motion.mode");
+    JAddStringToObject(req, "start", "true");
+    noteSend(req);
+
+    //Tracking mode set
+    req = notecard.newRequest("card.location.mode");
+    JAddStringToObject(req, "mode", "periodic");
+    JAddNumberToObject(req, "seconds", 3600);
+    noteSend(req);
+
+    //Enable heartbeat
+    req = notecard.newRequest("card.location.track");
+    JAddBoolToObject(req, "sync", true);
+    JAddBoolToObject(req, "heartbeat", true);
+    JAddNumberToObject(req, "hours", 12);
+    noteSend(req);*/
+}
+
+// Registers a template for every outbound data note. The Notecard then stores
+// and sends each note as a fixed-length binary record instead of JSON, so
+// every note.add below has to stick to these fields and types. Hints are
+// 11/12/14 for 1/2/4 byte signed integers (21/22/24 unsigned), 14.1 for
+// floats, true for bools, and a string as long as the longest value.
+void setupNoteTemplates()
+{
+  const char* files[] = { "controller.qo", "controllers.qo", "site.qo", "Sen5x.qo", "BMS.qo" };
+  for (uint8_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    J* req = notecard.newRequest("note.template");
+    if (req == NULL) {
+      continue;
+    }
+    JAddStringToObject(req, "file", files[i]);
+    J* body = JAddObjectToObject(req, "body");
+    if (body == NULL) {
+      JDelete(req);
+      continue;
+    }
+    JAddNumberToObject(body, "TemplateVersion", 11);
+
+    if (i == 0) {
+      // controller.qo: everything keyed in roverRegisters[] plus the OSM's own values
+      JAddNumberToObject(body, "Epoch", 14);
+      JAddNumberToObject(body, "OSMTemperature_1", 12);
+      JAddNumberToObject(body, "PollRate_2", 12);
+      JAddNumberToObject(body, "BusCycleTime", 14);
+      JAddStringToObject(body, "Link", "closed");
+      auto addHint = [body](const RoverRegister& field) {
+        char key[32];
+        roverNoteKey(field, key, sizeof(key));
+        if (field.type == FIELD_BOOL) {
+          JAddBoolToObject(body, key, true);
+        }
+        else {
+          // 11/12/14 signed or 21/22/24 unsigned, as the member decoded into
+          JAddNumberToObject(body, key, (field.isSigned ? 10 : 20) + field.size);
+        }
+      };
+      RoverRegisters::forEachNoteKey(addHint);
+      addSpreadHints(body, controller_spread, CONTROLLER_SPREAD);
+    }
+    else if (i == 1) {
+      // controllers.qo: one note per controller when several share the bus
+      JAddNumberToObject(body, "ModbusId", 12);
+      JAddBoolToObject(body, "Online", true);
+      JAddStringToObject(body, "Link", "closed");
+      JAddNumberToObject(body, "PollRate_2", 12);
+      JAddNumberToObject(body, "BatteryVoltage_1", 12);
+      JAddNumberToObject(body, "ChargingCurrent_2", 12);
+      JAddNumberToObject(body, "PanelPower", 12);
+      JAddNumberToObject(body, "LoadPower", 12);
+      JAddNumberToObject(body, "PowerGenerated_day", 12);
+    }
+    else if (i == 2) {
+      // site.qo: totals across the controllers
+      JAddNumberToObject(body, "Controllers", 11);
+      JAddNumberToObject(body, "Online", 11);
+      JAddNumberToObject(body, "ChargingCurrent_2", 14);
+      JAddNumberToObject(body, "PanelPower", 14);
+      JAddNumberToObject(body, "LoadCurrent_2", 14);
+      JAddNumberToObject(body, "LoadPower", 14);
+      JAddNumberToObject(body, "chargingAH_day", 14);
+      JAddNumberToObject(body, "DischargingAH_day", 14);
+      JAddNumberToObject(body, "PowerGenerated_day", 14);
+      JAddNumberToObject(body, "PowerConsumed_day", 14);
+      JAddNumberToObject(body, "PowerGenerated_4", 14);
+      JAddNumberToObject(body, "PowerConsumed_4", 14);
+    }
+    else if (i == 3) {
+      JAddNumberToObject(body, "Epoch", 14);
+      JAddNumberToObject(body, "PM1p0", 14.1);
+      JAddNumberToObject(body, "PM2p5", 14.1);
+      JAddNumberToObject(body, "PM4", 14.1);
+      JAddNumberToObject(body, "PM10", 14.1);
+      JAddNumberToObject(body, "Humidity", 14.1);
+      JAddNumberToObject(body, "Temperature", 14.1);
+      JAddNumberToObject(body, "VOCIndex", 14.1);
+      JAddNumberToObject(body, "NOxIndex", 14.1);
+      addSpreadHints(body, sen5x_spread, SEN5X_SPREAD);
+    }
+    else {
+      JAddNumberToObject(body, "Epoch", 14);
+      JAddNumberToObject(body, "BatteryVoltage", 14);
+      JAddNumberToObject(body, "BatteryCurrent", 12);
+      JAddNumberToObject(body, "BatteryTemperature", 14.1);
+      JAddNumberToObject(body, "BatteryStateOfCharge", 12);
+      JAddNumberToObject(body, "BatteryRemainingCapacity", 14);
+      JAddBoolToObject(body, "BatteryOK", true);
+      addSpreadHints(body, bms_spread, BMS_SPREAD);
+    }
+
+    J* rsp = noteRequest(req);
+    if (rsp == NULL || notecard.responseError(rsp)) {
+      Serial.print("Template for ");
+      Serial.print(files[i]);
+      Serial.println(" was not accepted, notes will be sent untemplated");
+    }
+    notecard.deleteResponse(rsp);
+  }
+}
+
+// Key of a Rover field in the templated notes. Scaled values are sent as the
+// controller's integer with the number of decimals as a suffix, so 13.2 V
+// goes out as BatteryVoltage_1 = 132
+void roverNoteKey(const RoverRegister& field, char* key, size_t size)
+{
+  if (field.exponent < 0) {
+    snprintf(key, size, "%s_%d", field.key, -field.exponent);
+  }
+  else {
+    snprintf(key, size, "%s", field.key);
+  }
+}
+
+// updates the notecard
+void updateNotecard()
+{
+  J* req = notecard.newRequest("hub.set");
+  JAddStringToObject(req, "mode", "periodic");
+  JAddNumberToObject(req, "outbound", outbound_interval);
+  JAddNumberToObject(req, "inbound", inbound_interval);
+  noteSend(req);
+}
+
+// Sends one controller sample as a templated controller.qo note
+void sendControllerNote(const ControllerSample& sample, time_t time) {
+  // Build the controller.qo note, flat to match its template
+  NoteWriter note(note_text, sizeof(note_text));
+  note.begin("controller.qo");
+  note.addInt("TemplateVersion", note_template_version);
+  note.addInt("Epoch", time);
+  note.addInt("OSMTemperature_1", sample.osmTemperature);
+  addBusStatusToNote(note);
+
+  // Rover values and their keys all come from roverRegisters[]
+  auto addField = [&note](const RoverRegister& field, int32_t raw) {
+    char key[32];
+    roverNoteKey(field, key, sizeof(key));
+    if (field.type == FIELD_BOOL) {
+      note.addBool(key, raw != 0);
+    }
+    else {
+      note.addInt(key, raw);
+    }
+  };
+  RoverRegisters::forEachNoteField(&sample.rover, addField);
+  addSpreadToNote(note, controller_spread, sample.spread, CONTROLLER_SPREAD);
+  queueNote(note);
+}
+
+// Sends a controllers.qo note for each controller and a site.qo note with the totals
+void sendSiteNotes() {
+  ControllerTelemetry telemetry;
+  if (readControllerTelemetry(&telemetry, ULONG_MAX) == 0) {
+    return;
+  }
+  NoteWriter note(note_text, sizeof(note_text));
+  for (uint8_t i = 0; i < telemetry.devices; i++) {
+    const RoverSnapshot& snapshot = telemetry.rovers[i];
+    note.begin("controllers.qo");
+    note.addInt("TemplateVersion", note_template_version);
+    note.addInt("ModbusId", telemetry.modbusIds[i]);
+    note.addBool("Online", telemetry.online[i]);
+    note.addString("Link", telemetry.breakerOpen[i] ? "open" : "closed");
+    note.addInt("PollRate_2", lroundf(telemetry.pollRates[i] * 100));
+    note.addInt("BatteryVoltage_1", snapshot.battery.batteryVoltage.raw);
+    note.addInt("ChargingCurrent_2", snapshot.battery.chargingCurrent.raw);
+    note.addInt("PanelPower", snapshot.panel.chargingPower);
+    note.addInt("LoadPower", snapshot.load.power);
+    note.addInt("PowerGenerated_day", snapshot.day.powerGenerationForDay);
+    queueNote(note);
+  }
+
+  const RoverSiteTotals& site_totals = telemetry.site;
+  note.begin("site.qo");
+  note.addInt("TemplateVersion", note_template_version);
+  note.addInt("Controllers", site_totals.controllers);
+  note.addInt("Online", site_totals.online);
+  note.addInt("ChargingCurrent_2", site_totals.chargingCurrent.raw);
+  note.addInt("PanelPower", site_totals.panelPower);
+  note.addInt("LoadCurrent_2", site_totals.loadCurrent.raw);
+  note.addInt("LoadPower", site_totals.loadPower);
+  note.addInt("chargingAH_day", site_totals.chargingAmpHoursForDay);
+  note.addInt("DischargingAH_day", site_totals.dischargingAmpHoursForDay);
+  note.addInt("PowerGenerated_day", site_totals.powerGenerationForDay);
+  note.addInt("PowerConsumed_day", site_totals.powerConsumptionForDay);
+  note.addInt("PowerGenerated_4", site_totals.powerGenerated.raw);
+  note.addInt("PowerConsumed_4", site_totals.powerConsumed.raw);
+  queueNote(note);
+}
+
+// Adds the primary controller's poll rate, the bus cycle time and the link
+// state, as of the latest poll
+void addBusStatusToNote(NoteWriter& note)
+{
+  ControllerTelemetry telemetry;
+  if (readControllerTelemetry(&telemetry, ULONG_MAX) == 0) {
+    telemetry = {};
+  }
+  note.addInt("PollRate_2", lroundf(telemetry.pollRates[0] * 100));
+  note.addInt("BusCycleTime", telemetry.cycleTime);
+  note.addString("Link", telemetry.breakerOpen[0] ? "open" : "closed");
+}
+
+// Reads the air quality sensor, returns false and the 555 markers on error
+bool readSen5x(Sen5xSample* sample) {
+  uint16_t error;
+  char errorMessage[256];
+
+  //Set these to nonsense value to be easy to debug
+  sample->pm1p0 = 555;
+  sample->pm2p5 = 555;
+  sample->pm4p0 = 555;
+  sample->pm10p0 = 555;
+  sample->humidity = 555;
+  sample->temperature = 555;
+  sample->vocIndex = 555;
+  sample->noxIndex = 555;
+
+  // Read Measurement
+  error = sen5x.readMeasuredValues(
+    sample->pm1p0, sample->pm2p5, sample->pm4p0,
+    sample->pm10p0, sample->humidity, sample->temperature, sample->vocIndex,
+    sample->noxIndex);
+
+  if (error) {
+    Serial.print("Error trying to execute readMeasuredValues(): ");
+    errorToString(error, errorMessage, 256);
+    Serial.println(errorMessage);
+    return false;
+  }
+
+  //Convert to mg/m3
+  sample->pm1p0 = sample->pm1p0 / 1000;
+  sample->pm2p5 = sample->pm2p5 / 1000;
+  sample->pm4p0 = sample->pm4p0 / 1000;
+  sample->pm10p0 = sample->pm10p0 / 1000;
+  return true;
+}
+
+// Sends one air quality sample as a templated Sen5x.qo note
+void sendSen5xNote(const Sen5xSample& sample, time_t time) {
+  // Build the Sen5x.qo note
+  NoteWriter note(note_text, sizeof(note_text));
+  note.begin("Sen5x.qo");
+  note.addInt("TemplateVersion", note_template_version);
+  note.addInt("Epoch", time);
+  double values[SEN5X_FIELDS];
+  sen5xValues(sample, values);
+  for (uint8_t field = 0; field < SEN5X_FIELDS; field++) {
+    note.addFixed(sen5x_fields[field], values[field], sen5x_decimals[field]);
+  }
+  addSpreadToNote(note, sen5x_spread, sample.spread, SEN5X_SPREAD);
+  queueNote(note);
+}
+
+// Reads the smart battery
+void readBMS(BMSSample* sample) {
+  sample->voltage = battery.voltage();
+  sample->current = battery.averageCurrent();
+  sample->temperature = battery.temperatureC();
+  sample->stateOfCharge = battery.relativeStateOfCharge();
+  sample->remainingCapacity = battery.remainingCapacity();
+  sample->ok = battery.statusOK();
+}
+
+//Sends one smart battery sample as a templated BMS.qo note
+void sendBMSNote(const BMSSample& sample, time_t time) {
+  // Build the BMS.qo note
+  NoteWriter note(note_text, sizeof(note_text));
+  note.begin("BMS.qo");
+  note.addInt("TemplateVersion", note_template_version);
+  note.addInt("Epoch", time);
+  double values[BMS_FIELDS];
+  bmsValues(sample, values);
+  // every field but BatteryOK, which is last
+  for (uint8_t field = 0; field < BMS_FIELDS - 1; field++) {
+    note.addFixed(bms_fields[field], values[field], bms_decimals[field]);
+  }
+  note.addBool("BatteryOK", sample.ok);
+  addSpreadToNote(note, bms_spread, sample.spread, BMS_SPREAD);
+  queueNote(note);
+}
+
+// ---- Store-and-forward ---- //
+
+// Mounts the flash log and recovers what the last run left. Without it, data
+// notes go straight to the Notecard as before
+void setupTelemetryLog()
+{
+  if (!log_storage.begin("/log") || !telemetry_log.begin(log_storage)) {
+    Serial.println("Telemetry log unavailable, notes are sent directly");
+    return;
+  }
+  log_ready = true;
+  Serial.print("Telemetry log ready, ");
+  Serial.print(telemetry_log.getPendingBytes());
+  Serial.println(" bytes waiting to be sent");
+}
+
+// Writes a finished data note to the flash log instead of sending it
+void queueNote(NoteWriter& note)
+{
+  const char* text = note.end();
+  if (text == NULL) {
+    Serial.println("Note does not fit its buffer, dropping it");
+    return;
+  }
+  queueNote(text, note.length());
+}
+
+// Writes a note's text to the flash log, or sends it directly when the log
+// is not available or full
+void queueNote(const char* text, size_t length)
+{
+  if (log_ready && telemetry_log.append((const uint8_t*) text, length)) {
+    return;
+  }
+  if (log_ready) {
+    Serial.println("Note could not be logged, sending it directly");
+  }
+  char* rsp = noteRequestText(text);
+  if (rsp != NULL) {
+    JFree(rsp);
+  }
+}
+
+// Hands logged notes to the Notecard in order. When it is busy, full or not
+// answering, the note stays in the log and draining backs off
+void drainTelemetryLog()
+{
+  if (!log_ready || (log_backoff > 0 && millis() - log_failed_at < log_backoff)) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < LOG_DRAIN_PER_LOOP; i++) {
+    size_t length = telemetry_log.peek(log_record, TelemetryLog::MAX_RECORD);
+    if (length == 0) {
+      return;
+    }
+    if (log_record[0] != '{') {
+      // passed its CRC but is not a request, retrying will not help
+      telemetry_log.advance();
+      continue;
+    }
+    // logged notes are sent as they are, without parsing them back
+    if (log_record[length - 1] != '\n') {
+      log_record[length++] = '\n';
+    }
+    log_record[length] = '\0';
+
+    char* rsp = noteRequestText((const char*) log_record);
+    bool answered = rsp != NULL;
+    bool accepted = answered && strstr(rsp, "\"err\"") == NULL;
+    if (rsp != NULL) {
+      JFree(rsp);
+    }
+    if (accepted) {
+      telemetry_log.advance();
+      log_backoff = 0;
+      log_attempts = 0;
+      continue;
+    }
+
+    log_failed_at = millis();
+    log_backoff = log_backoff == 0 ? LOG_BACKOFF_MIN : min(log_backoff * 2, (unsigned long) LOG_BACKOFF_MAX);
+    // a note refused again and again is dropped so it cannot block the rest
+    if (answered && ++log_attempts >= LOG_MAX_ATTEMPTS) {
+      Serial.println("Note refused by the Notecard, dropping it");
+      telemetry_log.advance();
+      log_attempts = 0;
+      log_refused++;
+    }
+    return;
+  }
+}
+
+// ---- High-rate sampling ---- //
+
+// Lists the fields whose spread is sent, with the key and decimals each is
+// sent under
+void setupSpreadFields()
+{
+  controller_spread[0] = { "OSMTemperature", 1, 0, 0 };
+  uint8_t index = 1;
+  uint8_t field = 1;
+  auto addField = [&index, &field](const RoverRegister& rover_field) {
+    if (rover_field.group == GROUP_LIVE && rover_field.type == FIELD_INT) {
+      controller_spread[index++] = { rover_field.key, (int8_t) -rover_field.exponent, 0, field };
+    }
+    field++;
+  };
+  RoverRegisters::forEachNoteKey(addField);
+
+  // the sensors' values are sent as floats, the blob keeps their resolution
+  for (uint8_t i = 0; i < SEN5X_SPREAD; i++) {
+    sen5x_spread[i] = { sen5x_fields[i], 0, sen5x_decimals[i], i };
+  }
+  for (uint8_t i = 0; i < BMS_SPREAD; i++) {
+    bms_spread[i] = { bms_fields[i], 0, bms_decimals[i], i };
+  }
+}
+
+// Reads every enabled I2C sensor in one pass of the sensor task and queues
+// the reading for the uplink task. The Notecard shares the bus, so the pass
+// holds i2c_mutex and is skipped when the Notecard keeps it too long
+void readSensors()
+{
+  if (xSemaphoreTake(i2c_mutex, pdMS_TO_TICKS(I2C_WAIT)) != pdTRUE) {
+    return;
+  }
+  unsigned long start = micros();
+
+  if (enable_STTS22H && tempSensor.dataReady()) {
+    tempSensor.getTemperatureC(&ext_temp);
+  }
+  SensorReading reading = {};
+  if (enable_sen5x) {
+    reading.sen5xValid = readSen5x(&reading.sen5x);
+  }
+  if (enable_bms) {
+    readBMS(&reading.bms);
+    reading.bmsValid = true;
+  }
+  reading.micros = micros() - start;
+  xSemaphoreGive(i2c_mutex);
+
+  if (enable_sen5x || enable_bms) {
+    postToQueue(sensor_readings, &reading);
+  }
+}
+
+// Takes the readings queued since the last pass. With sample_period set they
+// are folded into their statistics, and the latest sensor reading is kept for
+// takeSamples() either way
+void takeReadings()
+{
+  RoverSnapshot snapshot;
+  while (xQueueReceive(controller_readings, &snapshot, 0) == pdTRUE) {
+    if (sample_period > 0) {
+      ControllerSample sample;
+      sample.rover = snapshot;
+      sample.osmTemperature = lroundf(ext_temp * 10);
+      double values[CONTROLLER_FIELDS];
+      controllerValues(sample, values);
+      foldValues(controller_spread, controller_stats, CONTROLLER_SPREAD, values);
+    }
+  }
+
+  SensorReading reading;
+  while (xQueueReceive(sensor_readings, &reading, 0) == pdTRUE) {
+    latest_reading = reading;
+    reading_received = true;
+    if (sample_period <= 0) {
+      continue;
+    }
+    if (reading.sen5xValid) {
+      double values[SEN5X_FIELDS];
+      sen5xValues(reading.sen5x, values);
+      foldValues(sen5x_spread, sen5x_stats, SEN5X_SPREAD, values);
+    }
+    if (reading.bmsValid) {
+      double values[BMS_FIELDS];
+      bmsValues(reading.bms, values);
+      foldValues(bms_spread, bms_stats, BMS_SPREAD, values);
+      bms_fault_seen |= !reading.bms.ok;
+    }
+    sample_passes++;
+    sample_micros += reading.micros;
+  }
+}
+
+// Adds a reading of every spread field to its statistics
+void foldValues(const SpreadField* spread, RunningStats* stats, size_t count, const double* values)
+{
+  for (size_t i = 0; i < count; i++) {
+    stats[i].add(values[spread[i].field]);
+  }
+}
+
+// Takes the interval's spread of every field and replaces its value with the
+// mean, then starts a new interval. Without readings the point value stands
+// and its spread is zero, false then as there is nothing to replace
+bool takeSpread(const SpreadField* spread, RunningStats* stats, size_t count, double* values, FieldSpread* out)
+{
+  bool averaged = false;
+  for (size_t i = 0; i < count; i++) {
+    double& value = values[spread[i].field];
+    if (stats[i].count() == 0) {
+      out[i] = { (float) value, (float) value, 0 };
+      continue;
+    }
+    out[i] = { (float) stats[i].getMin(), (float) stats[i].getMax(), (float) stats[i].getStdDev() };
+    value = stats[i].getMean();
+    stats[i].clear();
+    averaged = true;
+  }
+  return averaged;
+}
+
+// Key of a spread value, the field's key and the suffix, then the decimals as
+// in roverNoteKey()
+void spreadKey(const SpreadField& spread, const char* suffix, char* key, size_t size)
+{
+  if (spread.decimals > 0) {
+    snprintf(key, size, "%s%s_%d", spread.key, suffix, spread.decimals);
+  }
+  else {
+    snprintf(key, size, "%s%s", spread.key, suffix);
+  }
+}
+
+// Adds <key>Min, <key>Max and <key>SD to a templated note. Integer fields
+// keep integer bounds
+void addSpreadToNote(NoteWriter& note, const SpreadField* spread, const FieldSpread* values, size_t count)
+{
+  char key[40];
+  for (size_t i = 0; i < count; i++) {
+    uint8_t decimals = spread[i].precision;
+    spreadKey(spread[i], "Min", key, sizeof(key));
+    note.addFixed(key, values[i].min, decimals);
+    spreadKey(spread[i], "Max", key, sizeof(key));
+    note.addFixed(key, values[i].max, decimals);
+    spreadKey(spread[i], "SD", key, sizeof(key));
+    note.addFixed(key, values[i].sd, decimals + 1);
+  }
+}
+
+// Adds the template hints of the spread values, as addSpreadToNote() sends them
+void addSpreadHints(J* body, const SpreadField* spread, size_t count)
+{
+  char key[40];
+  for (size_t i = 0; i < count; i++) {
+    float hint = spread[i].precision == 0 ? 14 : 14.1;
+    spreadKey(spread[i], "Min", key, sizeof(key));
+    JAddNumberToObject(body, key, hint);
+    spreadKey(spread[i], "Max", key, sizeof(key));
+    JAddNumberToObject(body, key, hint);
+    spreadKey(spread[i], "SD", key, sizeof(key));
+    JAddNumberToObject(body, key, 14.1);
+  }
+}
+
+// Adds one array per spread value to a batch note
+template <typename Batch>
+void addSpreadColumns(NoteWriter& note, const SpreadField* spread, size_t count, const Batch& batch)
+{
+  char key[40];
+  for (size_t i = 0; i < count; i++) {
+    uint8_t decimals = spread[i].precision;
+    spreadKey(spread[i], "Min", key, sizeof(key));
+    note.beginArray(key);
+    for (uint8_t sample = 0; sample < batch.count(); sample++) {
+      note.itemFixed(batch[sample].spread[i].min, decimals);
+    }
+    note.endArray();
+    spreadKey(spread[i], "Max", key, sizeof(key));
+    note.beginArray(key);
+    for (uint8_t sample = 0; sample < batch.count(); sample++) {
+      note.itemFixed(batch[sample].spread[i].max, decimals);
+    }
+    note.endArray();
+    spreadKey(spread[i], "SD", key, sizeof(key));
+    note.beginArray(key);
+    for (uint8_t sample = 0; sample < batch.count(); sample++) {
+      note.itemFixed(batch[sample].spread[i].sd, decimals + 1);
+    }
+    note.endArray();
+  }
+}
+
+// Adds a blob channel per spread value. Bounds keep the field's precision,
+// the deviation one decimal more
+void addSpreadChannels(SeriesEncoder& encoder, const SpreadField* spread, size_t count)
+{
+  char name[40];
+  for (size_t i = 0; i < count; i++) {
+    uint8_t decimals = spread[i].decimals + spread[i].precision;
+    snprintf(name, sizeof(name), "%sMin", spread[i].key);
+    encoder.addChannel(name, decimals);
+    snprintf(name, sizeof(name), "%sMax", spread[i].key);
+    encoder.addChannel(name, decimals);
+    snprintf(name, sizeof(name), "%sSD", spread[i].key);
+    encoder.addChannel(name, decimals + 1);
+  }
+}
+
+// Fills the spread channels of a blob row, returns how many it filled
+uint8_t addSpreadRow(int32_t* row, const SpreadField* spread, const FieldSpread* values, size_t count)
+{
+  uint8_t index = 0;
+  for (size_t i = 0; i < count; i++) {
+    double scale = pow(10, spread[i].precision);
+    row[index++] = lround(values[i].min * scale);
+    row[index++] = lround(values[i].max * scale);
+    row[index++] = lround(values[i].sd * scale * 10);
+  }
+  return index;
+}
+
+// ---- Sample Batches ---- //
+
+// Adds a sample of every enabled source to its batch. A sample that does not
+// continue its batch flushes it first, a full batch is flushed right away.
+// Averaged fields carry the interval's mean, the rest are as last read
+void takeSamples()
+{
+  time_t time = epochNow();
+  bool urgent = false;
+
+  if (enable_renogy) {
+    ControllerTelemetry telemetry;
+    readControllerTelemetry(&telemetry, TELEMETRY_MAX_AGE);
+    ControllerSample sample;
+    sample.rover = telemetry.rovers[0];
+    sample.osmTemperature = lroundf(ext_temp * 10);
+    double values[CONTROLLER_FIELDS];
+    controllerValues(sample, values);
+    if (takeSpread(controller_spread, controller_stats, CONTROLLER_SPREAD, values, sample.spread)) {
+      setControllerValues(&sample, values);
+    }
+    if (controller_filter.report(values)) {
+      if (!controller_batch.empty()) {
+        const ControllerSample& last = controller_batch[controller_batch.count() - 1];
+        // a load switching or a new fault should not wait for the batch to fill
+        urgent |= sample.rover.load.active != last.rover.load.active;
+        urgent |= sample.rover.errors != 0 && sample.rover.errors != last.rover.errors;
+      }
+      if (!controller_batch.add(sample, time)) {
+        flushControllerBatch(false);
+        controller_batch.add(sample, time);
+      }
+    }
+
+    // Per-controller summaries and combined totals when sharing the bus
+    if (telemetry.devices > 1) {
+      sendSiteNotes();
+    }
+  }
+  // the sensors are read by their own task, see readSensors()
+  if (enable_sen5x && reading_received) {
+    Sen5xSample sample = latest_reading.sen5x;
+    double values[SEN5X_FIELDS];
+    sen5xValues(sample, values);
+    if (takeSpread(sen5x_spread, sen5x_stats, SEN5X_SPREAD, values, sample.spread)) {
+      setSen5xValues(&sample, values);
+    }
+    if (sen5x_filter.report(values) && !sen5x_batch.add(sample, time)) {
+      flushSen5xBatch(false);
+      sen5x_batch.add(sample, time);
+    }
+  }
+  if (enable_bms && reading_received) {
+    BMSSample sample = latest_reading.bms;
+    // a fault anywhere in the interval marks its sample
+    sample.ok = sample.ok && !bms_fault_seen;
+    bms_fault_seen = false;
+    double values[BMS_FIELDS];
+    bmsValues(sample, values);
+    if (takeSpread(bms_spread, bms_stats, BMS_SPREAD, values, sample.spread)) {
+      setBMSValues(&sample, values);
+    }
+    if (bms_filter.report(values)) {
+      if (!bms_batch.empty()) {
+        urgent |= !sample.ok && bms_batch[bms_batch.count() - 1].ok;
+      }
+      if (!bms_batch.add(sample, time)) {
+        flushBMSBatch(false);
+        bms_batch.add(sample, time);
+      }
+    }
+  }
+
+  if (urgent) {
+    Serial.println("Urgent change, sending batched samples now");
+    flushBatches(true);
+    return;
+  }
+  if (controller_batch.full()) {
+    flushControllerBatch(false);
+  }
+  if (sen5x_batch.full()) {
+    flushSen5xBatch(false);
+  }
+  if (bms_batch.full()) {
+    flushBMSBatch(false);
+  }
+}
+
+// Sends every batch that holds samples
+void flushBatches(bool sync)
+{
+  flushControllerBatch(sync);
+  flushSen5xBatch(sync);
+  flushBMSBatch(sync);
+}
+
+// Sends batches whose oldest sample has waited an outbound interval, so
+// batching never holds data back past the next sync
+void flushAgedBatches()
+{
+  unsigned long max_age = (unsigned long) outbound_interval * 60000;
+  if (controller_batch.getAgeMillis() >= max_age) {
+    flushControllerBatch(false);
+  }
+  if (sen5x_batch.getAgeMillis() >= max_age) {
+    flushSen5xBatch(false);
+  }
+  if (bms_batch.getAgeMillis() >= max_age) {
+    flushBMSBatch(false);
+  }
+}
+
+// Starts an untemplated note.add for a batch of samples. The body holds the
+// time of the first sample, the seconds between samples and one array per
+// value, sample i was taken at BaseTime + i * Step. When report-by-exception
+// skipped samples, Index holds each sample's number of steps from BaseTime
+// instead. Templates cannot hold arrays, so batches go to their own
+// <source>_batch.qo files
+template <typename Batch>
+void beginBatchNote(NoteWriter& note, const char* file, const Batch& batch, bool sync)
+{
+  note.begin(file, sync);
+  note.addInt("BaseTime", batch.getBaseTime());
+  note.addInt("Step", batch.getStep());
+  note.addInt("Count", batch.count());
+  if (batch.hasGaps()) {
+    note.beginArray("Index");
+    for (uint8_t i = 0; i < batch.count(); i++) {
+      note.itemInt(batch.getIndex(i));
+    }
+    note.endArray();
+  }
+}
+
+void flushControllerBatch(bool sync)
+{
+  if (controller_batch.empty()) {
+    return;
+  }
+  if (controller_batch.count() == 1 && !sync) {
+    sendControllerNote(controller_batch[0], controller_batch.getBaseTime());
+    controller_batch.clear();
+    return;
+  }
+
+  NoteWriter note(note_text, sizeof(note_text));
+  beginBatchNote(note, "controller_batch.qo", controller_batch, sync);
+  addBusStatusToNote(note);
+
+  if (!batch_blob || !addControllerBlob(note)) {
+    for (uint8_t i = 0; i < controller_batch.count(); i++) {
+      controllerValues(controller_batch[i], batch_rows[i]);
+    }
+    note.beginArray("OSMTemperature_1");
+    for (uint8_t i = 0; i < controller_batch.count(); i++) {
+      note.itemInt(controller_batch[i].osmTemperature);
+    }
+    note.endArray();
+
+    // one column per key in roverRegisters[], in the order of controllerValues()
+    uint8_t column = 1;
+    auto addColumn = [&note, &column](const RoverRegister& field) {
+      char key[32];
+      roverNoteKey(field, key, sizeof(key));
+      note.beginArray(key);
+      for (uint8_t i = 0; i < controller_batch.count(); i++) {
+        if (field.type == FIELD_BOOL) {
+          note.itemBool(batch_rows[i][column] != 0);
+        }
+        else {
+          note.itemInt(lround(batch_rows[i][column]));
+        }
+      }
+      note.endArray();
+      column++;
+    };
+    RoverRegisters::forEachNoteKey(addColumn);
+    addSpreadColumns(note, controller_spread, CONTROLLER_SPREAD, controller_batch);
+  }
+  queueNote(note);
+  controller_batch.clear();
+}
+
+void flushSen5xBatch(bool sync)
+{
+  if (sen5x_batch.empty()) {
+    return;
+  }
+  if (sen5x_batch.count() == 1 && !sync) {
+    sendSen5xNote(sen5x_batch[0], sen5x_batch.getBaseTime());
+    sen5x_batch.clear();
+    return;
+  }
+
+  NoteWriter note(note_text, sizeof(note_text));
+  beginBatchNote(note, "Sen5x_batch.qo", sen5x_batch, sync);
+  if (!batch_blob || !addSen5xBlob(note)) {
+    for (uint8_t i = 0; i < sen5x_batch.count(); i++) {
+      sen5xValues(sen5x_batch[i], batch_rows[i]);
+    }
+    for (uint8_t field = 0; field < SEN5X_FIELDS; field++) {
+      note.beginArray(sen5x_fields[field]);
+      for (uint8_t i = 0; i < sen5x_batch.count(); i++) {
+        note.itemFixed(batch_rows[i][field], sen5x_decimals[field]);
+      }
+      note.endArray();
+    }
+    addSpreadColumns(note, sen5x_spread, SEN5X_SPREAD, sen5x_batch);
+  }
+  queueNote(note);
+  sen5x_batch.clear();
+}
+
+void flushBMSBatch(bool sync)
+{
+  if (bms_batch.empty()) {
+    return;
+  }
+  if (bms_batch.count() == 1 && !sync) {
+    sendBMSNote(bms_batch[0], bms_batch.getBaseTime());
+    bms_batch.clear();
+    return;
+  }
+
+  NoteWriter note(note_text, sizeof(note_text));
+  beginBatchNote(note, "BMS_batch.qo", bms_batch, sync);
+  if (!batch_blob || !addBMSBlob(note)) {
+    for (uint8_t i = 0; i < bms_batch.count(); i++) {
+      bmsValues(bms_batch[i], batch_rows[i]);
+    }
+    // every field but BatteryOK, which is last
+    for (uint8_t field = 0; field < BMS_FIELDS - 1; field++) {
+      note.beginArray(bms_fields[field]);
+      for (uint8_t i = 0; i < bms_batch.count(); i++) {
+        note.itemFixed(batch_rows[i][field], bms_decimals[field]);
+      }
+      note.endArray();
+    }
+    note.beginArray("BatteryOK");
+    for (uint8_t i = 0; i < bms_batch.count(); i++) {
+      note.itemBool(bms_batch[i].ok);
+    }
+    note.endArray();
+    addSpreadColumns(note, bms_spread, BMS_SPREAD, bms_batch);
+  }
+  queueNote(note);
+  bms_batch.clear();
+}
+
+// Packs the controller batch into a SeriesBlob, false if it did not fit
+bool addControllerBlob(NoteWriter& note)
+{
+  SeriesEncoder encoder(blob_buffer, sizeof(blob_buffer));
+  encoder.begin(controller_batch.getBaseTime(), controller_batch.getStep(), controller_batch.count());
+  encoder.addChannel("OSMTemperature", 1);
+  auto addChannel = [&encoder](const RoverRegister& field) {
+    encoder.addChannel(field.key, -field.exponent);
+  };
+  RoverRegisters::forEachNoteKey(addChannel);
+  addSpreadChannels(encoder, controller_spread, CONTROLLER_SPREAD);
+
+  for (uint8_t i = 0; i < controller_batch.count(); i++) {
+    int32_t row[CONTROLLER_FIELDS + 3 * CONTROLLER_SPREAD];
+    uint8_t index = 0;
+    row[index++] = controller_batch[i].osmTemperature;
+    auto addValue = [&row, &index](const RoverRegister& field, int32_t raw) {
+      row[index++] = raw;
+    };
+    RoverRegisters::forEachNoteField(&controller_batch[i].rover, addValue);
+    addSpreadRow(row + index, controller_spread, controller_batch[i].spread, CONTROLLER_SPREAD);
+    encoder.addSample(row);
+  }
+  return addBlobToNote(note, encoder);
+}
+
+bool addSen5xBlob(NoteWriter& note)
+{
+  SeriesEncoder encoder(blob_buffer, sizeof(blob_buffer));
+  encoder.begin(sen5x_batch.getBaseTime(), sen5x_batch.getStep(), sen5x_batch.count());
+  for (uint8_t field = 0; field < SEN5X_FIELDS; field++) {
+    encoder.addChannel(sen5x_fields[field], sen5x_decimals[field]);
+  }
+  addSpreadChannels(encoder, sen5x_spread, SEN5X_SPREAD);
+  for (uint8_t i = 0; i < sen5x_batch.count(); i++) {
+    double values[SEN5X_FIELDS];
+    int32_t row[SEN5X_FIELDS + 3 * SEN5X_SPREAD];
+    sen5xValues(sen5x_batch[i], values);
+    for (uint8_t field = 0; field < SEN5X_FIELDS; field++) {
+      row[field] = lround(values[field] * pow(10, sen5x_decimals[field]));
+    }
+    addSpreadRow(row + SEN5X_FIELDS, sen5x_spread, sen5x_batch[i].spread, SEN5X_SPREAD);
+    encoder.addSample(row);
+  }
+  return addBlobToNote(note, encoder);
+}
+
+bool addBMSBlob(NoteWriter& note)
+{
+  SeriesEncoder encoder(blob_buffer, sizeof(blob_buffer));
+  encoder.begin(bms_batch.getBaseTime(), bms_batch.getStep(), bms_batch.count());
+  for (uint8_t field = 0; field < BMS_FIELDS; field++) {
+    encoder.addChannel(bms_fields[field], bms_decimals[field]);
+  }
+  addSpreadChannels(encoder, bms_spread, BMS_SPREAD);
+  for (uint8_t i = 0; i < bms_batch.count(); i++) {
+    double values[BMS_FIELDS];
+    int32_t row[BMS_FIELDS + 3 * BMS_SPREAD];
+    bmsValues(bms_batch[i], values);
+    for (uint8_t field = 0; field < BMS_FIELDS; field++) {
+      row[field] = lround(values[field] * pow(10, bms_decimals[field]));
+    }
+    addSpreadRow(row + BMS_FIELDS, bms_spread, bms_batch[i].spread, BMS_SPREAD);
+    encoder.addSample(row);
+  }
+  return addBlobToNote(note, encoder);
+}
+
+// Adds the encoded batch to the note as base64 text, false if it did not fit
+bool addBlobToNote(NoteWriter& note, SeriesEncoder& encoder)
+{
+  if (encoder.overflowed() || seriesBase64Encode(blob_buffer, encoder.length(), blob_text, sizeof(blob_text)) == 0) {
+    Serial.println("Batch does not fit a blob, sending it as arrays");
+    return false;
+  }
+  note.addString("Blob", blob_text);
+  return true;
+}
+
+// ---- Report-by-exception ---- //
+
+// Key of a controller deadband field, as sent in controller.qo
+void controllerField(uint8_t field, char* key, size_t size)
+{
+  if (field == 0) {
+    snprintf(key, size, "OSMTemperature_1");
+    return;
+  }
+  uint8_t index = 1;
+  auto findKey = [field, key, size, &index](const RoverRegister& rover_field) {
+    if (index++ == field) {
+      roverNoteKey(rover_field, key, size);
+    }
+  };
+  RoverRegisters::forEachNoteKey(findKey);
+}
+
+// A sample's fields in the order of their deadbands, in the units they are sent in
+void controllerValues(const ControllerSample& sample, double* values)
+{
+  uint8_t index = 0;
+  values[index++] = sample.osmTemperature;
+  auto addValue = [values, &index](const RoverRegister& field, int32_t raw) {
+    values[index++] = raw;
+  };
+  RoverRegisters::forEachNoteField(&sample.rover, addValue);
+}
+
+void sen5xValues(const Sen5xSample& sample, double* values)
+{
+  values[0] = sample.pm1p0;
+  values[1] = sample.pm2p5;
+  values[2] = sample.pm4p0;
+  values[3] = sample.pm10p0;
+  values[4] = sample.humidity;
+  values[5] = sample.temperature;
+  values[6] = sample.vocIndex;
+  values[7] = sample.noxIndex;
+}
+
+void bmsValues(const BMSSample& sample, double* values)
+{
+  values[0] = sample.voltage;
+  values[1] = sample.current;
+  values[2] = sample.temperature;
+  values[3] = sample.stateOfCharge;
+  values[4] = sample.remainingCapacity;
+  values[5] = sample.ok;
+}
+
+// Puts averaged values back into a sample, rounded to what each field holds
+void setControllerValues(ControllerSample* sample, const double* values)
+{
+  sample->osmTemperature = lround(values[0]);
+  uint8_t index = 1;
+  auto setValue = [sample, values, &index](const RoverRegister& field) {
+    RoverRegisters::setField(&sample->rover, field, lround(values[index++]));
+  };
+  RoverRegisters::forEachNoteKey(setValue);
+}
+
+void setSen5xValues(Sen5xSample* sample, const double* values)
+{
+  sample->pm1p0 = values[0];
+  sample->pm2p5 = values[1];
+  sample->pm4p0 = values[2];
+  sample->pm10p0 = values[3];
+  sample->humidity = values[4];
+  sample->temperature = values[5];
+  sample->vocIndex = values[6];
+  sample->noxIndex = values[7];
+}
+
+void setBMSValues(BMSSample* sample, const double* values)
+{
+  sample->voltage = lround(values[0]);
+  sample->current = lround(values[1]);
+  sample->temperature = values[2];
+  sample->stateOfCharge = lround(values[3]);
+  sample->remainingCapacity = lround(values[4]);
+}
+
+// Loads the default deadbands, the ones kept in flash are read over them by readSettings()
+void setupDeadbands()
+{
+  for (uint8_t i = 0; i < sizeof(default_deadbands) / sizeof(default_deadbands[0]); i++) {
+    const DefaultDeadband& deadband = default_deadbands[i];
+    if (strcmp(deadband.source, "controller") == 0) {
+      char key[32];
+      for (uint8_t field = 0; field < CONTROLLER_FIELDS; field++) {
+        controllerField(field, key, sizeof(key));
+        if (strcmp(key, deadband.key) == 0) {
+          controller_filter.setThreshold(field, deadband.threshold);
+        }
+      }
+    }
+    for (uint8_t field = 0; field < SEN5X_FIELDS; field++) {
+      if (strcmp(deadband.source, "Sen5x") == 0 && strcmp(sen5x_fields[field], deadband.key) == 0) {
+        sen5x_filter.setThreshold(field, deadband.threshold);
+      }
+    }
+    for (uint8_t field = 0; field < BMS_FIELDS; field++) {
+      if (strcmp(deadband.source, "BMS") == 0 && strcmp(bms_fields[field], deadband.key) == 0) {
+        bms_filter.setThreshold(field, deadband.threshold);
+      }
+    }
+  }
+}
+
+// Takes the deadbands present in a settings update, keyed by source and then
+// by note key, e.g. {"controller": {"BatteryVoltage_1": 2}, "Sen5x": {"PM2p5": 0.005}}
+void applyDeadbands(J* deadbands)
+{
+  J* controller = JGetObject(deadbands, "controller");
+  if (controller != NULL) {
+    char key[32];
+    for (uint8_t field = 0; field < CONTROLLER_FIELDS; field++) {
+      controllerField(field, key, sizeof(key));
+      if (JIsPresent(controller, key)) {
+        controller_filter.setThreshold(field, JGetNumber(controller, key));
+      }
+    }
   }
-  if (enable_sen5x) {
-    setupSen5x();
+  J* sen5x_deadbands = JGetObject(deadbands, "Sen5x");
+  for (uint8_t field = 0; sen5x_deadbands != NULL && field < SEN5X_FIELDS; field++) {
+    if (JIsPresent(sen5x_deadbands, sen5x_fields[field])) {
+      sen5x_filter.setThreshold(field, JGetNumber(sen5x_deadbands, sen5x_fields[field]));
+    }
   }
-  if (enable_wifi) {
-    setupWiFi();
+  J* bms_deadbands = JGetObject(deadbands, "BMS");
+  for (uint8_t field = 0; bms_deadbands != NULL && field < BMS_FIELDS; field++) {
+    if (JIsPresent(bms_deadbands, bms_fields[field])) {
+      bms_filter.setThreshold(field, JGetNumber(bms_deadbands, bms_fields[field]));
+    }
   }
-
-  // Set up hardware watchdog timer
-  esp_task_wdt_init(WDT_TIMEOUT, true);
-  esp_task_wdt_add(NULL);
-
-  Serial.println("***** Setup Complete *****");
-  Serial.println("");
 }
 
-void loop()
+// Echoes the deadbands in settings.qo, in the same layout settingsUpdate.qi takes
+void addDeadbandsToNote(J* body)
 {
-  // Poll sensors
-  if (enable_STTS22H) {
-    if (tempSensor.dataReady()) {
-      tempSensor.getTemperatureC(&ext_temp);
+  J* deadbands = JAddObjectToObject(body, "deadbands");
+  if (deadbands == NULL) {
+    return;
+  }
+  J* controller = JAddObjectToObject(deadbands, "controller");
+  if (controller != NULL) {
+    char key[32];
+    for (uint8_t field = 0; field < CONTROLLER_FIELDS; field++) {
+      controllerField(field, key, sizeof(key));
+      JAddNumberToObject(controller, key, controller_filter.getThreshold(field));
     }
   }
-
-  // do actions
-  doNotecard();
-
-  if (enable_wifi) {
-    doWiFi();
+  J* sen5x_deadbands = JAddObjectToObject(deadbands, "Sen5x");
+  for (uint8_t field = 0; sen5x_deadbands != NULL && field < SEN5X_FIELDS; field++) {
+    JAddNumberToObject(sen5x_deadbands, sen5x_fields[field], sen5x_filter.getThreshold(field));
+  }
+  J* bms_deadbands = JAddObjectToObject(deadbands, "BMS");
+  for (uint8_t field = 0; bms_deadbands != NULL && field < BMS_FIELDS; field++) {
+    JAddNumberToObject(bms_deadbands, bms_fields[field], bms_filter.getThreshold(field));
   }
-
-  // run output state machine
-  //evaluateOutputState();
-
-  // reset watchdog timer
-  esp_task_wdt_reset();
-
-  // handle alarm scheduling
-  Alarm.delay(0);
 }
 
-/******** Function Definitions ********/
-// ---- Timer ---- //
-
-// Sets up power on/off timers
-void setupTimer()
+// Applies batch_size and the logging interval to every batch, samples
+// already held are sent first. With the step known, samples left out by
+// report-by-exception leave a gap in the batch instead of ending it
+void setBatchLimits()
 {
+  flushBatches(false);
+  unsigned long step = (unsigned long) logging_interval * 60;
+  controller_batch.setLimit(batch_size);
+  controller_batch.setStep(step);
+  sen5x_batch.setLimit(batch_size);
+  sen5x_batch.setStep(step);
+  bms_batch.setLimit(batch_size);
+  bms_batch.setStep(step);
+}
 
-  // Erase existing alarm
-  Alarm.free(on_timer);
-  Alarm.free(off_timer);
-
-  // write new times
-  on_timer = Alarm.alarmRepeat(time_on_hour, time_on_min, 0, powerOn);
-  off_timer = Alarm.alarmRepeat(time_off_hour, time_off_min, 0, powerOff);
+// Runs notecard update tasks
+void doNotecard()
+{
+  updateTime();
 
-  Serial.print("Timer set to turn on at ");
-  Serial.print(hour(Alarm.read(on_timer)));
-  Serial.print(":");
-  Serial.print(minute(Alarm.read(on_timer)));
-  Serial.print(", off at ");
-  Serial.print(hour(Alarm.read(off_timer)));
-  Serial.print(":");
-  Serial.println(minute(Alarm.read(off_timer)));
+  // batches are held at most an outbound interval
+  flushAgedBatches();
 
-  // Set up global reset timer
-  reset_timer = Alarm.alarmRepeat(time_reset_hour, time_reset_minute, 0, resetESP);
-  Serial.print("Reset timer set to ");
-  Serial.print(hour(Alarm.read(reset_timer)));
-  Serial.print(":");
-  Serial.println(minute(Alarm.read(reset_timer)));
+  // ATTN says settingsUpdate.qi has a note
+  if (settings_pending) {
+    settings_pending = false;
+    getSettingsUpdate();
+  }
 }
 
-// Deletes all timer objects
-void turnOffTimer()
+// Samples every source once a logging interval
+void logData()
 {
-  Alarm.free(on_timer);
-  Alarm.free(off_timer);
+  // Gather data from the enabled devices, batches send their own notes
+  takeSamples();
+
+  // without ATTN the settings are polled here
+  if (!attn_armed) {
+    getSettingsUpdate();
+  }
+
+  // Finish the function
+  Serial.println("Sensor data sampled");
 }
 
-// ---- Notecard ---- //
-// Sets up the notecard
-void setupNotecard()
+// Sends a request and returns its response like notecard.requestAndResponse(),
+// timing it into note_stats along with its size and whether it failed
+J* noteRequest(J* req)
 {
-  Serial.println("Starting Notecard...");
-  notecard.begin();
-  notecard.setDebugOutputStream(Serial);
+  if (req == NULL) {
+    return NULL;
+  }
+  // the request is gone once sent, so its type and size are taken first
+  char type[NoteStats::NAME_SIZE];
+  snprintf(type, sizeof(type), "%s", JGetString(req, "req"));
+  size_t sent = jsonLength(req);
 
-  //Init wifi
-  J* req = notecard.newRequest("card.wifi");
-  JAddStringToObject(req, "ssid", WIFI_SSID);
-  JAddStringToObject(req, "password", WIFI_PASS);
-  notecard.sendRequest(req);
+  unsigned long start = micros();
+  J* rsp = notecard.requestAndResponse(req);
+  unsigned long elapsed = micros() - start;
 
-  // Initial hub.set request
-  req = notecard.newRequest("hub.set");
-  JAddStringToObject(req, "product", PRODUCT_UID);
-  JAddStringToObject(req, "mode", "periodic");
-  JAddNumberToObject(req, "outbound", outbound_interval);
-  JAddNumberToObject(req, "inbound", inbound_interval);
-  JAddStringToObject(req, "sn", SERIAL_NO);
-  notecard.sendRequest(req);
-  /*
-    //Turn on accelerometer
-    req = notecard.newRequest("card.motion.mode");
-    JAddStringToObject(req, "start", "true");
-    notecard.sendRequest(req);
+  note_stats.record(type, elapsed, sent, jsonLength(rsp), rsp == NULL || notecard.responseError(rsp));
+  return rsp;
+}
 
-    //Tracking mode set
-    req = notecard.newRequest("card.location.mode");
-    JAddStringToObject(req, "mode", "periodic");
-    JAddNumberToObject(req, "seconds", 3600);
-    notecard.sendRequest(req);
+// Sends a request that is already JSON text ending in a newline, as the
+// telemetry log holds them, and returns the response text for JFree()
+char* noteRequestText(const char* text)
+{
+  // the type is the value of the leading "req"
+  char type[NoteStats::NAME_SIZE] = "";
+  const char* name = strstr(text, "\"req\":\"");
+  if (name != NULL) {
+    name += 7;
+    size_t length = strcspn(name, "\"");
+    snprintf(type, sizeof(type), "%.*s", (int) min(length, sizeof(type) - 1), name);
+  }
 
-    //Enable heartbeat
-    req = notecard.newRequest("card.location.track");
-    JAddBoolToObject(req, "sync", true);
-    JAddBoolToObject(req, "heartbeat", true);
-    JAddNumberToObject(req, "hours", 12);
-    notecard.sendRequest(req);*/
+  unsigned long start = micros();
+  char* rsp = NoteRequestResponseJSON(text);
+  unsigned long elapsed = micros() - start;
+
+  note_stats.record(type, elapsed, strlen(text) - 1, rsp == NULL ? 0 : strlen(rsp), rsp == NULL || strstr(rsp, "\"err\"") != NULL);
+  return rsp;
 }
 
-// updates the notecard
-void updateNotecard()
+// Sends a request like notecard.sendRequest(), false if it failed
+bool noteSend(J* req)
 {
-  J* req = notecard.newRequest("hub.set");
-  JAddStringToObject(req, "mode", "periodic");
-  JAddNumberToObject(req, "outbound", outbound_interval);
-  JAddNumberToObject(req, "inbound", inbound_interval);
-  notecard.sendRequest(req);
+  J* rsp = noteRequest(req);
+  bool sent = rsp != NULL && !notecard.responseError(rsp);
+  if (rsp != NULL && !sent) {
+    notecard.logDebug(JGetString(rsp, "err"));
+    notecard.logDebug("\n");
+  }
+  notecard.deleteResponse(rsp);
+  return sent;
 }
 
-void sendControllerNote() {
-  // update the time string
-  sprintf(time_string, "%02d:%02d:%02d", hour(), minute(), second());
-
-  // Build the controller.qo note
-  J* req = notecard.newRequest("note.add");
-  if (req != NULL) {
-    JAddStringToObject(req, "file", "controller.qo");
-    // JAddBoolToObject(req2, "sync", true);
-    J* body = JAddObjectToObject(req, "body");
-    if (body) {
-      J* battery = JAddObjectToObject(body, "battery");
-      if (battery) {
-        JAddNumberToObject(battery, "StateOfCharge", battery_state.stateOfCharge);
-        JAddNumberToObject(battery, "BatteryVoltage", roundf(battery_state.batteryVoltage * 10) / 10);
-        JAddNumberToObject(battery, "BatteryTemperature", battery_state.batteryTemperature);
-        JAddNumberToObject(battery, "ChargingCurrent", roundf(battery_state.chargingCurrent * 10) / 10);
-      }
-      J* panel = JAddObjectToObject(body, "panel");
-      if (panel) {
-        JAddNumberToObject(panel, "PanelVoltage", roundf(panel_state.voltage * 10) / 10);
-        JAddNumberToObject(panel, "PanelCurrent", roundf(panel_state.current * 10) / 10);
-        JAddNumberToObject(panel, "PanelPower", panel_state.chargingPower);
-      }
-      J* controller = JAddObjectToObject(body, "controller");
-      if (controller) {
-        JAddStringToObject(controller, "Controller_Time", time_string);
-        JAddNumberToObject(controller, "OSMTemperature", roundf(ext_temp * 10) / 10);
-        JAddNumberToObject(controller, "RoverTemperature", battery_state.controllerTemperature);
-      }
-      J* load = JAddObjectToObject(body, "load");
-      if (load) {
-        JAddBoolToObject(load, "LoadState", load_state.active);
-        JAddNumberToObject(load, "LoadVoltage", roundf(load_state.voltage * 10) / 10);
-        JAddNumberToObject(load, "LoadCurrent", roundf(load_state.current * 10) / 10);
-        JAddNumberToObject(load, "LoadPower", load_state.power);
-      }
-      J* statistics = JAddObjectToObject(body, "statistics");
-      if (statistics) {
-        JAddNumberToObject(statistics, "OperatingDays", controller_statistics.operatingDays);
-        JAddNumberToObject(statistics, "OverDischarges", controller_statistics.batOverDischarges);
-        JAddNumberToObject(statistics, "FullCharges", controller_statistics.batFullCharges);
-        JAddNumberToObject(statistics, "ChargingAH", controller_statistics.batChargingAmpHours);
-        JAddNumberToObject(statistics, "DischargingAH", controller_statistics.batDischargingAmpHours);
-        JAddNumberToObject(statistics, "PowerGenerated", roundf(controller_statistics.powerGenerated * 10) / 10);
-        JAddNumberToObject(statistics, "PowerConsumed", roundf(controller_statistics.powerConsumed * 10) / 10);
-      }
-      J* day = JAddObjectToObject(body, "dayStatistics");
-      if (day) {
-        JAddNumberToObject(day, "BattVoltageMin",
-          day_statistics.batteryVoltageMinForDay);
-        JAddNumberToObject(day, "BattVoltageMax",
-          day_statistics.batteryVoltageMaxForDay);
-        JAddNumberToObject(day, "MaxChargeCurrent",
-          day_statistics.maxChargeCurrentForDay);
-        JAddNumberToObject(day, "MaxChargePower",
-          day_statistics.maxChargePowerForDay);
-        JAddNumberToObject(day, "MaxDischargeCurrent",
-          day_statistics.maxDischargeCurrentForDay);
-        JAddNumberToObject(day, "MaxDischargePower",
-          day_statistics.maxDischargePowerForDay);
-        JAddNumberToObject(day, "chargingAH_day",
-          day_statistics.chargingAmpHoursForDay);
-        JAddNumberToObject(day, "DischargingAH_day",
-          day_statistics.dischargingAmpHoursForDay);
-        JAddNumberToObject(day, "PowerGenerated_day",
-          day_statistics.powerGenerationForDay);
-        JAddNumberToObject(day, "PowerConsumed_day",
-          day_statistics.powerConsumptionForDay);
-      }
-    }
-    notecard.sendRequest(req);
+// Length of a request or response as sent on the wire, without the newline
+size_t jsonLength(J* json)
+{
+  if (json == NULL) {
+    return 0;
+  }
+  char* text = JPrintUnformatted(json);
+  if (text == NULL) {
+    return 0;
   }
+  size_t length = strlen(text);
+  JFree(text);
+  return length;
 }
 
-void sendSen5xNote() {
-  uint16_t error;
-  char errorMessage[256];
-  unsigned long current_millis = millis();
-  // update the time string
-  sprintf(time_string, "%02d:%02d:%02d", hour(), minute(), second());
-
-  //Set these to nonsense value to be easy to debug
-  float massConcentrationPm1p0 = 555;
-  float massConcentrationPm2p5 = 555;
-  float massConcentrationPm4p0 = 555;
-  float massConcentrationPm10p0 = 555;
-  float ambientHumidity = 555;
-  float ambientTemperature = 555;
-  float vocIndex = 555;
-  float noxIndex = 555;
-
-  // Read Measurement
-  error = sen5x.readMeasuredValues(
-    massConcentrationPm1p0, massConcentrationPm2p5, massConcentrationPm4p0,
-    massConcentrationPm10p0, ambientHumidity, ambientTemperature, vocIndex,
-    noxIndex);
-
-  if (error) {
-    Serial.print("Error trying to execute readMeasuredValues(): ");
-    errorToString(error, errorMessage, 256);
-    Serial.println(errorMessage);
+// Reports note_stats and the telemetry log in health.qo, then starts a new
+// window. Written with NoteWriter like the data notes, so the hourly note
+// takes no heap. Each request type gets [count, errors, bytes sent, bytes received,
+// mean ms, max ms] and its latency histogram, with the bucket limits in HistMs
+void sendHealthNote()
+{
+  NoteWriter note(note_text, sizeof(note_text));
+  note.begin("health.qo");
+  note.addInt("Window", note_stats.getAgeMillis() / 1000);
+  note.addInt("NotecardMs", note_stats.getTotalMicros() / 1000);
+  note.beginArray("HistMs");
+  for (uint8_t bucket = 0; bucket < NoteStats::BUCKETS - 1; bucket++) {
+    note.itemInt(NoteStats::getBucketLimit(bucket));
   }
-  else {
-    //Convert to mg/m3
-    massConcentrationPm1p0 = massConcentrationPm1p0 / 1000;
-    massConcentrationPm2p5 = massConcentrationPm2p5 / 1000;
-    massConcentrationPm4p0 = massConcentrationPm4p0 / 1000;
-    massConcentrationPm10p0 = massConcentrationPm10p0 / 1000;
-  }
-
-  // Build the controller.qo note
-  J* req = notecard.newRequest("note.add");
-  if (req != NULL) {
-    JAddStringToObject(req, "file", "Sen5x.qo");
-    // JAddBoolToObject(req2, "sync", true);
-    J* body = JAddObjectToObject(req, "body");
-    if (body) {
-      JAddStringToObject(body, "SensorTime", time_string);
-      JAddNumberToObject(body, "PM1p0", massConcentrationPm1p0);
-      JAddNumberToObject(body, "PM2p5", massConcentrationPm2p5);
-      JAddNumberToObject(body, "PM4", massConcentrationPm4p0);
-      JAddNumberToObject(body, "PM10", massConcentrationPm10p0);
-      JAddNumberToObject(body, "Humidity", ambientHumidity);
-      JAddNumberToObject(body, "Temperature", ambientTemperature);
-      JAddNumberToObject(body, "VOCIndex", vocIndex);
-      JAddNumberToObject(body, "NOxIndex", noxIndex);
-
+  note.endArray();
+  note.beginObject("Requests");
+  for (uint8_t i = 0; i < note_stats.getTypeCount(); i++) {
+    const NoteStats::Entry& entry = note_stats.getType(i);
+    note.beginArray(entry.name);
+    note.itemInt(entry.count);
+    note.itemInt(entry.errors);
+    note.itemInt(entry.bytesSent);
+    note.itemInt(entry.bytesReceived);
+    note.itemFixed((double) entry.totalMicros / entry.count / 1000, 1);
+    note.itemFixed(entry.maxMicros / 1000.0, 1);
+    note.beginItemArray();
+    for (uint8_t bucket = 0; bucket < NoteStats::BUCKETS; bucket++) {
+      note.itemInt(entry.histogram[bucket]);
+    }
+    note.endArray();
+    note.endArray();
+  }
+  note.endObject();
+  if (log_ready) {
+    note.addInt("LogPending", telemetry_log.getPendingBytes());
+    note.addInt("LogDropped", telemetry_log.getDropped());
+  }
+  note.addInt("LogRefused", log_refused);
+  // what the tasks have left of their stacks, in bytes, and readings lost to full queues
+  note.beginObject("StackFree");
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    if (task_handles[i] != NULL) {
+      note.addInt(task_config[i].name, uxTaskGetStackHighWaterMark(task_handles[i]));
     }
-    notecard.sendRequest(req);
   }
+  note.endObject();
+  note.addInt("QueueDrops", queue_drops.load());
+  // sensor passes folded into the statistics this window, and their mean time on I2C
+  note.addInt("SamplePasses", sample_passes);
+  note.addInt("SampleMicros", sample_passes > 0 ? sample_micros / sample_passes : 0);
+  sample_passes = 0;
+  sample_micros = 0;
+  // percent of the time awake since power-up, deep sleeps included
+  portENTER_CRITICAL(&power_mux);
+  float duty_cycle = power_policy.getDutyCycle(esp_timer_get_time());
+  portEXIT_CRITICAL(&power_mux);
+  note.addFixed("DutyCycle", duty_cycle * 100, 1);
+  // every task's jobs since boot, [period ms, runs, missed, mean late ms, SD ms, max late ms]
+  note.beginObject("Jobs");
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    Scheduler::Report report;
+    if (schedule_reports[i].read(&report) == 0) {
+      continue;
+    }
+    note.beginObject(task_config[i].name);
+    for (uint8_t j = 0; j < report.jobs; j++) {
+      const Scheduler::JobReport& job = report.job[j];
+      note.beginArray(job.name);
+      note.itemInt(job.periodMs);
+      note.itemInt(job.runs);
+      note.itemInt(job.missed);
+      note.itemFixed(job.meanLateMs, 1);
+      note.itemFixed(job.sdLateMs, 1);
+      note.itemFixed(job.maxLateMs, 1);
+      note.endArray();
+    }
+    note.endObject();
+  }
+  note.endObject();
+  note_stats.clear();
+  queueNote(note);
+}
 
+// Sets up ATTN so settingsUpdate.qi is read as soon as a note arrives
+// instead of every logging interval
+void setupNotecardAttn()
+{
+  attachNotecardAttn();
+  attn_armed = armNotecardAttn();
+  if (!attn_armed) {
+    Serial.println("Notecard ATTN unavailable, polling for settings");
+  }
+}
 
+// Sets settings_pending on ATTN's rising edge, the Notecard arms it
+void attachNotecardAttn()
+{
+  pinMode(NOTECARD_ATTN_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(NOTECARD_ATTN_PIN), onNotecardAttn, RISING);
 }
 
-//Sends info from the smart battery via notecard
-void sendBMSNote() {
-  // Build the controller.qo note
-  J* req = notecard.newRequest("note.add");
-  if (req != NULL) {
-    JAddStringToObject(req, "file", "BMS.qo");
-    // JAddBoolToObject(req2, "sync", true);
-    J* body = JAddObjectToObject(req, "body");
-    if (body) {
-      JAddNumberToObject(body, "BatteryVoltage", battery.voltage());
-      JAddNumberToObject(body, "BatteryCurrent", battery.averageCurrent());
-      JAddNumberToObject(body, "BatteryTemperature", battery.temperatureC());
-      JAddNumberToObject(body, "BatteryStateOfCharge", battery.relativeStateOfCharge());
-      JAddNumberToObject(body, "BatteryRemainingCapacity", battery.remainingCapacity());
-      JAddBoolToObject(body, "BatteryOK", battery.statusOK());
-    }
-    notecard.sendRequest(req);
+// Arms ATTN, the Notecard drives it low now and high on the next change to
+// settingsUpdate.qi
+bool armNotecardAttn()
+{
+  J* req = notecard.newRequest("card.attn");
+  if (req == NULL) {
+    return false;
   }
+  JAddStringToObject(req, "mode", "arm,files");
+  J* files = JAddArrayToObject(req, "files");
+  JAddItemToArray(files, JCreateString("settingsUpdate.qi"));
+  J* rsp = noteRequest(req);
+  bool armed = rsp != NULL && !notecard.responseError(rsp);
+  notecard.deleteResponse(rsp);
+  return armed;
 }
 
-// Runs notecard update tasks
-void doNotecard()
+void IRAM_ATTR onNotecardAttn()
 {
-  current_time = millis();
+  settings_pending = true;
+}
 
-  if (current_time > previous_data_time + (logging_interval * 60000)) {
-    // Gather data from the enabled devices, send the appropriate note
-    if (enable_renogy) {
-      getCurrentControllerData();
-      sendControllerNote();
-    }
-    if (enable_sen5x) {
-      sendSen5xNote();
-    }
-    if (enable_bms) {
-      sendBMSNote();
-    }
+// Takes every note waiting in settingsUpdate.qi and merges the settings each
+// one holds, later notes winning. Flash, hub.set and the settings.qo echo are
+// then done once for the lot. ATTN is re-armed first so a note arriving
+// meanwhile raises it again. If that fails logData() polls instead, and each
+// poll tries to arm it again
+void getSettingsUpdate()
+{
+  bool was_armed = attn_armed;
+  attn_armed = armNotecardAttn();
+  if (was_armed && !attn_armed) {
+    Serial.println("Notecard ATTN could not be re-armed, polling for settings");
+  }
 
-    // receive settings data from notecard
+  SettingsChange change = {};
+  uint8_t notes = 0;
+  for (; notes < SETTINGS_DRAIN_MAX; notes++) {
     J* req = notecard.newRequest("note.get");
     JAddStringToObject(req, "file", "settingsUpdate.qi");
     JAddBoolToObject(req, "delete", true);
 
-    J* rsp = notecard.requestAndResponse(req);
-    if (notecard.responseError(rsp)) {
-      notecard.logDebug("No notes available");
-      Serial.println("");
+    J* rsp = noteRequest(req);
+    if (rsp == NULL || notecard.responseError(rsp)) {
+      notecard.deleteResponse(rsp);
+      break;
     }
-    else {
-      J* body = JGetObject(rsp, "body");
-      power_on = JGetBool(body, "power_on");
-      timer_mode = JGetBool(body, "timer_mode");
-      time_on_hour = JGetNumber(body, "time_on_hour");
-      time_on_min = JGetNumber(body, "time_on_min");
-      time_off_hour = JGetNumber(body, "time_off_hour");
-      time_off_min = JGetNumber(body, "time_off_min");
-      logging_interval = JGetNumber(body, "logging_interval");
-      inbound_interval = JGetNumber(body, "inbound_interval");
-      outbound_interval = JGetNumber(body, "outbound_interval");
-
-      if (JGetBool(body, "reset_esp_now")) {
-        resetESP();
-      }
+    mergeSettings(JGetObject(rsp, "body"), &change);
+    notecard.deleteResponse(rsp);
+  }
+  // more may be waiting, they are taken on the next loop
+  if (notes == SETTINGS_DRAIN_MAX) {
+    settings_pending = true;
+  }
+  if (notes == 0) {
+    notecard.logDebug("No notes available");
+    Serial.println("");
+    return;
+  }
 
-      if (timer_mode) {
-        setupTimer();
-      }
-      else {
-        turnOffTimer();
-      }
-      updateSettings();
-      readSettings();
+  if (change.any) {
+    updateSettings();
+    readSettings();
+    // the next data note moves to a boundary of the new interval
+    uplink_schedule.setPeriod(sample_job, logging_interval * 60000);
+    if (change.hub) {
       updateNotecard();
-
-      Serial.println("Settings updated. Current settings: ");
-      printCurrentSettings();
+    }
+    setBatchLimits();
+
+    Serial.print(notes);
+    Serial.println(" settings updates applied. Current settings: ");
+    printCurrentSettings();
+    // the control task owns the timers, it asks for the echo once they are set
+    const uint8_t command = CONTROL_TIMER;
+    if (!change.timer || !postToQueue(control_commands, &command)) {
       sendCurrentSettingsNote();
     }
-    notecard.deleteResponse(rsp);
+  }
+
+  if (change.reset) {
+    resetESP();
+  }
+}
+
+// Takes the settings present in a note, the ones it leaves out keep their values
+void mergeSettings(J* body, SettingsChange* change)
+{
+  if (body == NULL) {
+    return;
+  }
+  bool timer = false;
+  bool hub = false;
+  bool other = false;
+  other |= mergeBool(body, "power_on", &power_on);
+  timer |= mergeBool(body, "timer_mode", &timer_mode);
+  timer |= mergeInt(body, "time_on_hour", &time_on_hour);
+  timer |= mergeInt(body, "time_on_min", &time_on_min);
+  timer |= mergeInt(body, "time_off_hour", &time_off_hour);
+  timer |= mergeInt(body, "time_off_min", &time_off_min);
+  other |= mergeInt(body, "logging_interval", &logging_interval);
+  hub |= mergeInt(body, "inbound_interval", &inbound_interval);
+  hub |= mergeInt(body, "outbound_interval", &outbound_interval);
+  other |= mergeInt(body, "batch_size", &batch_size);
+  other |= mergeInt(body, "keyframe_interval", &keyframe_interval);
+  other |= mergeBool(body, "batch_blob", &batch_blob);
+  other |= mergeInt(body, "sample_period", &sample_period);
+  other |= mergeInt(body, "power_mode", &power_mode);
+  J* deadbands = JGetObject(body, "deadbands");
+  if (deadbands != NULL) {
+    applyDeadbands(deadbands);
+    other = true;
+  }
+
+  change->timer |= timer;
+  change->hub |= hub;
+  change->any |= timer || hub || other;
+  change->reset |= JGetBool(body, "reset_esp_now");
+}
 
-    // Update the time
-    getCurrentTimeFromNote();
+// Copies a setting from a note if it is there, true if it was
+bool mergeInt(J* body, const char* key, int* value)
+{
+  if (!JIsPresent(body, key)) {
+    return false;
+  }
+  *value = JGetNumber(body, key);
+  return true;
+}
 
-    // Finish the function
-    Serial.println("Sensor data transmitted");
-    previous_data_time = current_time;
+bool mergeBool(J* body, const char* key, bool* value)
+{
+  if (!JIsPresent(body, key)) {
+    return false;
   }
+  *value = JGetBool(body, key);
+  return true;
 }
 
 void sendCurrentSettingsNote()
 {
   readSettings();
 
-  // update the time string
-  sprintf(time_string, "%02d:%02d:%02d", hour(), minute(), second());
+  // update the time string, TimeLib's now() belongs to the control task
+  time_t local = getCurrentTimeFromNote();
+  sprintf(time_string, "%02d:%02d:%02d", hour(local), minute(local), second(local));
 
   // build firmware versioning strings
   char firmware_version[10];
@@ -573,6 +2752,7 @@ void sendCurrentSettingsNote()
     if (body) {
       JAddStringToObject(body, "firmware_version", firmware_version);
       JAddStringToObject(body, "firmware_date", firmware_date);
+      JAddNumberToObject(body, "note_template_version", note_template_version);
       JAddStringToObject(body, "controller_time", time_string);
       JAddBoolToObject(body, "power_on", power_on);
       JAddBoolToObject(body, "timer_mode", timer_mode);
@@ -586,53 +2766,106 @@ void sendCurrentSettingsNote()
       JAddNumberToObject(body, "logging_interval", logging_interval);
       JAddNumberToObject(body, "outbound_interval", outbound_interval);
       JAddNumberToObject(body, "inbound_interval", inbound_interval);
+      JAddNumberToObject(body, "batch_size", batch_size);
+      JAddNumberToObject(body, "keyframe_interval", keyframe_interval);
+      JAddBoolToObject(body, "batch_blob", batch_blob);
+      JAddNumberToObject(body, "sample_period", sample_period);
+      JAddNumberToObject(body, "power_mode", power_mode);
+      addDeadbandsToNote(body);
     }
-    notecard.sendRequest(req4);
+    noteSend(req4);
   }
 }
-// Updates the system time from the cellular time
+// TimeLib's sync provider, the local time kept by time_service. It is synced
+// from doNotecard() in the uplink task, TimeLib only reads it, and 0 before
+// the first sync leaves TimeLib asking again later
 time_t getCurrentTimeFromNote()
 {
-  // char time_string[12];
-  unsigned long current_unix_time = 10;
+  portENTER_CRITICAL(&time_mux);
+  time_t local = time_service.isSet() ? time_service.now(esp_timer_get_time()) + time_offset : 0;
+  portEXIT_CRITICAL(&time_mux);
+  return local;
+}
+
+// Syncs the clock when it may have drifted too far, a failure leaves it
+// running rather than setting it back to 1970
+void updateTime()
+{
+  if (time_service.needsSync(esp_timer_get_time()) && (!time_failed || millis() - time_failed_at >= TIME_RETRY)) {
+    syncTime();
+  }
+}
 
-  int gmt_offset = 0;
-  // recieve data from notecard
-  J* req3 = notecard.newRequest("card.time");
+// Loads the clock drift measured before the last reset
+void setupTime()
+{
+  time_service.setMaxError(TIME_MAX_ERROR);
+  preferences.begin("app_settings", false);
+  float drift = preferences.getFloat("clock_ppm", 0);
+  float uncertainty = preferences.getFloat("clock_unc", DriftClock::DEFAULT_UNCERTAINTY_PPM);
+  preferences.end();
+  time_service.setDrift(drift, uncertainty);
+}
 
-  J* rsp = notecard.requestAndResponse(req3);
-  if (notecard.responseError(rsp)) {
+// Syncs time_service with the cellular time, false if the Notecard has none
+bool syncTime()
+{
+  J* rsp = noteRequest(notecard.newRequest("card.time"));
+  if (rsp == NULL || notecard.responseError(rsp) || !JIsPresent(rsp, "time")) {
     notecard.logDebug("No time available");
+    notecard.deleteResponse(rsp);
+    time_failed = true;
+    time_failed_at = millis();
+    return false;
   }
-  else {
-    current_unix_time = JGetNumber(rsp, "time");
-    gmt_offset = JGetNumber(rsp, "minutes");
-    current_unix_time = current_unix_time + (gmt_offset * 60);
-
-    setTime(current_unix_time);
-
-    if (send_time_updates) {
-      // Send a note indicating the updated time
-      J* req = notecard.newRequest("note.add");
-      if (req != NULL) {
-        JAddStringToObject(req, "file", "time.qo");
-        JAddBoolToObject(req, "sync", true);
-        J* body = JAddObjectToObject(req, "body");
-        if (body) {
-          JAddNumberToObject(body, "Updated Unix Time", current_unix_time);
-        }
-        notecard.sendRequest(req);
+  time_t current_unix_time = JGetNumber(rsp, "time");
+  long offset = JGetNumber(rsp, "minutes") * 60;
+  notecard.deleteResponse(rsp);
+  time_failed = false;
+
+  // other tasks read the clock, it is only ever seen whole
+  portENTER_CRITICAL(&time_mux);
+  time_offset = offset;
+  bool measured = time_service.sync(current_unix_time, esp_timer_get_time());
+  portEXIT_CRITICAL(&time_mux);
+  if (measured) {
+    // a new drift estimate is worth keeping over the nightly reset
+    preferences.begin("app_settings", false);
+    preferences.putFloat("clock_ppm", time_service.getDrift());
+    preferences.putFloat("clock_unc", time_service.getUncertainty());
+    preferences.end();
+  }
+
+  if (send_time_updates) {
+    // Send a note indicating the updated time
+    J* req = notecard.newRequest("note.add");
+    if (req != NULL) {
+      JAddStringToObject(req, "file", "time.qo");
+      JAddBoolToObject(req, "sync", true);
+      J* body = JAddObjectToObject(req, "body");
+      if (body) {
+        JAddNumberToObject(body, "Updated Unix Time", current_unix_time + time_offset);
+        JAddNumberToObject(body, "ClockDrift", time_service.getDrift());
       }
+      noteSend(req);
     }
-
-    Serial.print("Current time updated: ");
-    Serial.print(hour());
-    Serial.print(":");
-    Serial.println(minute());
   }
 
-  notecard.deleteResponse(rsp);
-  return current_unix_time;
+  Serial.print("Clock synced, drift ");
+  Serial.print(time_service.getDrift());
+  Serial.print(" +/- ");
+  Serial.print(time_service.getUncertainty());
+  Serial.println(" ppm");
+  return true;
+}
+
+// UTC epoch seconds, 0 until the clock has been synced
+time_t epochNow()
+{
+  portENTER_CRITICAL(&time_mux);
+  time_t epoch = time_service.now(esp_timer_get_time());
+  portEXIT_CRITICAL(&time_mux);
+  return epoch;
 }
 
 // ---- Temp Sensor ---- //
@@ -718,12 +2951,12 @@ void evaluateOutputState()
   // Evaluate outputs based on state register
   switch (power_on) {
   case true:
-    if (!load_state.active) {
+    if (!loadActive()) {
       powerOn();
     }
     break;
   case false:
-    if (load_state.active) {
+    if (loadActive()) {
       powerOff();
     }
     break;
@@ -736,9 +2969,9 @@ void powerOn()
   power_on = true;
   Serial.println("Power turned on.");
   digitalWrite(LED_BUILTIN, HIGH);
-  if (!load_state.active) {
-    rover.setLoadState(1);
-    getCurrentControllerData();
+  if (!loadActive()) {
+    const uint8_t command = BUS_LOAD_ON;
+    postToQueue(bus_commands, &command);
   }
 }
 
@@ -748,40 +2981,118 @@ void powerOff()
   power_on = false;
   Serial.println("Power turned off");
   digitalWrite(LED_BUILTIN, LOW);
-  if (load_state.active) {
-    rover.setLoadState(0);
-    getCurrentControllerData();
+  if (loadActive()) {
+    const uint8_t command = BUS_LOAD_OFF;
+    postToQueue(bus_commands, &command);
   }
 }
 
 // ---- Rover Functions ---- //
 
-// Sets up the connection with the controller
+// Sets up the connection with the controllers
 void setupController()
 {
-  Serial2.begin(9600, SERIAL_8N1, RDX2, TXD2);
-  rover.begin(Serial2);
-
-  // Check to see if data can be pulled
-  rover.getBatteryState(&battery_state);
-  delay(500);
-  if (battery_state.batteryVoltage > 0) {
-    Serial.println("RS232 connection to Rover initialized");
+#ifdef ROVER_SIMULATOR
+  for (int i = 0; i < controller_count; i++) {
+    rover_sim.addDevice(controller_config[i].modbus_id);
   }
-  else {
-    Serial.println("RS232 connection failed!!!");
+  controller_bus.begin(rover_sim);
+  Serial.println("Using simulated controllers");
+#else
+  if (!controller_uart.begin(UART_NUM_2, 9600, RDX2, TXD2)) {
+    Serial.println("Controller UART setup failed!!!");
+  }
+  controller_bus.begin(controller_uart);
+#endif
+  controller_bus.onSnapshot(onControllerData);
+
+  for (int i = 0; i < controller_count; i++) {
+    int index = controller_bus.addDevice(controller_config[i].modbus_id, controller_config[i].poll_period_ms);
+    if (index < 0) {
+      Serial.println("Too many controllers configured, ignoring the rest");
+      break;
+    }
+    RenogyRover& rover = controller_bus.getRover(index);
+    rover.setRefreshPeriod(GROUP_DAY, DAY_STATS_REFRESH);
+    rover.setRefreshPeriod(GROUP_HISTORY, HIST_STATS_REFRESH);
+
+    // Check to see if data can be pulled
+    BatteryState state;
+    rover.getBatteryState(&state);
+    Serial.print("Controller ");
+    Serial.print(controller_config[i].modbus_id);
+    if (state.batteryVoltage.raw > 0) {
+      Serial.println(": serial connection initialized");
+    }
+    else {
+      Serial.println(": serial connection failed!!!");
+    }
   }
 }
 
-// Polls the controller for current data
+// Asks the bus task for fresh data, results arrive in onControllerData()
 void getCurrentControllerData()
 {
-  rover.getBatteryState(&battery_state);
-  rover.getPanelState(&panel_state);
-  rover.getControllerLoadState(&load_state);
-  rover.getHistoricalStatistics(&controller_statistics);
-  rover.getDayStatistics(&day_statistics);
-  Serial.println("Controller data updated");
+  const uint8_t command = BUS_POLL;
+  postToQueue(bus_commands, &command);
+}
+
+// Completes a controller poll, called from controller_bus.poll() in the bus task
+void onControllerData(uint8_t index, int success, const RoverSnapshot* snapshot)
+{
+  // Stale register groups are re-read, groups that failed read as zero
+  if (!success) {
+    Serial.print("Controller ");
+    Serial.print(controller_bus.getRover(index).getModbusId());
+    Serial.print(" read failed: ");
+    Serial.println(controller_bus.getRover(index).getLastModbusError());
+    if (controller_bus.isBreakerOpen(index)) {
+      Serial.println("Controller link open, probing until it answers again");
+    }
+  }
+
+  // every poll of the first controller counts towards the interval's
+  // statistics, which the uplink task keeps, see takeReadings()
+  if (index == 0 && success && sample_period > 0) {
+    postToQueue(controller_readings, snapshot);
+  }
+
+  // publish the bus state as a whole, readers never see half a poll
+  ControllerTelemetry telemetry;
+  telemetry.devices = controller_bus.getDeviceCount();
+  for (uint8_t i = 0; i < telemetry.devices; i++) {
+    telemetry.rovers[i] = *controller_bus.getSnapshot(i);
+    telemetry.modbusIds[i] = controller_bus.getRover(i).getModbusId();
+    telemetry.online[i] = controller_bus.isOnline(i);
+    telemetry.breakerOpen[i] = controller_bus.isBreakerOpen(i);
+    telemetry.pollRates[i] = controller_bus.getPollRate(i);
+  }
+  telemetry.cycleTime = controller_bus.getCycleTime();
+  controller_bus.getSiteTotals(&telemetry.site);
+  controller_telemetry.publish(telemetry);
+}
+
+// Copies the latest controller data and returns its version, 0 before the
+// first poll. Data older than max_age asks the bus for a poll, the copy is
+// still the latest there is
+uint32_t readControllerTelemetry(ControllerTelemetry* telemetry, unsigned long max_age)
+{
+  if (enable_renogy && controller_telemetry.getAgeMillis() > max_age) {
+    getCurrentControllerData();
+  }
+  uint32_t version = controller_telemetry.read(telemetry);
+  if (version == 0) {
+    *telemetry = {};
+  }
+  return version;
+}
+
+// Whether the primary controller's load is on, as of the latest poll
+bool loadActive()
+{
+  ControllerTelemetry telemetry;
+  readControllerTelemetry(&telemetry, ULONG_MAX);
+  return telemetry.rovers[0].load.active;
 }
 
 // ---- WiFi Functions ---- //
@@ -811,7 +3122,11 @@ void doWiFi()
 
   if (client) { // If a new client connects,
 
-    getCurrentControllerData();
+    // the page shows the latest published data, a client never polls the bus
+    ControllerTelemetry telemetry;
+    readControllerTelemetry(&telemetry, TELEMETRY_MAX_AGE);
+    NoteStats stats;
+    note_stats_view.read(&stats);
 
     current_time = millis();
     previous_time = current_time;
@@ -876,8 +3191,38 @@ void doWiFi()
 
             client.println("<h3>Controller</h3> <ul>");
             client.println("<li> Battery Voltage: ");
-            client.println(battery_state.batteryVoltage);
-            client.println("</li></ul>");
+            client.println(telemetry.rovers[0].battery.batteryVoltage.toDouble(), 1);
+            client.println("</li> <li>Data age: ");
+            client.print(controller_telemetry.getAgeMillis() / 1000);
+            client.println(" s</li></ul>");
+
+            client.println("<h3>Notecard</h3>");
+            client.print("<p>Last ");
+            client.print(stats.getAgeMillis() / 60000);
+            client.print(" min, ");
+            client.print((unsigned long) (stats.getTotalMicros() / 1000));
+            client.println(" ms in requests</p>");
+            client.println("<table style=\"margin: auto;\"><tr><th>Request</th><th>Count</th>"
+              "<th>Errors</th><th>Mean ms</th><th>Max ms</th><th>Bytes out/in</th></tr>");
+            for (uint8_t i = 0; i < stats.getTypeCount(); i++) {
+              const NoteStats::Entry& entry = stats.getType(i);
+              client.print("<tr><td>");
+              client.print(entry.name);
+              client.print("</td><td>");
+              client.print(entry.count);
+              client.print("</td><td>");
+              client.print(entry.errors);
+              client.print("</td><td>");
+              client.print((double) entry.totalMicros / entry.count / 1000, 1);
+              client.print("</td><td>");
+              client.print(entry.maxMicros / 1000.0, 1);
+              client.print("</td><td>");
+              client.print(entry.bytesSent);
+              client.print("/");
+              client.print(entry.bytesReceived);
+              client.println("</td></tr>");
+            }
+            client.println("</table>");
 
             client.println("</body></html>");
 
@@ -932,6 +3277,14 @@ void updateSettings()
   preferences.putInt("logging_int", logging_interval);
   preferences.putInt("outbound_int", outbound_interval);
   preferences.putInt("inbound_int", inbound_interval);
+  preferences.putInt("batch_size", batch_size);
+  preferences.putInt("keyframe_int", keyframe_interval);
+  preferences.putBool("batch_blob", batch_blob);
+  preferences.putInt("sample_period", sample_period);
+  preferences.putInt("power_mode", power_mode);
+  preferences.putBytes("db_controller", controller_filter.getThresholds(), sizeof(float) * CONTROLLER_FIELDS);
+  preferences.putBytes("db_sen5x", sen5x_filter.getThresholds(), sizeof(float) * SEN5X_FIELDS);
+  preferences.putBytes("db_bms", bms_filter.getThresholds(), sizeof(float) * BMS_FIELDS);
 
   preferences.end();
 
@@ -952,6 +3305,27 @@ void readSettings()
   logging_interval = preferences.getInt("logging_int");
   outbound_interval = preferences.getInt("outbound_int");
   inbound_interval = preferences.getInt("inbound_int");
+  batch_size = preferences.getInt("batch_size", 1);
+  keyframe_interval = preferences.getInt("keyframe_int", 1);
+  batch_blob = preferences.getBool("batch_blob", false);
+  sample_period = preferences.getInt("sample_period", 1);
+  power_mode = constrain(preferences.getInt("power_mode", PowerPolicy::MODE_AWAKE), PowerPolicy::MODE_AWAKE, PowerPolicy::MODE_DEEP);
+  controller_filter.setKeyframeInterval(keyframe_interval);
+  sen5x_filter.setKeyframeInterval(keyframe_interval);
+  bms_filter.setKeyframeInterval(keyframe_interval);
+  portENTER_CRITICAL(&power_mux);
+  power_policy.setMode((PowerPolicy::Mode) power_mode);
+  portEXIT_CRITICAL(&power_mux);
+  // a table saved by firmware with a different field list is ignored
+  if (preferences.getBytesLength("db_controller") == sizeof(float) * CONTROLLER_FIELDS) {
+    preferences.getBytes("db_controller", controller_filter.getThresholds(), sizeof(float) * CONTROLLER_FIELDS);
+  }
+  if (preferences.getBytesLength("db_sen5x") == sizeof(float) * SEN5X_FIELDS) {
+    preferences.getBytes("db_sen5x", sen5x_filter.getThresholds(), sizeof(float) * SEN5X_FIELDS);
+  }
+  if (preferences.getBytesLength("db_bms") == sizeof(float) * BMS_FIELDS) {
+    preferences.getBytes("db_bms", bms_filter.getThresholds(), sizeof(float) * BMS_FIELDS);
+  }
 
   preferences.end();
 
@@ -999,11 +3373,30 @@ void printCurrentSettings()
   Serial.println(inbound_interval);
   Serial.print("Outbound interval: ");
   Serial.println(outbound_interval);
+  Serial.print("Samples per note: ");
+  Serial.println(batch_size);
+  Serial.print("Keyframe interval: ");
+  Serial.println(keyframe_interval);
+  Serial.print("Batches as blobs: ");
+  Serial.println(batch_blob);
+  Serial.print("Sample period: ");
+  Serial.println(sample_period);
+  Serial.print("Power mode: ");
+  Serial.println(power_mode);
 }
 
 // ---- System Functions ---- //
+// The reset timer's alarm, the uplink task owns the batches to flush first
+void requestReset()
+{
+  const uint8_t command = UPLINK_RESET;
+  postToQueue(uplink_commands, &command);
+}
+
 void resetESP()
 {
+  // samples held in RAM would be lost with the restart
+  flushBatches(false);
   Serial.println("Restarting ESP");
   ESP.restart();
 }
@@ -0,0 +1,135 @@
+/*
+    Arduino.h - The part of the Arduino core the libraries use, for env:native
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using std::max;
+using std::min;
+
+template <typename T, typename L, typename H>
+inline T constrain(T value, L low, H high) {
+  return value < low ? low : (value > high ? high : value);
+}
+
+// Simulated time. It only moves when a test advances it or the code under
+// test waits, so bus timing is the same on every run and a 2 s timeout costs
+// no wall time
+inline std::atomic<uint64_t> native_micros(0);
+// what one pass of a busy-wait loop costs
+static const uint32_t NATIVE_YIELD_MICROS = 10;
+
+inline void advanceMicros(uint64_t us) {
+  native_micros += us;
+}
+
+inline unsigned long micros() {
+  return native_micros.load();
+}
+
+inline unsigned long millis() {
+  return native_micros.load() / 1000;
+}
+
+inline void delay(unsigned long ms) {
+  advanceMicros((uint64_t) ms * 1000);
+}
+
+inline void delayMicroseconds(unsigned int us) {
+  advanceMicros(us);
+}
+
+inline void yield() {
+  advanceMicros(NATIVE_YIELD_MICROS);
+}
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t* data, size_t length) {
+      size_t count = 0;
+      while (length-- > 0) {
+        count += write(*data++);
+      }
+      return count;
+    }
+    size_t write(const char* text) {
+      return write((const uint8_t*) text, strlen(text));
+    }
+    virtual void flush() {}
+
+    size_t print(const char* text) {
+      return write(text);
+    }
+    size_t print(long value) {
+      char text[24];
+      snprintf(text, sizeof(text), "%ld", value);
+      return write(text);
+    }
+    size_t print(unsigned long value) {
+      char text[24];
+      snprintf(text, sizeof(text), "%lu", value);
+      return write(text);
+    }
+    size_t print(int value) {
+      return print((long) value);
+    }
+    size_t print(unsigned int value) {
+      return print((unsigned long) value);
+    }
+    size_t print(double value, int decimals = 2) {
+      char text[48];
+      snprintf(text, sizeof(text), "%.*f", decimals, value);
+      return write(text);
+    }
+    template <typename T>
+    size_t println(T value) {
+      return print(value) + write("\r\n");
+    }
+    size_t println() {
+      return write("\r\n");
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// Serial goes to stdout
+class NativeSerial : public Stream {
+  public:
+    void begin(unsigned long baud) {
+      (void) baud;
+    }
+    size_t write(uint8_t value) {
+      return fputc(value, stdout) == EOF ? 0 : 1;
+    }
+    using Print::write;
+    int available() {
+      return 0;
+    }
+    int read() {
+      return -1;
+    }
+    int peek() {
+      return -1;
+    }
+};
+
+inline NativeSerial Serial;
+
+#endif
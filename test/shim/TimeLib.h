@@ -0,0 +1,10 @@
+/*
+    TimeLib.h - time_t for the headers that take TimeLib's, for env:native
+*/
+
+#ifndef TimeLib_h
+#define TimeLib_h
+
+#include <time.h>
+
+#endif
@@ -0,0 +1,314 @@
+/*
+    uart.h - A model of the ESP-IDF UART driver, for env:native_uart
+*/
+
+#ifndef uart_h
+#define uart_h
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_ARG 0x102
+
+typedef enum { UART_NUM_0, UART_NUM_1, UART_NUM_2, UART_NUM_MAX } uart_port_t;
+typedef enum { UART_DATA_5_BITS, UART_DATA_6_BITS, UART_DATA_7_BITS, UART_DATA_8_BITS } uart_word_length_t;
+typedef enum { UART_PARITY_DISABLE, UART_PARITY_EVEN = 2, UART_PARITY_ODD } uart_parity_t;
+typedef enum { UART_STOP_BITS_1 = 1, UART_STOP_BITS_1_5, UART_STOP_BITS_2 } uart_stop_bits_t;
+typedef enum { UART_HW_FLOWCTRL_DISABLE, UART_HW_FLOWCTRL_RTS, UART_HW_FLOWCTRL_CTS, UART_HW_FLOWCTRL_CTS_RTS } uart_hw_flowcontrol_t;
+typedef enum { UART_SCLK_APB, UART_SCLK_REF_TICK } uart_sclk_t;
+#define UART_PIN_NO_CHANGE (-1)
+
+typedef struct {
+  int baud_rate;
+  uart_word_length_t data_bits;
+  uart_parity_t parity;
+  uart_stop_bits_t stop_bits;
+  uart_hw_flowcontrol_t flow_ctrl;
+  uint8_t rx_flow_ctrl_thresh;
+  uart_sclk_t source_clk;
+} uart_config_t;
+
+typedef enum {
+  UART_DATA,
+  UART_BREAK,
+  UART_BUFFER_FULL,
+  UART_FIFO_OVF,
+  UART_FRAME_ERR,
+  UART_PARITY_ERR,
+  UART_DATA_BREAK,
+  UART_PATTERN_DET,
+  UART_EVENT_MAX
+} uart_event_type_t;
+
+typedef struct {
+  uart_event_type_t type;
+  size_t size;
+  bool timeout_flag;
+} uart_event_t;
+
+// The hardware and the driver's interrupt handler, run against the
+// simulated clock. Bytes come in from the other end of the line into a
+// 128 byte FIFO. The interrupt fires when the FIFO reaches its full
+// threshold or the line has been quiet for the RX timeout, and then runs
+// after isrLatencyMicros: it moves the FIFO into the ring buffer and posts
+// UART_DATA, or posts UART_BUFFER_FULL and stops receiving when the ring
+// buffer has no room. A byte arriving at a full FIFO is lost, and the
+// interrupt then resets the FIFO and posts UART_FIFO_OVF
+struct NativeUart {
+  static const size_t FIFO_SIZE = 128;
+
+  bool installed;
+  Stream* line;
+  unsigned long charMicros;
+  unsigned long isrLatencyMicros;
+  uint8_t fullThreshold;
+  uint8_t timeoutSymbols;
+
+  uint8_t fifo[FIFO_SIZE];
+  size_t fifoCount;
+  bool fifoOverflowed;
+  uint64_t overflowAt;
+  bool rxEnabled;
+  uint64_t lastArrival;
+  uint64_t lastService;
+  uint64_t fullAt;
+
+  std::deque<uint8_t> ring;
+  size_t ringSize;
+  NativeQueue events;
+
+  unsigned long bytesReceived;
+  unsigned long bytesLost;
+  unsigned long fifoOverflows;
+  unsigned long bufferFulls;
+  unsigned long eventsDropped;
+  unsigned long interrupts;
+};
+
+inline NativeUart native_uarts[UART_NUM_MAX];
+
+inline void nativeUartPost(NativeUart* uart, uart_event_type_t type, size_t size, bool timeout) {
+  uart_event_t event = { type, size, timeout };
+  if (!nativeQueueSend(&uart->events, &event)) {
+    uart->eventsDropped++;
+  }
+}
+
+// when the interrupt handler runs next, 0 if nothing has raised it
+inline uint64_t nativeUartInterruptDue(const NativeUart* uart) {
+  uint64_t due = 0;
+  if (uart->fifoOverflowed) {
+    due = uart->overflowAt;
+  }
+  else if (uart->rxEnabled && uart->fullAt != 0) {
+    due = uart->fullAt;
+  }
+  else if (uart->rxEnabled && uart->fifoCount > 0) {
+    due = uart->lastArrival + (uint64_t) uart->timeoutSymbols * uart->charMicros;
+  }
+  return due == 0 ? 0 : due + uart->isrLatencyMicros;
+}
+
+inline void nativeUartInterrupt(NativeUart* uart, bool timeout) {
+  uart->interrupts++;
+  if (uart->fifoOverflowed) {
+    uart->fifoCount = 0;
+    uart->fifoOverflowed = false;
+    uart->fullAt = 0;
+    uart->fifoOverflows++;
+    nativeUartPost(uart, UART_FIFO_OVF, 0, false);
+    return;
+  }
+  if (uart->ring.size() + uart->fifoCount > uart->ringSize) {
+    // the data stays in the FIFO until a read makes room
+    uart->rxEnabled = false;
+    uart->bufferFulls++;
+    nativeUartPost(uart, UART_BUFFER_FULL, 0, false);
+    return;
+  }
+  uart->ring.insert(uart->ring.end(), uart->fifo, uart->fifo + uart->fifoCount);
+  nativeUartPost(uart, UART_DATA, uart->fifoCount, timeout);
+  uart->fifoCount = 0;
+  uart->fullAt = 0;
+}
+
+inline void nativeUartInterruptsUntil(NativeUart* uart, uint64_t time) {
+  uint64_t due = nativeUartInterruptDue(uart);
+  while (due != 0 && due <= time) {
+    nativeUartInterrupt(uart, uart->fullAt == 0);
+    due = nativeUartInterruptDue(uart);
+  }
+}
+
+inline void nativeUartArrive(NativeUart* uart, uint8_t value, uint64_t time) {
+  uart->bytesReceived++;
+  uart->lastArrival = time;
+  if (uart->fifoCount >= NativeUart::FIFO_SIZE) {
+    uart->bytesLost++;
+    if (!uart->fifoOverflowed) {
+      uart->fifoOverflowed = true;
+      uart->overflowAt = time;
+    }
+    return;
+  }
+  uart->fifo[uart->fifoCount++] = value;
+  if (uart->fifoCount >= uart->fullThreshold && uart->fullAt == 0) {
+    uart->fullAt = time;
+  }
+}
+
+// Brings the UART up to the simulated now. Bytes are taken off the line as
+// they have arrived, a character time apart, and interrupts in between run
+// in order
+inline void nativeUartService(void* context) {
+  NativeUart* uart = (NativeUart*) context;
+  uint64_t now = micros();
+  if (uart->line != NULL) {
+    int count = uart->line->available();
+    for (int i = 0; i < count; i++) {
+      uint64_t back = (uint64_t) (count - 1 - i) * uart->charMicros;
+      uint64_t time = now > back ? now - back : 0;
+      time = max(time, uart->lastService);
+      nativeUartInterruptsUntil(uart, time);
+      nativeUartArrive(uart, uart->line->read(), time);
+    }
+  }
+  nativeUartInterruptsUntil(uart, now);
+  uart->lastService = now;
+}
+
+// Connects a port to the other end of the line, e.g. a RenogyRoverSim
+inline void nativeUartAttach(uart_port_t port, Stream& line, unsigned long baud) {
+  NativeUart* uart = &native_uarts[port];
+  uart->line = &line;
+  uart->charMicros = 11000000UL / baud;
+  uart->lastService = micros();
+}
+
+// How long the driver's interrupt waits to run, e.g. behind a flash write
+inline void nativeUartSetInterruptLatency(uart_port_t port, unsigned long latencyMicros) {
+  native_uarts[port].isrLatencyMicros = latencyMicros;
+}
+
+inline esp_err_t uart_driver_install(uart_port_t port, int rxBufferSize, int txBufferSize,
+  int queueSize, QueueHandle_t* queue, int flags) {
+  (void) txBufferSize;
+  (void) flags;
+  NativeUart* uart = &native_uarts[port];
+  if (port >= UART_NUM_MAX || uart->installed || rxBufferSize <= (int) NativeUart::FIFO_SIZE) {
+    return ESP_FAIL;
+  }
+  Stream* line = uart->line;
+  unsigned long charMicros = uart->charMicros;
+  unsigned long latency = uart->isrLatencyMicros;
+  *uart = NativeUart();
+  uart->installed = true;
+  uart->line = line;
+  uart->charMicros = charMicros != 0 ? charMicros : 11000000UL / 115200;
+  uart->isrLatencyMicros = latency;
+  // the driver's defaults
+  uart->fullThreshold = 120;
+  uart->timeoutSymbols = 10;
+  uart->rxEnabled = true;
+  uart->ringSize = rxBufferSize;
+  uart->lastService = micros();
+  uart->events.itemSize = sizeof(uart_event_t);
+  uart->events.length = queueSize;
+  uart->events.service = nativeUartService;
+  uart->events.context = uart;
+  if (queue != NULL) {
+    *queue = &uart->events;
+  }
+  return ESP_OK;
+}
+
+inline esp_err_t uart_driver_delete(uart_port_t port) {
+  native_uarts[port].installed = false;
+  return ESP_OK;
+}
+
+inline esp_err_t uart_param_config(uart_port_t port, const uart_config_t* config) {
+  if (config->baud_rate <= 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  native_uarts[port].charMicros = 11000000UL / config->baud_rate;
+  return ESP_OK;
+}
+
+inline esp_err_t uart_set_pin(uart_port_t port, int txPin, int rxPin, int rtsPin, int ctsPin) {
+  (void) port;
+  (void) txPin;
+  (void) rxPin;
+  (void) rtsPin;
+  (void) ctsPin;
+  return ESP_OK;
+}
+
+// in symbol times, the ESP32 counts up to 126 at 8N1
+inline esp_err_t uart_set_rx_timeout(uart_port_t port, uint8_t threshold) {
+  if (threshold > 126) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  native_uarts[port].timeoutSymbols = threshold;
+  return ESP_OK;
+}
+
+inline esp_err_t uart_set_rx_full_threshold(uart_port_t port, int threshold) {
+  if (threshold < 1 || threshold >= (int) NativeUart::FIFO_SIZE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  native_uarts[port].fullThreshold = threshold;
+  return ESP_OK;
+}
+
+inline int uart_tx_chars(uart_port_t port, const char* data, uint32_t length) {
+  NativeUart* uart = &native_uarts[port];
+  nativeUartService(uart);
+  if (uart->line != NULL) {
+    uart->line->write((const uint8_t*) data, length);
+  }
+  return length;
+}
+
+// what the ring buffer holds, bytes still in the FIFO are not counted
+inline esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t* size) {
+  NativeUart* uart = &native_uarts[port];
+  nativeUartService(uart);
+  *size = uart->ring.size();
+  return ESP_OK;
+}
+
+inline int uart_read_bytes(uart_port_t port, void* buffer, uint32_t length, TickType_t ticks) {
+  (void) ticks;
+  NativeUart* uart = &native_uarts[port];
+  nativeUartService(uart);
+  size_t count = min((size_t) length, uart->ring.size());
+  std::copy(uart->ring.begin(), uart->ring.begin() + count, (uint8_t*) buffer);
+  uart->ring.erase(uart->ring.begin(), uart->ring.begin() + count);
+  // reading makes room for what the FIFO held back, and receiving resumes
+  if (!uart->rxEnabled && uart->ring.size() + uart->fifoCount <= uart->ringSize) {
+    uart->ring.insert(uart->ring.end(), uart->fifo, uart->fifo + uart->fifoCount);
+    uart->fifoCount = 0;
+    uart->fullAt = 0;
+    uart->rxEnabled = true;
+  }
+  return count;
+}
+
+// empties the ring buffer and the FIFO and receives again
+inline esp_err_t uart_flush_input(uart_port_t port) {
+  NativeUart* uart = &native_uarts[port];
+  nativeUartService(uart);
+  uart->ring.clear();
+  uart->fifoCount = 0;
+  uart->fifoOverflowed = false;
+  uart->fullAt = 0;
+  uart->rxEnabled = true;
+  return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,17 @@
+/*
+    FreeRTOS.h - The FreeRTOS types the UART driver model uses, for env:native_uart
+*/
+
+#ifndef FreeRTOS_h
+#define FreeRTOS_h
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+
+#endif
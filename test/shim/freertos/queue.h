@@ -0,0 +1,54 @@
+/*
+    queue.h - FreeRTOS queues as far as the UART driver model needs them,
+    for env:native_uart
+*/
+
+#ifndef queue_h
+#define queue_h
+
+#include <freertos/FreeRTOS.h>
+#include <deque>
+#include <string.h>
+#include <vector>
+
+// A fixed length queue of fixed size items. service, when set, runs before
+// every receive, so the driver model can catch up with the simulated clock
+struct NativeQueue {
+  size_t itemSize;
+  size_t length;
+  std::deque<std::vector<uint8_t> > items;
+  void (*service)(void* context);
+  void* context;
+};
+
+typedef NativeQueue* QueueHandle_t;
+
+// false when the queue is full and the item was dropped, as from an ISR
+inline bool nativeQueueSend(QueueHandle_t queue, const void* item) {
+  if (queue->items.size() >= queue->length) {
+    return false;
+  }
+  const uint8_t* bytes = (const uint8_t*) item;
+  queue->items.push_back(std::vector<uint8_t>(bytes, bytes + queue->itemSize));
+  return true;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks) {
+  (void) ticks;
+  if (queue->service != NULL) {
+    queue->service(queue->context);
+  }
+  if (queue->items.empty()) {
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  return pdTRUE;
+}
+
+inline BaseType_t xQueueReset(QueueHandle_t queue) {
+  queue->items.clear();
+  return pdPASS;
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+    The Modbus stack polls without touching the heap: every malloc and new
+    made while RoverBus polls RenogyRoverSim 100000 times is counted
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <new>
+#include <RoverBus.h>
+#include <RenogyRoverSim.h>
+
+static const unsigned long POLLS = 100000;
+
+static bool counting = false;
+static unsigned long allocations = 0;
+
+static void countAllocation() {
+    if (counting) {
+        allocations++;
+    }
+}
+
+#if defined(__GLIBC__)
+// glibc's own entry points, so malloc can be replaced and still allocate
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+extern "C" void* malloc(size_t size) {
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size) {
+    countAllocation();
+    return __libc_realloc(pointer, size);
+}
+
+static void* rawAllocate(size_t size) {
+    return __libc_malloc(size);
+}
+#else
+// elsewhere only new is hooked
+static void* rawAllocate(size_t size) {
+    countAllocation();
+    return malloc(size);
+}
+#endif
+
+// the default delete frees with free(), which suits both allocators
+void* operator new(size_t size) {
+#if defined(__GLIBC__)
+    countAllocation();
+#endif
+    void* pointer = rawAllocate(size != 0 ? size : 1);
+    if (pointer == NULL) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void setUp(void) {
+    allocations = 0;
+}
+
+void tearDown(void) {
+    counting = false;
+}
+
+void test_hook_counts(void) {
+    counting = true;
+    int* value = new int(1);
+    void* block = malloc(16);
+    counting = false;
+    delete value;
+    free(block);
+#if defined(__GLIBC__)
+    TEST_ASSERT_EQUAL_UINT32(2, allocations);
+#else
+    TEST_ASSERT_EQUAL_UINT32(1, allocations);
+#endif
+}
+
+void test_polling_does_not_allocate(void) {
+    // a fast bus keeps 100000 polls to a few minutes of simulated time,
+    // with the odd lost and garbled reply to run the retry path too
+    RenogyRoverSim sim(115200);
+    sim.addDevice(1);
+    sim.addDevice(2);
+    sim.setResponseLatency(0);
+    sim.setSeed(99);
+    sim.setDropRate(1);
+    sim.setCrcErrorRate(1);
+
+    RoverBus bus;
+    bus.begin(sim, 115200);
+    bus.setResponseTimeout(20);
+    bus.addDevice(1, 0);
+    bus.addDevice(2, 0);
+    bus.getRover(1).setRefreshPeriod(GROUP_HISTORY, 1000);
+
+    // first cycle outside the count
+    while (sim.getRequestCount() < 10) {
+        bus.poll();
+        advanceMicros(100);
+    }
+
+    counting = true;
+    while (sim.getRequestCount() < 10 + POLLS) {
+        bus.poll();
+        advanceMicros(100);
+    }
+    counting = false;
+
+    char message[80];
+    snprintf(message, sizeof(message), "%lu requests, %lu dropped, %lu corrupted, %lu allocations",
+        sim.getRequestCount(), sim.getDroppedCount(), sim.getCorruptedCount(), allocations);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_GREATER_THAN(0, sim.getDroppedCount());
+    TEST_ASSERT_EQUAL_UINT32(0, allocations);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_hook_counts);
+    RUN_TEST(test_polling_does_not_allocate);
+    return UNITY_END();
+}
@@ -0,0 +1,435 @@
+/*
+    NoteWriter's output, character for character: request framing, string
+    escaping, fixed-point rounding of negatives and halves, and a buffer too
+    small at any length giving NULL without writing past its end. On glibc
+    every malloc in the process is counted, and building a note has to take
+    none. With note-c on the include path (pio test -e native_cjson) the same
+    controller-sized note is also built through cJSON, parsed back, and its
+    time, allocations and peak heap compared with NoteWriter's
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include <NoteWriter.h>
+
+#if __has_include(<note.h>)
+#include <note.h>
+#define HAVE_NOTE_C 1
+#endif
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define HAVE_HEAP_HOOK 1
+#endif
+
+static char buffer[2048];
+
+// Allocations and the most bytes outstanding at once since reset()
+struct HeapCount {
+    unsigned long allocations;
+    long bytes;
+    long peak;
+
+    void reset() {
+        allocations = 0;
+        bytes = 0;
+        peak = 0;
+    }
+    void allocated(size_t size) {
+        allocations++;
+        bytes += size;
+        peak = bytes > peak ? bytes : peak;
+    }
+    void freed(size_t size) {
+        bytes -= size;
+    }
+};
+
+// every malloc in the process, counted while counting is set
+static HeapCount process;
+static bool counting;
+
+#ifdef HAVE_HEAP_HOOK
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void __libc_free(void* pointer);
+
+void* malloc(size_t size) {
+    void* pointer = __libc_malloc(size);
+    if (counting && pointer != NULL) {
+        process.allocated(malloc_usable_size(pointer));
+    }
+    return pointer;
+}
+
+void* calloc(size_t count, size_t size) {
+    void* pointer = __libc_calloc(count, size);
+    if (counting && pointer != NULL) {
+        process.allocated(malloc_usable_size(pointer));
+    }
+    return pointer;
+}
+
+void* realloc(void* pointer, size_t size) {
+    if (counting && pointer != NULL) {
+        process.freed(malloc_usable_size(pointer));
+    }
+    void* moved = __libc_realloc(pointer, size);
+    if (counting && moved != NULL) {
+        process.allocated(malloc_usable_size(moved));
+    }
+    return moved;
+}
+
+void free(void* pointer) {
+    if (counting && pointer != NULL) {
+        process.freed(malloc_usable_size(pointer));
+    }
+    __libc_free(pointer);
+}
+}
+#endif
+
+static const char* writeOne(void (*add)(NoteWriter&)) {
+    NoteWriter note(buffer, sizeof(buffer));
+    note.begin("data.qo");
+    add(note);
+    return note.end();
+}
+
+// the body of a single fixed value, e.g. {"V":-0.1} for -0.05 to 1 decimal
+static void expectFixed(double value, uint8_t decimals, const char* expected) {
+    NoteWriter note(buffer, sizeof(buffer));
+    note.begin("data.qo");
+    note.addFixed("V", value, decimals);
+    TEST_ASSERT_NOT_NULL(note.end());
+    char body[128];
+    snprintf(body, sizeof(body), "{\"req\":\"note.add\",\"file\":\"data.qo\",\"body\":{\"V\":%s}}\n", expected);
+    TEST_ASSERT_EQUAL_STRING(body, buffer);
+}
+
+// about the size of a controller note: 72 fields, most of them scaled
+static const size_t FIELDS = 72;
+
+static void controllerNote(NoteWriter& note) {
+    note.begin("controller.qo");
+    note.addInt("Epoch", 1760000000);
+    note.addString("Name", "Site \"north\"");
+    for (size_t i = 0; i < FIELDS; i++) {
+        char key[24];
+        snprintf(key, sizeof(key), "Field%02u_1", (unsigned) i);
+        note.addFixed(key, -20.5 + i * 3.7, 1);
+    }
+    note.addBool("LoadOn", true);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_request_framing(void) {
+    NoteWriter note(buffer, sizeof(buffer));
+    note.begin("data.qo", true);
+    note.addInt("A", 1);
+    note.addBool("B", false);
+    note.beginArray("C");
+    note.itemInt(-2);
+    note.itemFixed(0.5, 1);
+    note.itemBool(true);
+    note.endArray();
+    note.beginArray("D");
+    note.endArray();
+    note.addString("E", "");
+    const char* text = note.end();
+    TEST_ASSERT_TRUE(text == buffer);
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"req\":\"note.add\",\"file\":\"data.qo\",\"sync\":true,"
+        "\"body\":{\"A\":1,\"B\":false,\"C\":[-2,0.5,true],\"D\":[],\"E\":\"\"}}\n", text);
+    TEST_ASSERT_EQUAL(strlen(text), note.length());
+    TEST_ASSERT_FALSE(note.overflowed());
+}
+
+void test_nesting(void) {
+    const char* text = writeOne([](NoteWriter& note) {
+        note.beginObject("Jobs");
+        note.beginObject("bus");
+        note.beginArray("poll");
+        note.itemInt(5);
+        note.beginItemArray();
+        note.itemInt(1);
+        note.itemInt(2);
+        note.endArray();
+        note.endArray();
+        note.endObject();
+        note.beginObject("web");
+        note.endObject();
+        note.endObject();
+        note.addInt("After", 1);
+    });
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"req\":\"note.add\",\"file\":\"data.qo\",\"body\":{"
+        "\"Jobs\":{\"bus\":{\"poll\":[5,[1,2]]},\"web\":{}},\"After\":1}}\n", text);
+
+    // a level deeper than MAX_DEPTH is refused rather than left open
+    NoteWriter note(buffer, sizeof(buffer));
+    note.begin("data.qo");
+    note.beginObject("A");
+    note.beginObject("B");
+    note.beginObject("C");
+    note.beginObject("D");
+    TEST_ASSERT_FALSE(note.overflowed());
+    note.beginObject("E");
+    TEST_ASSERT_TRUE(note.overflowed());
+    TEST_ASSERT_NULL(note.end());
+}
+
+void test_string_escaping(void) {
+    const char* text = writeOne([](NoteWriter& note) {
+        note.addString("quote\"key", "a\"b\\c/d\ne\rf\tg\x01h\x1f");
+        note.addString("UTF-8", "25\xc2\xb0" "C");
+    });
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"req\":\"note.add\",\"file\":\"data.qo\",\"body\":{"
+        "\"quote\\\"key\":\"a\\\"b\\\\c/d\\ne\\rf\\tg\\u0001h\\u001f\","
+        "\"UTF-8\":\"25\xc2\xb0" "C\"}}\n", text);
+}
+
+void test_integers(void) {
+    const char* text = writeOne([](NoteWriter& note) {
+        note.addInt("Zero", 0);
+        note.addInt("Minus", -1);
+        note.addInt("Max", INT64_MAX);
+        note.addInt("Min", INT64_MIN);
+    });
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"req\":\"note.add\",\"file\":\"data.qo\",\"body\":{\"Zero\":0,\"Minus\":-1,"
+        "\"Max\":9223372036854775807,\"Min\":-9223372036854775808}}\n", text);
+}
+
+void test_fixed_rounding(void) {
+    expectFixed(0, 2, "0.00");
+    expectFixed(12.3456, 2, "12.35");
+    expectFixed(-12.3456, 2, "-12.35");
+    expectFixed(9.96, 1, "10.0");
+    expectFixed(0.001, 4, "0.0010");
+    // halves go away from zero
+    expectFixed(1.25, 1, "1.3");
+    expectFixed(-1.25, 1, "-1.3");
+    expectFixed(-1.5, 0, "-2");
+    expectFixed(2.5, 0, "3");
+    // scaled first, then rounded: 2.675 * 100 is 267.5 as a double
+    expectFixed(2.675, 2, "2.68");
+    // negatives that round to zero carry no sign, those that do not keep it
+    // in front of a zero integer part
+    expectFixed(-0.04, 1, "0.0");
+    expectFixed(-0.05, 1, "-0.1");
+    expectFixed(-0.5, 1, "-0.5");
+    expectFixed(-0.0001, 4, "-0.0001");
+    expectFixed(-3.0, 0, "-3");
+}
+
+void test_fixed_not_a_number(void) {
+    expectFixed(NAN, 2, "null");
+    expectFixed(INFINITY, 1, "null");
+    expectFixed(-INFINITY, 0, "null");
+    // no int64 holds these scaled
+    expectFixed(1e30, 2, "null");
+    expectFixed(-1e16, 4, "null");
+    expectFixed(1e14, 4, "100000000000000.0000");
+}
+
+void test_overflow_returns_null(void) {
+    char full[2048];
+    NoteWriter reference(full, sizeof(full));
+    controllerNote(reference);
+    TEST_ASSERT_NOT_NULL(reference.end());
+    const size_t needed = reference.length() + 1;
+
+    // every size short of the text and its NUL, and none written past
+    char small[2048 + 8];
+    for (size_t size = 0; size <= needed; size++) {
+        memset(small, '#', sizeof(small));
+        NoteWriter note(small, size);
+        controllerNote(note);
+        const char* text = note.end();
+        if (size < needed) {
+            TEST_ASSERT_NULL(text);
+            TEST_ASSERT_TRUE(note.overflowed());
+        }
+        else {
+            TEST_ASSERT_EQUAL_STRING(full, text);
+        }
+        for (size_t i = size; i < sizeof(small); i++) {
+            TEST_ASSERT_EQUAL_INT('#', small[i]);
+        }
+    }
+
+    // begin() starts over on the same buffer
+    NoteWriter reused(small, 64);
+    controllerNote(reused);
+    TEST_ASSERT_NULL(reused.end());
+    TEST_ASSERT_TRUE(reused.overflowed());
+    reused.begin("a.qo");
+    TEST_ASSERT_EQUAL_STRING("{\"req\":\"note.add\",\"file\":\"a.qo\",\"body\":{}}\n", reused.end());
+}
+
+#ifdef HAVE_HEAP_HOOK
+
+void test_no_heap(void) {
+    process.reset();
+    counting = true;
+    for (int i = 0; i < 100; i++) {
+        NoteWriter note(buffer, sizeof(buffer));
+        controllerNote(note);
+        TEST_ASSERT_NOT_NULL(note.end());
+    }
+    counting = false;
+    char message[96];
+    snprintf(message, sizeof(message), "NoteWriter: %lu allocations and %ld bytes peak heap for 100 notes",
+        process.allocations, process.peak);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_EQUAL_UINT32(0, process.allocations);
+    TEST_ASSERT_EQUAL_INT(0, process.peak);
+}
+
+#endif
+
+#ifdef HAVE_NOTE_C
+
+// what note-c allocates through its hooks, each block behind its size
+static HeapCount notec;
+
+static void* countingMalloc(size_t size) {
+    size_t* block = (size_t*) malloc(sizeof(size_t) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    *block = size;
+    notec.allocated(size);
+    return block + 1;
+}
+
+static void countingFree(void* pointer) {
+    if (pointer == NULL) {
+        return;
+    }
+    size_t* block = (size_t*) pointer - 1;
+    notec.freed(*block);
+    free(block);
+}
+
+static void delayMs(uint32_t ms) {
+    delay(ms);
+}
+
+static uint32_t getMs(void) {
+    return millis();
+}
+
+static J* cjsonNote() {
+    J* req = JCreateObject();
+    JAddStringToObject(req, "req", "note.add");
+    JAddStringToObject(req, "file", "controller.qo");
+    J* body = JAddObjectToObject(req, "body");
+    JAddNumberToObject(body, "Epoch", 1760000000);
+    JAddStringToObject(body, "Name", "Site \"north\"");
+    for (size_t i = 0; i < FIELDS; i++) {
+        char key[24];
+        snprintf(key, sizeof(key), "Field%02u_1", (unsigned) i);
+        JAddNumberToObject(body, key, round((-20.5 + i * 3.7) * 10) / 10);
+    }
+    JAddBoolToObject(body, "LoadOn", true);
+    return req;
+}
+
+void test_compare_with_cjson(void) {
+    NoteSetFnDefault(countingMalloc, countingFree, delayMs, getMs);
+
+    // NoteWriter's text has to parse back to the values cJSON was given
+    NoteWriter note(buffer, sizeof(buffer));
+    controllerNote(note);
+    TEST_ASSERT_NOT_NULL(note.end());
+    J* parsed = JParse(buffer);
+    TEST_ASSERT_NOT_NULL(parsed);
+    J* body = JGetObject(parsed, "body");
+    TEST_ASSERT_EQUAL_STRING("Site \"north\"", JGetString(body, "Name"));
+    for (size_t i = 0; i < FIELDS; i++) {
+        char key[24];
+        snprintf(key, sizeof(key), "Field%02u_1", (unsigned) i);
+        TEST_ASSERT_DOUBLE_WITHIN(1e-9, round((-20.5 + i * 3.7) * 10) / 10, JGetNumber(body, key));
+    }
+    JDelete(parsed);
+
+    // each path is counted by note-c's hooks and, where there is one, by the
+    // process-wide malloc hook
+    const int rounds = 2000;
+    size_t cjsonLength = 0;
+    notec.reset();
+    process.reset();
+    counting = true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        J* req = cjsonNote();
+        char* text = JPrintUnformatted(req);
+        cjsonLength = strlen(text);
+        JFree(text);
+        JDelete(req);
+    }
+    double cjsonMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+    counting = false;
+    HeapCount cjsonHeap = notec;
+    HeapCount cjsonProcess = process;
+
+    notec.reset();
+    process.reset();
+    counting = true;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        NoteWriter writer(buffer, sizeof(buffer));
+        controllerNote(writer);
+        TEST_ASSERT_NOT_NULL(writer.end());
+    }
+    double writerMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+    counting = false;
+    HeapCount writerHeap = notec;
+    HeapCount writerProcess = process;
+
+    char message[320];
+    snprintf(message, sizeof(message),
+        "%u fields: cJSON %.2f us, %.0f allocations, %ld bytes peak heap and %u bytes per note; "
+        "NoteWriter %.2f us, %lu allocations, %ld bytes peak heap and %u bytes (malloc hook: cJSON %lu, NoteWriter %lu allocations)",
+        (unsigned) FIELDS, cjsonMicros, (double) cjsonHeap.allocations / rounds, cjsonHeap.peak, (unsigned) cjsonLength,
+        writerMicros, writerHeap.allocations, writerHeap.peak, (unsigned) note.length(),
+        cjsonProcess.allocations, writerProcess.allocations);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_GREATER_THAN(FIELDS, cjsonHeap.allocations / rounds);
+    TEST_ASSERT_EQUAL_UINT32(0, writerHeap.allocations);
+    TEST_ASSERT_EQUAL_INT(0, writerHeap.peak);
+    TEST_ASSERT_EQUAL_UINT32(0, writerProcess.allocations);
+    TEST_ASSERT_EQUAL_INT(0, writerProcess.peak);
+}
+
+#endif
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_request_framing);
+    RUN_TEST(test_nesting);
+    RUN_TEST(test_string_escaping);
+    RUN_TEST(test_integers);
+    RUN_TEST(test_fixed_rounding);
+    RUN_TEST(test_fixed_not_a_number);
+    RUN_TEST(test_overflow_returns_null);
+#ifdef HAVE_HEAP_HOOK
+    RUN_TEST(test_no_heap);
+#endif
+#ifdef HAVE_NOTE_C
+    RUN_TEST(test_compare_with_cjson);
+#endif
+    return UNITY_END();
+}
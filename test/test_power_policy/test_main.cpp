@@ -0,0 +1,167 @@
+/*
+    PowerPolicy's sleep decisions at the edges of its thresholds, and the
+    duty cycle kept across light sleeps and a simulated deep sleep
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <PowerPolicy.h>
+
+static const int64_t SECOND = 1000000;
+// the default deep lead, 30 s
+static const int64_t DEEP_LEAD = 30 * SECOND;
+
+// idle, ready for a restart, and nothing due for an hour
+static PowerPolicy::State idleState(int64_t now) {
+    PowerPolicy::State state;
+    state.now = now;
+    state.nextDeadline = now + 3600 * SECOND;
+    state.idle = true;
+    state.deepDeadline = now + 3600 * SECOND;
+    state.deepReady = true;
+    return state;
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_awake_mode_never_sleeps(void) {
+    PowerPolicy policy;
+    PowerPolicy::Plan plan = policy.decide(idleState(0));
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::STAY_AWAKE, plan.action);
+    TEST_ASSERT_EQUAL_INT64(0, plan.sleepUs);
+}
+
+void test_busy_never_sleeps(void) {
+    PowerPolicy policy;
+    policy.setMode(PowerPolicy::MODE_DEEP);
+    PowerPolicy::State state = idleState(0);
+    state.idle = false;
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::STAY_AWAKE, policy.decide(state).action);
+}
+
+void test_light_sleep_threshold(void) {
+    PowerPolicy policy;
+    policy.setMode(PowerPolicy::MODE_LIGHT);
+    PowerPolicy::State state = idleState(5 * SECOND);
+
+    // the gap less the wake-up lead has to reach LIGHT_MIN_US
+    state.nextDeadline = state.now + PowerPolicy::LIGHT_MIN_US + PowerPolicy::LIGHT_LEAD_US - 1;
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::STAY_AWAKE, policy.decide(state).action);
+
+    state.nextDeadline += 1;
+    PowerPolicy::Plan plan = policy.decide(state);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::LIGHT_SLEEP, plan.action);
+    TEST_ASSERT_EQUAL_INT64(PowerPolicy::LIGHT_MIN_US, plan.sleepUs);
+
+    // a deadline already passed is not slept through
+    state.nextDeadline = state.now - 1000;
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::STAY_AWAKE, policy.decide(state).action);
+}
+
+void test_light_mode_never_deep_sleeps(void) {
+    PowerPolicy policy;
+    policy.setMode(PowerPolicy::MODE_LIGHT);
+    PowerPolicy::State state = idleState(0);
+    PowerPolicy::Plan plan = policy.decide(state);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::LIGHT_SLEEP, plan.action);
+    TEST_ASSERT_EQUAL_INT64(3600 * SECOND - PowerPolicy::LIGHT_LEAD_US, plan.sleepUs);
+}
+
+void test_deep_sleep_threshold_with_lead(void) {
+    PowerPolicy policy;
+    policy.setMode(PowerPolicy::MODE_DEEP);
+    PowerPolicy::State state = idleState(7 * SECOND);
+    state.nextDeadline = state.now + 500000;
+
+    // the gap less the deep lead has to reach DEEP_MIN_US, short of that
+    // the device light sleeps to the next deadline instead
+    state.deepDeadline = state.now + PowerPolicy::DEEP_MIN_US + DEEP_LEAD - 1;
+    PowerPolicy::Plan plan = policy.decide(state);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::LIGHT_SLEEP, plan.action);
+    TEST_ASSERT_EQUAL_INT64(500000 - PowerPolicy::LIGHT_LEAD_US, plan.sleepUs);
+
+    state.deepDeadline += 1;
+    plan = policy.decide(state);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::DEEP_SLEEP, plan.action);
+    TEST_ASSERT_EQUAL_INT64(PowerPolicy::DEEP_MIN_US, plan.sleepUs);
+
+    // a longer lead moves the threshold out by the difference
+    policy.setDeepLead(45000);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::LIGHT_SLEEP, policy.decide(state).action);
+    state.deepDeadline += 15 * SECOND;
+    plan = policy.decide(state);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::DEEP_SLEEP, plan.action);
+    TEST_ASSERT_EQUAL_INT64(PowerPolicy::DEEP_MIN_US, plan.sleepUs);
+}
+
+void test_deep_sleep_needs_deep_ready(void) {
+    PowerPolicy policy;
+    policy.setMode(PowerPolicy::MODE_DEEP);
+    PowerPolicy::State state = idleState(0);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::DEEP_SLEEP, policy.decide(state).action);
+
+    // e.g. running statistics held in RAM, only a light sleep is safe
+    state.deepReady = false;
+    PowerPolicy::Plan plan = policy.decide(state);
+    TEST_ASSERT_EQUAL_INT(PowerPolicy::LIGHT_SLEEP, plan.action);
+    TEST_ASSERT_EQUAL_INT64(3600 * SECOND - PowerPolicy::LIGHT_LEAD_US, plan.sleepUs);
+}
+
+void test_duty_cycle_counts_light_sleeps(void) {
+    PowerPolicy policy;
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 1.0, policy.getDutyCycle(0));
+
+    // 10 s since boot, 7.5 s of it in light sleeps
+    policy.addSleep(5 * SECOND);
+    policy.addSleep(5 * SECOND / 2);
+    TEST_ASSERT_EQUAL_UINT64(5 * SECOND / 2, policy.getAwakeMicros(10 * SECOND));
+    TEST_ASSERT_EQUAL_UINT64(15 * SECOND / 2, policy.getAsleepMicros());
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 0.25, policy.getDutyCycle(10 * SECOND));
+}
+
+void test_duty_cycle_survives_deep_sleep(void) {
+    // first boot: awake 4 s of 10, then deep sleeps 50 s, keeping the totals
+    // the way deepSleep() does in RTC memory
+    PowerPolicy before;
+    before.setMode(PowerPolicy::MODE_DEEP);
+    before.addSleep(6 * SECOND);
+    int64_t now = 10 * SECOND;
+    uint64_t rtcAwake = before.getAwakeMicros(now);
+    uint64_t rtcAsleep = before.getAsleepMicros() + 50 * SECOND;
+    TEST_ASSERT_EQUAL_UINT64(4 * SECOND, rtcAwake);
+    TEST_ASSERT_EQUAL_UINT64(56 * SECOND, rtcAsleep);
+
+    // after the restart the local clock starts again from 0
+    PowerPolicy after;
+    after.restore(rtcAwake, rtcAsleep);
+    TEST_ASSERT_EQUAL_UINT64(4 * SECOND, after.getAwakeMicros(0));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 4.0 / 60, after.getDutyCycle(0));
+
+    // 2 s awake then 2 s light asleep in the new boot
+    after.addSleep(2 * SECOND);
+    TEST_ASSERT_EQUAL_UINT64(6 * SECOND, after.getAwakeMicros(4 * SECOND));
+    TEST_ASSERT_EQUAL_UINT64(58 * SECOND, after.getAsleepMicros());
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, 6.0 / 64, after.getDutyCycle(4 * SECOND));
+
+    // restore() also drops this boot's sleeps, for a second deep sleep
+    after.restore(after.getAwakeMicros(4 * SECOND), after.getAsleepMicros() + 10 * SECOND);
+    TEST_ASSERT_EQUAL_UINT64(68 * SECOND, after.getAsleepMicros());
+    TEST_ASSERT_EQUAL_UINT64(6 * SECOND, after.getAwakeMicros(0));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_awake_mode_never_sleeps);
+    RUN_TEST(test_busy_never_sleeps);
+    RUN_TEST(test_light_sleep_threshold);
+    RUN_TEST(test_light_mode_never_deep_sleeps);
+    RUN_TEST(test_deep_sleep_threshold_with_lead);
+    RUN_TEST(test_deep_sleep_needs_deep_ready);
+    RUN_TEST(test_duty_cycle_counts_light_sleeps);
+    RUN_TEST(test_duty_cycle_survives_deep_sleep);
+    return UNITY_END();
+}
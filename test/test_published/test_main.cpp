@@ -0,0 +1,151 @@
+/*
+    Published under a writer thread publishing as fast as it can and several
+    reader threads copying at the same time: no copy may mix two values
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <thread>
+#include <Published.h>
+
+static const uint32_t PUBLISHES = 2000000;
+static const int READERS = 3;
+
+// every word holds the same number, a torn copy has two different ones;
+// the odd size leaves a partial last word
+struct Value {
+    uint32_t words[61];
+    uint8_t tail[3];
+};
+
+static void fill(Value* value, uint32_t number) {
+    for (size_t i = 0; i < sizeof(value->words) / sizeof(value->words[0]); i++) {
+        value->words[i] = number;
+    }
+    memset(value->tail, (uint8_t) number, sizeof(value->tail));
+}
+
+static bool consistent(const Value& value) {
+    for (size_t i = 1; i < sizeof(value.words) / sizeof(value.words[0]); i++) {
+        if (value.words[i] != value.words[0]) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < sizeof(value.tail); i++) {
+        if (value.tail[i] != (uint8_t) value.words[0]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static Published<Value> published;
+
+struct ReaderResult {
+    unsigned long reads;
+    unsigned long torn;
+    unsigned long wrongVersion;
+    unsigned long backwards;
+};
+
+static void reader(std::atomic<bool>* done, ReaderResult* result) {
+    uint32_t last = 0;
+    Value value;
+    while (!done->load(std::memory_order_acquire)) {
+        uint32_t version = published.read(&value);
+        if (version == 0) {
+            continue;
+        }
+        result->reads++;
+        if (!consistent(value)) {
+            result->torn++;
+        } else if (value.words[0] != version) {
+            // the writer publishes number n as version n
+            result->wrongVersion++;
+        }
+        if (version < last) {
+            result->backwards++;
+        }
+        last = version;
+    }
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_nothing_published(void) {
+    Published<Value> empty;
+    Value value;
+    fill(&value, 7);
+    TEST_ASSERT_EQUAL_UINT32(0, empty.read(&value));
+    TEST_ASSERT_EQUAL_UINT32(7, value.words[0]);
+    TEST_ASSERT_EQUAL_UINT32(ULONG_MAX, empty.getAgeMillis());
+}
+
+void test_versions_and_age(void) {
+    Published<Value> single;
+    Value value;
+    fill(&value, 1);
+    single.publish(value);
+    advanceMicros(250000);
+    fill(&value, 2);
+    single.publish(value);
+    advanceMicros(40000);
+
+    Value copy;
+    TEST_ASSERT_EQUAL_UINT32(2, single.read(&copy));
+    TEST_ASSERT_EQUAL_UINT32(2, single.getVersion());
+    TEST_ASSERT_TRUE(consistent(copy));
+    TEST_ASSERT_EQUAL_UINT32(2, copy.words[0]);
+    TEST_ASSERT_EQUAL_UINT32(40, single.getAgeMillis());
+}
+
+void test_readers_never_see_torn_values(void) {
+    std::atomic<bool> done(false);
+    ReaderResult results[READERS];
+    memset(results, 0, sizeof(results));
+    std::thread readers[READERS];
+    for (int i = 0; i < READERS; i++) {
+        readers[i] = std::thread(reader, &done, &results[i]);
+    }
+
+    Value value;
+    for (uint32_t number = 1; number <= PUBLISHES; number++) {
+        fill(&value, number);
+        published.publish(value);
+    }
+    done.store(true, std::memory_order_release);
+    for (int i = 0; i < READERS; i++) {
+        readers[i].join();
+    }
+
+    ReaderResult total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < READERS; i++) {
+        total.reads += results[i].reads;
+        total.torn += results[i].torn;
+        total.wrongVersion += results[i].wrongVersion;
+        total.backwards += results[i].backwards;
+    }
+    char message[96];
+    snprintf(message, sizeof(message), "%u publishes, %lu reads, %lu torn, %lu wrong version, %lu backwards",
+        (unsigned) PUBLISHES, total.reads, total.torn, total.wrongVersion, total.backwards);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_GREATER_THAN(0, total.reads);
+    TEST_ASSERT_EQUAL_UINT32(0, total.torn);
+    TEST_ASSERT_EQUAL_UINT32(0, total.wrongVersion);
+    TEST_ASSERT_EQUAL_UINT32(0, total.backwards);
+    TEST_ASSERT_EQUAL_UINT32(PUBLISHES, published.getVersion());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_nothing_published);
+    RUN_TEST(test_versions_and_age);
+    RUN_TEST(test_readers_never_see_torn_values);
+    return UNITY_END();
+}
@@ -0,0 +1,471 @@
+/*
+    RenogyRover and RoverBus against RenogyRoverSim on the simulated clock:
+    frames on the wire, decoding of the 0x0100 - 0x0122 window, and the
+    bus's timing under reply latency, dropped requests and CRC errors
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <RenogyRover.h>
+#include <RenogyRoverSim.h>
+#include <RoverBus.h>
+
+// 11 bits per character at 9600 baud, as the simulator times them
+static const unsigned long CHAR_MICROS = 11000000UL / 9600;
+// 0x0100 - 0x0121 in one read: id, function, count, 34 registers, crc
+static const unsigned long WINDOW_REPLY = 5 + 2 * 34;
+
+// Passes everything through to the simulator and keeps a copy of both
+// directions, so tests can check the frames byte for byte
+class TapStream : public Stream {
+    public:
+        TapStream(Stream& inner) : sentLength(0), receivedLength(0), _inner(inner) {}
+
+        size_t write(uint8_t value) {
+            if (sentLength < sizeof(sent)) {
+                sent[sentLength++] = value;
+            }
+            return _inner.write(value);
+        }
+        using Print::write;
+        int available() {
+            return _inner.available();
+        }
+        int read() {
+            int value = _inner.read();
+            if (value >= 0 && receivedLength < sizeof(received)) {
+                received[receivedLength++] = value;
+            }
+            return value;
+        }
+        int peek() {
+            return _inner.peek();
+        }
+        void clear() {
+            sentLength = 0;
+            receivedLength = 0;
+        }
+
+        uint8_t sent[64];
+        size_t sentLength;
+        uint8_t received[160];
+        size_t receivedLength;
+
+    private:
+        Stream& _inner;
+};
+
+// Answers any request with one fixed frame, for replies the simulator
+// would never send
+class CannedStream : public Stream {
+    public:
+        CannedStream(const uint8_t* frame, size_t length) : _frame(frame), _length(length), _read(length) {}
+
+        size_t write(uint8_t value) {
+            (void) value;
+            _read = 0;
+            return 1;
+        }
+        using Print::write;
+        int available() {
+            return _length - _read;
+        }
+        int read() {
+            return _read < _length ? _frame[_read++] : -1;
+        }
+        int peek() {
+            return _read < _length ? _frame[_read] : -1;
+        }
+
+    private:
+        const uint8_t* _frame;
+        size_t _length;
+        size_t _read;
+};
+
+// Loses whole requests on their way to the simulator while dropNext is set
+class LossyStream : public Stream {
+    public:
+        LossyStream(Stream& inner) : dropNext(0), _inner(inner), _written(0), _dropping(false) {}
+
+        size_t write(uint8_t value) {
+            // every request is 8 bytes
+            if (_written++ % 8 == 0 && dropNext > 0) {
+                dropNext--;
+                _dropping = true;
+            } else if (_written % 8 == 1) {
+                _dropping = false;
+            }
+            return _dropping ? 1 : _inner.write(value);
+        }
+        using Print::write;
+        int available() {
+            return _inner.available();
+        }
+        int read() {
+            return _inner.read();
+        }
+        int peek() {
+            return _inner.peek();
+        }
+
+        uint8_t dropNext;
+
+    private:
+        Stream& _inner;
+        unsigned long _written;
+        bool _dropping;
+};
+
+// runs the bus on the simulated clock until ms have passed
+static void runBus(RoverBus& bus, unsigned long ms) {
+    unsigned long end = millis() + ms;
+    while (millis() < end) {
+        bus.poll();
+        yield();
+    }
+}
+
+void setUp(void) {
+    advanceMicros(1000000);
+}
+
+void tearDown(void) {
+}
+
+void test_read_frames_match_modbus(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    sim.setRegister(1, 0x0120, 0x8205);
+    sim.setRegister(1, 0x0121, 0x7FFF);
+    TapStream tap(sim);
+    ModbusRtuMaster master;
+    master.begin(1, tap);
+
+    master.readHoldingRegisters(0x0100, 1, NULL, NULL);
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, master.waitIdle());
+    const uint8_t socRequest[] = { 0x01, 0x03, 0x01, 0x00, 0x00, 0x01, 0x85, 0xF6 };
+    const uint8_t socReply[] = { 0x01, 0x03, 0x02, 0x00, 0x57, 0xF9, 0xBA };
+    TEST_ASSERT_EQUAL(sizeof(socRequest), tap.sentLength);
+    TEST_ASSERT_EQUAL_MEMORY(socRequest, tap.sent, sizeof(socRequest));
+    TEST_ASSERT_EQUAL(sizeof(socReply), tap.receivedLength);
+    TEST_ASSERT_EQUAL_MEMORY(socReply, tap.received, sizeof(socReply));
+    TEST_ASSERT_EQUAL_UINT16(87, master.getResponseBuffer(0));
+
+    tap.clear();
+    master.readHoldingRegisters(0x0120, 2, NULL, NULL);
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, master.waitIdle());
+    const uint8_t stateRequest[] = { 0x01, 0x03, 0x01, 0x20, 0x00, 0x02, 0xC4, 0x3D };
+    const uint8_t stateReply[] = { 0x01, 0x03, 0x04, 0x82, 0x05, 0x7F, 0xFF, 0xA2, 0x3A };
+    TEST_ASSERT_EQUAL_MEMORY(stateRequest, tap.sent, sizeof(stateRequest));
+    TEST_ASSERT_EQUAL(sizeof(stateReply), tap.receivedLength);
+    TEST_ASSERT_EQUAL_MEMORY(stateReply, tap.received, sizeof(stateReply));
+}
+
+void test_whole_window_reads_back(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    for (uint16_t address = 0x0100; address <= 0x0122; address++) {
+        sim.setRegister(1, address, 0x1000 + address * 7);
+    }
+    ModbusRtuMaster master;
+    master.begin(1, sim);
+
+    master.readHoldingRegisters(0x0100, 0x23, NULL, NULL);
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, master.waitIdle());
+    for (uint8_t i = 0; i < 0x23; i++) {
+        TEST_ASSERT_EQUAL_UINT16(0x1000 + (0x0100 + i) * 7, master.getResponseBuffer(i));
+    }
+    TEST_ASSERT_EQUAL_UINT16(0xFFFF, master.getResponseBuffer(0x23));
+}
+
+void test_snapshot_decodes_every_register(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    // signed magnitude temperatures, -5 C controller and 12 C battery
+    sim.setRegister(1, 0x0103, 0x850C);
+    // street light on at brightness 2, floating
+    sim.setRegister(1, 0x0120, 0x8205);
+    // the reserved top bit is masked off the faults
+    sim.setRegister(1, 0x0121, 0xFFFF);
+    sim.setRegister(1, 0x0118, 0x0002);
+    sim.setRegister(1, 0x0119, 0x0003);
+    RenogyRover rover(1);
+    rover.begin(sim);
+
+    RoverSnapshot snapshot;
+    TEST_ASSERT_EQUAL_INT(1, rover.getSnapshot(&snapshot));
+    TEST_ASSERT_EQUAL_INT(87, snapshot.battery.stateOfCharge);
+    TEST_ASSERT_EQUAL_INT(132, snapshot.battery.batteryVoltage.raw);
+    TEST_ASSERT_EQUAL_INT(412, snapshot.battery.chargingCurrent.raw);
+    TEST_ASSERT_EQUAL_INT(-5, snapshot.battery.controllerTemperature);
+    TEST_ASSERT_EQUAL_INT(12, snapshot.battery.batteryTemperature);
+    TEST_ASSERT_EQUAL_INT(131, snapshot.load.voltage.raw);
+    TEST_ASSERT_EQUAL_INT(85, snapshot.load.current.raw);
+    TEST_ASSERT_EQUAL_INT(11, snapshot.load.power);
+    TEST_ASSERT_EQUAL_INT(186, snapshot.panel.voltage.raw);
+    TEST_ASSERT_EQUAL_INT(301, snapshot.panel.current.raw);
+    TEST_ASSERT_EQUAL_INT(56, snapshot.panel.chargingPower);
+    TEST_ASSERT_TRUE(snapshot.load.active);
+    TEST_ASSERT_EQUAL_INT(124, snapshot.day.batteryVoltageMinForDay.raw);
+    TEST_ASSERT_EQUAL_INT(141, snapshot.day.batteryVoltageMaxForDay.raw);
+    TEST_ASSERT_EQUAL_INT(598, snapshot.day.maxChargeCurrentForDay.raw);
+    TEST_ASSERT_EQUAL_INT(120, snapshot.day.maxDischargeCurrentForDay.raw);
+    TEST_ASSERT_EQUAL_INT(82, snapshot.day.maxChargePowerForDay);
+    TEST_ASSERT_EQUAL_INT(16, snapshot.day.maxDischargePowerForDay);
+    TEST_ASSERT_EQUAL_INT(21, snapshot.day.chargingAmpHoursForDay);
+    TEST_ASSERT_EQUAL_INT(6, snapshot.day.dischargingAmpHoursForDay);
+    TEST_ASSERT_EQUAL_INT(275, snapshot.day.powerGenerationForDay);
+    TEST_ASSERT_EQUAL_INT(74, snapshot.day.powerConsumptionForDay);
+    TEST_ASSERT_EQUAL_INT(412, snapshot.hist.operatingDays);
+    TEST_ASSERT_EQUAL_INT(3, snapshot.hist.batOverDischarges);
+    TEST_ASSERT_EQUAL_INT(288, snapshot.hist.batFullCharges);
+    TEST_ASSERT_EQUAL_INT(0x00020003, snapshot.hist.batChargingAmpHours);
+    TEST_ASSERT_EQUAL_INT(2480, snapshot.hist.batDischargingAmpHours);
+    TEST_ASSERT_EQUAL_INT(65536 + 45100, snapshot.hist.powerGenerated.raw);
+    TEST_ASSERT_FLOAT_WITHIN(1e-9, 11.0636, snapshot.hist.powerGenerated.toDouble());
+    TEST_ASSERT_EQUAL_INT(32400, snapshot.hist.powerConsumed.raw);
+    TEST_ASSERT_EQUAL_INT(1, snapshot.charging.streetLightState);
+    TEST_ASSERT_EQUAL_INT(2, snapshot.charging.streetLightBrightness);
+    TEST_ASSERT_EQUAL_INT(FLOATING, snapshot.charging.chargingMode);
+    TEST_ASSERT_EQUAL_INT(0x7FFF, snapshot.errors);
+
+    // the whole window is one transaction, 8 bytes out and the reply back
+    TEST_ASSERT_EQUAL_UINT32(1, rover.getTransactionCount());
+    TEST_ASSERT_EQUAL_UINT32(8 + WINDOW_REPLY, rover.getBytesTransferred());
+}
+
+void test_reply_time_follows_latency(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    RenogyRover rover(1);
+    rover.begin(sim);
+
+    unsigned long latencies[] = { 0, 20, 150 };
+    for (unsigned long latency : latencies) {
+        sim.setResponseLatency(latency);
+        rover.invalidateCache();
+        rover.getModbusClient().waitIdle();
+        // past the master's inter-frame gap, so the request goes out at once
+        advanceMicros(10000);
+
+        RoverSnapshot snapshot;
+        unsigned long start = micros();
+        TEST_ASSERT_EQUAL_INT(1, rover.getSnapshot(&snapshot));
+        unsigned long elapsed = micros() - start;
+
+        // last request character, the latency, then the reply on the wire
+        unsigned long wire = CHAR_MICROS + latency * 1000 + WINDOW_REPLY * CHAR_MICROS;
+        TEST_ASSERT_GREATER_OR_EQUAL(wire - CHAR_MICROS, elapsed);
+        TEST_ASSERT_LESS_THAN(wire + 200, elapsed);
+    }
+}
+
+void test_dropped_request_times_out(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    sim.setDropRate(100);
+    RenogyRover rover(1);
+    rover.begin(sim);
+    rover.getModbusClient().setResponseTimeout(300);
+
+    RoverSnapshot snapshot;
+    unsigned long start = millis();
+    TEST_ASSERT_EQUAL_INT(0, rover.getSnapshot(&snapshot));
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBResponseTimedOut, rover.getLastModbusErrorCode());
+    // the inter-frame gap after begin(), then the timeout
+    TEST_ASSERT_UINT32_WITHIN(2, 4 + 301, millis() - start);
+    TEST_ASSERT_EQUAL_UINT32(1, sim.getDroppedCount());
+    // failed groups read as zero rather than keeping stale values
+    TEST_ASSERT_EQUAL_INT(0, snapshot.battery.batteryVoltage.raw);
+    TEST_ASSERT_EQUAL_INT(UNDEFINED, snapshot.charging.chargingMode);
+}
+
+void test_corrupted_reply_is_crc_error(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    sim.setCrcErrorRate(100);
+    RenogyRover rover(1);
+    rover.begin(sim);
+
+    RoverSnapshot snapshot;
+    TEST_ASSERT_EQUAL_INT(0, rover.getSnapshot(&snapshot));
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBInvalidCRC, rover.getLastModbusErrorCode());
+    TEST_ASSERT_EQUAL_UINT32(1, sim.getCorruptedCount());
+
+    sim.setCrcErrorRate(0);
+    TEST_ASSERT_EQUAL_INT(1, rover.getSnapshot(&snapshot));
+    TEST_ASSERT_EQUAL_INT(132, snapshot.battery.batteryVoltage.raw);
+}
+
+void test_reply_for_other_quantity_is_rejected(void) {
+    // a good frame with one register, as a late reply to an earlier read
+    const uint8_t reply[] = { 0x01, 0x03, 0x02, 0x00, 0x57, 0xF9, 0xBA };
+    CannedStream stream(reply, sizeof(reply));
+    ModbusRtuMaster master;
+    master.begin(1, stream);
+
+    master.readHoldingRegisters(0x0100, 2, NULL, NULL);
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBInvalidByteCount, master.waitIdle());
+    TEST_ASSERT_EQUAL_UINT16(0xFFFF, master.getResponseBuffer(0));
+
+    master.readHoldingRegisters(0x0100, 1, NULL, NULL);
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, master.waitIdle());
+    TEST_ASSERT_EQUAL_UINT16(87, master.getResponseBuffer(0));
+}
+
+void test_failed_range_keeps_other_groups(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    LossyStream lossy(sim);
+    RenogyRover rover(1);
+    rover.begin(lossy);
+    rover.getModbusClient().setResponseTimeout(300);
+    rover.setRefreshPeriod(GROUP_DAY, 60000);
+    rover.setRefreshPeriod(GROUP_HISTORY, 60000);
+
+    RoverSnapshot snapshot;
+    TEST_ASSERT_EQUAL_INT(1, rover.getSnapshot(&snapshot));
+    TEST_ASSERT_EQUAL_UINT32(1, rover.getTransactionCount());
+
+    // live and state are stale and too far apart to merge, two reads, the
+    // first of which is lost
+    sim.setRegister(1, 0x0120, 5);
+    lossy.dropNext = 1;
+    TEST_ASSERT_EQUAL_INT(0, rover.getSnapshot(&snapshot));
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBResponseTimedOut, rover.getLastModbusErrorCode());
+    TEST_ASSERT_EQUAL_UINT32(3, rover.getTransactionCount());
+    TEST_ASSERT_EQUAL_INT(0, snapshot.battery.batteryVoltage.raw);
+    TEST_ASSERT_EQUAL_INT(141, snapshot.day.batteryVoltageMaxForDay.raw);
+    TEST_ASSERT_EQUAL_INT(412, snapshot.hist.operatingDays);
+    TEST_ASSERT_EQUAL_INT(FLOATING, snapshot.charging.chargingMode);
+
+    // only the group that failed is read again
+    TEST_ASSERT_EQUAL_INT(1, rover.getSnapshot(&snapshot));
+    TEST_ASSERT_EQUAL_UINT32(5, rover.getTransactionCount());
+    TEST_ASSERT_EQUAL_INT(132, snapshot.battery.batteryVoltage.raw);
+}
+
+// counts RoverBus callbacks per device
+static unsigned long busPolls[RoverBus::MAX_DEVICES];
+static unsigned long busSuccesses[RoverBus::MAX_DEVICES];
+
+static void countSnapshot(uint8_t index, int success, const RoverSnapshot* snapshot) {
+    (void) snapshot;
+    busPolls[index]++;
+    if (success) {
+        busSuccesses[index]++;
+    }
+}
+
+void test_bus_retries_lossy_link(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    sim.setSeed(12345);
+    sim.setDropRate(10);
+    sim.setCrcErrorRate(10);
+    RoverBus bus;
+    bus.begin(sim);
+    bus.setResponseTimeout(200);
+    bus.addDevice(1, 1000);
+    memset(busPolls, 0, sizeof(busPolls));
+    memset(busSuccesses, 0, sizeof(busSuccesses));
+    bus.onSnapshot(countSnapshot);
+
+    runBus(bus, 200000);
+
+    char message[96];
+    snprintf(message, sizeof(message), "%lu polls, %lu ok, %lu requests, %lu dropped, %lu corrupted",
+        busPolls[0], busSuccesses[0], sim.getRequestCount(), sim.getDroppedCount(), sim.getCorruptedCount());
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_GREATER_THAN(0, sim.getDroppedCount());
+    TEST_ASSERT_GREATER_THAN(0, sim.getCorruptedCount());
+    // every lost request is retried within the same poll
+    TEST_ASSERT_EQUAL_UINT32(sim.getRequestCount() - sim.getDroppedCount() - sim.getCorruptedCount(),
+        busSuccesses[0]);
+    TEST_ASSERT_GREATER_OR_EQUAL(busPolls[0] * 98 / 100, busSuccesses[0]);
+    TEST_ASSERT_FALSE(bus.isBreakerOpen(0));
+}
+
+void test_bus_retries_back_off(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    sim.setDropRate(100);
+    RoverBus bus;
+    bus.begin(sim);
+    bus.setResponseTimeout(50);
+    bus.addDevice(1, 60000);
+
+    // time each request goes out, and when its timeout fires
+    unsigned long sentAt[3];
+    unsigned long failedAt[3];
+    uint8_t sent = 0;
+    uint8_t failed = 0;
+    unsigned long end = millis() + 1000;
+    while (millis() < end) {
+        unsigned long requests = sim.getRequestCount();
+        bool busy = bus.getIdleMillis() == 0 && sent > failed;
+        bus.poll();
+        if (sim.getRequestCount() != requests && sent < 3) {
+            sentAt[sent++] = micros();
+        }
+        if (busy && bus.getIdleMillis() != 0 && failed < 3) {
+            failedAt[failed++] = micros();
+        }
+        yield();
+    }
+    TEST_ASSERT_EQUAL_UINT32(3, sim.getRequestCount());
+    TEST_ASSERT_EQUAL_INT(3, failed);
+
+    // 4010 us frame gap at 9600 baud, doubled for each retry
+    TEST_ASSERT_UINT32_WITHIN(20, 2 * 4010, sentAt[1] - failedAt[0]);
+    TEST_ASSERT_UINT32_WITHIN(20, 4 * 4010, sentAt[2] - failedAt[1]);
+    // after the last retry the device waits for its next poll period
+    TEST_ASSERT_GREATER_THAN(50000, bus.getIdleMillis());
+}
+
+void test_bus_cycle_time(void) {
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    sim.addDevice(2);
+    RoverBus bus;
+    bus.begin(sim);
+    bus.addDevice(1, 1000);
+    bus.addDevice(2, 1000);
+
+    runBus(bus, 20500);
+    TEST_ASSERT_UINT32_WITHIN(2, 1000, bus.getCycleTime());
+    TEST_ASSERT_FLOAT_WITHIN(0.11, 1.0, bus.getPollRate(0));
+    TEST_ASSERT_FLOAT_WITHIN(0.11, 1.0, bus.getPollRate(1));
+
+    // polled back to back the cycle is the two transactions and their gaps
+    RoverBus busy;
+    busy.begin(sim);
+    busy.addDevice(1, 0);
+    busy.addDevice(2, 0);
+    runBus(busy, 5000);
+    unsigned long transaction = (CHAR_MICROS + 20000 + WINDOW_REPLY * CHAR_MICROS) / 1000;
+    char message[64];
+    snprintf(message, sizeof(message), "cycle %lu ms, %lu ms per transaction on the wire",
+        busy.getCycleTime(), transaction);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_GREATER_OR_EQUAL(2 * transaction, busy.getCycleTime());
+    TEST_ASSERT_LESS_OR_EQUAL(2 * (transaction + 10), busy.getCycleTime());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_read_frames_match_modbus);
+    RUN_TEST(test_whole_window_reads_back);
+    RUN_TEST(test_snapshot_decodes_every_register);
+    RUN_TEST(test_reply_time_follows_latency);
+    RUN_TEST(test_dropped_request_times_out);
+    RUN_TEST(test_corrupted_reply_is_crc_error);
+    RUN_TEST(test_reply_for_other_quantity_is_rejected);
+    RUN_TEST(test_failed_range_keeps_other_groups);
+    RUN_TEST(test_bus_retries_lossy_link);
+    RUN_TEST(test_bus_retries_back_off);
+    RUN_TEST(test_bus_cycle_time);
+    return UNITY_END();
+}
@@ -0,0 +1,104 @@
+/*
+    SampleBatch with the step learned from its first two samples, where every
+    sample has to follow on from the last, and with the step set, where
+    samples left out by report-by-exception leave gaps the indexes record
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <SampleBatch.h>
+
+static const time_t BASE = 1760000000;
+static const unsigned long STEP = 300;
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_learned_step_has_no_gaps(void) {
+    SampleBatch<int, 10> batch;
+    batch.setLimit(10);
+    TEST_ASSERT_TRUE(batch.add(1, BASE));
+    TEST_ASSERT_EQUAL_UINT32(0, batch.getStep());
+    TEST_ASSERT_TRUE(batch.add(2, BASE + STEP));
+    TEST_ASSERT_EQUAL_UINT32(STEP, batch.getStep());
+    // a second of slip either way
+    TEST_ASSERT_TRUE(batch.add(3, BASE + 2 * STEP + 1));
+    TEST_ASSERT_TRUE(batch.add(4, BASE + 3 * STEP - 1));
+    // a skipped step ends the batch
+    TEST_ASSERT_FALSE(batch.accepts(BASE + 5 * STEP));
+    TEST_ASSERT_FALSE(batch.hasGaps());
+    for (uint8_t i = 0; i < batch.count(); i++) {
+        TEST_ASSERT_EQUAL_UINT16(i, batch.getIndex(i));
+    }
+}
+
+void test_set_step_takes_gaps(void) {
+    SampleBatch<int, 10> batch;
+    batch.setLimit(10);
+    batch.setStep(STEP);
+    TEST_ASSERT_TRUE(batch.add(1, BASE));
+    TEST_ASSERT_EQUAL_UINT32(STEP, batch.getStep());
+    TEST_ASSERT_FALSE(batch.hasGaps());
+    TEST_ASSERT_TRUE(batch.add(2, BASE + 3 * STEP));
+    TEST_ASSERT_TRUE(batch.add(3, BASE + 4 * STEP + 1));
+    TEST_ASSERT_TRUE(batch.add(4, BASE + 9 * STEP - 1));
+    TEST_ASSERT_TRUE(batch.hasGaps());
+
+    const uint16_t expected[] = { 0, 3, 4, 9 };
+    TEST_ASSERT_EQUAL_UINT8(4, batch.count());
+    for (uint8_t i = 0; i < batch.count(); i++) {
+        TEST_ASSERT_EQUAL_UINT16(expected[i], batch.getIndex(i));
+        TEST_ASSERT_EQUAL_INT(i + 1, batch[i]);
+    }
+}
+
+void test_set_step_rejects_off_grid(void) {
+    SampleBatch<int, 10> batch;
+    batch.setLimit(10);
+    batch.setStep(STEP);
+    batch.add(1, BASE);
+    batch.add(2, BASE + 2 * STEP);
+    // between two steps, more than a second of slip
+    TEST_ASSERT_FALSE(batch.accepts(BASE + 2 * STEP + STEP / 2));
+    TEST_ASSERT_FALSE(batch.accepts(BASE + 3 * STEP + 2));
+    // at or before the last sample's step
+    TEST_ASSERT_FALSE(batch.accepts(BASE + 2 * STEP));
+    TEST_ASSERT_FALSE(batch.accepts(BASE + STEP));
+    TEST_ASSERT_FALSE(batch.accepts(BASE));
+    // further than an index can count
+    TEST_ASSERT_FALSE(batch.accepts(BASE + 65536 * (time_t) STEP));
+    TEST_ASSERT_TRUE(batch.accepts(BASE + 65535 * (time_t) STEP));
+}
+
+void test_limit_and_set_step_clear(void) {
+    SampleBatch<int, 10> batch;
+    batch.setLimit(3);
+    batch.setStep(STEP);
+    batch.add(1, BASE);
+    batch.add(2, BASE + 5 * STEP);
+    batch.add(3, BASE + 6 * STEP);
+    TEST_ASSERT_TRUE(batch.full());
+    TEST_ASSERT_FALSE(batch.accepts(BASE + 7 * STEP));
+
+    // a new step starts over, clear() keeps it
+    batch.setStep(60);
+    TEST_ASSERT_TRUE(batch.empty());
+    batch.add(1, BASE);
+    batch.add(2, BASE + 120);
+    TEST_ASSERT_EQUAL_UINT16(2, batch.getIndex(1));
+    batch.clear();
+    TEST_ASSERT_EQUAL_UINT32(60, batch.getStep());
+    TEST_ASSERT_FALSE(batch.hasGaps());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_learned_step_has_no_gaps);
+    RUN_TEST(test_set_step_takes_gaps);
+    RUN_TEST(test_set_step_rejects_off_grid);
+    RUN_TEST(test_limit_and_set_step_clear);
+    return UNITY_END();
+}
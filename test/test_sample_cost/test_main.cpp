@@ -0,0 +1,136 @@
+/*
+    What one sample costs at a sample_period of 1 s: the bus time and bytes
+    of the controller poll behind it, against RenogyRoverSim with the
+    firmware's refresh periods, and the CPU time of folding every averaged
+    field into its RunningStats. Figures are printed for the record and
+    checked against the 1 s budget
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include <RenogyRover.h>
+#include <RenogyRoverSim.h>
+#include <RoverRegisters.h>
+#include <RunningStats.h>
+
+static const unsigned long SAMPLE_PERIOD_MS = 1000;
+static const unsigned long SAMPLES = 3600;
+// as set in src/main.cpp
+static const unsigned long DAY_STATS_REFRESH = 300000;
+static const unsigned long HIST_STATS_REFRESH = 3600000;
+// controller live fields plus the Sen5x and BMS values averaged per sample
+static const size_t SEN5X_SPREAD = 8;
+static const size_t BMS_SPREAD = 5;
+
+static int snapshotDone;
+static int snapshotOk;
+
+static void onSnapshot(int success, const RoverSnapshot* snapshot) {
+    (void) snapshot;
+    snapshotDone = 1;
+    snapshotOk = success;
+}
+
+static size_t liveFieldCount() {
+    size_t count = 0;
+    for (size_t i = 0; i < RoverRegisters::COUNT; i++) {
+        if (roverRegisters[i].key != NULL && roverRegisters[i].group == GROUP_LIVE
+            && roverRegisters[i].type == FIELD_INT) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_bus_cost_per_sample(void) {
+    const unsigned long bauds[] = { 9600, 19200 };
+    for (unsigned long baud : bauds) {
+        RenogyRoverSim sim(baud);
+        sim.addDevice(1);
+        RenogyRover rover(1);
+        rover.begin(sim, baud);
+        rover.setRefreshPeriod(GROUP_DAY, DAY_STATS_REFRESH);
+        rover.setRefreshPeriod(GROUP_HISTORY, HIST_STATS_REFRESH);
+
+        unsigned long busyMicros = 0;
+        unsigned long worstMicros = 0;
+        unsigned long failed = 0;
+        for (unsigned long sample = 0; sample < SAMPLES; sample++) {
+            unsigned long due = micros();
+            snapshotDone = 0;
+            TEST_ASSERT_TRUE(rover.requestSnapshot(onSnapshot));
+            while (!snapshotDone) {
+                rover.poll();
+                yield();
+            }
+            unsigned long busy = micros() - due;
+            busyMicros += busy;
+            worstMicros = max(worstMicros, busy);
+            failed += !snapshotOk;
+            // the next sample is due a whole period after this one
+            TEST_ASSERT_LESS_THAN(SAMPLE_PERIOD_MS * 1000, busy);
+            advanceMicros(SAMPLE_PERIOD_MS * 1000 - busy);
+        }
+
+        double meanMs = busyMicros / 1000.0 / SAMPLES;
+        double bytes = (double) rover.getBytesTransferred() / SAMPLES;
+        double transactions = (double) rover.getTransactionCount() / SAMPLES;
+        char message[160];
+        snprintf(message, sizeof(message),
+            "%lu baud: %.2f transactions, %.1f bytes, %.1f ms mean and %.1f ms worst bus time per sample, %.1f%% of the bus",
+            baud, transactions, bytes, meanMs, worstMicros / 1000.0, meanMs / SAMPLE_PERIOD_MS * 100);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_EQUAL_UINT32(0, failed);
+        // live and state every sample, day and history only when they are due
+        TEST_ASSERT_TRUE(transactions < 2.1);
+        // a quarter of the period leaves room for retries and a second controller
+        TEST_ASSERT_LESS_THAN(SAMPLE_PERIOD_MS / 4, (unsigned long) meanMs);
+        TEST_ASSERT_LESS_THAN(SAMPLE_PERIOD_MS / 2, worstMicros / 1000);
+    }
+}
+
+void test_cpu_cost_per_sample(void) {
+    const size_t fields = liveFieldCount() + 1 + SEN5X_SPREAD + BMS_SPREAD;
+    RunningStats stats[64];
+    TEST_ASSERT_LESS_OR_EQUAL(64, fields);
+
+    // a day of samples folded, the way takeReadings() does it
+    const unsigned long samples = 86400;
+    double values[64];
+    for (size_t i = 0; i < fields; i++) {
+        values[i] = 10 + i;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned long sample = 0; sample < samples; sample++) {
+        for (size_t i = 0; i < fields; i++) {
+            stats[i].add(values[i] + (sample % 17) * 0.1);
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    double perSample = elapsed / samples;
+
+    char message[128];
+    snprintf(message, sizeof(message), "%u fields, %.3f us of host CPU per sample folded, mean %.2f",
+        (unsigned) fields, perSample, stats[0].getMean());
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_EQUAL_UINT32(samples, stats[fields - 1].count());
+    // the ESP32 does doubles in software, a few hundred times slower than
+    // the host would still leave the fold well inside 1% of the period
+    TEST_ASSERT_LESS_THAN(SAMPLE_PERIOD_MS * 1000 / 100 / 300, (unsigned long) perSample);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_bus_cost_per_sample);
+    RUN_TEST(test_cpu_cost_per_sample);
+    return UNITY_END();
+}
@@ -0,0 +1,304 @@
+/*
+    Controller, Sen5x and BMS batches through SeriesEncoder and back through
+    SeriesDecoder: every value has to come back as it went in, and the blob
+    note is compared in size with the same batch as JSON arrays. The time to
+    encode a batch is reported per sample
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <NoteWriter.h>
+#include <RenogyRover.h>
+#include <RenogyRoverSim.h>
+#include <RoverRegisters.h>
+#include <SeriesBlob.h>
+
+// SAMPLE_BATCH_MAX in src/main.cpp
+static const uint8_t BATCH = 10;
+static const uint32_t BASE_TIME = 1760000000;
+static const uint32_t STEP = 60;
+
+// fixed: sent as itemFixed() under the plain key, the way the Sen5x and BMS
+// batches are, otherwise raw integers under key_decimals like the controller's
+struct Batch {
+    const char* file;
+    bool fixed;
+    std::vector<std::string> channels;
+    std::vector<uint8_t> decimals;
+    std::vector<std::vector<int32_t> > rows;
+};
+
+static uint8_t blob[2048];
+static char blobText[4096];
+static char noteBuffer[8192];
+static uint32_t randomState;
+
+// xorshift32, the same batches every run
+static int32_t jitter(int32_t amplitude) {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return (int32_t) (randomState % (2 * amplitude + 1)) - amplitude;
+}
+
+static int32_t scale(double value, uint8_t decimals) {
+    return lround(value * pow(10, decimals));
+}
+
+// A morning at the simulator's Rover: charge current and panel power ramp
+// up, the battery voltage follows, the rest holds. Each row is polled over
+// Modbus and taken from the snapshot the way addControllerBlob() does
+static Batch controllerBatch() {
+    Batch batch;
+    batch.file = "controller_batch.qo";
+    batch.fixed = false;
+    batch.channels.push_back("OSMTemperature");
+    batch.decimals.push_back(1);
+    auto addChannel = [&batch](const RoverRegister& field) {
+        batch.channels.push_back(field.key);
+        batch.decimals.push_back(-field.exponent);
+    };
+    RoverRegisters::forEachNoteKey(addChannel);
+
+    RenogyRoverSim sim;
+    sim.addDevice(1);
+    RenogyRover rover(1);
+    rover.begin(sim);
+    for (uint8_t i = 0; i < BATCH; i++) {
+        sim.setRegister(1, 0x0101, 132 + i / 3 + jitter(1));
+        sim.setRegister(1, 0x0102, 412 + 25 * i + jitter(12));
+        sim.setRegister(1, 0x0105, 85 + jitter(3));
+        sim.setRegister(1, 0x0107, 186 + jitter(4));
+        sim.setRegister(1, 0x0108, 301 + 20 * i + jitter(10));
+        sim.setRegister(1, 0x0109, 56 + 4 * i + jitter(2));
+
+        RoverSnapshot snapshot;
+        TEST_ASSERT_EQUAL_INT(1, rover.getSnapshot(&snapshot));
+        std::vector<int32_t> row;
+        row.push_back(215 + jitter(2));
+        auto addValue = [&row](const RoverRegister& field, int32_t raw) {
+            (void) field;
+            row.push_back(raw);
+        };
+        RoverRegisters::forEachNoteField(&snapshot, addValue);
+        batch.rows.push_back(row);
+    }
+    return batch;
+}
+
+// Sen5x keys and decimals as sen5x_fields and sen5x_decimals
+static Batch sen5xBatch() {
+    Batch batch;
+    batch.file = "Sen5x_batch.qo";
+    batch.fixed = true;
+    const char* keys[] = { "PM1p0", "PM2p5", "PM4", "PM10", "Humidity", "Temperature", "VOCIndex", "NOxIndex" };
+    const uint8_t decimals[] = { 4, 4, 4, 4, 2, 2, 1, 1 };
+    for (uint8_t i = 0; i < 8; i++) {
+        batch.channels.push_back(keys[i]);
+        batch.decimals.push_back(decimals[i]);
+    }
+    for (uint8_t i = 0; i < BATCH; i++) {
+        double pm1 = 3.2 + jitter(30) / 100.0;
+        std::vector<int32_t> row;
+        row.push_back(scale(pm1, 4));
+        row.push_back(scale(pm1 * 1.6, 4));
+        row.push_back(scale(pm1 * 1.9, 4));
+        row.push_back(scale(pm1 * 2.1, 4));
+        row.push_back(scale(45.3 + i * 0.05 + jitter(10) / 100.0, 2));
+        row.push_back(scale(21.5 + i * 0.02 + jitter(3) / 100.0, 2));
+        row.push_back(scale(100 + jitter(2), 1));
+        row.push_back(scale(1, 1));
+        batch.rows.push_back(row);
+    }
+    return batch;
+}
+
+// BMS keys and decimals as bms_fields and bms_decimals
+static Batch bmsBatch() {
+    Batch batch;
+    batch.file = "BMS_batch.qo";
+    batch.fixed = true;
+    const char* keys[] = { "BatteryVoltage", "BatteryCurrent", "BatteryTemperature",
+        "BatteryStateOfCharge", "BatteryRemainingCapacity", "BatteryOK" };
+    const uint8_t decimals[] = { 0, 0, 1, 0, 0, 0 };
+    for (uint8_t i = 0; i < 6; i++) {
+        batch.channels.push_back(keys[i]);
+        batch.decimals.push_back(decimals[i]);
+    }
+    for (uint8_t i = 0; i < BATCH; i++) {
+        std::vector<int32_t> row;
+        row.push_back(13250 + 8 * i + jitter(5));
+        row.push_back(1200 + jitter(60));
+        row.push_back(215 + jitter(1));
+        row.push_back(87 + i / 4);
+        row.push_back(87000 + 20 * i + jitter(10));
+        row.push_back(1);
+        batch.rows.push_back(row);
+    }
+    return batch;
+}
+
+static size_t headerLength;
+
+static size_t encode(const Batch& batch) {
+    SeriesEncoder encoder(blob, sizeof(blob));
+    encoder.begin(BASE_TIME, STEP, batch.rows.size());
+    for (size_t i = 0; i < batch.channels.size(); i++) {
+        TEST_ASSERT_TRUE(encoder.addChannel(batch.channels[i].c_str(), batch.decimals[i]));
+    }
+    headerLength = encoder.length();
+    for (size_t i = 0; i < batch.rows.size(); i++) {
+        TEST_ASSERT_TRUE(encoder.addSample(batch.rows[i].data()));
+    }
+    TEST_ASSERT_FALSE(encoder.overflowed());
+    return encoder.length();
+}
+
+// µs to encode one sample, channel names included, averaged over many batches
+static double encodeMicros(const Batch& batch) {
+    const int rounds = 2000;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        SeriesEncoder encoder(blob, sizeof(blob));
+        encoder.begin(BASE_TIME, STEP, batch.rows.size());
+        for (size_t i = 0; i < batch.channels.size(); i++) {
+            encoder.addChannel(batch.channels[i].c_str(), batch.decimals[i]);
+        }
+        for (size_t i = 0; i < batch.rows.size(); i++) {
+            encoder.addSample(batch.rows[i].data());
+        }
+        TEST_ASSERT_FALSE(encoder.overflowed());
+    }
+    double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    return micros / rounds / batch.rows.size();
+}
+
+static void expectRoundTrip(const Batch& batch, size_t length) {
+    SeriesDecoder decoder(blob, length);
+    TEST_ASSERT_TRUE(decoder.begin());
+    TEST_ASSERT_EQUAL_UINT32(BASE_TIME, decoder.getBaseTime());
+    TEST_ASSERT_EQUAL_UINT32(STEP, decoder.getStep());
+    TEST_ASSERT_EQUAL_UINT32(batch.rows.size(), decoder.getCount());
+    TEST_ASSERT_EQUAL_UINT32(batch.channels.size(), decoder.getChannelCount());
+    for (size_t i = 0; i < batch.channels.size(); i++) {
+        TEST_ASSERT_EQUAL_STRING(batch.channels[i].c_str(), decoder.getChannelName(i));
+        TEST_ASSERT_EQUAL_UINT8(batch.decimals[i], decoder.getDecimals(i));
+    }
+    int32_t values[SeriesEncoder::MAX_CHANNELS];
+    for (size_t row = 0; row < batch.rows.size(); row++) {
+        TEST_ASSERT_TRUE(decoder.nextSample(values));
+        TEST_ASSERT_EQUAL_MEMORY(batch.rows[row].data(), values, batch.channels.size() * sizeof(int32_t));
+    }
+    TEST_ASSERT_FALSE(decoder.nextSample(values));
+}
+
+// as beginBatchNote()
+static void beginNote(NoteWriter& note, const Batch& batch) {
+    note.begin(batch.file);
+    note.addInt("BaseTime", BASE_TIME);
+    note.addInt("Step", STEP);
+    note.addInt("Count", batch.rows.size());
+}
+
+// the batch note the firmware sends without batch_blob
+static size_t arraysNoteLength(const Batch& batch) {
+    NoteWriter note(noteBuffer, sizeof(noteBuffer));
+    beginNote(note, batch);
+    for (size_t i = 0; i < batch.channels.size(); i++) {
+        char key[40];
+        if (!batch.fixed && batch.decimals[i] > 0) {
+            snprintf(key, sizeof(key), "%s_%u", batch.channels[i].c_str(), batch.decimals[i]);
+        } else {
+            snprintf(key, sizeof(key), "%s", batch.channels[i].c_str());
+        }
+        note.beginArray(key);
+        for (size_t row = 0; row < batch.rows.size(); row++) {
+            if (batch.fixed) {
+                note.itemFixed(batch.rows[row][i] / pow(10, batch.decimals[i]), batch.decimals[i]);
+            } else {
+                note.itemInt(batch.rows[row][i]);
+            }
+        }
+        note.endArray();
+    }
+    TEST_ASSERT_NOT_NULL(note.end());
+    return note.length();
+}
+
+// and with it
+static size_t blobNoteLength(const Batch& batch, size_t length) {
+    TEST_ASSERT_GREATER_THAN(0, seriesBase64Encode(blob, length, blobText, sizeof(blobText)));
+    uint8_t decoded[sizeof(blob)];
+    TEST_ASSERT_EQUAL(length, seriesBase64Decode(blobText, decoded, sizeof(decoded)));
+    TEST_ASSERT_EQUAL_MEMORY(blob, decoded, length);
+
+    NoteWriter note(noteBuffer, sizeof(noteBuffer));
+    beginNote(note, batch);
+    note.addString("Blob", blobText);
+    TEST_ASSERT_NOT_NULL(note.end());
+    return note.length();
+}
+
+static void checkBatch(const Batch& batch, double minimumRatio) {
+    size_t length = encode(batch);
+    expectRoundTrip(batch, length);
+    size_t arrays = arraysNoteLength(batch);
+    size_t blobNote = blobNoteLength(batch, length);
+    double micros = encodeMicros(batch);
+
+    double ratio = (double) arrays / blobNote;
+    char message[256];
+    snprintf(message, sizeof(message),
+        "%s: %u samples x %u channels, %u bytes encoded (%u of them channel names), note %u bytes against %u as arrays, %.2fx smaller, %.3f us per sample to encode",
+        batch.file, (unsigned) batch.rows.size(), (unsigned) batch.channels.size(), (unsigned) length,
+        (unsigned) headerLength, (unsigned) blobNote, (unsigned) arrays, ratio, micros);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(ratio >= minimumRatio);
+}
+
+void setUp(void) {
+    randomState = 2463534242u;
+}
+
+void tearDown(void) {
+}
+
+// the channel names take most of a 10 sample blob, so the floors are set
+// just under what these batches measure
+void test_controller_batch(void) {
+    checkBatch(controllerBatch(), 1.4);
+}
+
+void test_sen5x_batch(void) {
+    checkBatch(sen5xBatch(), 1.6);
+}
+
+void test_bms_batch(void) {
+    checkBatch(bmsBatch(), 1.25);
+}
+
+void test_extremes_round_trip(void) {
+    // the largest jumps a 32 bit channel can make, and back
+    Batch batch;
+    batch.file = "extremes";
+    batch.fixed = false;
+    batch.channels.push_back("Swing");
+    batch.decimals.push_back(0);
+    const int32_t values[] = { INT32_MAX, INT32_MIN, INT32_MAX, 0, -1, INT32_MIN, INT32_MIN };
+    for (int32_t value : values) {
+        batch.rows.push_back(std::vector<int32_t>(1, value));
+    }
+    expectRoundTrip(batch, encode(batch));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_controller_batch);
+    RUN_TEST(test_sen5x_batch);
+    RUN_TEST(test_bms_batch);
+    RUN_TEST(test_extremes_round_trip);
+    return UNITY_END();
+}
@@ -0,0 +1,214 @@
+/*
+    TelemetryLog across power losses: appends are torn at a random byte in an
+    in-memory LogStorage, and the log restarted on what was left must hand
+    back every whole record from the saved cursor on
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <map>
+#include <vector>
+#include <TelemetryLog.h>
+
+// Segments in RAM. tearNextAppend() makes the next append write only part
+// of its record and fail, as if the power went in the middle of it
+class MemoryStorage : public LogStorage {
+    public:
+        MemoryStorage() : _tearAt(-1) {}
+
+        void tearNextAppend(size_t keep) {
+            _tearAt = keep;
+        }
+
+        bool append(uint32_t segment, const uint8_t* header, size_t headerLength,
+            const uint8_t* payload, size_t payloadLength) {
+            std::vector<uint8_t>& data = _segments[segment];
+            std::vector<uint8_t> record(header, header + headerLength);
+            record.insert(record.end(), payload, payload + payloadLength);
+            if (_tearAt >= 0) {
+                record.resize(min((size_t) _tearAt, record.size()));
+                data.insert(data.end(), record.begin(), record.end());
+                _tearAt = -1;
+                return false;
+            }
+            data.insert(data.end(), record.begin(), record.end());
+            return true;
+        }
+        size_t read(uint32_t segment, uint32_t offset, uint8_t* buffer, size_t length) {
+            std::map<uint32_t, std::vector<uint8_t> >::iterator found = _segments.find(segment);
+            if (found == _segments.end() || offset >= found->second.size()) {
+                return 0;
+            }
+            length = min(length, found->second.size() - offset);
+            memcpy(buffer, found->second.data() + offset, length);
+            return length;
+        }
+        uint32_t size(uint32_t segment) {
+            std::map<uint32_t, std::vector<uint8_t> >::iterator found = _segments.find(segment);
+            return found == _segments.end() ? 0 : found->second.size();
+        }
+        bool remove(uint32_t segment) {
+            return _segments.erase(segment) > 0;
+        }
+        bool range(uint32_t* first, uint32_t* last) {
+            if (_segments.empty()) {
+                return false;
+            }
+            *first = _segments.begin()->first;
+            *last = _segments.rbegin()->first;
+            return true;
+        }
+        bool writeCursor(const uint8_t* data, size_t length) {
+            _cursor.assign(data, data + length);
+            return true;
+        }
+        size_t readCursor(uint8_t* data, size_t length) {
+            length = min(length, _cursor.size());
+            memcpy(data, _cursor.data(), length);
+            return length;
+        }
+
+    private:
+        std::map<uint32_t, std::vector<uint8_t> > _segments;
+        std::vector<uint8_t> _cursor;
+        long _tearAt;
+};
+
+static uint8_t buffer[TelemetryLog::MAX_RECORD];
+static uint32_t randomState = 1;
+
+// xorshift32, the same run every time
+static uint32_t nextRandom(uint32_t limit) {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState % limit;
+}
+
+// record n is n bytes of n's low byte and a length that varies with n,
+// large enough that a run fills several segments
+static size_t makeRecord(uint32_t n, uint8_t* out) {
+    size_t length = 1 + (n * 2654435761u) % 3000;
+    memset(out, (uint8_t) n, length);
+    memcpy(out, &n, min(length, sizeof(n)));
+    return length;
+}
+
+static void appendRecords(TelemetryLog& log, uint32_t first, uint32_t count) {
+    uint8_t record[TelemetryLog::MAX_RECORD];
+    for (uint32_t n = first; n < first + count; n++) {
+        size_t length = makeRecord(n, record);
+        TEST_ASSERT_TRUE(log.append(record, length));
+    }
+}
+
+// reads count records, which have to be first, first + 1, ...
+static void expectRecords(TelemetryLog& log, uint32_t first, uint32_t count, bool consume) {
+    uint8_t record[TelemetryLog::MAX_RECORD];
+    for (uint32_t n = first; n < first + count; n++) {
+        size_t expected = makeRecord(n, record);
+        size_t length = log.peek(buffer, sizeof(buffer));
+        if (length != expected || memcmp(buffer, record, length) != 0) {
+            char message[64];
+            snprintf(message, sizeof(message), "record %u: %u bytes, %u expected",
+                (unsigned) n, (unsigned) length, (unsigned) expected);
+            TEST_FAIL_MESSAGE(message);
+        }
+        if (consume) {
+            log.advance();
+        }
+    }
+}
+
+void setUp(void) {
+    randomState = 2463534242u;
+}
+
+void tearDown(void) {
+}
+
+void test_records_survive_restart(void) {
+    MemoryStorage storage;
+    TelemetryLog log;
+    log.begin(storage);
+    appendRecords(log, 0, 20);
+    expectRecords(log, 0, 5, true);
+    TEST_ASSERT_GREATER_THAN(1, log.getSegmentCount());
+
+    TelemetryLog restarted;
+    restarted.begin(storage);
+    TEST_ASSERT_EQUAL_UINT32(log.getPendingBytes(), restarted.getPendingBytes());
+    expectRecords(restarted, 5, 15, true);
+    TEST_ASSERT_EQUAL_UINT32(0, restarted.peek(buffer, sizeof(buffer)));
+    TEST_ASSERT_TRUE(restarted.empty());
+}
+
+void test_torn_header_and_payload(void) {
+    // nothing, part of the header, all of it, and the payload but for its
+    // last byte, counted back from the end of the record
+    const long tears[] = { 0, 1, 5, TelemetryLog::HEADER_SIZE, TelemetryLog::HEADER_SIZE + 1, -1 };
+    for (long tear : tears) {
+        MemoryStorage storage;
+        TelemetryLog log;
+        log.begin(storage);
+        appendRecords(log, 0, 3);
+        expectRecords(log, 0, 1, true);
+
+        uint8_t record[TelemetryLog::MAX_RECORD];
+        size_t length = makeRecord(3, record);
+        storage.tearNextAppend(tear >= 0 ? tear : TelemetryLog::HEADER_SIZE + length + tear);
+        TEST_ASSERT_FALSE(log.append(record, length));
+
+        TelemetryLog restarted;
+        restarted.begin(storage);
+        expectRecords(restarted, 1, 2, true);
+        // the log carries on after the torn tail
+        appendRecords(restarted, 4, 2);
+        expectRecords(restarted, 4, 2, true);
+        TEST_ASSERT_EQUAL_UINT32(0, restarted.peek(buffer, sizeof(buffer)));
+        // the torn record itself is counted as lost to damage
+        TEST_ASSERT_EQUAL_UINT32(tear != 0 ? 1 : 0, restarted.getDropped());
+    }
+}
+
+void test_random_power_loss(void) {
+    for (int trial = 0; trial < 300; trial++) {
+        MemoryStorage storage;
+        TelemetryLog log;
+        log.begin(storage);
+
+        uint32_t written = 1 + nextRandom(30);
+        uint32_t sent = nextRandom(written + 1);
+        appendRecords(log, 0, written);
+        expectRecords(log, 0, sent, true);
+
+        // the power goes somewhere in the next record
+        uint8_t record[TelemetryLog::MAX_RECORD];
+        size_t length = makeRecord(written, record);
+        size_t tear = nextRandom(TelemetryLog::HEADER_SIZE + length);
+        storage.tearNextAppend(tear);
+        log.append(record, length);
+
+        TelemetryLog restarted;
+        restarted.begin(storage);
+        expectRecords(restarted, sent, written - sent, true);
+        TEST_ASSERT_EQUAL_UINT32(0, restarted.peek(buffer, sizeof(buffer)));
+        TEST_ASSERT_EQUAL_UINT32(tear != 0 ? 1 : 0, restarted.getDropped());
+
+        // and once more, with records appended since the first restart
+        appendRecords(restarted, written + 1, 3);
+        expectRecords(restarted, written + 1, 1, true);
+        TelemetryLog again;
+        again.begin(storage);
+        expectRecords(again, written + 2, 2, true);
+        TEST_ASSERT_TRUE(again.empty());
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_records_survive_restart);
+    RUN_TEST(test_torn_header_and_payload);
+    RUN_TEST(test_random_power_loss);
+    return UNITY_END();
+}
@@ -0,0 +1,273 @@
+/*
+    UartTransport against the ESP-IDF UART driver model in test/shim/driver,
+    fed by RenogyRoverSim from 9600 to 115200 baud: frames are handed over by
+    the RX timeout as soon as the line goes quiet, and replies longer than the
+    128 byte FIFO survive a late interrupt or, past that, are reported as lost
+    and the next request goes through. A full ring buffer is reported the
+    same way. Run with pio test -e native_uart
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include <ModbusRtuMaster.h>
+#include <ModbusTransport.h>
+#include <RenogyRoverSim.h>
+
+static const uart_port_t PORT = UART_NUM_2;
+static const unsigned long BAUDS[] = { 9600, 19200, 38400, 57600, 115200 };
+// 0x0100 - 0x0122, the window RenogyRover reads in one request
+static const uint16_t WINDOW = 0x23;
+
+// A Modbus device that answers reads of up to 64 registers, with register
+// n holding n, so replies run to 133 bytes. The Rover tops out at 75
+class LongReplyDevice : public Stream {
+    public:
+        LongReplyDevice(unsigned long baud)
+            : _charMicros(11000000UL / baud), _requestLength(0), _length(0), _read(0), _start(0) {}
+
+        size_t write(uint8_t value) {
+            _request[_requestLength++] = value;
+            if (_requestLength < sizeof(_request)) {
+                return 1;
+            }
+            _requestLength = 0;
+            uint16_t address = ((uint16_t) _request[2] << 8) | _request[3];
+            uint16_t quantity = ((uint16_t) _request[4] << 8) | _request[5];
+            _length = 0;
+            _reply[_length++] = _request[0];
+            _reply[_length++] = 0x03;
+            _reply[_length++] = quantity * 2;
+            for (uint16_t i = 0; i < quantity; i++) {
+                _reply[_length++] = (address + i) >> 8;
+                _reply[_length++] = address + i;
+            }
+            uint16_t crc = crc16(_reply, _length);
+            _reply[_length++] = crc;
+            _reply[_length++] = crc >> 8;
+            _read = 0;
+            _start = micros() + _charMicros + 2000;
+            return 1;
+        }
+        using Print::write;
+        int available() {
+            if (_read >= _length || (long) (micros() - _start) < 0) {
+                return 0;
+            }
+            size_t arrived = min((size_t) ((micros() - _start) / _charMicros + 1), _length);
+            return arrived - _read;
+        }
+        int read() {
+            return available() > 0 ? _reply[_read++] : -1;
+        }
+        int peek() {
+            return available() > 0 ? _reply[_read] : -1;
+        }
+
+        static uint16_t crc16(const uint8_t* data, size_t length) {
+            uint16_t crc = 0xFFFF;
+            for (size_t i = 0; i < length; i++) {
+                crc ^= data[i];
+                for (int bit = 0; bit < 8; bit++) {
+                    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+                }
+            }
+            return crc;
+        }
+
+    private:
+        unsigned long _charMicros;
+        uint8_t _request[8];
+        size_t _requestLength;
+        uint8_t _reply[5 + 2 * 64];
+        size_t _length;
+        size_t _read;
+        unsigned long _start;
+};
+
+static int done;
+static uint8_t result;
+static unsigned long doneMicros;
+
+static void onComplete(uint8_t code, void* context) {
+    (void) context;
+    done = 1;
+    result = code;
+    doneMicros = micros();
+}
+
+// one read through the master, polled the way RoverBus polls it
+static uint8_t readRegisters(ModbusRtuMaster& master, uint16_t address, uint16_t quantity) {
+    done = 0;
+    TEST_ASSERT_TRUE(master.readHoldingRegisters(address, quantity, onComplete, NULL));
+    while (!done) {
+        master.poll();
+        yield();
+    }
+    return result;
+}
+
+static void startUart(UartTransport& uart, Stream& line, unsigned long baud) {
+    native_uarts[PORT] = NativeUart();
+    nativeUartAttach(PORT, line, baud);
+    TEST_ASSERT_EQUAL_INT(1, uart.begin(PORT, baud, 16, 17));
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+    native_uarts[PORT] = NativeUart();
+}
+
+void test_frames_at_each_baud(void) {
+    for (unsigned long baud : BAUDS) {
+        RenogyRoverSim sim(baud);
+        sim.addDevice(1);
+        sim.setResponseLatency(2);
+        UartTransport uart;
+        startUart(uart, sim, baud);
+        ModbusRtuMaster master;
+        master.begin(1, uart, baud);
+        master.setResponseTimeout(200);
+
+        const unsigned long charMicros = 11000000UL / baud;
+        unsigned long worst = 0;
+        for (int i = 0; i < 200; i++) {
+            advanceMicros(5000);
+            unsigned long sent = micros();
+            TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, readRegisters(master, 0x0100, WINDOW));
+            TEST_ASSERT_EQUAL_UINT16(132, master.getResponseBuffer(1));
+            TEST_ASSERT_EQUAL_UINT16(2, master.getResponseBuffer(0x20));
+            // the reply's last character, then the RX timeout hands it over
+            unsigned long lastByte = sent + charMicros + 2000 + (5 + 2 * WINDOW - 1) * charMicros;
+            worst = max(worst, doneMicros - lastByte);
+        }
+        NativeUart& model = native_uarts[PORT];
+        char message[160];
+        snprintf(message, sizeof(message),
+            "%lu baud: frame handed over at most %lu us (%.1f characters) after its last byte, %lu interrupts for 200 frames",
+            baud, worst, (double) worst / charMicros, model.interrupts);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_EQUAL_UINT32(0, model.bytesLost);
+        // the full threshold at 64 bytes, then the RX timeout for the rest
+        TEST_ASSERT_EQUAL_UINT32(2 * 200, model.interrupts);
+        // the 4 symbol timeout, a character of arrival rounding and a poll
+        TEST_ASSERT_LESS_OR_EQUAL(6 * charMicros + 2 * NATIVE_YIELD_MICROS, worst);
+    }
+}
+
+void test_late_interrupt_short_frames(void) {
+    // a flash erase can hold the non-IRAM UART interrupt off for tens of
+    // milliseconds, a Rover reply still fits the FIFO
+    RenogyRoverSim sim(115200);
+    sim.addDevice(1);
+    UartTransport uart;
+    startUart(uart, sim, 115200);
+    nativeUartSetInterruptLatency(PORT, 40000);
+    ModbusRtuMaster master;
+    master.begin(1, uart, 115200);
+    master.setResponseTimeout(200);
+    for (int i = 0; i < 50; i++) {
+        TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, readRegisters(master, 0x0100, WINDOW));
+        advanceMicros(5000);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, native_uarts[PORT].bytesLost);
+}
+
+void test_long_frames_against_interrupt_latency(void) {
+    for (unsigned long baud : BAUDS) {
+        const unsigned long charMicros = 11000000UL / baud;
+        // the longest interrupt delay a 133 byte reply survives
+        unsigned long survived = 0;
+        for (unsigned long latency = 0; latency <= 100 * charMicros; latency += charMicros / 2) {
+            LongReplyDevice device(baud);
+            UartTransport uart;
+            startUart(uart, device, baud);
+            nativeUartSetInterruptLatency(PORT, latency);
+            ModbusRtuMaster master;
+            master.begin(1, uart, baud);
+            master.setResponseTimeout(500);
+
+            uint8_t code = readRegisters(master, 0x0200, 64);
+            if (code != ModbusRtuMaster::ku8MBSuccess) {
+                // an overflow is reported, not taken for a short frame
+                TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBInvalidCRC, code);
+                TEST_ASSERT_GREATER_THAN(0, native_uarts[PORT].fifoOverflows);
+                break;
+            }
+            TEST_ASSERT_EQUAL_UINT16(0x0200, master.getResponseBuffer(0));
+            TEST_ASSERT_EQUAL_UINT16(0x023F, master.getResponseBuffer(63));
+            survived = latency;
+        }
+        char message[128];
+        snprintf(message, sizeof(message), "%lu baud: a 133 byte reply survives %lu us (%.1f characters) of interrupt latency",
+            baud, survived, (double) survived / charMicros);
+        TEST_MESSAGE(message);
+        // the FIFO's room above the full threshold, less a character
+        TEST_ASSERT_GREATER_OR_EQUAL((128 - 64 - 1) * charMicros, survived);
+    }
+}
+
+void test_recovers_after_overflow(void) {
+    LongReplyDevice device(115200);
+    UartTransport uart;
+    startUart(uart, device, 115200);
+    ModbusRtuMaster master;
+    master.begin(1, uart, 115200);
+    master.setResponseTimeout(500);
+
+    nativeUartSetInterruptLatency(PORT, 20000);
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBInvalidCRC, readRegisters(master, 0x0200, 64));
+    // the rest of the reply comes in after the overflow was seen
+    advanceMicros(20000);
+    nativeUartSetInterruptLatency(PORT, 0);
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, readRegisters(master, 0x0200, 64));
+        TEST_ASSERT_EQUAL_UINT16(0x0220, master.getResponseBuffer(0x20));
+        advanceMicros(5000);
+    }
+    TEST_ASSERT_FALSE(uart.overrun());
+}
+
+void test_full_ring_buffer_reported(void) {
+    // a master that stops reading while frames keep coming fills the
+    // driver's ring buffer
+    LongReplyDevice device(115200);
+    UartTransport uart;
+    startUart(uart, device, 115200);
+    ModbusRtuMaster master;
+    master.begin(1, uart, 115200);
+    master.setResponseTimeout(500);
+
+    const uint8_t request[] = { 1, 0x03, 0x02, 0x00, 0x00, 0x40 };
+    uint8_t frame[8];
+    memcpy(frame, request, sizeof(request));
+    uint16_t crc = LongReplyDevice::crc16(frame, 6);
+    frame[6] = crc;
+    frame[7] = crc >> 8;
+    for (int i = 0; i < 5; i++) {
+        // five replies unread, 665 bytes for a 512 byte ring buffer
+        uart.write(frame, sizeof(frame));
+        advanceMicros(40000);
+        nativeUartService(&native_uarts[PORT]);
+    }
+    TEST_ASSERT_GREATER_THAN(0, native_uarts[PORT].bufferFulls);
+    // every event got into the queue, UART_BUFFER_FULL among them
+    TEST_ASSERT_EQUAL_UINT32(0, native_uarts[PORT].eventsDropped);
+    TEST_ASSERT_TRUE(uart.overrun());
+    TEST_ASSERT_FALSE(uart.overrun());
+
+    // and the next request is read whole
+    TEST_ASSERT_EQUAL_UINT8(ModbusRtuMaster::ku8MBSuccess, readRegisters(master, 0x0200, 64));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_frames_at_each_baud);
+    RUN_TEST(test_late_interrupt_short_frames);
+    RUN_TEST(test_long_frames_against_interrupt_latency);
+    RUN_TEST(test_recovers_after_overflow);
+    RUN_TEST(test_full_ring_buffer_reported);
+    return UNITY_END();
+}
@@ -0,0 +1,141 @@
+/*
+ * series_decode.cpp - Reference decoder for SeriesBlob batch notes
+ *
+ * Reads one batch per line from stdin, either a note body holding
+ * "Blob":"<base64>" or the bare base64 text, and prints each batch as the
+ * same [{"key", "value", "epoch"}] events the JSONata batch route makes.
+ * A note body's "Index":[...] array, sent when samples were skipped, places
+ * each sample at BaseTime + Index[i] * Step.
+ * With --stats, the size of the blob and of the same batch as JSON arrays
+ * are reported on stderr.
+ *
+ * Build on Linux with
+ *   g++ -O2 -I../lib/SeriesBlob/src series_decode.cpp ../lib/SeriesBlob/src/SeriesBlob.cpp -o series_decode
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "SeriesBlob.h"
+
+static const size_t MAX_BLOB = 8192;
+
+// value with its decimal point put back, 132 with 1 decimal prints as 13.2
+static std::string formatValue(int32_t raw, uint8_t decimals)
+{
+  char text[48];
+  // a 32 bit value has at most 10 digits
+  decimals = decimals > 10 ? 10 : decimals;
+  if (decimals == 0) {
+    snprintf(text, sizeof(text), "%ld", (long) raw);
+    return text;
+  }
+  long long scale = 1;
+  for (uint8_t i = 0; i < decimals; i++) {
+    scale *= 10;
+  }
+  long long magnitude = raw < 0 ? -(long long) raw : raw;
+  snprintf(text, sizeof(text), "%s%lld.%0*lld", raw < 0 ? "-" : "", magnitude / scale, (int) decimals, magnitude % scale);
+  return text;
+}
+
+// the numbers of the body's "Index" array, how many were read
+static size_t readIndex(const char* line, unsigned long* index, size_t size)
+{
+  const char* text = strstr(line, "\"Index\":[");
+  if (text == NULL) {
+    return 0;
+  }
+  text += 9;
+  size_t count = 0;
+  while (count < size) {
+    char* end;
+    unsigned long value = strtoul(text, &end, 10);
+    if (end == text) {
+      break;
+    }
+    index[count++] = value;
+    if (*end != ',') {
+      break;
+    }
+    text = end + 1;
+  }
+  return count;
+}
+
+static bool decodeLine(const char* line, bool stats)
+{
+  const char* start = strstr(line, "\"Blob\":\"");
+  start = start != NULL ? start + 8 : line;
+  std::string text(start);
+  size_t end = text.find_first_of("\"\r\n");
+  if (end != std::string::npos) {
+    text.resize(end);
+  }
+
+  static uint8_t blob[MAX_BLOB];
+  size_t length = seriesBase64Decode(text.c_str(), blob, sizeof(blob));
+  SeriesDecoder decoder(blob, length);
+  if (length == 0 || !decoder.begin()) {
+    fprintf(stderr, "not a version %d blob\n", SeriesEncoder::VERSION);
+    return false;
+  }
+
+  static unsigned long index[65536];
+  size_t indexed = readIndex(line, index, decoder.getCount());
+  if (indexed != 0 && indexed != decoder.getCount()) {
+    fprintf(stderr, "Index has %zu of %u samples\n", indexed, decoder.getCount());
+    return false;
+  }
+
+  uint8_t channels = decoder.getChannelCount();
+  std::string events = "[";
+  std::string columns[SeriesEncoder::MAX_CHANNELS];
+  int32_t values[SeriesEncoder::MAX_CHANNELS];
+  uint16_t sample = 0;
+  while (decoder.nextSample(values)) {
+    unsigned long epoch = decoder.getBaseTime() + (indexed != 0 ? index[sample] : sample) * decoder.getStep();
+    for (uint8_t i = 0; i < channels; i++) {
+      std::string value = formatValue(values[i], decoder.getDecimals(i));
+      char event[160];
+      snprintf(event, sizeof(event), "%s{\"key\":\"%s\",\"value\":%s,\"epoch\":%lu}",
+        events.size() > 1 ? "," : "", decoder.getChannelName(i), value.c_str(), epoch);
+      events += event;
+      columns[i] += (sample > 0 ? "," : "") + value;
+    }
+    sample++;
+  }
+  events += "]";
+  printf("%s\n", events.c_str());
+
+  if (sample != decoder.getCount()) {
+    fprintf(stderr, "blob ends after %u of %u samples\n", sample, decoder.getCount());
+    return false;
+  }
+
+  if (stats) {
+    // the same batch as the arrays body the firmware sends without blobs
+    size_t json = 0;
+    for (uint8_t i = 0; i < channels; i++) {
+      json += strlen(decoder.getChannelName(i)) + columns[i].size() + 6;
+    }
+    fprintf(stderr, "%u samples x %u channels: %zu bytes, %zu as base64, %zu as JSON arrays, %.1fx smaller\n",
+      sample, channels, length, text.size(), json, text.size() > 0 ? (double) json / text.size() : 0.0);
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  bool stats = argc > 1 && strcmp(argv[1], "--stats") == 0;
+  static char line[MAX_BLOB * 2];
+  bool ok = true;
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    if (line[0] != '\n') {
+      ok &= decodeLine(line, stats);
+    }
+  }
+  return ok ? 0 : 1;
+}